@@ -0,0 +1,123 @@
+// isValidEmailAddress (state machine) against the std::regex it replaced.
+// Before timing anything, a differential fuzz run checks both accept exactly
+// the same strings and exits non-zero on the first disagreement.
+//
+// Run:
+//   ./address_bench [--fuzz_iterations=N]
+
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+#include "smtp_parser.h"
+
+namespace {
+    const char* const PATTERN = R"(^([a-zA-Z0-9_\-\.\+]+)@([a-zA-Z0-9_\-\.]+)\.([a-zA-Z]{2,})$)";
+
+    const char* const SAMPLES[] = {
+        "user@example.com",
+        "first.last+tag@mail.example.co.uk",
+        "a@b.cc",
+        "x_y-z@sub-domain.example.museum",
+        "no-at-sign.example.com",
+        "user@example.c",
+        "user@example.c0m",
+        "user@@example.com",
+    };
+
+    // Mostly the bytes that matter to the language, sometimes anything
+    char randomByte(std::mt19937& random) {
+        static const char INTERESTING[] = "aZ09_-.+@.@..xq";
+        if (random() % 8 == 0) return static_cast<char>(random() % 256);
+        return INTERESTING[random() % (sizeof(INTERESTING) - 1)];
+    }
+
+    std::string randomCandidate(std::mt19937& random) {
+        std::string candidate;
+        if (random() % 2 == 0) {
+            // Mutate a sample: valid-looking input exercises the accepting paths
+            candidate = SAMPLES[random() % (sizeof(SAMPLES) / sizeof(SAMPLES[0]))];
+            int edits = 1 + static_cast<int>(random() % 3);
+            for (int i = 0; i < edits; ++i) {
+                size_t position = candidate.empty() ? 0 : random() % (candidate.size() + 1);
+                switch (random() % 3) {
+                case 0: candidate.insert(candidate.begin() + position, randomByte(random)); break;
+                case 1: if (position < candidate.size()) candidate.erase(position, 1); break;
+                default: if (position < candidate.size()) candidate[position] = randomByte(random); break;
+                }
+            }
+        }
+        else {
+            size_t length = random() % 16;
+            for (size_t i = 0; i < length; ++i) candidate += randomByte(random);
+        }
+        return candidate;
+    }
+
+    bool fuzz(long iterations) {
+        const std::regex pattern(PATTERN);
+        std::mt19937 random(12345);
+        long accepted = 0;
+        for (long i = 0; i < iterations; ++i) {
+            std::string candidate = randomCandidate(random);
+            bool expected = std::regex_match(candidate, pattern);
+            if (smtp::isValidEmailAddress(candidate) != expected) {
+                std::cerr << "Mismatch on \"" << candidate << "\": regex says " << expected << std::endl;
+                return false;
+            }
+            accepted += expected;
+        }
+        std::cout << "Differential fuzz: " << iterations << " inputs agree ("
+            << accepted << " accepted)" << std::endl;
+        return true;
+    }
+
+    void BM_Regex(benchmark::State& state) {
+        std::string_view address = SAMPLES[state.range(0)];
+        for (auto _ : state) {
+            // As the server did: pattern compiled on every call
+            const std::regex pattern(PATTERN);
+            benchmark::DoNotOptimize(std::regex_match(address.begin(), address.end(), pattern));
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_RegexPrecompiled(benchmark::State& state) {
+        std::string_view address = SAMPLES[state.range(0)];
+        const std::regex pattern(PATTERN);
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(std::regex_match(address.begin(), address.end(), pattern));
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_StateMachine(benchmark::State& state) {
+        std::string_view address = SAMPLES[state.range(0)];
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(address);
+            benchmark::DoNotOptimize(smtp::isValidEmailAddress(address));
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+// Args: index into SAMPLES
+BENCHMARK(BM_Regex)->Arg(0)->Arg(1);
+BENCHMARK(BM_RegexPrecompiled)->Arg(0)->Arg(1);
+BENCHMARK(BM_StateMachine)->Arg(0)->Arg(1);
+
+int main(int argc, char** argv) {
+    long iterations = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--fuzz_iterations=", 18) == 0) iterations = atol(argv[i] + 18);
+    }
+    if (!fuzz(iterations)) return 1;
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
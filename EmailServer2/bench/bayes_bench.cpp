@@ -0,0 +1,65 @@
+// BayesClassifier scoring throughput (bytes/sec through tokenizer + lookup)
+// for typical message sizes, and how well a synthetic corpus separates.
+
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "smtp_bayes.h"
+
+namespace {
+    const char* const HAM_WORDS[] = { "meeting", "agenda", "report", "quarterly", "project", "review",
+        "schedule", "lunch", "attached", "minutes", "budget", "deadline", "team", "thanks", "regards" };
+    const char* const SPAM_WORDS[] = { "winner", "prize", "free", "viagra", "click", "unsubscribe",
+        "casino", "bonus", "offer", "limited", "cash", "urgent", "claim", "discount", "guaranteed" };
+    const char* const COMMON_WORDS[] = { "the", "and", "you", "for", "this", "with", "your", "from",
+        "have", "are", "please", "today", "will", "our", "now" };
+
+    std::string makeMessage(std::mt19937& random, const char* const* words, size_t size) {
+        std::string message = "Subject: Hello\r\nFrom: someone@example.com\r\n\r\n";
+        while (message.size() < size) {
+            bool common = random() % 2 == 0;
+            message += common ? COMMON_WORDS[random() % 15] : words[random() % 15];
+            message += random() % 12 == 0 ? "\r\n" : " ";
+        }
+        message.resize(size);
+        return message;
+    }
+
+    smtp::BayesClassifier& trainedClassifier() {
+        static smtp::BayesClassifier* classifier = [] {
+            smtp::BayesOptions options;
+            options.retrainIntervalSec = 0;
+            auto* trained = new smtp::BayesClassifier(options, "/nonexistent/bayes_bench.db");
+
+            std::mt19937 random(42);
+            std::vector<std::string> spam, ham;
+            for (int i = 0; i < 2000; ++i) {
+                spam.push_back(makeMessage(random, SPAM_WORDS, 2048));
+                ham.push_back(makeMessage(random, HAM_WORDS, 2048));
+            }
+            trained->train(spam, ham);
+            return trained;
+        }();
+        return *classifier;
+    }
+
+    void BM_Score(benchmark::State& state) {
+        smtp::BayesClassifier& classifier = trainedClassifier();
+        std::mt19937 random(7);
+        std::string body = makeMessage(random, state.range(1) ? SPAM_WORDS : HAM_WORDS, static_cast<size_t>(state.range(0)));
+
+        double probability = 0.0;
+        for (auto _ : state) {
+            probability = classifier.score(body).value_or(-1.0);
+            benchmark::DoNotOptimize(probability);
+        }
+        state.SetBytesProcessed(state.iterations() * state.range(0));
+        state.counters["p_spam"] = probability;
+    }
+}
+
+// Args: body size, 1 = spam-like text
+BENCHMARK(BM_Score)->Args({ 1024, 0 })->Args({ 16 * 1024, 0 })->Args({ 256 * 1024, 0 })->Args({ 16 * 1024, 1 });
+
+BENCHMARK_MAIN();
@@ -0,0 +1,90 @@
+// Per-command CPU cost of the SMTP front end: verb classification, address
+// extraction and validation, and input sanitizing, on a realistic command
+// mix. storeEmail is measured by storage_bench, whole sessions by smtp_load.
+
+#include <benchmark/benchmark.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "smtp_parser.h"
+
+namespace {
+    const std::vector<std::string> COMMANDS = {
+        "EHLO client.example.com",
+        "MAIL FROM:<alice.sender@example.com>",
+        "RCPT TO:<bob.recipient@example.org>",
+        "RCPT TO: <carol+lists@mail.example.net>",
+        "DATA",
+        "RSET",
+        "NOOP",
+        "mail from:<lower.case@example.com> SIZE=4096",
+        "VRFY postmaster",
+        "QUIT",
+    };
+
+    const std::vector<std::string> ARGUMENTS = {
+        "<alice.sender@example.com>",
+        " <bob.recipient@example.org>",
+        "<carol+lists@mail.example.net> SIZE=4096",
+        "dave@example.com",
+        "<>",
+    };
+
+    void BM_ParseCommand(benchmark::State& state) {
+        size_t matched = 0;
+        for (auto _ : state) {
+            for (const std::string& command : COMMANDS) {
+                std::string_view argument;
+                if (smtp::parseCommand(command, argument) != smtp::Verb::Unknown) ++matched;
+                benchmark::DoNotOptimize(argument.data());
+            }
+        }
+        benchmark::DoNotOptimize(matched);
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(COMMANDS.size()));
+    }
+
+    void BM_ExtractEmailAddress(benchmark::State& state) {
+        for (auto _ : state) {
+            for (const std::string& argument : ARGUMENTS) {
+                std::string_view address = smtp::extractEmailAddress(argument);
+                benchmark::DoNotOptimize(address.data());
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ARGUMENTS.size()));
+    }
+
+    // What TcpServer::validateEmail runs for MAIL/RCPT: extract, then validate
+    void BM_ValidateEmail(benchmark::State& state) {
+        size_t valid = 0;
+        for (auto _ : state) {
+            for (const std::string& argument : ARGUMENTS) {
+                if (smtp::isValidEmailAddress(smtp::extractEmailAddress(argument))) ++valid;
+            }
+        }
+        benchmark::DoNotOptimize(valid);
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ARGUMENTS.size()));
+    }
+
+    // Copies the input each time: sanitizeInput works in place
+    void BM_SanitizeInput(benchmark::State& state) {
+        std::string input;
+        while (input.size() < static_cast<size_t>(state.range(0))) {
+            input += "Subject: hello\tworld\r\n";
+        }
+        input.resize(static_cast<size_t>(state.range(0)));
+        std::string data;
+        for (auto _ : state) {
+            data = input;
+            smtp::sanitizeInput(data);
+            benchmark::DoNotOptimize(data.data());
+        }
+        state.SetBytesProcessed(state.iterations() * state.range(0));
+    }
+}
+
+BENCHMARK(BM_ParseCommand);
+BENCHMARK(BM_ExtractEmailAddress);
+BENCHMARK(BM_ValidateEmail);
+BENCHMARK(BM_SanitizeInput)->Arg(64)->Arg(512)->Arg(4096);
+
+BENCHMARK_MAIN();
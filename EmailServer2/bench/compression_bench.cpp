@@ -0,0 +1,291 @@
+// Body compression: ratio and throughput of storing bodies raw, as plain
+// raw deflate, and as deflate primed with a dictionary trained on the first
+// messages of the corpus (8, 16 and 32 KB), then MailStore ingest with
+// compression on and off. The corpus is synthetic mail of the usual kinds
+// (HTML newsletters, notifications, personal text with quoted replies, base64
+// attachments, all under realistic headers), or one message per file from
+// --corpus=DIR. "ratio" is original bytes over stored bytes; compress and
+// decode rates are of original bytes.
+//
+// Run:
+//   ./compression_bench [--corpus=DIR]
+
+#include <benchmark/benchmark.h>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "smtp_compression.h"
+#include "smtp_storage.h"
+
+namespace {
+    const size_t TRAINING_MESSAGES = 256;
+    const size_t CORPUS_MESSAGES = 2000;
+
+    const char* const WORDS[] = { "the", "meeting", "and", "project", "thanks", "for", "update", "please",
+        "review", "attached", "schedule", "next", "week", "budget", "team", "we", "should", "discuss",
+        "report", "with", "customer", "release", "today", "tomorrow", "issue", "fixed", "agree", "plan" };
+    const char* const SENDERS[] = { "news@shop.example.com", "alerts@bank.example.net", "noreply@tracker.example.org",
+        "alice@example.com", "bob@example.org", "digest@forum.example.com" };
+
+    std::string corpusDirectory;
+
+    std::string words(std::mt19937& random, size_t count) {
+        std::string text;
+        for (size_t i = 0; i < count; ++i) {
+            text += WORDS[random() % (sizeof(WORDS) / sizeof(WORDS[0]))];
+            text += i % 14 == 13 ? "\r\n" : " ";
+        }
+        return text;
+    }
+
+    std::string headers(std::mt19937& random, const char* from, const std::string& subject, const char* type) {
+        std::string id = std::to_string(random());
+        return "Received: from mx" + std::to_string(random() % 20) + ".example.net (mx.example.net [192.0.2." + std::to_string(random() % 250)
+            + "])\r\n\tby mail.example.com with ESMTPS id " + id + "\r\n\tfor <user@example.com>; Tue, 14 Oct 2025 09:"
+            + std::to_string(10 + random() % 50) + ":00 +0000\r\n"
+            "DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; d=example.com; s=selector1;\r\n"
+            "\th=from:to:subject:date:message-id:mime-version:content-type;\r\n"
+            "\tbh=" + id + "Zm9vYmFyYmF6cXV4; b=" + std::to_string(random()) + std::to_string(random()) + "\r\n"
+            "From: <" + std::string(from) + ">\r\nTo: user@example.com\r\nSubject: " + subject + "\r\n"
+            "Message-ID: <" + id + "@example.com>\r\nMIME-Version: 1.0\r\nContent-Type: " + type + "\r\n\r\n";
+    }
+
+    std::string newsletter(std::mt19937& random) {
+        std::string body = headers(random, SENDERS[0], "This week's deals " + std::to_string(random() % 1000), "text/html; charset=utf-8")
+            + "<!DOCTYPE html>\r\n<html><head><meta charset=\"utf-8\"><style>td{font-family:Arial,sans-serif;font-size:14px}</style></head>\r\n"
+            "<body style=\"margin:0;padding:0\"><table width=\"100%\" cellpadding=\"0\" cellspacing=\"0\" border=\"0\">\r\n";
+        for (size_t i = 0, items = 8 + random() % 30; i < items; ++i) {
+            body += "<tr><td class=\"item\" style=\"padding:8px 16px\"><a href=\"https://shop.example.com/p/" + std::to_string(random() % 100000)
+                + "?utm_source=newsletter&amp;utm_medium=email\">" + words(random, 6) + "</a> now $" + std::to_string(random() % 200) + ".99</td></tr>\r\n";
+        }
+        return body + "<tr><td style=\"color:#888;font-size:11px\">You are receiving this email because you subscribed at shop.example.com.\r\n"
+            "<a href=\"https://shop.example.com/unsubscribe\">Unsubscribe</a> | <a href=\"https://shop.example.com/privacy\">Privacy</a></td></tr>\r\n"
+            "</table></body></html>\r\n";
+    }
+
+    std::string notification(std::mt19937& random) {
+        std::string order = std::to_string(100000 + random() % 900000);
+        return headers(random, SENDERS[1 + random() % 2], "Your order #" + order + " has shipped", "text/plain; charset=utf-8")
+            + "Hello,\r\n\r\nGood news: your order #" + order + " has shipped and is on its way.\r\n"
+            "Tracking number: 1Z" + std::to_string(random()) + "\r\nEstimated delivery: " + std::to_string(1 + random() % 28) + " October\r\n\r\n"
+            "You can follow your package at https://tracker.example.org/track/" + order + "\r\n\r\n"
+            "This is an automated message, please do not reply. For help visit https://help.example.org.\r\n";
+    }
+
+    std::string personal(std::mt19937& random) {
+        std::string body = headers(random, SENDERS[3 + random() % 2], "Re: " + words(random, 3), "text/plain; charset=utf-8")
+            + words(random, 30 + random() % 200) + "\r\n\r\nOn Mon, 13 Oct 2025, Bob wrote:\r\n";
+        std::string quoted = words(random, 40 + random() % 150);
+        for (size_t start = 0; start < quoted.size();) {
+            size_t end = quoted.find("\r\n", start);
+            if (end == std::string::npos) end = quoted.size();
+            body += "> " + quoted.substr(start, end - start) + "\r\n";
+            start = end + 2;
+        }
+        return body + "\r\n-- \r\nAlice Example | Engineering | +1 555 0100\r\n";
+    }
+
+    std::string attachment(std::mt19937& random) {
+        static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string body = headers(random, SENDERS[3], "Report attached", "multipart/mixed; boundary=\"b1\"")
+            + "--b1\r\nContent-Type: text/plain\r\n\r\n" + words(random, 20) + "\r\n--b1\r\n"
+            "Content-Type: application/pdf\r\nContent-Transfer-Encoding: base64\r\n"
+            "Content-Disposition: attachment; filename=\"report.pdf\"\r\n\r\n";
+        for (size_t line = 0, lines = 100 + random() % 600; line < lines; ++line) {
+            for (int i = 0; i < 76; ++i) body += BASE64[random() % 64];
+            body += "\r\n";
+        }
+        return body + "--b1--\r\n";
+    }
+
+    std::vector<std::string> loadCorpus(const std::string& directory) {
+        std::vector<std::string> messages;
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr) return messages;
+        while (dirent* item = readdir(dir)) {
+            if (item->d_name[0] == '.') continue;
+            std::ifstream file(directory + "/" + item->d_name, std::ios::binary);
+            std::stringstream text;
+            text << file.rdbuf();
+            if (!text.str().empty()) messages.push_back(text.str());
+        }
+        closedir(dir);
+        return messages;
+    }
+
+    // Synthetic mix: mostly bulk mail, which is what recurs across a mailbox
+    const std::vector<std::string>& corpus() {
+        static const std::vector<std::string> messages = [] {
+            if (!corpusDirectory.empty()) return loadCorpus(corpusDirectory);
+            std::mt19937 random(42);
+            std::vector<std::string> generated;
+            for (size_t i = 0; i < CORPUS_MESSAGES; ++i) {
+                switch (random() % 10) {
+                case 0: case 1: case 2: case 3: generated.push_back(newsletter(random)); break;
+                case 4: case 5: case 6: generated.push_back(notification(random)); break;
+                case 7: case 8: generated.push_back(personal(random)); break;
+                default: generated.push_back(attachment(random)); break;
+                }
+            }
+            return generated;
+        }();
+        return messages;
+    }
+
+    // A compressor as a shard writer has it after training on the first
+    // messages; the rest are what gets measured
+    struct Trained {
+        sqlite3* db = nullptr;
+        smtp::BodyCompressor compressor;
+
+        explicit Trained(const smtp::CompressionOptions& options) : compressor(options) {
+            sqlite3_open(":memory:", &db);
+            sqlite3_exec(db, "CREATE TABLE Dictionaries (id INTEGER PRIMARY KEY, data BLOB NOT NULL, created DATETIME);", nullptr, nullptr, nullptr);
+            if (options.dictionaryBytes == 0) return;
+            const std::vector<std::string>& messages = corpus();
+            for (size_t i = 0; i < TRAINING_MESSAGES && i < messages.size(); ++i) compressor.observe(messages[i]);
+            compressor.retrain(db);
+        }
+
+        ~Trained() {
+            sqlite3_close(db);
+        }
+    };
+
+    smtp::CompressionOptions codecOptions(const benchmark::State& state) {
+        smtp::CompressionOptions options;
+        options.enabled = state.range(0) != 0;
+        options.dictionaryBytes = static_cast<size_t>(state.range(1));
+        options.trainingSamples = options.dictionaryBytes == 0 ? 0 : TRAINING_MESSAGES;
+        return options;
+    }
+
+    void BM_Compress(benchmark::State& state) {
+        const std::vector<std::string>& messages = corpus();
+        Trained trained(codecOptions(state));
+        std::string stored;
+        int64_t dictionary = 0;
+        double original = 0, kept = 0;
+        for (auto _ : state) {
+            original = kept = 0;
+            for (size_t i = TRAINING_MESSAGES; i < messages.size(); ++i) {
+                bool compressed = trained.compressor.compress(messages[i], stored, dictionary);
+                original += static_cast<double>(messages[i].size());
+                kept += static_cast<double>(compressed ? stored.size() : messages[i].size());
+            }
+        }
+        state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(original));
+        state.counters["ratio"] = original / kept;
+    }
+
+    void BM_Decode(benchmark::State& state) {
+        const std::vector<std::string>& messages = corpus();
+        Trained trained(codecOptions(state));
+        std::vector<std::string> stored;
+        std::vector<int> codecs;
+        std::vector<int64_t> dictionaries;
+        for (size_t i = TRAINING_MESSAGES; i < messages.size(); ++i) {
+            std::string encoded;
+            int64_t dictionary = 0;
+            bool compressed = trained.compressor.compress(messages[i], encoded, dictionary);
+            stored.push_back(compressed ? encoded : messages[i]);
+            codecs.push_back(static_cast<int>(compressed ? smtp::BodyCodec::Deflate : smtp::BodyCodec::None));
+            dictionaries.push_back(compressed ? dictionary : 0);
+        }
+
+        std::string body;
+        int64_t original = 0;
+        for (auto _ : state) {
+            original = 0;
+            for (size_t i = 0; i < stored.size(); ++i) {
+                const std::string& message = messages[TRAINING_MESSAGES + i];
+                if (!trained.compressor.decoder().decode(trained.db, codecs[i], dictionaries[i], stored[i], message.size(), body)) {
+                    state.SkipWithError("body does not decode");
+                    return;
+                }
+                original += static_cast<int64_t>(body.size());
+            }
+        }
+        state.SetBytesProcessed(state.iterations() * original);
+    }
+
+    void removeDatabase(const std::string& path) {
+        unlink(path.c_str());
+        unlink((path + "-wal").c_str());
+        unlink((path + "-shm").c_str());
+        unlink((path + "-gen").c_str());
+    }
+
+    double fileBytes(const std::string& path) {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 ? static_cast<double>(info.st_size) : 0;
+    }
+
+    // Every message is new to the store (the corpus is stored once per
+    // iteration under a fresh first line), so each one is compressed
+    void BM_Ingest(benchmark::State& state) {
+        const std::vector<std::string>& messages = corpus();
+        std::string path = "/tmp/compression_bench_" + std::to_string(getpid()) + ".db";
+        std::vector<std::string_view> recipients = { "user@example.com" };
+        uint64_t stored = 0;
+        {
+            smtp::StorageOptions options;
+            options.path = path;
+            options.compression.enabled = state.range(0) != 0;
+            smtp::MailStore store(options);
+
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::vector<std::string> bodies(messages.size());
+            for (auto _ : state) {
+                state.PauseTiming();
+                for (size_t i = 0; i < messages.size(); ++i) bodies[i] = "X-Sequence: " + std::to_string(stored + i) + "\r\n" + messages[i];
+                state.ResumeTiming();
+
+                size_t outstanding = bodies.size();
+                for (const std::string& body : bodies) {
+                    store.storeEmail("sender@example.com", recipients, body, std::nullopt, [&](bool) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--outstanding == 0) finished.notify_one();
+                        });
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding == 0; });
+                stored += bodies.size();
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(messages.size()));
+        }
+        // Checkpointed into the main file when the store closed
+        state.counters["db_bytes_per_message"] = fileBytes(path) / static_cast<double>(stored);
+        removeDatabase(path);
+    }
+}
+
+// Args: compression on, dictionary bytes (0: none)
+BENCHMARK(BM_Compress)->ArgNames({ "deflate", "dictionary" })
+    ->Args({ 0, 0 })->Args({ 1, 0 })->Args({ 1, 8192 })->Args({ 1, 16384 })->Args({ 1, 32768 })->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Decode)->ArgNames({ "deflate", "dictionary" })
+    ->Args({ 1, 0 })->Args({ 1, 8192 })->Args({ 1, 16384 })->Args({ 1, 32768 })->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Ingest)->ArgNames({ "deflate" })->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--corpus=", 9) == 0) corpusDirectory = argv[i] + 9;
+    }
+    if (corpus().size() <= TRAINING_MESSAGES) {
+        fprintf(stderr, "corpus needs more than %zu messages\n", TRAINING_MESSAGES);
+        return 1;
+    }
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Outbound delivery end to end: a MailStore with a DeliveryAgent routed to a
+// sink SMTP server in this process. Half the messages are stored before the
+// agent starts (the queue a restart finds), half while it runs. The sink
+// answers 451 to the first RCPT for "defer-*" recipients and 550 to
+// "reject-*", checks every body it receives against the one stored, and
+// delays each batch of replies by latencyUs to stand in for a network round
+// trip, which is what PIPELINING saves. Reports messages/s and the final
+// Emails.status counts; exits 1 if anything is missing, wrong or unsettled.
+//
+// Run:
+//   ./delivery_bench [pipelining=1] [messages=2000] [latencyUs=1000] [connections=2] [shards=1]
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sqlite3.h>
+#include "smtp_storage.h"
+#include "smtp_delivery.h"
+
+namespace {
+    std::atomic<int> g_connections{ 0 };
+    std::atomic<int> g_received{ 0 };
+    std::atomic<int> g_corrupt{ 0 };
+
+    std::mutex g_sinkMutex;
+    std::set<std::string> g_deferred;   // Recipients already answered 451 once
+
+    // Message i: leading dots and a line without its CR exercise dot-stuffing
+    std::string makeBody(int i) {
+        std::string body = "X-Seq: " + std::to_string(i) + "\r\nSubject: delivery bench\r\n\r\n";
+        for (int line = 0; line < 20; ++line) {
+            if (line % 7 == 3) body += ".leading dot\r\n";
+            if (line % 11 == 5) body += "..\r\n";
+            body += "The quick brown fox jumps over the lazy dog " + std::to_string(line) + "\r\n";
+        }
+        return body;
+    }
+
+    std::string recipientOf(int i) {
+        if (i % 50 == 7) return "reject-" + std::to_string(i) + "@example.org";
+        if (i % 50 == 13) return "defer-" + std::to_string(i) + "@example.org";
+        return "user" + std::to_string(i % 97) + "@example.org";
+    }
+
+    bool writeFully(int s, const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t n = send(s, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            offset += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void checkBody(const std::string& body) {
+        int seq = body.compare(0, 7, "X-Seq: ") == 0 ? atoi(body.c_str() + 7) : -1;
+        if (seq < 0 || body != makeBody(seq)) ++g_corrupt;
+        ++g_received;
+    }
+
+    // One client; replies to everything read in one recv() go out together
+    void sinkSession(int s, bool pipelining, int latencyUs) {
+        std::string in;
+        std::string out = "220 sink ESMTP\r\n";
+        std::string body;
+        std::string recipient;
+        bool data = false;
+        bool accepted = false;
+        char buffer[65536];
+
+        while (writeFully(s, out)) {
+            out.clear();
+            ssize_t n = recv(s, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            in.append(buffer, static_cast<size_t>(n));
+
+            size_t offset = 0;
+            size_t end;
+            bool quit = false;
+            while ((end = in.find("\r\n", offset)) != std::string::npos) {
+                std::string line = in.substr(offset, end - offset);
+                offset = end + 2;
+                if (data) {
+                    if (line == ".") {
+                        data = false;
+                        checkBody(body);
+                        out += "250 OK\r\n";
+                        continue;
+                    }
+                    body += (line[0] == '.' ? line.substr(1) : line) + "\r\n";
+                    continue;
+                }
+                if (line.compare(0, 4, "EHLO") == 0) {
+                    out += pipelining ? "250-sink\r\n250-PIPELINING\r\n250 8BITMIME\r\n" : "250-sink\r\n250 8BITMIME\r\n";
+                }
+                else if (line.compare(0, 10, "MAIL FROM:") == 0) {
+                    accepted = false;
+                    out += "250 OK\r\n";
+                }
+                else if (line.compare(0, 8, "RCPT TO:") == 0) {
+                    recipient = line.substr(9, line.size() - 10);
+                    if (recipient.compare(0, 7, "reject-") == 0) {
+                        out += "550 5.1.1 No such user\r\n";
+                        continue;
+                    }
+                    if (recipient.compare(0, 6, "defer-") == 0) {
+                        std::lock_guard<std::mutex> lock(g_sinkMutex);
+                        if (g_deferred.insert(recipient).second) {
+                            out += "451 4.3.0 Try again later\r\n";
+                            continue;
+                        }
+                    }
+                    accepted = true;
+                    out += "250 OK\r\n";
+                }
+                else if (line == "DATA") {
+                    if (accepted) {
+                        data = true;
+                        body.clear();
+                        out += "354 Go ahead\r\n";
+                    }
+                    else {
+                        out += "554 No valid recipients\r\n";
+                    }
+                }
+                else if (line == "RSET") {
+                    out += "250 OK\r\n";
+                }
+                else if (line == "QUIT") {
+                    out += "221 Bye\r\n";
+                    quit = true;
+                    break;
+                }
+                else {
+                    out += "500 Unrecognized\r\n";
+                }
+            }
+            in.erase(0, offset);
+            if (!out.empty() && latencyUs > 0) usleep(static_cast<useconds_t>(latencyUs));
+            if (quit) {
+                writeFully(s, out);
+                break;
+            }
+        }
+        close(s);
+    }
+
+    void sink(int listener, bool pipelining, int latencyUs) {
+        for (;;) {
+            int s = accept(listener, nullptr, nullptr);
+            if (s < 0) return;
+            ++g_connections;
+            std::thread(sinkSession, s, pipelining, latencyUs).detach();
+        }
+    }
+
+    int listenOnLoopback(int& port) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(s, (sockaddr*)&address, sizeof(address)) < 0 || listen(s, 64) < 0
+            || getsockname(s, (sockaddr*)&address, &length) < 0) {
+            perror("sink listen");
+            exit(1);
+        }
+        port = ntohs(address.sin_port);
+        return s;
+    }
+
+    void storeAll(smtp::MailStore& store, int from, int to) {
+        std::mutex mutex;
+        std::condition_variable finished;
+        int outstanding = to - from;
+        std::vector<std::string> recipients;
+        std::vector<std::string> bodies;
+        for (int i = from; i < to; ++i) {
+            recipients.push_back(recipientOf(i));
+            bodies.push_back(makeBody(i));
+        }
+        // Must outlive the writes
+        std::vector<std::vector<std::string_view>> lists;
+        for (const std::string& recipient : recipients) lists.push_back({ recipient });
+        for (int i = 0; i < to - from; ++i) {
+            store.storeEmail("sender@example.com", lists[i], bodies[i], std::nullopt, [&](bool) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--outstanding == 0) finished.notify_one();
+                });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return outstanding == 0; });
+    }
+
+    // status -> rows, over every shard
+    std::map<std::string, int> statusCounts(const std::string& path, size_t shards, int& retried) {
+        std::map<std::string, int> counts;
+        retried = 0;
+        for (size_t i = 0; i < shards; ++i) {
+            sqlite3* db = nullptr;
+            if (sqlite3_open_v2(smtp::shardPath(path, i, shards).c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+                sqlite3_close(db);
+                continue;
+            }
+            sqlite3_busy_timeout(db, 1000);
+            sqlite3_stmt* stmt = nullptr;
+            sqlite3_prepare_v2(db, "SELECT status, count(*), sum(attempts > 1) FROM Emails GROUP BY status;", -1, &stmt, nullptr);
+            while (stmt != nullptr && sqlite3_step(stmt) == SQLITE_ROW) {
+                counts[reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))] += sqlite3_column_int(stmt, 1);
+                retried += sqlite3_column_int(stmt, 2);
+            }
+            sqlite3_finalize(stmt);
+            sqlite3_close(db);
+        }
+        return counts;
+    }
+
+    void removeDatabase(const std::string& path, size_t shards) {
+        for (size_t i = 0; i < shards; ++i) {
+            std::string file = smtp::shardPath(path, i, shards);
+            unlink(file.c_str());
+            unlink((file + "-wal").c_str());
+            unlink((file + "-shm").c_str());
+        }
+        unlink((path + "-gen").c_str());
+    }
+}
+
+int main(int argc, char** argv) {
+    bool pipelining = argc > 1 ? atoi(argv[1]) != 0 : true;
+    int messages = argc > 2 ? atoi(argv[2]) : 2000;
+    int latencyUs = argc > 3 ? atoi(argv[3]) : 1000;
+    int connections = argc > 4 ? atoi(argv[4]) : 2;
+    size_t shards = argc > 5 ? strtoull(argv[5], nullptr, 10) : 1;
+
+    int port = 0;
+    int listener = listenOnLoopback(port);
+    std::thread(sink, listener, pipelining, latencyUs).detach();
+
+    std::string path = "/tmp/delivery_bench_" + std::to_string(getpid()) + ".db";
+    smtp::StorageOptions storage;
+    storage.path = path;
+    storage.shards = shards;
+    storage.synchronous = "OFF";
+
+    smtp::DeliveryOptions options;
+    options.enabled = true;
+    options.routes["example.org"] = "127.0.0.1:" + std::to_string(port);
+    options.connectionsPerDomain = connections;
+    options.retryInitialMs = 50;
+    options.idleTimeoutMs = 200;
+
+    int expectedRejects = 0;
+    int expectedDeferrals = 0;
+    for (int i = 0; i < messages; ++i) {
+        if (recipientOf(i).compare(0, 7, "reject-") == 0) ++expectedRejects;
+        if (recipientOf(i).compare(0, 6, "defer-") == 0) ++expectedDeferrals;
+    }
+
+    bool ok;
+    double seconds;
+    int retried = 0;
+    std::map<std::string, int> counts;
+    {
+        smtp::MailStore store(storage);
+        storeAll(store, 0, messages / 2);
+
+        auto start = std::chrono::steady_clock::now();
+        smtp::DeliveryAgent agent(options, store, path, shards);
+        storeAll(store, messages / 2, messages);
+
+        // Settled: nothing left queued or deferred
+        for (int waited = 0; waited < 60000; waited += 10) {
+            counts = statusCounts(path, shards, retried);
+            if (counts["DELIVERED"] + counts["FAILED"] == messages) break;
+            usleep(10 * 1000);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    counts = statusCounts(path, shards, retried);
+
+    int delivered = messages - expectedRejects;
+    ok = counts["DELIVERED"] == delivered && counts["FAILED"] == expectedRejects
+        && retried == expectedDeferrals && g_received.load() == delivered && g_corrupt.load() == 0;
+
+    printf("%s, %d connection(s) per domain, %d us per round trip: %d messages in %.3f s, %.0f msg/s over %d connections\n",
+        pipelining ? "pipelined" : "sequential", connections, latencyUs, messages, seconds,
+        messages / seconds, g_connections.load());
+    printf("  DELIVERED %d (expected %d), FAILED %d (expected %d), retried %d (expected %d), received %d, corrupt %d\n",
+        counts["DELIVERED"], delivered, counts["FAILED"], expectedRejects, retried, expectedDeferrals,
+        g_received.load(), g_corrupt.load());
+
+    removeDatabase(path, shards);
+    fflush(stdout);
+    _exit(ok ? 0 : 1); // Sink threads are detached
+}
@@ -0,0 +1,173 @@
+// wrk-style load generator for the Linux HTTP server: keeps C keep-alive
+// connections busy from T threads for D seconds (one request in flight per
+// connection) and reports requests/sec and latency percentiles. Point it at a
+// mailbox path to measure the read path with and without the response cache.
+//
+// Run:
+//   ./http_bench [host=127.0.0.1] [port=8080] [connections=64] [threads=4] [seconds=10] [path=/]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    std::string request;
+
+    struct Client {
+        int socket = -1;
+        Clock::time_point sentAt;
+        std::string response;
+    };
+
+    struct WorkerResult {
+        std::vector<uint32_t> latenciesUs;
+        uint64_t errors = 0;
+    };
+
+    // Length of the first complete response in data, or 0 if incomplete
+    size_t completeResponse(const std::string& data) {
+        size_t headerEnd = data.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) return 0;
+        size_t chunked = data.find("Transfer-Encoding: chunked");
+        if (chunked != std::string::npos && chunked < headerEnd) {
+            size_t last = data.find("\r\n0\r\n\r\n", headerEnd);
+            return last == std::string::npos ? 0 : last + 7;
+        }
+        size_t contentLength = 0;
+        size_t field = data.find("Content-Length:");
+        if (field != std::string::npos && field < headerEnd) {
+            contentLength = strtoul(data.c_str() + field + 15, nullptr, 10);
+        }
+        size_t total = headerEnd + 4 + contentLength;
+        return data.size() >= total ? total : 0;
+    }
+
+    bool connectClient(Client& client, const sockaddr_in& address) {
+        client.socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (client.socket < 0) return false;
+        if (connect(client.socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+            close(client.socket);
+            client.socket = -1;
+            return false;
+        }
+        int opt = 1;
+        setsockopt(client.socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        return true;
+    }
+
+    bool sendRequest(Client& client) {
+        client.sentAt = Clock::now();
+        return send(client.socket, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+    }
+
+    void runWorker(const sockaddr_in& address, int connections, Clock::time_point deadline, WorkerResult& result) {
+        int epoll = epoll_create1(0);
+        std::vector<Client> clients(static_cast<size_t>(connections));
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (!connectClient(clients[i], address) || !sendRequest(clients[i])) {
+                ++result.errors;
+                continue;
+            }
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u64 = i;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, clients[i].socket, &ev);
+        }
+
+        epoll_event events[256];
+        char buffer[16384];
+        while (Clock::now() < deadline) {
+            int ready = epoll_wait(epoll, events, 256, 100);
+            for (int i = 0; i < ready; ++i) {
+                Client& client = clients[events[i].data.u64];
+                ssize_t received = recv(client.socket, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    ++result.errors;
+                    epoll_ctl(epoll, EPOLL_CTL_DEL, client.socket, nullptr);
+                    close(client.socket);
+                    client.socket = -1;
+                    continue;
+                }
+                client.response.append(buffer, static_cast<size_t>(received));
+
+                size_t length = completeResponse(client.response);
+                if (length == 0) continue;
+                auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - client.sentAt);
+                result.latenciesUs.push_back(static_cast<uint32_t>(latency.count()));
+                client.response.erase(0, length);
+                if (!sendRequest(client)) ++result.errors;
+            }
+        }
+
+        for (Client& client : clients) {
+            if (client.socket >= 0) close(client.socket);
+        }
+        close(epoll);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 8080;
+    int connections = argc > 3 ? atoi(argv[3]) : 64;
+    int threads = argc > 4 ? atoi(argv[4]) : 4;
+    int seconds = argc > 5 ? atoi(argv[5]) : 10;
+    const char* path = argc > 6 ? argv[6] : "/";
+    if (threads > connections) threads = connections;
+
+    request = std::string("GET ") + path + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: http_bench\r\n\r\n";
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    inet_pton(AF_INET, host, &address.sin_addr);
+
+    printf("Running %ds test @ http://%s:%d%s\n  %d threads and %d connections\n", seconds, host, port, path, threads, connections);
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + std::chrono::seconds(seconds);
+    std::vector<WorkerResult> results(static_cast<size_t>(threads));
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        int share = connections / threads + (i < connections % threads ? 1 : 0);
+        workers.emplace_back(runWorker, std::cref(address), share, deadline, std::ref(results[i]));
+    }
+    for (auto& worker : workers) worker.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint32_t> latencies;
+    uint64_t errors = 0;
+    for (auto& result : results) {
+        latencies.insert(latencies.end(), result.latenciesUs.begin(), result.latenciesUs.end());
+        errors += result.errors;
+    }
+    if (latencies.empty()) {
+        printf("No responses (%llu errors)\n", static_cast<unsigned long long>(errors));
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+
+    printf("  Latency   p50 %uus  p90 %uus  p99 %uus  max %uus\n",
+        percentile(0.50), percentile(0.90), percentile(0.99), latencies.back());
+    printf("  %zu requests in %.2fs, %llu errors\n", latencies.size(), elapsed, static_cast<unsigned long long>(errors));
+    printf("Requests/sec: %.0f\n", latencies.size() / elapsed);
+    return 0;
+}
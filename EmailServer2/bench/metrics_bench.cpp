@@ -0,0 +1,42 @@
+// Cost of recording metrics on the hot path: a counter increment, a histogram
+// observation, and a scoped timer (two clock reads plus the observation),
+// single-threaded and with every thread recording at once.
+
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include "smtp_metrics.h"
+
+namespace {
+    void BM_Counter(benchmark::State& state) {
+        for (auto _ : state) {
+            smtp::Metrics::add(smtp::Metrics::Counter::BytesReceived, 512);
+        }
+    }
+
+    void BM_Observe(benchmark::State& state) {
+        uint64_t nanos = 1000;
+        for (auto _ : state) {
+            smtp::Metrics::observe(smtp::Metrics::Histogram::SpamCheck, nanos);
+            nanos = nanos * 7 % 1000003;
+        }
+    }
+
+    void BM_Timer(benchmark::State& state) {
+        for (auto _ : state) {
+            smtp::Metrics::Timer timer(smtp::Metrics::Histogram::CommandMail);
+        }
+    }
+
+    void BM_Scrape(benchmark::State& state) {
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(smtp::Metrics::scrape());
+        }
+    }
+}
+
+BENCHMARK(BM_Counter)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_Observe)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_Timer)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_Scrape);
+
+BENCHMARK_MAIN();
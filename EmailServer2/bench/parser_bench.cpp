@@ -0,0 +1,77 @@
+// Command tokenizer microbenchmark: the per-recv std::string loop handleClient
+// used to run against LineBuffer, on pipelined input fed in 1024-byte reads.
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "smtp_parser.h"
+
+namespace {
+    const size_t READ_SIZE = 1024;
+
+    std::string pipelinedInput(size_t commands) {
+        static const char* script[] = {
+            "MAIL FROM:<alice.sender@example.com>\r\n",
+            "RCPT TO:<bob.recipient@example.org>\r\n",
+            "NOOP\r\n",
+            "RSET\r\n",
+        };
+        std::string input;
+        for (size_t i = 0; i < commands; ++i) input += script[i % 4];
+        return input;
+    }
+
+    // The loop handleClient ran before the session buffer existed (minus the
+    // sanitizeInput call, which stripped the CRLFs it then searched for).
+    // Commands that straddle two reads are lost.
+    void BM_LegacyTokenizer(benchmark::State& state) {
+        std::string input = pipelinedInput(static_cast<size_t>(state.range(0)));
+        size_t commands = 0;
+        for (auto _ : state) {
+            for (size_t offset = 0; offset < input.size(); offset += READ_SIZE) {
+                std::string clientData(input.data() + offset, std::min(READ_SIZE, input.size() - offset));
+                size_t crlfPos;
+                while ((crlfPos = clientData.find("\r\n")) != std::string::npos) {
+                    std::string command = clientData.substr(0, crlfPos);
+                    clientData.erase(0, crlfPos + 2);
+                    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+                    if (command.substr(0, 4) == "MAIL" || command.substr(0, 4) == "RCPT") ++commands;
+                    benchmark::DoNotOptimize(command.data());
+                }
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+        state.counters["matched"] = benchmark::Counter(static_cast<double>(commands), benchmark::Counter::kAvgIterations);
+    }
+
+    void BM_LineBuffer(benchmark::State& state) {
+        std::string input = pipelinedInput(static_cast<size_t>(state.range(0)));
+        smtp::LineBuffer buffer;
+        size_t commands = 0;
+        for (auto _ : state) {
+            size_t offset = 0;
+            while (offset < input.size()) {
+                size_t available;
+                char* tail = buffer.writable(available);
+                size_t chunk = std::min({ READ_SIZE, available, input.size() - offset });
+                memcpy(tail, input.data() + offset, chunk);
+                buffer.commit(chunk);
+                offset += chunk;
+
+                std::string_view line;
+                while (buffer.nextLine(line, 512) == smtp::LineBuffer::Line::Ready) {
+                    if (smtp::startsWithNoCase(line, "MAIL FROM:") || smtp::startsWithNoCase(line, "RCPT TO:")) ++commands;
+                    benchmark::DoNotOptimize(line.data());
+                }
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+        state.counters["matched"] = benchmark::Counter(static_cast<double>(commands), benchmark::Counter::kAvgIterations);
+    }
+}
+
+BENCHMARK(BM_LegacyTokenizer)->Arg(1000)->Arg(100000);
+BENCHMARK(BM_LineBuffer)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
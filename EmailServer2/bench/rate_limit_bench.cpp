@@ -0,0 +1,65 @@
+// RateLimiter::allow() cost under contention, 1-64 threads. "Spread" gives
+// every thread its own range of client addresses (the normal case: many
+// clients, independent cache lines); "Hot" sends every thread at the same
+// address, so all of them CAS the same slot.
+
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <arpa/inet.h>
+#include "smtp_rate_limiter.h"
+
+namespace {
+    const int ADDRESSES_PER_THREAD = 4096;
+
+    smtp::RateLimiter& sharedLimiter() {
+        // One table for every thread count; large enough for 64 x 4096 addresses
+        static std::unique_ptr<smtp::RateLimiter> instance = [] {
+            smtp::RateLimitOptions options;
+            options.ratePerSec = 1000000;
+            options.burst = 65535;
+            options.shardBits = 6;
+            options.bucketsPerShard = 2048;
+            return std::make_unique<smtp::RateLimiter>(options);
+        }();
+        return *instance;
+    }
+
+    sockaddr_in makeAddress(uint32_t host) {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(host);
+        return address;
+    }
+
+    void BM_Spread(benchmark::State& state) {
+        smtp::RateLimiter& limiter = sharedLimiter();
+        std::vector<sockaddr_in> addresses;
+        for (int i = 0; i < ADDRESSES_PER_THREAD; ++i) {
+            addresses.push_back(makeAddress(0x0A000000u + static_cast<uint32_t>(state.thread_index()) * ADDRESSES_PER_THREAD + i));
+        }
+
+        size_t next = 0;
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(limiter.allow(reinterpret_cast<sockaddr*>(&addresses[next])));
+            if (++next == addresses.size()) next = 0;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_Hot(benchmark::State& state) {
+        smtp::RateLimiter& limiter = sharedLimiter();
+        sockaddr_in address = makeAddress(0xC0A80001u);
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(limiter.allow(reinterpret_cast<sockaddr*>(&address)));
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+BENCHMARK(BM_Spread)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_Hot)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,241 @@
+// Heap allocations per message through the whole server: counts every
+// operator new in the process while one client sends messages over fresh
+// connections, after a warm-up so per-thread pools and buffers have reached
+// their steady-state size. The client and the classifier stand-in run in this
+// process too and allocate nothing while measuring. SQLite allocates with its
+// own malloc and is not counted.
+//
+// Run:
+//   ./session_alloc_bench [io=epoll|threaded|uring] [messages=2000] [perConnection=10] [size=4096]
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "smtp_server.h"
+
+namespace {
+    std::atomic<uint64_t> g_allocations{ 0 };
+}
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Out of line, so GCC does not pair the inlined free() with operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { free(p); }
+
+namespace {
+    const int SMTP_PORT = 2599;
+    const int SPAM_PORT = 2598;
+
+    int listenOn(int port) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(s, (sockaddr*)&address, sizeof(address)) < 0 || listen(s, 16) < 0) {
+            perror("spam stub listen");
+            exit(1);
+        }
+        return s;
+    }
+
+    bool readFully(int s, char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = recv(s, data, length, 0);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool writeFully(int s, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(s, data, length, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Answers HAM to everything; buffers are allocated once per connection
+    void spamStub(int listener) {
+        for (;;) {
+            int s = accept(listener, nullptr, nullptr);
+            if (s < 0) continue;
+            std::thread([s] {
+                std::vector<char> body(1 << 20);
+                char header[8];
+                while (readFully(s, header, sizeof(header))) {
+                    uint32_t length;
+                    memcpy(&length, header + 4, sizeof(length));
+                    length = ntohl(length);
+                    if (length > body.size()) body.resize(length);
+                    if (!readFully(s, body.data(), length)) break;
+                    char reply[11];
+                    uint32_t verdictLength = htonl(3);
+                    memcpy(reply, header, 4);
+                    memcpy(reply + 4, &verdictLength, 4);
+                    memcpy(reply + 8, "HAM", 3);
+                    if (!writeFully(s, reply, sizeof(reply))) break;
+                }
+                close(s);
+            }).detach();
+        }
+    }
+
+    // Reads replies line by line from a fixed buffer (pipelined replies may
+    // arrive together)
+    class Replies {
+    public:
+        explicit Replies(int socket) : m_socket(socket) {}
+
+        // Waits for the final line of the next reply and checks its code
+        bool expect(const char* code) {
+            for (;;) {
+                const char* crlf = static_cast<const char*>(memmem(m_buffer + m_begin, m_end - m_begin, "\r\n", 2));
+                if (crlf != nullptr) {
+                    size_t line = m_begin;
+                    m_begin = static_cast<size_t>(crlf - m_buffer) + 2;
+                    if (m_buffer[line + 3] == ' ') return memcmp(m_buffer + line, code, 3) == 0;
+                    continue;
+                }
+                if (m_begin > 0) {
+                    memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+                    m_end -= m_begin;
+                    m_begin = 0;
+                }
+                if (m_end == sizeof(m_buffer)) return false;
+                ssize_t n = recv(m_socket, m_buffer + m_end, sizeof(m_buffer) - m_end, 0);
+                if (n <= 0) return false;
+                m_end += static_cast<size_t>(n);
+            }
+        }
+
+    private:
+        int m_socket;
+        char m_buffer[1024];
+        size_t m_begin = 0;
+        size_t m_end = 0;
+    };
+
+    bool session(const sockaddr_in& address, int messages, const std::string& body) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(s, (const sockaddr*)&address, sizeof(address)) < 0) return false;
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        const char ehlo[] = "EHLO bench.example.com\r\n";
+        const char envelope[] = "MAIL FROM:<alice.sender@example.com>\r\nRCPT TO:<bob.recipient@example.org>\r\nDATA\r\n";
+        const char quit[] = "QUIT\r\n";
+        Replies replies(s);
+        bool ok = replies.expect("220") && writeFully(s, ehlo, sizeof(ehlo) - 1) && replies.expect("250");
+        for (int i = 0; ok && i < messages; ++i) {
+            ok = writeFully(s, envelope, sizeof(envelope) - 1) && replies.expect("250") && replies.expect("250")
+                && replies.expect("354") && writeFully(s, body.data(), body.size()) && replies.expect("250");
+        }
+        ok = ok && writeFully(s, quit, sizeof(quit) - 1) && replies.expect("221");
+        close(s);
+        return ok;
+    }
+
+    bool run(const sockaddr_in& address, int messages, int perConnection, const std::string& body) {
+        for (int sent = 0; sent < messages; sent += perConnection) {
+            if (!session(address, std::min(perConnection, messages - sent), body)) return false;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* io = argc > 1 ? argv[1] : "epoll";
+    bool threaded = strcmp(io, "threaded") == 0;
+    int messages = argc > 2 ? atoi(argv[2]) : 2000;
+    int perConnection = argc > 3 ? atoi(argv[3]) : 10;
+    size_t size = argc > 4 ? strtoull(argv[4], nullptr, 10) : 4096;
+
+    std::string path = "/tmp/session_alloc_bench_" + std::to_string(getpid()) + ".db";
+    int spamListener = listenOn(SPAM_PORT);
+    std::thread(spamStub, spamListener).detach();
+
+    smtp::ServerConfig config;
+    config.ipAddress = "127.0.0.1";
+    config.port = SMTP_PORT;
+    config.ioModel = threaded ? smtp::IoModel::Threaded : strcmp(io, "uring") == 0 ? smtp::IoModel::IoUring : smtp::IoModel::Epoll;
+    config.maxThreads = 4;
+    config.eventLoops = 1;
+    config.storage.path = path;
+    config.storage.synchronous = "OFF";
+    config.spamCheck.port = SPAM_PORT;
+    config.rateLimit.enabled = false;
+    config.bayes.enabled = false;
+    config.metrics.enabled = false;
+    smtp::TcpServer* server = new smtp::TcpServer(config);
+    std::thread([server] { server->startListen(); }).detach();
+    usleep(200 * 1000);
+
+    std::string data = "Subject: allocation bench\r\n\r\n";
+    while (data.size() < size) data += "The quick brown fox jumps over the lazy dog 0123456789\r\n";
+    data.resize(size);
+    data += "\r\n.\r\n";
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SMTP_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Warm-up: thread pools, spam client connections, prepared statements, buffers
+    if (!run(address, std::max(perConnection * 20, messages / 4), perConnection, data)) {
+        fprintf(stderr, "warm-up failed\n");
+        return 1;
+    }
+    usleep(100 * 1000);
+
+    uint64_t before = g_allocations.load();
+    bool ok = run(address, messages, perConnection, data);
+    usleep(100 * 1000); // Let the writer finish its last batch
+    uint64_t allocations = g_allocations.load() - before;
+    if (!ok) {
+        fprintf(stderr, "run failed\n");
+        return 1;
+    }
+
+    int connections = (messages + perConnection - 1) / perConnection;
+    printf("%s: %d messages over %d connections, %llu allocations: %.2f per message\n",
+        io, messages, connections,
+        static_cast<unsigned long long>(allocations), static_cast<double>(allocations) / messages);
+
+    fflush(stdout);
+
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    unlink((path + "-shm").c_str());
+    unlink((path + "-gen").c_str());
+    _exit(0); // The server has no shutdown path; skip destructors of detached threads
+}
@@ -0,0 +1,44 @@
+// SMTP server configured for load tests: no per-address rate limit (every
+// session comes from one host), no in-process Bayes model, so each message
+// takes the full path through the external classifier (run spam_stub) and
+// the group-committed store. Given a certificate and key it also offers
+// STARTTLS (see tls_bench).
+//
+// Run:
+//   ./spam_stub 65432 &
+//   ./smtp_bench_server [port=2525] [io=epoll|threaded|uring] [db=bench.db] [synchronous=FULL] [spamPort=65432]
+//                       [cert.pem key.pem [ktls=on|off]]
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "smtp_server.h"
+
+int main(int argc, char** argv) {
+    smtp::ServerConfig config;
+    config.port = argc > 1 ? atoi(argv[1]) : 2525;
+    const char* io = argc > 2 ? argv[2] : "epoll";
+    config.ioModel = strcmp(io, "threaded") == 0 ? smtp::IoModel::Threaded
+        : strcmp(io, "uring") == 0 ? smtp::IoModel::IoUring : smtp::IoModel::Epoll;
+    config.storage.path = argc > 3 ? argv[3] : "bench.db";
+    config.storage.synchronous = argc > 4 ? argv[4] : "FULL";
+    config.spamCheck.port = argc > 5 ? atoi(argv[5]) : 65432;
+    config.rateLimit.enabled = false;
+    config.bayes.enabled = false;
+    if (argc > 7) {
+        config.tls.enabled = true;
+        config.tls.certificateFile = argv[6];
+        config.tls.privateKeyFile = argv[7];
+        config.tls.kernelTls = !(argc > 8 && strcmp(argv[8], "off") == 0);
+    }
+
+    std::cout << "Benchmark SMTP server on port " << config.port
+        << (config.ioModel == smtp::IoModel::Epoll ? " (epoll)" : config.ioModel == smtp::IoModel::IoUring ? " (io_uring)" : " (threaded)")
+        << ", database " << config.storage.path
+        << (config.tls.enabled ? (config.tls.kernelTls ? ", STARTTLS (kTLS if available)" : ", STARTTLS") : "")
+        << std::endl;
+
+    smtp::TcpServer server(config);
+    server.startListen();
+    return 0;
+}
@@ -0,0 +1,334 @@
+// SMTP load generator: S concurrent sessions spread over T threads send
+// messages of a fixed size for D seconds, reconnecting every P messages.
+// Reports messages/sec and latency percentiles per phase: connect, banner,
+// EHLO, MAIL, RCPT, DATA (until 354) and the final 250 (from the first body
+// byte to the reply). Run it against smtp_bench_server and spam_stub.
+//
+// Run:
+//   ./smtp_load [host=127.0.0.1] [port=2525] [sessions=64] [threads=4] [seconds=10] [size=4096] [perConnection=10]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    enum Phase { CONNECT, BANNER, EHLO, MAIL, RCPT, DATA, BODY, QUIT, PHASES };
+    const char* PHASE_NAMES[] = { "connect", "banner", "EHLO", "MAIL", "RCPT", "DATA", "final 250", "QUIT" };
+
+    struct Settings {
+        sockaddr_in address;
+        int perConnection;
+        std::string body;   // Message text including the terminating ".\r\n"
+    };
+
+    struct Client {
+        int socket = -1;
+        Phase phase = CONNECT;
+        Clock::time_point sentAt;
+        std::string input;
+        std::string output;
+        size_t outputSent = 0;
+        bool wantWrite = false;
+        int messages = 0;           // Sent on this connection
+        std::string mailFrom, rcptTo;
+    };
+
+    struct WorkerResult {
+        std::vector<uint32_t> latenciesUs[PHASES];
+        uint64_t messages = 0;
+        uint64_t errors = 0;
+    };
+
+    class Worker {
+    public:
+        Worker(const Settings& settings, int sessions, int firstSession, Clock::time_point deadline, WorkerResult& result)
+            : m_settings(settings), m_clients(static_cast<size_t>(sessions)), m_deadline(deadline), m_result(result) {
+            for (size_t i = 0; i < m_clients.size(); ++i) {
+                int id = firstSession + static_cast<int>(i);
+                m_clients[i].mailFrom = "MAIL FROM:<load" + std::to_string(id) + "@example.com>\r\n";
+                m_clients[i].rcptTo = "RCPT TO:<user" + std::to_string(id % 100) + "@example.org>\r\n";
+            }
+        }
+
+        void run() {
+            m_epoll = epoll_create1(0);
+            for (size_t i = 0; i < m_clients.size(); ++i) connectClient(i);
+
+            epoll_event events[256];
+            while (Clock::now() < m_deadline) {
+                int ready = epoll_wait(m_epoll, events, 256, 100);
+                for (int i = 0; i < ready; ++i) {
+                    size_t index = events[i].data.u64;
+                    Client& client = m_clients[index];
+                    if (client.socket < 0) continue;
+
+                    bool ok = true;
+                    if (client.phase == CONNECT) ok = connected(index, events[i].events);
+                    else {
+                        if (events[i].events & EPOLLOUT) ok = flush(index);
+                        if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) ok = readReplies(index);
+                    }
+                    if (!ok) fail(index);
+                }
+            }
+
+            for (Client& client : m_clients) {
+                if (client.socket >= 0) close(client.socket);
+            }
+            close(m_epoll);
+        }
+
+    private:
+        void connectClient(size_t index) {
+            Client& client = m_clients[index];
+            client.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            client.phase = CONNECT;
+            client.input.clear();
+            client.output.clear();
+            client.outputSent = 0;
+            client.messages = 0;
+            client.sentAt = Clock::now();
+            if (client.socket < 0) {
+                ++m_result.errors;
+                return;
+            }
+            int rc = connect(client.socket, reinterpret_cast<const sockaddr*>(&m_settings.address), sizeof(m_settings.address));
+            if (rc < 0 && errno != EINPROGRESS) {
+                ++m_result.errors;
+                close(client.socket);
+                client.socket = -1;
+                return;
+            }
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.u64 = index;
+            epoll_ctl(m_epoll, EPOLL_CTL_ADD, client.socket, &ev);
+            client.wantWrite = true;
+        }
+
+        bool connected(size_t index, uint32_t events) {
+            Client& client = m_clients[index];
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(client.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0 || (events & EPOLLERR)) return false;
+
+            int opt = 1;
+            setsockopt(client.socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            record(client, BANNER);
+            return watch(index, false);
+        }
+
+        // Phase that just finished gets its latency; the next one starts now
+        void record(Client& client, Phase next) {
+            Clock::time_point now = Clock::now();
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - client.sentAt);
+            m_result.latenciesUs[client.phase].push_back(static_cast<uint32_t>(latency.count()));
+            client.phase = next;
+            client.sentAt = now;
+        }
+
+        bool send(size_t index, const std::string& data) {
+            Client& client = m_clients[index];
+            client.output.append(data);
+            return flush(index);
+        }
+
+        bool flush(size_t index) {
+            Client& client = m_clients[index];
+            while (client.outputSent < client.output.size()) {
+                ssize_t sent = ::send(client.socket, client.output.data() + client.outputSent,
+                    client.output.size() - client.outputSent, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return watch(index, true);
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                client.outputSent += static_cast<size_t>(sent);
+            }
+            client.output.clear();
+            client.outputSent = 0;
+            return watch(index, false);
+        }
+
+        bool watch(size_t index, bool writable) {
+            Client& client = m_clients[index];
+            if (client.wantWrite == writable) return true;
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+            ev.data.u64 = index;
+            client.wantWrite = writable;
+            return epoll_ctl(m_epoll, EPOLL_CTL_MOD, client.socket, &ev) == 0;
+        }
+
+        bool readReplies(size_t index) {
+            Client& client = m_clients[index];
+            char buffer[4096];
+            ssize_t received = recv(client.socket, buffer, sizeof(buffer), 0);
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (received <= 0) return client.phase == QUIT && received == 0 ? reconnect(index) : false;
+            client.input.append(buffer, static_cast<size_t>(received));
+
+            size_t begin = 0;
+            size_t end;
+            while ((end = client.input.find("\r\n", begin)) != std::string::npos) {
+                std::string line = client.input.substr(begin, end - begin);
+                begin = end + 2;
+                if (line.size() >= 4 && line[3] == '-') continue;  // Multi-line reply continues
+                if (!onReply(index, atoi(line.c_str()))) return false;
+                if (client.phase == CONNECT) return true;  // Reconnecting: the rest belonged to the old session
+            }
+            client.input.erase(0, begin);
+            return true;
+        }
+
+        bool onReply(size_t index, int code) {
+            Client& client = m_clients[index];
+            switch (client.phase) {
+            case BANNER:
+                if (code != 220) return false;
+                record(client, EHLO);
+                return send(index, "EHLO loadgen.example.com\r\n");
+            case EHLO:
+                if (code != 250) return false;
+                record(client, MAIL);
+                return send(index, client.mailFrom);
+            case MAIL:
+                if (code != 250) return false;
+                record(client, RCPT);
+                return send(index, client.rcptTo);
+            case RCPT:
+                if (code != 250) return false;
+                record(client, DATA);
+                return send(index, "DATA\r\n");
+            case DATA:
+                if (code != 354) return false;
+                record(client, BODY);
+                return send(index, m_settings.body);
+            case BODY:
+                if (code != 250) return false;
+                ++m_result.messages;
+                ++client.messages;
+                if (client.messages >= m_settings.perConnection || Clock::now() >= m_deadline) {
+                    record(client, QUIT);
+                    return send(index, "QUIT\r\n");
+                }
+                record(client, MAIL);
+                return send(index, client.mailFrom);
+            case QUIT:
+                if (code != 221) return false;
+                record(client, CONNECT);
+                return reconnect(index);
+            default:
+                return false;
+            }
+        }
+
+        bool reconnect(size_t index) {
+            Client& client = m_clients[index];
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, client.socket, nullptr);
+            close(client.socket);
+            client.socket = -1;
+            if (Clock::now() < m_deadline) connectClient(index);
+            return true;
+        }
+
+        void fail(size_t index) {
+            ++m_result.errors;
+            Client& client = m_clients[index];
+            client.phase = QUIT;
+            reconnect(index);
+        }
+
+        const Settings& m_settings;
+        std::vector<Client> m_clients;
+        Clock::time_point m_deadline;
+        WorkerResult& m_result;
+        int m_epoll = -1;
+    };
+
+    std::string makeBody(size_t size) {
+        std::string body = "From: <load@example.com>\r\nTo: <user@example.org>\r\nSubject: load test\r\n\r\n";
+        const std::string line = std::string(76, 'x') + "\r\n";
+        while (body.size() + line.size() <= size) body += line;
+        if (body.size() < size) body += std::string(size - body.size(), 'x') + "\r\n";
+        return body + ".\r\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 2525;
+    int sessions = argc > 3 ? atoi(argv[3]) : 64;
+    int threads = argc > 4 ? atoi(argv[4]) : 4;
+    int seconds = argc > 5 ? atoi(argv[5]) : 10;
+    size_t size = argc > 6 ? strtoul(argv[6], nullptr, 10) : 4096;
+    int perConnection = argc > 7 ? atoi(argv[7]) : 10;
+    if (threads > sessions) threads = sessions;
+
+    Settings settings;
+    memset(&settings.address, 0, sizeof(settings.address));
+    settings.address.sin_family = AF_INET;
+    settings.address.sin_port = htons(static_cast<uint16_t>(port));
+    inet_pton(AF_INET, host, &settings.address.sin_addr);
+    settings.perConnection = std::max(1, perConnection);
+    settings.body = makeBody(size);
+
+    printf("Running %ds SMTP test @ %s:%d\n  %d threads, %d sessions, %zu-byte messages, %d per connection\n",
+        seconds, host, port, threads, sessions, size, settings.perConnection);
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + std::chrono::seconds(seconds);
+    std::vector<WorkerResult> results(static_cast<size_t>(threads));
+    std::vector<std::thread> workers;
+    int firstSession = 0;
+    for (int i = 0; i < threads; ++i) {
+        int share = sessions / threads + (i < sessions % threads ? 1 : 0);
+        workers.emplace_back([&settings, share, firstSession, deadline, &results, i] {
+            Worker(settings, share, firstSession, deadline, results[i]).run();
+        });
+        firstSession += share;
+    }
+    for (auto& worker : workers) worker.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    uint64_t messages = 0;
+    uint64_t errors = 0;
+    printf("  %-10s %9s %9s %9s %9s %9s\n", "phase", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (int phase = 0; phase < PHASES; ++phase) {
+        std::vector<uint32_t> latencies;
+        for (auto& result : results) {
+            latencies.insert(latencies.end(), result.latenciesUs[phase].begin(), result.latenciesUs[phase].end());
+        }
+        if (latencies.empty()) continue;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+        printf("  %-10s %9zu %9u %9u %9u %9u\n", PHASE_NAMES[phase], latencies.size(),
+            percentile(0.50), percentile(0.90), percentile(0.99), latencies.back());
+    }
+    for (auto& result : results) {
+        messages += result.messages;
+        errors += result.errors;
+    }
+
+    printf("  %llu messages in %.2fs, %llu errors\n", static_cast<unsigned long long>(messages), elapsed,
+        static_cast<unsigned long long>(errors));
+    printf("Messages/sec: %.0f\n", messages / elapsed);
+    return messages > 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+// Local stand-in for the spam classifier, speaking SpamClient's framing:
+//   request  [u32 id][u32 length][body]
+//   reply    [u32 id][u32 length]["SPAM" | "HAM"]
+// A body is SPAM when it contains the keyword. An optional per-request delay
+// makes it easy to exercise deadlines and the circuit breaker.
+//
+// Run:
+//   ./spam_stub [port=65432] [delayMs=0] [keyword=VIAGRA]
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace {
+    bool readFully(int sock, char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = recv(sock, data, length, 0);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool writeFully(int sock, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void serve(int sock, int delayMs, std::string keyword) {
+        std::string body;
+        char header[8];
+        while (readFully(sock, header, sizeof(header))) {
+            uint32_t length;
+            memcpy(&length, header + 4, sizeof(length));
+            body.resize(ntohl(length));
+            if (!readFully(sock, &body[0], body.size())) break;
+
+            if (delayMs > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+
+            const char* verdict = body.find(keyword) != std::string::npos ? "SPAM" : "HAM";
+            uint32_t verdictLength = htonl(static_cast<uint32_t>(strlen(verdict)));
+            char reply[16];
+            memcpy(reply, header, 4); // Echo the request id
+            memcpy(reply + 4, &verdictLength, 4);
+            memcpy(reply + 8, verdict, strlen(verdict));
+            if (!writeFully(sock, reply, 8 + strlen(verdict))) break;
+        }
+        close(sock);
+    }
+}
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? std::atoi(argv[1]) : 65432;
+    int delayMs = argc > 2 ? std::atoi(argv[2]) : 0;
+    std::string keyword = argc > 3 ? argv[3] : "VIAGRA";
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+        std::cerr << "ERROR: Failed to listen on 127.0.0.1:" << port << std::endl;
+        return 1;
+    }
+    std::cout << "Spam stub listening on 127.0.0.1:" << port << std::endl;
+
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) continue;
+        std::thread(serve, client, delayMs, keyword).detach();
+    }
+}
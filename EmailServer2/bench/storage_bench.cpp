@@ -0,0 +1,199 @@
+// MailStore group-commit throughput: inserts/sec as a function of the
+// transaction batch size, with WAL and synchronous=FULL (every commit fsyncs).
+// BM_FanOut sends each message to N recipients, the mailing-list case: with
+// single-instance bodies the database grows by one body per message plus a
+// small row per recipient ("db_bytes_per_message"). BM_Shards spreads
+// single-recipient messages over N database files, each with its own writer
+// and fsync; it scales with the cores and disks available to the writers.
+// BM_Bodies compares the two body backends at 4 KB, 64 KB and 1 MB: bodies in
+// the SQLite Bodies table against bodies appended to the segment log, with
+// only metadata in SQLite ("disk_bytes_per_message" counts the database,
+// and the records appended to segment files).
+
+#include <benchmark/benchmark.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "smtp_storage.h"
+
+namespace {
+    const int MESSAGES_PER_ITERATION = 2000;
+
+    void removeDatabase(const std::string& path, size_t shards = 1) {
+        for (size_t i = 0; i < shards; ++i) {
+            std::string file = smtp::shardPath(path, i, shards);
+            unlink(file.c_str());
+            unlink((file + "-wal").c_str());
+            unlink((file + "-shm").c_str());
+
+            std::string log = file + "-log";
+            if (DIR* directory = opendir(log.c_str())) {
+                while (dirent* item = readdir(directory)) {
+                    if (item->d_name[0] != '.') unlink((log + "/" + item->d_name).c_str());
+                }
+                closedir(directory);
+                rmdir(log.c_str());
+            }
+        }
+        unlink((path + "-gen").c_str());
+    }
+
+    double fileBytes(const std::string& path) {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 ? static_cast<double>(info.st_size) : 0;
+    }
+
+    void BM_GroupCommit(benchmark::State& state) {
+        std::string path = "/tmp/storage_bench_" + std::to_string(getpid()) + ".db";
+        std::string body(4096, 'x');
+        std::vector<std::string_view> recipients = { "recipient@example.com" };
+        {
+            smtp::StorageOptions options;
+            options.path = path;
+            options.maxBatch = static_cast<size_t>(state.range(0));
+            smtp::MailStore store(options);
+
+            std::mutex mutex;
+            std::condition_variable finished;
+            for (auto _ : state) {
+                int outstanding = MESSAGES_PER_ITERATION;
+                for (int i = 0; i < MESSAGES_PER_ITERATION; ++i) {
+                    store.storeEmail("sender@example.com", recipients, body, std::nullopt, [&](bool) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--outstanding == 0) finished.notify_one();
+                        });
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding == 0; });
+            }
+            state.SetItemsProcessed(state.iterations() * MESSAGES_PER_ITERATION);
+        }
+        removeDatabase(path);
+    }
+
+    // Every message is distinct, so each stores one body and N rows
+    void BM_FanOut(benchmark::State& state) {
+        const int messages = 200;
+        std::string path = "/tmp/storage_bench_" + std::to_string(getpid()) + ".db";
+        std::vector<std::string> addresses;
+        for (int64_t i = 0; i < state.range(0); ++i) addresses.push_back("user" + std::to_string(i) + "@example.com");
+        std::vector<std::string_view> recipients(addresses.begin(), addresses.end());
+        std::string body(16384, 'x');
+        uint64_t sequence = 0;
+        double databaseBytes = 0;
+        {
+            smtp::StorageOptions options;
+            options.path = path;
+            options.synchronous = "NORMAL";
+            smtp::MailStore store(options);
+
+            std::vector<std::string> bodies(messages, body);
+            std::mutex mutex;
+            std::condition_variable finished;
+            for (auto _ : state) {
+                for (std::string& text : bodies) text.replace(0, 20, std::to_string(sequence++) + "                    ", 0, 20);
+                int outstanding = messages;
+                for (const std::string& text : bodies) {
+                    store.storeEmail("list@example.com", recipients, text, std::nullopt, [&](bool) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--outstanding == 0) finished.notify_one();
+                        });
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding == 0; });
+            }
+            state.SetItemsProcessed(state.iterations() * messages);
+        }
+        // Checkpointed into the main file when the store closed
+        databaseBytes = fileBytes(path);
+        state.counters["db_bytes_per_message"] = databaseBytes / static_cast<double>(state.iterations() * messages);
+        removeDatabase(path);
+    }
+
+    // Distinct bodies of state.range(0) bytes; range(1) selects the backend
+    void BM_Bodies(benchmark::State& state) {
+        const int messages = 64;
+        size_t size = static_cast<size_t>(state.range(0));
+        bool segmentLog = state.range(1) != 0;
+        std::string path = "/tmp/storage_bench_" + std::to_string(getpid()) + ".db";
+        std::vector<std::string_view> recipients = { "recipient@example.com" };
+        std::vector<std::string> bodies(messages, std::string(size, 'x'));
+        uint64_t sequence = 0;
+        double diskBytes = 0;
+        {
+            smtp::StorageOptions options;
+            options.path = path;
+            options.bodies = segmentLog ? smtp::BodyStorage::SegmentLog : smtp::BodyStorage::Sqlite;
+            options.segmentLog.compactIntervalMs = 0;
+            smtp::MailStore store(options);
+
+            std::mutex mutex;
+            std::condition_variable finished;
+            for (auto _ : state) {
+                for (std::string& text : bodies) text.replace(0, 20, std::to_string(sequence++) + "                    ", 0, 20);
+                int outstanding = messages;
+                for (const std::string& text : bodies) {
+                    store.storeEmail("sender@example.com", recipients, text, std::nullopt, [&](bool) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--outstanding == 0) finished.notify_one();
+                        });
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding == 0; });
+            }
+            state.SetItemsProcessed(state.iterations() * messages);
+            state.SetBytesProcessed(state.iterations() * messages * static_cast<int64_t>(size));
+        }
+        // The database checkpointed when the store closed; segments are
+        // preallocated, so count the records appended rather than the files
+        diskBytes = fileBytes(path);
+        if (segmentLog) diskBytes += static_cast<double>(sequence) * static_cast<double>(size + 24);
+        state.counters["disk_bytes_per_message"] = diskBytes / static_cast<double>(sequence);
+        removeDatabase(path);
+    }
+
+    void BM_Shards(benchmark::State& state) {
+        size_t shards = static_cast<size_t>(state.range(0));
+        std::string path = "/tmp/storage_bench_" + std::to_string(getpid()) + ".db";
+        std::string body(4096, 'x');
+        std::vector<std::string> addresses;
+        for (int i = 0; i < 1024; ++i) addresses.push_back("user" + std::to_string(i) + "@example.com");
+        std::vector<std::vector<std::string_view>> recipients;
+        for (const std::string& address : addresses) recipients.push_back({ address });
+        {
+            smtp::StorageOptions options;
+            options.path = path;
+            options.shards = shards;
+            smtp::MailStore store(options);
+
+            std::mutex mutex;
+            std::condition_variable finished;
+            for (auto _ : state) {
+                int outstanding = MESSAGES_PER_ITERATION;
+                for (int i = 0; i < MESSAGES_PER_ITERATION; ++i) {
+                    store.storeEmail("sender@example.com", recipients[i % recipients.size()], body, std::nullopt, [&](bool) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--outstanding == 0) finished.notify_one();
+                        });
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&] { return outstanding == 0; });
+            }
+            state.SetItemsProcessed(state.iterations() * MESSAGES_PER_ITERATION);
+        }
+        removeDatabase(path, shards);
+    }
+}
+
+BENCHMARK(BM_GroupCommit)->Arg(1)->Arg(8)->Arg(64)->Arg(256)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_FanOut)->Arg(1)->Arg(10)->Arg(100)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_Bodies)->ArgNames({ "size", "log" })
+    ->Args({ 4096, 0 })->Args({ 4096, 1 })->Args({ 65536, 0 })->Args({ 65536, 1 })->Args({ 1 << 20, 0 })->Args({ 1 << 20, 1 })
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_Shards)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,223 @@
+// Session deadlines under load: opens many clients that go quiet against a
+// server in this process, half of them right after the banner and half in
+// the middle of DATA, then checks that every one is sent 421 and closed, and
+// how late. A well-behaved client connects once the quiet ones are in place
+// and reports how long it took to be served, which in threaded mode is how
+// long it queued behind them for a worker. Server CPU time over the run is
+// what holding the quiet sessions cost. Exits 1 if any session was not timed
+// out or the well-behaved client failed.
+//
+// Run:
+//   ./timeout_bench [io=epoll|threaded|uring] [clients=2000] [timeoutMs=1000] [maxThreads=50]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "smtp_server.h"
+
+namespace {
+    const int SMTP_PORT = 2597;
+    const int SPAM_PORT = 2596; // Nothing listens; the server fails open
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Quiet {
+        int socket = -1;
+        bool inData = false;            // Stalls after 354 instead of after the banner
+        Clock::time_point stalledAt;    // When the server last heard from it
+        Clock::time_point timedOutAt;
+        std::string input;
+        bool sentEnvelope = false;
+        bool got421 = false;
+        bool closed = false;
+    };
+
+    double msSince(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    double cpuSeconds() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    bool writeFully(int s, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(s, data, length, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    int connectTo(const sockaddr_in& address) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(s, (const sockaddr*)&address, sizeof(address)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        return s;
+    }
+
+    // Reads what arrived; the envelope goes out once the banner has
+    void onReadable(Quiet& client) {
+        char buffer[4096];
+        for (;;) {
+            ssize_t n = recv(client.socket, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                client.input.append(buffer, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) client.closed = true;
+            break;
+        }
+
+        if (client.inData && !client.sentEnvelope && client.input.find("\r\n") != std::string::npos) {
+            const char envelope[] = "EHLO quiet.example.com\r\nMAIL FROM:<a@example.com>\r\nRCPT TO:<b@example.org>\r\nDATA\r\n"
+                "Subject: never finished\r\n\r\nfirst line\r\n";
+            client.sentEnvelope = writeFully(client.socket, envelope, sizeof(envelope) - 1);
+            client.stalledAt = Clock::now();
+        }
+        if (!client.got421 && client.input.find("\r\n421 ") != std::string::npos) {
+            client.got421 = true;
+            client.timedOutAt = Clock::now();
+        }
+        if (client.closed && client.timedOutAt == Clock::time_point()) client.timedOutAt = Clock::now();
+    }
+
+    // EHLO and QUIT; returns the milliseconds from connect to 221
+    double wellBehaved(const sockaddr_in& address) {
+        auto start = Clock::now();
+        int s = connectTo(address);
+        const char commands[] = "EHLO prompt.example.com\r\nQUIT\r\n";
+        std::string input;
+        char buffer[4096];
+        bool sent = false;
+        for (;;) {
+            ssize_t n = recv(s, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            input.append(buffer, static_cast<size_t>(n));
+            if (!sent && input.find("\r\n") != std::string::npos) {
+                sent = writeFully(s, commands, sizeof(commands) - 1);
+            }
+        }
+        close(s);
+        return input.find("\r\n221 ") != std::string::npos ? msSince(start, Clock::now()) : -1;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* io = argc > 1 ? argv[1] : "epoll";
+    bool threaded = strcmp(io, "threaded") == 0;
+    int clients = argc > 2 ? atoi(argv[2]) : 2000;
+    int timeoutMs = argc > 3 ? atoi(argv[3]) : 1000;
+    int maxThreads = argc > 4 ? atoi(argv[4]) : 50;
+
+    std::string path = "/tmp/timeout_bench_" + std::to_string(getpid()) + ".db";
+    smtp::ServerConfig config;
+    config.ipAddress = "127.0.0.1";
+    config.port = SMTP_PORT;
+    config.ioModel = threaded ? smtp::IoModel::Threaded : strcmp(io, "uring") == 0 ? smtp::IoModel::IoUring : smtp::IoModel::Epoll;
+    config.maxThreads = maxThreads;
+    config.eventLoops = 1;
+    config.storage.path = path;
+    config.storage.synchronous = "OFF";
+    config.spamCheck.port = SPAM_PORT;
+    config.rateLimit.enabled = false;
+    config.bayes.enabled = false;
+    config.metrics.enabled = false;
+    config.timeouts.bannerMs = timeoutMs;
+    config.timeouts.commandMs = timeoutMs;
+    config.timeouts.dataBlockMs = timeoutMs;
+    smtp::TcpServer* server = new smtp::TcpServer(config);
+    std::thread([server] { server->startListen(); }).detach();
+    usleep(200 * 1000);
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SMTP_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<Quiet> quiet(static_cast<size_t>(clients));
+    double cpuBefore = cpuSeconds();
+    auto start = Clock::now();
+    for (int i = 0; i < clients; ++i) {
+        Quiet& client = quiet[static_cast<size_t>(i)];
+        client.socket = connectTo(address);
+        client.inData = i % 2 == 1;
+        client.stalledAt = Clock::now();
+        fcntl(client.socket, F_SETFL, fcntl(client.socket, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = &client;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, client.socket, &ev);
+    }
+    double connectMs = msSince(start, Clock::now());
+
+    double promptMs = -1;
+    std::thread prompt([&] { promptMs = wellBehaved(address); });
+
+    // Until every quiet client has been closed, or well past when it should have been
+    int open = clients;
+    auto giveUp = Clock::now() + std::chrono::milliseconds(timeoutMs * 3 + 10000)
+        + std::chrono::milliseconds(threaded ? static_cast<int64_t>(timeoutMs) * clients / std::max(maxThreads, 1) : 0);
+    struct epoll_event events[256];
+    while (open > 0 && Clock::now() < giveUp) {
+        int ready = epoll_wait(epoll, events, 256, 100);
+        for (int i = 0; i < ready; ++i) {
+            Quiet& client = *static_cast<Quiet*>(events[i].data.ptr);
+            if (client.closed) continue;
+            onReadable(client);
+            if (client.closed) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, client.socket, nullptr);
+                close(client.socket);
+                --open;
+            }
+        }
+    }
+    prompt.join();
+    double seconds = msSince(start, Clock::now()) / 1000;
+    double cpu = cpuSeconds() - cpuBefore;
+
+    int timedOut = 0;
+    std::vector<double> lateness;
+    for (const Quiet& client : quiet) {
+        if (!client.got421 || !client.closed) continue;
+        ++timedOut;
+        lateness.push_back(msSince(client.stalledAt, client.timedOutAt) - timeoutMs);
+    }
+    std::sort(lateness.begin(), lateness.end());
+    auto percentile = [&](double p) {
+        return lateness.empty() ? 0.0 : lateness[std::min(lateness.size() - 1, static_cast<size_t>(p * lateness.size()))];
+    };
+
+    printf("%s: %d quiet clients (connected in %.0f ms), %d ms deadlines: %d sent 421 and closed in %.2f s\n",
+        io, clients, connectMs, timeoutMs, timedOut, seconds);
+    printf("  past the deadline: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n", percentile(0.5), percentile(0.99), percentile(1.0));
+    printf("  well-behaved client served in %.1f ms; process CPU %.3f s\n", promptMs, cpu);
+
+    fflush(stdout);
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    unlink((path + "-shm").c_str());
+    unlink((path + "-gen").c_str());
+    _exit(timedOut == clients && promptMs >= 0 ? 0 : 1); // The server has no shutdown path
+}
@@ -0,0 +1,208 @@
+// STARTTLS cost: handshakes/sec (full vs. resumed from the server's session
+// cache or a ticket) and bulk DATA throughput over TLS. Each connection does
+// EHLO, STARTTLS, the handshake, EHLO again, then sends `messages` messages of
+// `size` bytes and QUITs. Compare runs against smtp_bench_server with ktls=on
+// and ktls=off (smtp_tls_kernel_send_total on /metrics shows whether the
+// kernel took over; it needs the tls module: modprobe tls).
+//
+// Run (self-signed certificate for localhost):
+//   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes
+//       -keyout key.pem -out cert.pem -days 30 -subj /CN=localhost   (one line)
+//   ./smtp_bench_server 2525 epoll bench.db OFF 65432 cert.pem key.pem on &
+//   ./tls_bench [host=127.0.0.1] [port=2525] [connections=500] [resume=0|1] [messages=0] [size=1048576]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    double secondsSince(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    [[noreturn]] void fail(const char* what) {
+        fprintf(stderr, "%s\n", what);
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+
+    // Reads one SMTP reply (all continuation lines) through plain recv or SSL
+    class ReplyReader {
+    public:
+        ReplyReader(int socket) : m_socket(socket) {}
+        void useTls(SSL* ssl) { m_ssl = ssl; m_buffer.clear(); }
+
+        // Returns the reply code of the final line
+        int read() {
+            for (;;) {
+                size_t end;
+                while ((end = m_buffer.find("\r\n")) != std::string::npos) {
+                    std::string line = m_buffer.substr(0, end);
+                    m_buffer.erase(0, end + 2);
+                    if (line.size() >= 4 && line[3] == ' ') return atoi(line.c_str());
+                }
+                char chunk[4096];
+                int n = m_ssl ? SSL_read(m_ssl, chunk, sizeof(chunk))
+                              : static_cast<int>(recv(m_socket, chunk, sizeof(chunk), 0));
+                if (n <= 0) fail("Connection closed while waiting for a reply");
+                m_buffer.append(chunk, static_cast<size_t>(n));
+            }
+        }
+
+    private:
+        int m_socket;
+        SSL* m_ssl = nullptr;
+        std::string m_buffer;
+    };
+
+    void sendAll(int socket, SSL* ssl, const char* data, size_t length) {
+        while (length > 0) {
+            int n = ssl ? SSL_write(ssl, data, static_cast<int>(std::min<size_t>(length, 1 << 20)))
+                        : static_cast<int>(send(socket, data, length, MSG_NOSIGNAL));
+            if (n <= 0) fail("Send failed");
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+    }
+
+    void expect(ReplyReader& reader, int code, const char* step) {
+        int got = reader.read();
+        if (got != code) {
+            fprintf(stderr, "%s: expected %d, got %d\n", step, code, got);
+            exit(1);
+        }
+    }
+
+    int connectTo(const sockaddr_in& address) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0 || connect(s, (const sockaddr*)&address, sizeof(address)) < 0) fail("Cannot connect");
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return s;
+    }
+
+    double percentile(std::vector<double>& values, double p) {
+        if (values.empty()) return 0;
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 2525;
+    int connections = argc > 3 ? atoi(argv[3]) : 500;
+    bool resume = argc > 4 && atoi(argv[4]) != 0;
+    int messages = argc > 5 ? atoi(argv[5]) : 0;
+    size_t size = argc > 6 ? strtoull(argv[6], nullptr, 10) : 1048576;
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) fail("Bad host address");
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == nullptr) fail("Cannot create TLS context");
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr); // Self-signed test certificate
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    // Body: printable lines, no lone dots, terminated by CRLF.CRLF
+    std::string body;
+    body.reserve(size + 64);
+    body += "Subject: tls bench\r\n\r\n";
+    while (body.size() < size) body += "abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789\r\n";
+    body.resize(size);
+    body += "\r\n.\r\n";
+
+    SSL_SESSION* saved = nullptr;
+    std::vector<double> handshakeSeconds;
+    int resumed = 0;
+    size_t dataBytes = 0;
+    double dataSeconds = 0;
+
+    Clock::time_point started = Clock::now();
+    for (int i = 0; i < connections; ++i) {
+        int s = connectTo(address);
+        ReplyReader reader(s);
+        expect(reader, 220, "banner");
+        sendAll(s, nullptr, "EHLO bench.example.com\r\n", 24);
+        expect(reader, 250, "EHLO");
+        sendAll(s, nullptr, "STARTTLS\r\n", 10);
+
+        Clock::time_point handshakeStart = Clock::now();
+        expect(reader, 220, "STARTTLS");
+        SSL* ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, s);
+        SSL_set_tlsext_host_name(ssl, "localhost");
+        if (resume && saved != nullptr) SSL_set_session(ssl, saved);
+        if (SSL_connect(ssl) != 1) fail("Handshake failed");
+        handshakeSeconds.push_back(secondsSince(handshakeStart));
+        if (SSL_session_reused(ssl)) ++resumed;
+        reader.useTls(ssl);
+
+        // TLS 1.3 tickets arrive after the handshake; the EHLO reply flushes them
+        sendAll(s, ssl, "EHLO bench.example.com\r\n", 24);
+        expect(reader, 250, "EHLO over TLS");
+        if (resume) {
+            SSL_SESSION* session = SSL_get1_session(ssl);
+            if (session != nullptr) {
+                if (saved != nullptr) SSL_SESSION_free(saved);
+                saved = session;
+            }
+        }
+
+        for (int m = 0; m < messages; ++m) {
+            const char envelope[] = "MAIL FROM:<bench@example.com>\r\nRCPT TO:<sink@example.com>\r\nDATA\r\n";
+            sendAll(s, ssl, envelope, sizeof(envelope) - 1);
+            expect(reader, 250, "MAIL");
+            expect(reader, 250, "RCPT");
+            expect(reader, 354, "DATA");
+            Clock::time_point dataStart = Clock::now();
+            sendAll(s, ssl, body.data(), body.size());
+            int code = reader.read();
+            if (code != 250 && code != 451 && code != 554) {
+                fprintf(stderr, "end of data: got %d\n", code);
+                return 1;
+            }
+            dataSeconds += secondsSince(dataStart);
+            dataBytes += body.size();
+        }
+
+        sendAll(s, ssl, "QUIT\r\n", 6);
+        reader.read();
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(s);
+    }
+    double elapsed = secondsSince(started);
+
+    printf("%d connections in %.2f s: %.0f connections/s, resumed %d (%s)\n",
+        connections, elapsed, connections / elapsed, resumed, resume ? "resumption on" : "full handshakes");
+    double handshakeTotal = 0;
+    for (double seconds : handshakeSeconds) handshakeTotal += seconds;
+    printf("handshake (220 to Finished): %.0f handshakes/s on one connection at a time, p50 %.3f ms, p99 %.3f ms\n",
+        handshakeSeconds.size() / handshakeTotal,
+        percentile(handshakeSeconds, 0.50) * 1e3, percentile(handshakeSeconds, 0.99) * 1e3);
+    if (dataBytes > 0) {
+        printf("DATA: %zu bytes in %.2f s, %.1f MB/s (body send to 250, includes spam check and store)\n",
+            dataBytes, dataSeconds, dataBytes / dataSeconds / 1e6);
+    }
+
+    if (saved != nullptr) SSL_SESSION_free(saved);
+    SSL_CTX_free(ctx);
+    return 0;
+}
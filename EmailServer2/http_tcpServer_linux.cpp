@@ -1,24 +1,174 @@
-/*#include "http_tcpServer_linux.h"
+#ifdef __linux__ // The Windows build uses http_tcpServer.cpp
+
+#include "http_tcpServer_linux.h"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 namespace http
 {
-    TcpServer::TcpServer(const std::string& ipAddress, int port)
+    namespace
+    {
+        const int MAX_EVENTS = 256;
+
+        const char BAD_REQUEST[] =
+            "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        const char HEADERS_TOO_LARGE[] =
+            "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        const char NOT_IMPLEMENTED[] =
+            "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+        bool headerIs(const char* name, size_t nameLength, const char* expected)
+        {
+            return nameLength == strlen(expected) && strncasecmp(name, expected, nameLength) == 0;
+        }
+
+        // Whether a comma-separated list like "keep-alive, Upgrade" has token
+        // as one whole element, ignoring case (RFC 9110 5.6.1, 7.6.1)
+        bool hasToken(const char* value, size_t length, const char* token)
+        {
+            size_t tokenLength = strlen(token);
+            size_t i = 0;
+            while (i < length)
+            {
+                size_t end = i;
+                while (end < length && value[end] != ',') ++end;
+                size_t first = i;
+                size_t last = end;
+                while (first < last && (value[first] == ' ' || value[first] == '\t')) ++first;
+                while (last > first && (value[last - 1] == ' ' || value[last - 1] == '\t')) --last;
+                if (last - first == tokenLength && strncasecmp(value + first, token, tokenLength) == 0) return true;
+                i = end + 1;
+            }
+            return false;
+        }
+
+        // Content-Length per RFC 9110 8.6: one or more comma-separated copies
+        // of the same decimal value. Anything else, including a value that
+        // overflows, means the message cannot be framed (RFC 9112 6.3).
+        bool parseContentLength(const char* value, size_t length, size_t& contentLength)
+        {
+            bool any = false;
+            size_t i = 0;
+            while (i <= length)
+            {
+                while (i < length && (value[i] == ' ' || value[i] == '\t')) ++i;
+                if (i == length || value[i] < '0' || value[i] > '9') return false;
+                size_t parsed = 0;
+                for (; i < length && value[i] >= '0' && value[i] <= '9'; ++i)
+                {
+                    size_t digit = static_cast<size_t>(value[i] - '0');
+                    if (parsed > (SIZE_MAX - digit) / 10) return false;
+                    parsed = parsed * 10 + digit;
+                }
+                while (i < length && (value[i] == ' ' || value[i] == '\t')) ++i;
+                if (i < length && value[i] != ',') return false;
+                if (any && parsed != contentLength) return false;
+                contentLength = parsed;
+                any = true;
+                ++i;
+            }
+            return true;
+        }
+
+        const size_t STREAM_CHUNK = 16384;
+        const int DEFAULT_PAGE_SIZE = 20;
+        const int MAX_PAGE_SIZE = 100;
+
+        // %XX escapes in a path segment or query value
+        std::string urlDecode(std::string_view text)
+        {
+            std::string decoded;
+            decoded.reserve(text.size());
+            for (size_t i = 0; i < text.size(); ++i)
+            {
+                if (text[i] == '%' && i + 2 < text.size()
+                    && isxdigit(static_cast<unsigned char>(text[i + 1])) && isxdigit(static_cast<unsigned char>(text[i + 2])))
+                {
+                    char hex[3] = { text[i + 1], text[i + 2], 0 };
+                    decoded += static_cast<char>(strtol(hex, nullptr, 16));
+                    i += 2;
+                }
+                else
+                {
+                    decoded += text[i] == '+' ? ' ' : text[i];
+                }
+            }
+            return decoded;
+        }
+
+        // Value of name in a query string like "limit=20&after=...", empty if absent
+        std::string_view queryParameter(std::string_view query, std::string_view name)
+        {
+            while (!query.empty())
+            {
+                size_t end = query.find('&');
+                std::string_view pair = query.substr(0, end);
+                if (pair.size() > name.size() && pair.compare(0, name.size(), name) == 0 && pair[name.size()] == '=')
+                {
+                    return pair.substr(name.size() + 1);
+                }
+                if (end == std::string_view::npos) break;
+                query.remove_prefix(end + 1);
+            }
+            return std::string_view();
+        }
+
+        std::string jsonNumber(double value)
+        {
+            char text[32];
+            snprintf(text, sizeof(text), "%.6g", value);
+            return text;
+        }
+    }
+
+    TcpServer::TcpServer(const std::string& ipAddress, int port, int eventLoops, const std::string& databasePath, size_t cacheBytes, size_t shards)
         : m_socket(-1),
-        m_new_socket(-1),
         m_ip_address(ipAddress),
-        m_port(port)
+        m_port(port),
+        m_eventLoopCount(eventLoops),
+        m_mailbox(std::make_unique<smtp::MailboxReader>(databasePath, shards))
     {
+        if (cacheBytes > 0)
+        {
+            smtp::CacheOptions cacheOptions;
+            cacheOptions.byteBudget = cacheBytes;
+            m_generations = std::make_unique<smtp::MailboxGenerations>(databasePath);
+            m_cache = std::make_unique<smtp::MailboxCache>(cacheOptions, *m_generations);
+        }
+
         // Zero out the socket address structure
         std::memset(&m_socketAddress, 0, sizeof(m_socketAddress));
         m_socketAddress_len = sizeof(m_socketAddress);
 
-        // Prepare a very basic HTTP/1.1 200 response
-        m_serverMessage =
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/html\r\n"
-            "Connection: close\r\n\r\n"
+        // Serialize the responses once; every request just points at them
+        const std::string body =
             "<html><head><title>Test HTTP Server</title></head>"
             "<body><h1>Welcome to my test HTTP server!</h1></body></html>\r\n";
+        std::ostringstream headers;
+        headers << "HTTP/1.1 200 OK\r\n"
+            << "Content-Type: text/html\r\n"
+            << "Content-Length: " << body.size() << "\r\n";
+        m_serverMessage = headers.str() + "\r\n";
+        m_serverMessageClose = headers.str() + "Connection: close\r\n\r\n";
+        m_headerLength = m_serverMessage.size();
+        m_headerLengthClose = m_serverMessageClose.size();
+        m_serverMessage += body;
+        m_serverMessageClose += body;
 
         // Attempt to initialize the server
         if (startServer() != 0)
@@ -29,13 +179,20 @@ namespace http
 
     TcpServer::~TcpServer()
     {
+        for (auto& loop : m_eventLoops)
+        {
+            loop->stop();
+            loop->join();
+        }
+        m_eventLoops.clear();
         closeServer();
+        smtp::Log::flush();
     }
 
     int TcpServer::startServer()
     {
-        // Create the socket
-        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+        // Create the socket; every loop accepts for itself, so it never blocks
+        m_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (m_socket < 0)
         {
             exitWithError("Cannot create socket");
@@ -69,74 +226,602 @@ namespace http
 
     void TcpServer::startListen()
     {
-        // Start listening with a backlog of 20
-        if (listen(m_socket, 20) < 0)
+        // Start listening; keep-alive clients connect once, storms need room
+        if (listen(m_socket, 1024) < 0)
         {
             exitWithError("Failed to put socket in listening state");
         }
 
+        int loops = m_eventLoopCount;
+        if (loops <= 0)
+        {
+            loops = static_cast<int>(std::thread::hardware_concurrency());
+            if (loops <= 0) loops = 1;
+        }
+        for (int i = 0; i < loops; ++i)
+        {
+            m_eventLoops.push_back(std::make_unique<EventLoop>(*this));
+        }
+        for (auto& loop : m_eventLoops)
+        {
+            loop->start();
+        }
+
         std::ostringstream ss;
-        ss << "\n*** Listening on ADDRESS: " << m_ip_address
-            << " PORT: " << m_port << " ***\n" << std::endl;
+        ss << "*** Listening on ADDRESS: " << m_ip_address
+            << " PORT: " << m_port << " (" << loops << " event loops) ***";
         log(ss.str());
 
-        // Keep accepting new connections in a loop
-        while (true)
+        for (auto& loop : m_eventLoops)
         {
-            acceptConnection(m_new_socket);
-            log("------ Client connected ------");
+            loop->join();
+        }
+    }
 
-            // Read the client request
-            const int BUFFER_SIZE = 30720;
-            char buffer[BUFFER_SIZE] = { 0 };
-            long bytesReceived = read(m_new_socket, buffer, BUFFER_SIZE);
+    bool TcpServer::parseRequests(Connection& connection)
+    {
+        char* buffer = connection.buffer;
+        size_t offset = 0;
+        bool keepOpen = true;
 
-            if (bytesReceived < 0)
+        while (keepOpen && !connection.message && connection.pending.size() < MAX_PENDING_WRITES)
+        {
+            // Body of the previous request (ignored, the response is fixed)
+            if (connection.bodyRemaining > 0)
             {
-                exitWithError("Failed to read bytes from client socket connection");
+                size_t skip = std::min(connection.bodyRemaining, connection.length - offset);
+                offset += skip;
+                connection.bodyRemaining -= skip;
+                if (connection.bodyRemaining > 0) break;
             }
-            else if (bytesReceived == 0)
+
+            // Only bytes that arrived since the last call are searched
+            size_t from = std::max(offset, connection.scanned >= 3 ? connection.scanned - 3 : 0);
+            const char* end = nullptr;
+            if (connection.length > from)
             {
-                log("Client disconnected immediately or no data received.");
+                end = static_cast<const char*>(memmem(buffer + from, connection.length - from, "\r\n\r\n", 4));
             }
-            else
+            if (end == nullptr)
             {
-                // Print out the request
-                std::string request(buffer, bytesReceived);
-                log("------ Received Request from client ------\n" + request);
+                connection.scanned = connection.length;
+                if (connection.length - offset == BUFFER_SIZE)
+                {
+                    queueResponse(connection, HEADERS_TOO_LARGE, sizeof(HEADERS_TOO_LARGE) - 1);
+                    keepOpen = false;
+                }
+                break;
+            }
+
+            const char* request = buffer + offset;
+            size_t headerLength = static_cast<size_t>(end - request) + 4;
+
+            // Request line: METHOD SP target SP version
+            const char* lineEnd = static_cast<const char*>(memchr(request, '\r', headerLength));
+            const char* methodEnd = static_cast<const char*>(memchr(request, ' ', lineEnd - request));
+            const char* versionStart = methodEnd == nullptr ? nullptr
+                : static_cast<const char*>(memrchr(methodEnd + 1, ' ', lineEnd - methodEnd - 1));
+            if (methodEnd == nullptr || versionStart == nullptr || versionStart == methodEnd + 1
+                || lineEnd - versionStart != 9 || strncmp(versionStart + 1, "HTTP/1.", 7) != 0)
+            {
+                queueResponse(connection, BAD_REQUEST, sizeof(BAD_REQUEST) - 1);
+                keepOpen = false;
+                break;
+            }
+            bool http10 = versionStart[8] == '0';
+            bool keepAlive = !http10;   // HTTP/1.1 defaults to persistent
 
-                // Send a response
-                long bytesSent = write(m_new_socket, m_serverMessage.c_str(), m_serverMessage.size());
-                if (bytesSent == static_cast<long>(m_serverMessage.size()))
+            // Headers that change how the connection is handled
+            size_t contentLength = 0;
+            bool hasContentLength = false;
+            bool badContentLength = false;
+            bool chunked = false;
+            const char* line = lineEnd + 2;
+            while (line < end + 2)
+            {
+                const char* next = static_cast<const char*>(memchr(line, '\r', end + 2 - line));
+                const char* colon = static_cast<const char*>(memchr(line, ':', next - line));
+                if (colon != nullptr)
                 {
-                    log("------ Response sent to client ------\n");
+                    const char* value = colon + 1;
+                    size_t valueLength = static_cast<size_t>(next - value);
+                    size_t nameLength = static_cast<size_t>(colon - line);
+                    if (headerIs(line, nameLength, "connection"))
+                    {
+                        if (hasToken(value, valueLength, "close")) keepAlive = false;
+                        else if (hasToken(value, valueLength, "keep-alive")) keepAlive = true;
+                    }
+                    else if (headerIs(line, nameLength, "content-length"))
+                    {
+                        // A repeated header must agree with the first
+                        size_t parsed = 0;
+                        if (!parseContentLength(value, valueLength, parsed)
+                            || (hasContentLength && parsed != contentLength)) badContentLength = true;
+                        contentLength = parsed;
+                        hasContentLength = true;
+                    }
+                    else if (headerIs(line, nameLength, "transfer-encoding"))
+                    {
+                        chunked = true;
+                    }
+                }
+                line = next + 2;
+            }
+            if (badContentLength)
+            {
+                // Where this request ends is unknown, so nothing after it can be read
+                queueResponse(connection, BAD_REQUEST, sizeof(BAD_REQUEST) - 1);
+                keepOpen = false;
+                break;
+            }
+            if (chunked)
+            {
+                queueResponse(connection, NOT_IMPLEMENTED, sizeof(NOT_IMPLEMENTED) - 1);
+                keepOpen = false;
+                break;
+            }
+
+            std::string_view method(request, static_cast<size_t>(methodEnd - request));
+            std::string_view target(methodEnd + 1, static_cast<size_t>(versionStart - methodEnd - 1));
+            keepOpen = route(connection, method, target, keepAlive, http10);
+
+            offset += headerLength;
+            connection.bodyRemaining = contentLength;
+            connection.scanned = offset;
+        }
+
+        // Keep the unparsed tail at the front of the buffer
+        if (offset > 0)
+        {
+            memmove(buffer, buffer + offset, connection.length - offset);
+            connection.length -= offset;
+            connection.scanned = connection.scanned > offset ? connection.scanned - offset : 0;
+        }
+        return keepOpen;
+    }
+
+    void TcpServer::queueResponse(Connection& connection, const char* data, size_t size)
+    {
+        connection.pending.push_back(Piece{ data, size, std::string(), nullptr });
+    }
+
+    void TcpServer::queueOwned(Connection& connection, std::string data)
+    {
+        connection.pending.push_back(Piece{ nullptr, 0, std::move(data), nullptr });
+    }
+
+    void TcpServer::queueShared(Connection& connection, std::shared_ptr<const std::string> data)
+    {
+        const char* bytes = data->data();
+        size_t size = data->size();
+        connection.pending.push_back(Piece{ bytes, size, std::string(), std::move(data) });
+    }
+
+    bool TcpServer::flush(Connection& connection)
+    {
+        while (!connection.pending.empty())
+        {
+            // Everything queued, up to MAX_PENDING_WRITES pieces, in one call
+            iovec pieces[MAX_PENDING_WRITES];
+            size_t count = 0;
+            for (auto it = connection.pending.begin(); it != connection.pending.end() && count < MAX_PENDING_WRITES; ++it, ++count)
+            {
+                const char* data = it->data != nullptr ? it->data : it->owned.data();
+                size_t size = it->data != nullptr ? it->size : it->owned.size();
+                if (count == 0)
+                {
+                    data += connection.headWritten;
+                    size -= connection.headWritten;
+                }
+                pieces[count].iov_base = const_cast<char*>(data);
+                pieces[count].iov_len = size;
+            }
+
+            struct msghdr message;
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = pieces;
+            message.msg_iovlen = count;
+
+            ssize_t sent = sendmsg(connection.socket, &message, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            // Drop what was written, remember how far into a partly written piece
+            size_t remaining = static_cast<size_t>(sent);
+            while (remaining > 0)
+            {
+                const Piece& front = connection.pending.front();
+                size_t left = (front.data != nullptr ? front.size : front.owned.size()) - connection.headWritten;
+                if (remaining < left)
+                {
+                    connection.headWritten += remaining;
+                    break;
+                }
+                remaining -= left;
+                connection.headWritten = 0;
+                connection.pending.pop_front();
+            }
+        }
+        return true;
+    }
+
+    size_t TcpServer::pendingBytes(const Connection& connection) const
+    {
+        size_t bytes = 0;
+        for (const Piece& piece : connection.pending)
+        {
+            bytes += piece.data != nullptr ? piece.size : piece.owned.size();
+        }
+        return bytes - connection.headWritten;
+    }
+
+    void TcpServer::resumeMessage(Connection& connection)
+    {
+        MessageResponse& response = *connection.message;
+        ResponseStream& stream = response.stream;
+        std::string_view body(response.body);
+        while (response.written < body.size())
+        {
+            // The client is not keeping up; the next writable event continues
+            if (pendingBytes(connection) >= MAX_PENDING_BYTES) return;
+            size_t length = std::min(STREAM_CHUNK, body.size() - response.written);
+            stream.writeEscaped(body.substr(response.written, length));
+            response.written += length;
+        }
+        stream.write("\"}");
+        stream.finish();
+        if (response.cacheable)
+        {
+            uint64_t generation = m_generations->current(response.recipient);
+            auto copy = stream.takeCopy();
+            if (copy && m_generations->unchanged(response.commits))
+            {
+                m_cache->insert(response.key, response.recipient, generation, std::move(copy));
+            }
+        }
+        connection.message.reset();
+    }
+
+    bool TcpServer::route(Connection& connection, std::string_view method, std::string_view target, bool keepAlive, bool http10)
+    {
+        // Welcome page: pre-serialized, any method
+        if (target == "/")
+        {
+            const std::string& message = keepAlive ? m_serverMessage : m_serverMessageClose;
+            size_t size = method == "HEAD" ? (keepAlive ? m_headerLength : m_headerLengthClose) : message.size();
+            queueResponse(connection, message.data(), size);
+            return keepAlive;
+        }
+
+        // Generated responses are chunked; HTTP/1.0 clients get them close-delimited
+        bool persistent = keepAlive && !http10;
+
+        size_t question = target.find('?');
+        std::string_view path = target.substr(0, question);
+        std::string_view query = question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+
+        if (path == "/cache")
+        {
+            if (method != "GET") return serveError(connection, "405 Method Not Allowed", persistent);
+            return serveCacheStats(connection, persistent);
+        }
+
+        // GET /mailboxes/{recipient}/messages?limit=N&after=cursor
+        // GET /messages/{id}
+        const std::string_view mailboxPrefix = "/mailboxes/";
+        const std::string_view mailboxSuffix = "/messages";
+        const std::string_view messagePrefix = "/messages/";
+        bool isMailbox = path.size() > mailboxPrefix.size() + mailboxSuffix.size()
+            && path.compare(0, mailboxPrefix.size(), mailboxPrefix) == 0
+            && path.compare(path.size() - mailboxSuffix.size(), mailboxSuffix.size(), mailboxSuffix) == 0;
+        bool isMessage = !isMailbox && path.size() > messagePrefix.size()
+            && path.compare(0, messagePrefix.size(), messagePrefix) == 0;
+        if (!isMailbox && !isMessage)
+        {
+            return serveError(connection, "404 Not Found", persistent);
+        }
+        if (method != "GET")
+        {
+            return serveError(connection, "405 Method Not Allowed", persistent);
+        }
+
+        if (isMailbox)
+        {
+            std::string_view recipient = path.substr(mailboxPrefix.size(),
+                path.size() - mailboxPrefix.size() - mailboxSuffix.size());
+            return serveMailbox(connection, recipient, query, persistent);
+        }
+        return serveMessage(connection, path.substr(messagePrefix.size()), persistent);
+    }
+
+    bool TcpServer::serveMailbox(Connection& connection, std::string_view recipient, std::string_view query, bool keepAlive)
+    {
+        std::string mailbox = urlDecode(recipient);
+
+        int limit = DEFAULT_PAGE_SIZE;
+        std::string_view limitText = queryParameter(query, "limit");
+        if (!limitText.empty())
+        {
+            limit = std::atoi(std::string(limitText).c_str());
+            limit = std::max(1, std::min(MAX_PAGE_SIZE, limit));
+        }
+
+        std::optional<smtp::MailboxCursor> after;
+        std::string_view afterText = queryParameter(query, "after");
+        if (!afterText.empty())
+        {
+            after = smtp::MailboxCursor::decode(urlDecode(afterText));
+            if (!after) return serveError(connection, "400 Bad Request", keepAlive);
+        }
+
+        // Pages are cached by what they contain, whatever the cursor's spelling
+        std::string key;
+        uint64_t generation = 0;
+        if (m_cache)
+        {
+            key.append("L").append(std::to_string(limit)).append(" ");
+            if (after) key.append(after->encode());
+            key.append(" ").append(mailbox);
+            if (auto cached = m_cache->find(key)) return serveCached(connection, std::move(cached), keepAlive);
+            // Read before the query: mail committed after this makes the page stale
+            generation = m_generations->current(mailbox);
+        }
+
+        // {"recipient":"...","messages":[{...},...],"next":"cursor"|null}
+        ResponseStream stream(*this, connection, keepAlive);
+        if (m_cache) stream.keepCopy(m_cache->maxEntryBytes());
+        stream.write("{\"recipient\":");
+        stream.writeJsonString(mailbox);
+        stream.write(",\"messages\":[");
+
+        bool first = true;
+        std::optional<smtp::MailboxCursor> next;
+        smtp::ReadResult result = m_mailbox->listMessages(mailbox, after ? &*after : nullptr, limit,
+            [&](const smtp::MailboxEntry& entry)
+            {
+                stream.write(first ? "{\"id\":" : ",{\"id\":");
+                first = false;
+                stream.write(std::to_string(entry.id));
+                stream.write(",\"sender\":");
+                stream.writeJsonString(entry.sender);
+                stream.write(",\"subject\":");
+                stream.writeJsonString(entry.subject);
+                stream.write(",\"timestamp\":");
+                stream.writeJsonString(entry.timestamp);
+                stream.write(",\"status\":");
+                stream.writeJsonString(entry.status);
+                stream.write(",\"spam_score\":");
+                stream.write(entry.spamScore ? jsonNumber(*entry.spamScore) : "null");
+                stream.write("}");
+            }, next);
+
+        if (result != smtp::ReadResult::Found)
+        {
+            if (stream.started()) return false;     // A truncated chunked body tells the client
+            return serveError(connection, "500 Internal Server Error", keepAlive);
+        }
+
+        stream.write("],\"next\":");
+        if (next) stream.writeJsonString(next->encode());
+        else stream.write("null");
+        stream.write("}");
+        stream.finish();
+        if (m_cache)
+        {
+            if (auto copy = stream.takeCopy()) m_cache->insert(key, mailbox, generation, std::move(copy));
+        }
+        return keepAlive;
+    }
+
+    bool TcpServer::serveMessage(Connection& connection, std::string_view id, bool keepAlive)
+    {
+        std::optional<int64_t> parsedId = smtp::parseMessageId(id);
+        if (!parsedId) return serveError(connection, "404 Not Found", keepAlive);
+        int64_t messageId = *parsedId;
+
+        // The recipient is only known after the read, so the generation is
+        // trusted only if no commit was in flight around it
+        auto response = std::make_unique<MessageResponse>(*this, connection, keepAlive);
+        if (m_cache)
+        {
+            response->key.append("M").append(std::to_string(messageId));
+            if (auto cached = m_cache->find(response->key)) return serveCached(connection, std::move(cached), keepAlive);
+            response->cacheable = m_generations->snapshot(response->commits);
+        }
+
+        // The fields go out now; the body is escaped as the client reads it
+        ResponseStream& stream = response->stream;
+        if (response->cacheable) stream.keepCopy(m_cache->maxEntryBytes());
+        smtp::ReadResult result = m_mailbox->fetchMessage(messageId, [&](const smtp::MailboxMessage& message)
+            {
+                if (response->cacheable) response->recipient.assign(message.recipient);
+                stream.write("{\"id\":");
+                stream.write(std::to_string(message.id));
+                stream.write(",\"sender\":");
+                stream.writeJsonString(message.sender);
+                stream.write(",\"recipient\":");
+                stream.writeJsonString(message.recipient);
+                stream.write(",\"subject\":");
+                stream.writeJsonString(message.subject);
+                stream.write(",\"timestamp\":");
+                stream.writeJsonString(message.timestamp);
+                stream.write(",\"status\":");
+                stream.writeJsonString(message.status);
+                stream.write(",\"spam_score\":");
+                stream.write(message.spamScore ? jsonNumber(*message.spamScore) : "null");
+                stream.write(",\"body\":\"");
+                response->body = std::move(*message.bodyBuffer);
+            });
+
+        if (result == smtp::ReadResult::NotFound) return serveError(connection, "404 Not Found", keepAlive);
+        if (result == smtp::ReadResult::Error)
+        {
+            if (stream.started()) return false;
+            return serveError(connection, "500 Internal Server Error", keepAlive);
+        }
+        connection.message = std::move(response);
+        resumeMessage(connection);
+        return keepAlive;
+    }
+
+    bool TcpServer::serveError(Connection& connection, const char* status, bool keepAlive)
+    {
+        std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\n";
+        response += keepAlive ? "\r\n" : "Connection: close\r\n\r\n";
+        queueOwned(connection, std::move(response));
+        return keepAlive;
+    }
+
+    bool TcpServer::serveCached(Connection& connection, std::shared_ptr<const std::string> body, bool keepAlive)
+    {
+        std::string headers = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+            + std::to_string(body->size()) + (keepAlive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+        queueOwned(connection, std::move(headers));
+        queueShared(connection, std::move(body));
+        return keepAlive;
+    }
+
+    bool TcpServer::serveCacheStats(Connection& connection, bool keepAlive)
+    {
+        smtp::CacheStats stats = m_cache ? m_cache->stats() : smtp::CacheStats();
+        std::ostringstream json;
+        json << "{\"enabled\":" << (m_cache ? "true" : "false")
+            << ",\"hits\":" << stats.hits
+            << ",\"misses\":" << stats.misses
+            << ",\"evictions\":" << stats.evictions
+            << ",\"invalidations\":" << stats.invalidations
+            << ",\"entries\":" << stats.entries
+            << ",\"bytes\":" << stats.bytes << "}";
+
+        ResponseStream stream(*this, connection, keepAlive);
+        stream.write(json.str());
+        stream.finish();
+        return keepAlive;
+    }
+
+    TcpServer::ResponseStream::ResponseStream(TcpServer& server, Connection& connection, bool chunked)
+        : m_server(server), m_connection(connection), m_chunked(chunked)
+    {
+        m_chunk.reserve(STREAM_CHUNK);
+    }
+
+    void TcpServer::ResponseStream::write(std::string_view text)
+    {
+        m_chunk.append(text.data(), text.size());
+        if (m_chunk.size() >= STREAM_CHUNK) emit();
+    }
+
+    void TcpServer::ResponseStream::writeJsonString(std::string_view text)
+    {
+        m_chunk += '"';
+        writeEscaped(text);
+        m_chunk += '"';
+    }
+
+    void TcpServer::ResponseStream::writeEscaped(std::string_view text)
+    {
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '"': m_chunk += "\\\""; break;
+            case '\\': m_chunk += "\\\\"; break;
+            case '\n': m_chunk += "\\n"; break;
+            case '\r': m_chunk += "\\r"; break;
+            case '\t': m_chunk += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    m_chunk += escaped;
                 }
                 else
                 {
-                    log("Error sending response to the client.");
+                    m_chunk += c;
                 }
             }
+            if (m_chunk.size() >= STREAM_CHUNK) emit();
+        }
+    }
 
-            // Close this connected socket
-            close(m_new_socket);
-            m_new_socket = -1;
+    void TcpServer::ResponseStream::finish()
+    {
+        emit();
+        sendHeaders(); // Empty body: the status line still goes out
+        if (m_chunked) m_server.queueResponse(m_connection, "0\r\n\r\n", 5);
+        if (!m_server.flush(m_connection)) m_connection.closeAfterWrite = true;
+    }
+
+    void TcpServer::ResponseStream::sendHeaders()
+    {
+        if (m_started) return;
+        m_started = true;
+        if (m_chunked)
+        {
+            static const char CHUNKED[] =
+                "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n";
+            m_server.queueResponse(m_connection, CHUNKED, sizeof(CHUNKED) - 1);
+        }
+        else
+        {
+            static const char CLOSE_DELIMITED[] =
+                "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n";
+            m_server.queueResponse(m_connection, CLOSE_DELIMITED, sizeof(CLOSE_DELIMITED) - 1);
         }
     }
 
-    void TcpServer::acceptConnection(int& new_socket)
+    void TcpServer::ResponseStream::keepCopy(size_t limit)
     {
-        new_socket = accept(m_socket,
-            reinterpret_cast<struct sockaddr*>(&m_socketAddress),
-            &m_socketAddress_len);
-        if (new_socket < 0)
+        m_copying = true;
+        m_copyLimit = limit;
+    }
+
+    std::shared_ptr<const std::string> TcpServer::ResponseStream::takeCopy()
+    {
+        if (!m_copying) return nullptr;
+        m_copying = false;
+        return std::make_shared<const std::string>(std::move(m_copy));
+    }
+
+    void TcpServer::ResponseStream::emit()
+    {
+        if (m_chunk.empty()) return;
+        sendHeaders();
+
+        if (m_copying)
         {
-            std::ostringstream ss;
-            ss << "Server failed to accept incoming connection from ADDRESS: "
-                << inet_ntoa(m_socketAddress.sin_addr)
-                << "; PORT: " << ntohs(m_socketAddress.sin_port);
+            if (m_copy.size() + m_chunk.size() > m_copyLimit)
+            {
+                m_copying = false;
+                m_copy = std::string();
+            }
+            else
+            {
+                m_copy += m_chunk;
+            }
+        }
 
-            exitWithError(ss.str());
+        if (m_chunked)
+        {
+            char sizeLine[24];
+            snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", m_chunk.size());
+            m_server.queueOwned(m_connection, sizeLine);
+            m_server.queueOwned(m_connection, std::move(m_chunk));
+            m_server.queueResponse(m_connection, "\r\n", 2);
         }
+        else
+        {
+            m_server.queueOwned(m_connection, std::move(m_chunk));
+        }
+        m_chunk = std::string();
+        m_chunk.reserve(STREAM_CHUNK);
+
+        // Start sending now; whatever the socket does not take stays queued
+        if (!m_server.flush(m_connection)) m_connection.closeAfterWrite = true;
     }
 
     void TcpServer::closeServer()
@@ -147,24 +832,189 @@ namespace http
             close(m_socket);
             m_socket = -1;
         }
-
-        // Close the connection socket if open
-        if (m_new_socket >= 0)
-        {
-            close(m_new_socket);
-            m_new_socket = -1;
-        }
     }
 
     void TcpServer::log(const std::string& message)
     {
-        std::cout << message << std::endl;
+        smtp::Log::write(smtp::LogLevel::Info, message);
     }
 
     void TcpServer::exitWithError(const std::string& errorMessage)
     {
+        smtp::Log::flush();
         std::cerr << "ERROR: " << errorMessage << std::endl;
         std::exit(EXIT_FAILURE);
     }
+
+    TcpServer::EventLoop::EventLoop(TcpServer& server)
+        : m_server(server)
+    {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_epoll < 0 || m_wakeFd < 0)
+        {
+            m_server.exitWithError("Cannot create event loop");
+        }
+
+        // EPOLLEXCLUSIVE: a new connection wakes one loop, not all of them
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &m_server.m_socket;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_server.m_socket, &ev) < 0)
+        {
+            m_server.exitWithError("Cannot register listening socket with epoll");
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &m_wakeFd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev) < 0)
+        {
+            m_server.exitWithError("Cannot register eventfd with epoll");
+        }
+    }
+
+    TcpServer::EventLoop::~EventLoop()
+    {
+        stop();
+        join();
+        for (auto& entry : m_connections)
+        {
+            close(entry.first);
+        }
+        close(m_wakeFd);
+        close(m_epoll);
+    }
+
+    void TcpServer::EventLoop::start()
+    {
+        m_thread = std::thread([this] { run(); });
+    }
+
+    void TcpServer::EventLoop::stop()
+    {
+        m_stop = true;
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void TcpServer::EventLoop::join()
+    {
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    void TcpServer::EventLoop::run()
+    {
+        struct epoll_event events[MAX_EVENTS];
+
+        while (!m_stop)
+        {
+            int ready = epoll_wait(m_epoll, events, MAX_EVENTS, -1);
+            if (ready < 0)
+            {
+                if (errno == EINTR) continue;
+                m_server.exitWithError("epoll_wait failed");
+            }
+
+            for (int i = 0; i < ready; ++i)
+            {
+                void* tag = events[i].data.ptr;
+                if (tag == &m_wakeFd) continue;
+                if (tag == &m_server.m_socket)
+                {
+                    acceptClients();
+                    continue;
+                }
+
+                // Readable and writable both resume the same state machine
+                onReadable(*static_cast<Connection*>(tag));
+            }
+        }
+    }
+
+    void TcpServer::EventLoop::acceptClients()
+    {
+        while (!m_stop)
+        {
+            int clientSocket = accept4(m_server.m_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    m_server.log("Failed to accept connection: " + std::string(strerror(errno)));
+                }
+                return;
+            }
+
+            // Responses are small and written whole; do not hold them back
+            int opt = 1;
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+            auto connection = std::make_unique<Connection>();
+            connection->socket = clientSocket;
+
+            struct epoll_event ev;
+            std::memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = connection.get();
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, clientSocket, &ev) < 0)
+            {
+                close(clientSocket);
+                continue;
+            }
+            m_connections.emplace(clientSocket, std::move(connection));
+        }
+    }
+
+    void TcpServer::EventLoop::onReadable(Connection& connection)
+    {
+        for (;;)
+        {
+            // A message body still being written goes before any later request
+            if (connection.message) m_server.resumeMessage(connection);
+            if (!connection.message && !connection.closeAfterWrite && !m_server.parseRequests(connection))
+            {
+                connection.closeAfterWrite = true;
+            }
+            if (!m_server.flush(connection))
+            {
+                closeConnection(connection);
+                return;
+            }
+            if (!connection.pending.empty()) return;    // Socket full: EPOLLOUT resumes here
+            if (connection.message) continue;           // Everything queued left; write more of it
+            if (connection.closeAfterWrite)
+            {
+                closeConnection(connection);
+                return;
+            }
+
+            // Parsing stopped early to drain responses; there may be more buffered
+            if (connection.length > connection.scanned && connection.bodyRemaining == 0) continue;
+
+            ssize_t bytesRead = recv(connection.socket, connection.buffer + connection.length,
+                BUFFER_SIZE - connection.length, 0);
+            if (bytesRead > 0)
+            {
+                connection.length += static_cast<size_t>(bytesRead);
+                continue;
+            }
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (bytesRead < 0 && errno == EINTR) continue;
+            closeConnection(connection);
+            return;
+        }
+    }
+
+    void TcpServer::EventLoop::closeConnection(Connection& connection)
+    {
+        int clientSocket = connection.socket;
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, clientSocket, nullptr);
+        close(clientSocket);
+        m_connections.erase(clientSocket);
+    }
 }
-*/
\ No newline at end of file
+
+#endif
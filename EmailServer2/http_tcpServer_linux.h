@@ -0,0 +1,199 @@
+#ifndef INCLUDED_HTTP_TCPSERVER_LINUX
+#define INCLUDED_HTTP_TCPSERVER_LINUX
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <cstring>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "smtp_mailbox.h"
+#include "smtp_mailbox_cache.h"
+#include "smtp_log.h"
+
+namespace http
+{
+    class TcpServer
+    {
+    public:
+        // Constructor with default IP "0.0.0.0" and port 8080; 0 loops = one per core.
+        // Mailbox endpoints read the SMTP server's database at databasePath (split
+        // over `shards` files, as StorageOptions::shards) and keep up to cacheBytes
+        // of rendered responses (0 disables the cache).
+        TcpServer(const std::string& ipAddress = "0.0.0.0", int port = 8080, int eventLoops = 0,
+            const std::string& databasePath = "smtp_server.db", size_t cacheBytes = 64 * 1024 * 1024, size_t shards = 1);
+        ~TcpServer();
+
+        // Start listening for connections (blocking call)
+        void startListen();
+
+    private:
+        // Requests must fit in the per-connection buffer (the original 30 KB read buffer)
+        static const size_t BUFFER_SIZE = 30720;
+        static const size_t MAX_PENDING_WRITES = 64;
+        static const size_t MAX_PENDING_BYTES = 65536; // Queued while a message body is escaped
+
+        // Response bytes waiting for the socket: a pre-serialized message
+        // (data points at it), generated output (data is null, owned holds it)
+        // or a cached body (data points into shared, which keeps it alive)
+        struct Piece
+        {
+            const char* data;
+            size_t size;
+            std::string owned;
+            std::shared_ptr<const std::string> shared;
+        };
+
+        struct MessageResponse;
+
+        // One keep-alive connection. Requests are parsed in place as bytes arrive.
+        struct Connection
+        {
+            int socket = -1;
+            char buffer[BUFFER_SIZE];
+            size_t length = 0;          // Bytes in buffer
+            size_t scanned = 0;         // Prefix already searched for the end of headers
+            size_t bodyRemaining = 0;   // Request body bytes still to skip
+            std::deque<Piece> pending;
+            size_t headWritten = 0;     // Bytes of pending.front() already sent
+            bool closeAfterWrite = false;
+            std::unique_ptr<MessageResponse> message;   // Body still being written; later requests wait
+        };
+
+        // Writes a generated 200 response in chunks as it is produced: each
+        // full chunk is queued and the socket is tried right away, so a long
+        // listing or message never exists in memory as a whole. Headers go out
+        // with the first chunk, so a failure before that can still become a 500.
+        class ResponseStream
+        {
+        public:
+            ResponseStream(TcpServer& server, Connection& connection, bool chunked);
+            void write(std::string_view text);
+            void writeJsonString(std::string_view text); // Quoted and escaped
+            void writeEscaped(std::string_view text);    // Escaped, without the quotes
+            void finish();
+
+            bool started() const { return m_started; } // Status line already queued
+
+            // Also collect the body, up to limit bytes, for the response cache;
+            // takeCopy() is null if it grew past the limit
+            void keepCopy(size_t limit);
+            std::shared_ptr<const std::string> takeCopy();
+
+        private:
+            void sendHeaders();
+            void emit();
+
+            TcpServer& m_server;
+            Connection& m_connection;
+            bool m_chunked;
+            bool m_started = false;
+            std::string m_chunk;
+            bool m_copying = false;
+            size_t m_copyLimit = 0;
+            std::string m_copy;
+        };
+
+        // A message response whose body is escaped into the stream only as
+        // the socket takes it: writing stops once MAX_PENDING_BYTES are
+        // queued and resumes on the next writable event (resumeMessage)
+        struct MessageResponse
+        {
+            MessageResponse(TcpServer& server, Connection& connection, bool chunked)
+                : stream(server, connection, chunked) {}
+
+            ResponseStream stream;
+            std::string body;           // As decoded, the only copy
+            size_t written = 0;         // Bytes of body already escaped into stream
+            bool cacheable = false;
+            std::string key;
+            std::string recipient;
+            uint64_t commits = 0;
+        };
+
+        // One edge-triggered epoll loop; all loops share the listening socket
+        class EventLoop
+        {
+        public:
+            EventLoop(TcpServer& server);
+            ~EventLoop();
+            void start();
+            void stop();
+            void join();
+
+        private:
+            void run();
+            void acceptClients();
+            void onReadable(Connection& connection);
+            void closeConnection(Connection& connection);
+
+            TcpServer& m_server;
+            int m_epoll;
+            int m_wakeFd;
+            std::thread m_thread;
+            std::atomic<bool> m_stop{ false };
+            std::unordered_map<int, std::unique_ptr<Connection>> m_connections;
+        };
+
+        // Listening socket
+        int m_socket;
+
+        // Server address
+        struct sockaddr_in m_socketAddress;
+        socklen_t m_socketAddress_len;
+
+        // IP address and port
+        std::string m_ip_address;
+        int m_port;
+        int m_eventLoopCount;
+
+        // Responses serialized once: status line, headers and body in one block
+        std::string m_serverMessage;        // 200, keep-alive
+        std::string m_serverMessageClose;   // 200, Connection: close
+        size_t m_headerLength;              // HEAD responses send only this prefix
+        size_t m_headerLengthClose;
+
+        std::vector<std::unique_ptr<EventLoop>> m_eventLoops;
+
+        // Read side of the SMTP database, and rendered responses from it
+        std::unique_ptr<smtp::MailboxReader> m_mailbox;
+        std::unique_ptr<smtp::MailboxGenerations> m_generations;
+        std::unique_ptr<smtp::MailboxCache> m_cache;    // Null when disabled
+
+        // Create the server socket (called in constructor)
+        int startServer();
+
+        // Clean up resources (called in destructor)
+        void closeServer();
+
+        // Consume every complete request in the buffer and queue its response;
+        // false if the connection must close once pending writes are flushed
+        bool parseRequests(Connection& connection);
+        void queueResponse(Connection& connection, const char* data, size_t size);
+        void queueOwned(Connection& connection, std::string data);
+        void queueShared(Connection& connection, std::shared_ptr<const std::string> data);
+        bool flush(Connection& connection); // false on a socket error
+        size_t pendingBytes(const Connection& connection) const;
+        void resumeMessage(Connection& connection);
+
+        // Request routing; each returns whether the connection may stay open
+        bool route(Connection& connection, std::string_view method, std::string_view target, bool keepAlive, bool http10);
+        bool serveMailbox(Connection& connection, std::string_view recipient, std::string_view query, bool keepAlive);
+        bool serveMessage(Connection& connection, std::string_view id, bool keepAlive);
+        bool serveError(Connection& connection, const char* status, bool keepAlive);
+        bool serveCached(Connection& connection, std::shared_ptr<const std::string> body, bool keepAlive);
+        bool serveCacheStats(Connection& connection, bool keepAlive);
+
+        // Helper methods for logging and error-handling
+        void log(const std::string& message);
+        void exitWithError(const std::string& errorMessage);
+    };
+}
+
+#endif
@@ -1,11 +1,14 @@
-/*#include "http_tcpServer_linux.h"
+#ifdef __linux__ // The Windows build uses server.cpp
+
+#include "http_tcpServer_linux.h"
 
 int main()
 {
-    // Create and run the server on 0.0.0.0:8080
+    // Create and run the server on 0.0.0.0:8080, one event loop per core
     http::TcpServer server("0.0.0.0", 8080);
     // Start listening (blocking call)
     server.startListen();
     return 0;
 }
-*/
\ No newline at end of file
+
+#endif
@@ -0,0 +1,291 @@
+#include "smtp_bayes.h"
+#include "smtp_log.h"
+#include "smtp_shards.h"
+#include "smtp_segment_log.h"
+#include "smtp_compression.h"
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <sqlite3.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+namespace smtp {
+
+    namespace {
+        const size_t BLOCK = 16;
+        const size_t MIN_TOKEN = 2;
+        const size_t MAX_TOKEN = 40;    // Longer runs are base64/hex noise
+        const double SMOOTHING = 1.0;   // Laplace
+        const double MAX_LOGIT = 30.0;
+
+#ifndef __SSE2__
+        bool isTokenByte(unsigned char c) {
+            return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c >= 0x80;
+        }
+#endif
+
+        // Bit i set when block[i] is a token byte: ASCII letters and digits, plus
+        // anything >= 0x80 so UTF-8 words stay whole
+        uint32_t tokenMask(const char* block) {
+#ifdef __SSE2__
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+            __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+            __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+            // Signed compares: bytes >= 0x80 are negative and fall outside both ranges
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(letter, digit)))
+                | static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+#else
+            uint32_t mask = 0;
+            for (size_t i = 0; i < BLOCK; ++i) {
+                if (isTokenByte(static_cast<unsigned char>(block[i]))) mask |= 1u << i;
+            }
+            return mask;
+#endif
+        }
+
+        // FNV-1a over the case-folded token
+        uint32_t hashToken(const char* token, size_t length) {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < length; ++i) {
+                hash ^= static_cast<unsigned char>(token[i]) | 0x20;
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        // Calls onToken(hash) for every token. Token boundaries are found 16 bytes
+        // at a time from the class mask; only token bytes are touched by the hash.
+        template <typename F>
+        void forEachToken(std::string_view text, F&& onToken) {
+            const char* data = text.data();
+            size_t length = text.size();
+            size_t tokenStart = 0;
+            bool inToken = false;
+
+            auto emit = [&](size_t end) {
+                size_t size = end - tokenStart;
+                if (size >= MIN_TOKEN && size <= MAX_TOKEN) onToken(hashToken(data + tokenStart, size));
+            };
+
+            char tail[BLOCK];
+            for (size_t offset = 0; offset < length; offset += BLOCK) {
+                const char* block = data + offset;
+                if (length - offset < BLOCK) {
+                    // Pad the last partial block with delimiters
+                    memset(tail, ' ', BLOCK);
+                    memcpy(tail, block, length - offset);
+                    block = tail;
+                }
+
+                uint32_t mask = tokenMask(block);
+                uint32_t position = 0;
+                while (position < BLOCK) {
+                    uint32_t remaining = inToken ? (~mask & 0xFFFFu) : mask;
+                    remaining &= 0xFFFFu << position;
+                    if (remaining == 0) break;
+
+                    position = static_cast<uint32_t>(__builtin_ctz(remaining));
+                    if (inToken) emit(offset + position);
+                    else tokenStart = offset + position;
+                    inToken = !inToken;
+                }
+            }
+            if (inToken) emit(length);
+        }
+    }
+
+
+
+    struct BayesClassifier::Counts {
+        std::vector<uint32_t> spam, ham;
+        uint64_t spamTokens = 0, hamTokens = 0;
+        uint64_t spamDocs = 0, hamDocs = 0;
+
+        explicit Counts(size_t buckets) : spam(buckets, 0), ham(buckets, 0) {}
+
+        void add(std::string_view body, bool isSpam, size_t maxBytes) {
+            std::vector<uint32_t>& table = isSpam ? spam : ham;
+            uint64_t& tokens = isSpam ? spamTokens : hamTokens;
+            uint32_t mask = static_cast<uint32_t>(table.size() - 1);
+            forEachToken(body.substr(0, maxBytes), [&](uint32_t hash) {
+                ++table[hash & mask];
+                ++tokens;
+                });
+            ++(isSpam ? spamDocs : hamDocs);
+        }
+    };
+
+
+
+    BayesClassifier::BayesClassifier(const BayesOptions& options, const std::string& databasePath, size_t shards)
+        : m_options(options), m_databasePath(databasePath), m_shards(std::max<size_t>(shards, 1)) {
+        if (!m_options.enabled) return;
+
+        // First model is trained in the background like every later one
+        m_reloadRequested = true;
+        m_trainer = std::thread([this] { run(); });
+    }
+
+
+
+    BayesClassifier::~BayesClassifier() {
+        {
+            std::lock_guard<std::mutex> lock(m_trainMutex);
+            m_stop = true;
+        }
+        m_trainWake.notify_one();
+        if (m_trainer.joinable()) m_trainer.join();
+    }
+
+
+
+    std::optional<double> BayesClassifier::score(std::string_view body) const {
+        std::shared_ptr<const Model> model = std::atomic_load(&m_model);
+        if (!model) return std::nullopt;
+
+        const float* weights = model->weights.data();
+        uint32_t mask = static_cast<uint32_t>(model->weights.size() - 1);
+        double logit = model->prior;
+        forEachToken(body.substr(0, m_options.maxScanBytes), [&](uint32_t hash) {
+            logit += weights[hash & mask];
+            });
+
+        logit = std::max(-MAX_LOGIT, std::min(MAX_LOGIT, logit));
+        return 1.0 / (1.0 + std::exp(-logit));
+    }
+
+
+
+    void BayesClassifier::reload() {
+        {
+            std::lock_guard<std::mutex> lock(m_trainMutex);
+            m_reloadRequested = true;
+        }
+        m_trainWake.notify_one();
+    }
+
+
+
+    bool BayesClassifier::train(const std::vector<std::string>& spam, const std::vector<std::string>& ham) {
+        Counts counts(size_t(1) << m_options.tableBits);
+        for (const std::string& body : spam) counts.add(body, true, m_options.maxScanBytes);
+        for (const std::string& body : ham) counts.add(body, false, m_options.maxScanBytes);
+
+        std::shared_ptr<const Model> model = build(counts);
+        if (!model) return false;
+        std::atomic_store(&m_model, model);
+        return true;
+    }
+
+
+
+    void BayesClassifier::run() {
+        std::unique_lock<std::mutex> lock(m_trainMutex);
+        while (!m_stop) {
+            if (!m_reloadRequested) {
+                if (m_options.retrainIntervalSec > 0) {
+                    m_trainWake.wait_for(lock, std::chrono::seconds(m_options.retrainIntervalSec));
+                    m_reloadRequested = true;
+                }
+                else {
+                    m_trainWake.wait(lock);
+                }
+                continue;
+            }
+
+            m_reloadRequested = false;
+            lock.unlock();
+            trainFromDatabase();
+            lock.lock();
+        }
+    }
+
+
+
+    bool BayesClassifier::trainFromDatabase() {
+        Counts counts(size_t(1) << m_options.tableBits);
+        const struct { const char* sql; bool isSpam; } sources[] = {
+            // A body sent to many recipients is one document
+            { "SELECT body, location, codec, dictionary, size FROM Bodies WHERE id IN (SELECT body_id FROM SpamLogs ORDER BY id DESC LIMIT ?);", true },
+            { "SELECT body, location, codec, dictionary, size FROM Bodies WHERE id IN (SELECT body_id FROM Emails ORDER BY id DESC LIMIT ?);", false },
+        };
+        // Recipients spread evenly, so each shard gives its share of the most recent rows
+        size_t rowsPerShard = (m_options.trainingRows + m_shards - 1) / m_shards;
+
+        for (size_t shard = 0; shard < m_shards; ++shard) {
+            // Separate read-only connection: never contends with the writer in WAL mode
+            sqlite3* db = nullptr;
+            std::string path = shardPath(m_databasePath, shard, m_shards);
+            if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+                sqlite3_close(db);
+                continue;
+            }
+
+            // Bodies kept out of the database (BodyStorage::SegmentLog)
+            SegmentLogReader log(path + "-log");
+            BodyDecoder decoder;
+            std::string logged, body;
+
+            for (const auto& source : sources) {
+                sqlite3_stmt* stmt;
+                if (sqlite3_prepare_v2(db, source.sql, -1, &stmt, nullptr) != SQLITE_OK) continue;
+                sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(rowsPerShard));
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    std::string_view stored;
+                    if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+                        if (!log.read(static_cast<uint64_t>(sqlite3_column_int64(stmt, 1)), logged)) continue;
+                        stored = logged;
+                    }
+                    else {
+                        const char* data = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+                        if (data == nullptr) continue;
+                        stored = std::string_view(data, static_cast<size_t>(sqlite3_column_bytes(stmt, 0)));
+                    }
+                    if (decoder.decode(db, sqlite3_column_int(stmt, 2), sqlite3_column_int64(stmt, 3), stored,
+                        static_cast<size_t>(sqlite3_column_int64(stmt, 4)), body)) {
+                        counts.add(body, source.isSpam, m_options.maxScanBytes);
+                    }
+                }
+                sqlite3_finalize(stmt);
+            }
+            sqlite3_close(db);
+        }
+
+        std::shared_ptr<const Model> model = build(counts);
+        if (!model) return false;
+        std::atomic_store(&m_model, model);
+
+        Log::printf(LogLevel::Info, "Spam model trained on %llu spam / %llu ham messages",
+            static_cast<unsigned long long>(counts.spamDocs), static_cast<unsigned long long>(counts.hamDocs));
+        return true;
+    }
+
+
+
+    std::shared_ptr<const BayesClassifier::Model> BayesClassifier::build(const Counts& counts) const {
+        // Both classes are needed for a meaningful ratio
+        if (counts.spamDocs == 0 || counts.hamDocs == 0) return nullptr;
+
+        auto model = std::make_shared<Model>();
+        size_t buckets = counts.spam.size();
+        model->weights.resize(buckets);
+
+        double spamTotal = static_cast<double>(counts.spamTokens) + SMOOTHING * buckets;
+        double hamTotal = static_cast<double>(counts.hamTokens) + SMOOTHING * buckets;
+        for (size_t i = 0; i < buckets; ++i) {
+            double pSpam = (counts.spam[i] + SMOOTHING) / spamTotal;
+            double pHam = (counts.ham[i] + SMOOTHING) / hamTotal;
+            model->weights[i] = static_cast<float>(std::log(pSpam) - std::log(pHam));
+        }
+        model->prior = std::log(static_cast<double>(counts.spamDocs)) - std::log(static_cast<double>(counts.hamDocs));
+        return model;
+    }
+}
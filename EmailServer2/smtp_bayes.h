@@ -0,0 +1,71 @@
+#ifndef INCLUDED_SMTP_BAYES_LINUX
+#define INCLUDED_SMTP_BAYES_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <optional>
+#include <condition_variable>
+
+namespace smtp {
+    struct BayesOptions {
+        bool enabled = true;
+        unsigned tableBits = 20;                // 2^20 hashed token buckets (4 MiB of weights)
+        double hamThreshold = 0.10;             // At or below: ham without asking the classifier
+        double spamThreshold = 0.95;            // At or above: spam without asking the classifier
+        size_t maxScanBytes = 1024 * 1024;      // Only the head of very large bodies is scored
+        size_t trainingRows = 20000;            // Most recent rows per class used for training
+        int retrainIntervalSec = 3600;          // Background retrain period, 0 = only on reload()
+    };
+
+    // Multinomial naive Bayes over hashed tokens. Training turns per-bucket token
+    // counts into log-likelihood ratios once, so scoring is a tokenizer pass plus
+    // one table lookup and add per token. Spam examples come from SpamLogs, ham
+    // from Emails. A retrained model replaces the live one atomically; scoring
+    // threads never wait on training.
+    class BayesClassifier {
+    public:
+        // A sharded store (StorageOptions::shards > 1) is read shard by shard
+        BayesClassifier(const BayesOptions& options, const std::string& databasePath, size_t shards = 1);
+        ~BayesClassifier();
+
+        // Probability that body is spam, or nothing while no model is trained
+        std::optional<double> score(std::string_view body) const;
+
+        // Retrains from the database in the background and swaps the model in
+        void reload();
+
+        // Trains synchronously from explicit examples (tools and benchmarks)
+        bool train(const std::vector<std::string>& spam, const std::vector<std::string>& ham);
+
+    private:
+        struct Model {
+            std::vector<float> weights;     // log P(token|spam) - log P(token|ham), per bucket
+            double prior = 0.0;             // log P(spam) - log P(ham)
+        };
+
+        struct Counts;
+
+        bool trainFromDatabase();
+        std::shared_ptr<const Model> build(const Counts& counts) const;
+        void run();
+
+        BayesOptions m_options;
+        std::string m_databasePath;
+        size_t m_shards;
+        std::shared_ptr<const Model> m_model;   // Accessed with std::atomic_load/store
+
+        // Background retraining
+        std::thread m_trainer;
+        std::mutex m_trainMutex;
+        std::condition_variable m_trainWake;
+        bool m_reloadRequested = false;
+        bool m_stop = false;
+    };
+}
+
+#endif
@@ -0,0 +1,257 @@
+#include "smtp_compression.h"
+#include "smtp_log.h"
+#include <algorithm>
+#include <unordered_map>
+
+
+namespace smtp {
+
+    namespace {
+        const size_t MAX_DICTIONARY = 32768 - 262;     // The farthest back deflate can reach
+        const size_t SAMPLE_BYTES = 8192;               // Of each body, kept for training
+        const size_t MIN_LINE = 8;                      // Shorter lines are cheaper to send again than to find
+        const size_t MAX_LINE = 1024;
+        const size_t CHUNK_BYTES = 8192;                // Of a body between strategy decisions
+
+        // One inflate state per thread, reset for every body
+        struct Inflater {
+            z_stream stream = {};
+            bool ready;
+
+            Inflater() {
+                ready = inflateInit2(&stream, -MAX_WBITS) == Z_OK;
+            }
+
+            ~Inflater() {
+                if (ready) inflateEnd(&stream);
+            }
+        };
+    }
+
+
+
+    bool BodyDecoder::decode(sqlite3* db, int codec, int64_t dictionary, std::string_view stored, size_t size, std::string& body) {
+        if (codec == static_cast<int>(BodyCodec::None)) {
+            body.assign(stored);
+            return true;
+        }
+        if (codec != static_cast<int>(BodyCodec::Deflate)) return false;
+
+        std::shared_ptr<const std::string> words;
+        if (dictionary != 0 && !(words = this->dictionary(db, dictionary))) return false;
+
+        thread_local Inflater inflater;
+        z_stream& stream = inflater.stream;
+        if (!inflater.ready || inflateReset(&stream) != Z_OK) return false;
+        if (words && inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(words->data()), static_cast<uInt>(words->size())) != Z_OK) {
+            return false;
+        }
+
+        body.resize(size);
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(stored.data()));
+        stream.avail_in = static_cast<uInt>(stored.size());
+        stream.next_out = reinterpret_cast<Bytef*>(&body[0]);
+        stream.avail_out = static_cast<uInt>(size);
+        return inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == size;
+    }
+
+
+
+    std::shared_ptr<const std::string> BodyDecoder::dictionary(sqlite3* db, int64_t id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_dictionaries.find(id);
+        if (found != m_dictionaries.end()) return found->second;
+
+        std::shared_ptr<const std::string> words;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT data FROM Dictionaries WHERE id = ?1;", -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, id);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char* data = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+                words = std::make_shared<const std::string>(data ? data : "", static_cast<size_t>(sqlite3_column_bytes(stmt, 0)));
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (!words) {
+            Log::printf(LogLevel::Error, "Body dictionary %lld not found", static_cast<long long>(id));
+            return nullptr;
+        }
+        m_dictionaries.emplace(id, words);
+        return words;
+    }
+
+
+
+    BodyCompressor::BodyCompressor(const CompressionOptions& options)
+        : m_options(options), m_deflate() {
+        if (m_options.enabled) {
+            m_ready = deflateInit2(&m_deflate, m_options.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+    }
+
+
+
+    BodyCompressor::~BodyCompressor() {
+        if (m_ready) deflateEnd(&m_deflate);
+    }
+
+
+
+    bool BodyCompressor::loadDictionary(sqlite3* db) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT id, data FROM Dictionaries ORDER BY id DESC LIMIT 1;", -1, &stmt, nullptr) != SQLITE_OK) {
+            return false;
+        }
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            m_dictionaryId = sqlite3_column_int64(stmt, 0);
+            const char* data = static_cast<const char*>(sqlite3_column_blob(stmt, 1));
+            m_dictionary.assign(data ? data : "", static_cast<size_t>(sqlite3_column_bytes(stmt, 1)));
+        }
+        sqlite3_finalize(stmt);
+        return rc == SQLITE_ROW || rc == SQLITE_DONE;
+    }
+
+
+
+    bool BodyCompressor::compress(std::string_view body, std::string& stored, int64_t& dictionary) {
+        if (!m_ready || body.empty()) return false;
+        if (deflateReset(&m_deflate) != Z_OK || deflateParams(&m_deflate, m_options.level, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        if (!m_dictionary.empty() && deflateSetDictionary(&m_deflate,
+            reinterpret_cast<const Bytef*>(m_dictionary.data()), static_cast<uInt>(m_dictionary.size())) != Z_OK) {
+            return false;
+        }
+
+        // Output no larger than the body, or it is kept raw. Large bodies go
+        // in chunks: where one barely compresses (base64 attachments) the
+        // following ones are Huffman-coded only, which is about three times
+        // faster there and saves as much; matching resumes once they compress.
+        stored.resize(body.size());
+        m_deflate.next_out = reinterpret_cast<Bytef*>(&stored[0]);
+        m_deflate.avail_out = static_cast<uInt>(stored.size());
+        int strategy = Z_DEFAULT_STRATEGY;
+        for (size_t offset = 0; ; ) {
+            size_t chunk = std::min(CHUNK_BYTES, body.size() - offset);
+            bool last = offset + chunk == body.size();
+            uLong before = m_deflate.total_out;
+            m_deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data() + offset));
+            m_deflate.avail_in = static_cast<uInt>(chunk);
+            int rc = deflate(&m_deflate, last ? Z_FINISH : Z_BLOCK);
+            if (last) {
+                if (rc != Z_STREAM_END) return false;
+                break;
+            }
+            if (rc != Z_OK || m_deflate.avail_in != 0) return false;
+            offset += chunk;
+
+            uLong produced = m_deflate.total_out - before;
+            int next = strategy;
+            if (strategy == Z_DEFAULT_STRATEGY && produced * 4 > chunk * 3) next = Z_HUFFMAN_ONLY;
+            else if (strategy == Z_HUFFMAN_ONLY && produced * 8 < chunk * 5) next = Z_DEFAULT_STRATEGY;
+            if (next != strategy) {
+                if (deflateParams(&m_deflate, m_options.level, next) != Z_OK) return false;
+                strategy = next;
+            }
+        }
+
+        stored.resize(m_deflate.total_out);
+        dictionary = m_dictionary.empty() ? 0 : m_dictionaryId;
+        return true;
+    }
+
+
+
+    void BodyCompressor::observe(std::string_view body) {
+        if (!m_ready || m_options.trainingSamples == 0) return;
+        std::string_view sample = body.substr(0, SAMPLE_BYTES);
+        if (m_samples.size() < m_options.trainingSamples) {
+            m_samples.emplace_back(sample);
+        }
+        else {
+            m_samples[m_nextSample].assign(sample.data(), sample.size());
+            m_nextSample = (m_nextSample + 1) % m_samples.size();
+        }
+        ++m_sinceTraining;
+    }
+
+
+
+    bool BodyCompressor::due() const {
+        if (!m_ready || m_options.trainingSamples == 0 || m_samples.size() < m_options.trainingSamples) return false;
+        if (m_dictionaryId == 0) return m_sinceTraining >= m_options.trainingSamples;
+        return m_options.retrainEvery > 0 && m_sinceTraining >= m_options.retrainEvery;
+    }
+
+
+
+    bool BodyCompressor::retrain(sqlite3* db) {
+        m_sinceTraining = 0;
+        std::string dictionary = train(m_samples, std::min(m_options.dictionaryBytes, MAX_DICTIONARY));
+        if (dictionary.empty()) return false;
+
+        // Durable before any row can name it
+        sqlite3_stmt* stmt = nullptr;
+        bool stored = sqlite3_prepare_v2(db, "INSERT INTO Dictionaries (data) VALUES (?1);", -1, &stmt, nullptr) == SQLITE_OK
+            && sqlite3_bind_blob(stmt, 1, dictionary.data(), static_cast<int>(dictionary.size()), SQLITE_STATIC) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        if (!stored) {
+            Log::printf(LogLevel::Error, "Storing a body dictionary failed: %s", sqlite3_errmsg(db));
+            return false;
+        }
+
+        m_dictionaryId = sqlite3_last_insert_rowid(db);
+        m_dictionary = std::move(dictionary);
+        Log::printf(LogLevel::Info, "Body dictionary %lld: %zu bytes trained on %zu messages",
+            static_cast<long long>(m_dictionaryId), m_dictionary.size(), m_samples.size());
+        return true;
+    }
+
+
+
+    std::string BodyCompressor::train(const std::vector<std::string>& samples, size_t bytes) {
+        // Documents each line occurs in (once per document)
+        struct Occurrences {
+            size_t documents = 0;
+            size_t lastDocument = SIZE_MAX;
+        };
+        std::unordered_map<std::string_view, Occurrences> lines;
+        for (size_t document = 0; document < samples.size(); ++document) {
+            std::string_view text = samples[document];
+            while (!text.empty()) {
+                size_t end = text.find('\n');
+                std::string_view line = text.substr(0, end == std::string_view::npos ? text.size() : end + 1);
+                text.remove_prefix(line.size());
+                if (line.size() < MIN_LINE || line.size() > MAX_LINE) continue;
+                Occurrences& occurrences = lines[line];
+                if (occurrences.lastDocument != document) {
+                    occurrences.lastDocument = document;
+                    ++occurrences.documents;
+                }
+            }
+        }
+
+        // Bytes the dictionary would save over the sample, assuming each later copy becomes a match
+        std::vector<std::pair<size_t, std::string_view>> ranked;
+        for (const auto& line : lines) {
+            if (line.second.documents >= 2) ranked.emplace_back((line.second.documents - 1) * line.first.size(), line.first);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+
+        std::vector<std::string_view> chosen;
+        size_t total = 0;
+        for (const auto& line : ranked) {
+            if (total + line.second.size() > bytes) continue;
+            chosen.push_back(line.second);
+            total += line.second.size();
+        }
+
+        // Most valuable last, at the shortest distance from the data
+        std::string dictionary;
+        dictionary.reserve(total);
+        for (auto line = chosen.rbegin(); line != chosen.rend(); ++line) dictionary.append(*line);
+        return dictionary;
+    }
+}
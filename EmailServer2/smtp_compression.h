@@ -0,0 +1,88 @@
+#ifndef INCLUDED_SMTP_COMPRESSION_LINUX
+#define INCLUDED_SMTP_COMPRESSION_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <sqlite3.h>
+#include <zlib.h>
+
+namespace smtp {
+    // Bodies.codec; stored with every body, so values are never reused
+    enum class BodyCodec { None = 0, Deflate = 1 };
+
+    struct CompressionOptions {
+        bool enabled = true;
+        int level = 1;                  // zlib level: 1 is fastest, 9 smallest
+        size_t dictionaryBytes = 8192;  // Trained dictionary size; priming one costs about as much as compressing it
+        size_t trainingSamples = 256;   // Recent new bodies a dictionary is trained on
+        size_t retrainEvery = 100000;   // New bodies between dictionary retrainings; 0 trains once
+    };
+
+    // Read side of compressed bodies, safe from any thread. Dictionaries are
+    // immutable once written, so each is read from the database the first
+    // time a body needs it and kept.
+    class BodyDecoder {
+    public:
+        // body from its stored bytes, the codec and dictionary id of its
+        // Bodies row, and its original size; dictionaries are read from db
+        bool decode(sqlite3* db, int codec, int64_t dictionary, std::string_view stored, size_t size, std::string& body);
+
+    private:
+        std::shared_ptr<const std::string> dictionary(sqlite3* db, int64_t id);
+
+        std::mutex m_mutex;
+        std::map<int64_t, std::shared_ptr<const std::string>> m_dictionaries;
+    };
+
+    // Write side, owned by one shard writer. Bodies are raw deflate primed
+    // with a dictionary trained on the shard's recent mail: headers, HTML
+    // boilerplate and signatures that recur across messages then cost a few
+    // bytes even in a short body. zlib has no trainer, so the dictionary is
+    // the lines that recur across the sampled bodies, most valuable last
+    // (nearest the data, where deflate reaches them cheapest). New
+    // dictionaries go to the Dictionaries table and never replace one, so
+    // every row stays readable under the dictionary it was written with.
+    class BodyCompressor {
+    public:
+        explicit BodyCompressor(const CompressionOptions& options);
+        ~BodyCompressor();
+
+        // The newest dictionary in db, if any
+        bool loadDictionary(sqlite3* db);
+
+        // Deflate bytes of body in stored, and the dictionary they need (0:
+        // none); false when compression is off or would not save anything
+        bool compress(std::string_view body, std::string& stored, int64_t& dictionary);
+
+        // Offers a newly stored body for training; due() once enough arrived for a new dictionary
+        void observe(std::string_view body);
+        bool due() const;
+
+        // Trains on the bodies observed, stores the dictionary in db and uses it from now on
+        bool retrain(sqlite3* db);
+
+        BodyDecoder& decoder() { return m_decoder; }
+
+        // A dictionary of at most bytes from samples (empty if nothing recurs)
+        static std::string train(const std::vector<std::string>& samples, size_t bytes);
+
+    private:
+        CompressionOptions m_options;
+        z_stream m_deflate;
+        bool m_ready = false;
+        int64_t m_dictionaryId = 0;
+        std::string m_dictionary;
+        std::vector<std::string> m_samples;     // Ring of body prefixes
+        size_t m_nextSample = 0;
+        size_t m_sinceTraining = 0;
+        BodyDecoder m_decoder;
+    };
+}
+
+#endif
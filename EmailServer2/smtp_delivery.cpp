@@ -0,0 +1,949 @@
+#include "smtp_delivery.h"
+#include "smtp_metrics.h"
+#include "smtp_log.h"
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+
+namespace smtp {
+
+    namespace {
+        const int MAX_EVENTS = 64;
+        const uint64_t TICK_MS = 10;
+        const size_t MAX_REPLY = 64 * 1024;     // Unanswered bytes from a server that never ends a line
+
+        std::string lowercase(std::string_view text) {
+            std::string out(text);
+            for (char& c : out) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            return out;
+        }
+
+        // Appends body as DATA content (RFC 5321 4.5.2): a leading dot on any
+        // line is doubled, and the end-of-data line follows a final CRLF
+        void appendStuffed(std::string& out, std::string_view body) {
+            out.reserve(out.size() + body.size() + body.size() / 64 + 5);
+            size_t line = 0;
+            while (line < body.size()) {
+                size_t end = body.find('\n', line);
+                end = (end == std::string_view::npos) ? body.size() : end + 1;
+                if (body[line] == '.') out += '.';
+                out.append(body.data() + line, end - line);
+                line = end;
+            }
+            if (!body.empty() && (body.size() < 2 || body.compare(body.size() - 2, 2, "\r\n") != 0)) out += "\r\n";
+            out += ".\r\n";
+        }
+
+        // "host:port", or "[v6 address]:port"
+        bool splitRoute(const std::string& route, std::string& host, std::string& port) {
+            size_t colon = route.rfind(':');
+            if (colon == std::string::npos || colon + 1 == route.size()) return false;
+            host = route.substr(0, colon);
+            port = route.substr(colon + 1);
+            if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+            return true;
+        }
+
+        enum class Lookup { Found, Missing, Retry };     // Missing: the name does not exist
+
+        template <typename Address>
+        Lookup addressesOf(const std::string& host, const std::string& port, std::vector<Address>& out) {
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* found = nullptr;
+            int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+            if (rc != 0) return rc == EAI_NONAME ? Lookup::Missing : Lookup::Retry;
+            for (addrinfo* item = found; item != nullptr; item = item->ai_next) {
+                Address address;
+                memset(&address.address, 0, sizeof(address.address));
+                memcpy(&address.address, item->ai_addr, item->ai_addrlen);
+                address.length = item->ai_addrlen;
+                out.push_back(address);
+            }
+            freeaddrinfo(found);
+            return Lookup::Found;
+        }
+
+        // MX hosts of domain, most preferred first. An empty list with Found
+        // means the domain has no MX records (its own address is the implicit
+        // MX, RFC 5321 5.1); a single "" is a null MX (RFC 7505).
+        Lookup mxHosts(const std::string& domain, std::vector<std::string>& hosts) {
+            struct __res_state state;
+            memset(&state, 0, sizeof(state));
+            if (res_ninit(&state) != 0) return Lookup::Retry;
+
+            unsigned char answer[NS_MAXMSG / 8];
+            int length = res_nquery(&state, domain.c_str(), ns_c_in, ns_t_mx, answer, sizeof(answer));
+            int error = state.res_h_errno;
+            res_nclose(&state);
+            if (length < 0) {
+                if (error == HOST_NOT_FOUND) return Lookup::Missing;
+                return error == NO_DATA ? Lookup::Found : Lookup::Retry;
+            }
+
+            ns_msg message;
+            if (ns_initparse(answer, length, &message) < 0) return Lookup::Retry;
+            std::vector<std::pair<int, std::string>> records;
+            for (int i = 0; i < ns_msg_count(message, ns_s_an); ++i) {
+                ns_rr record;
+                if (ns_parserr(&message, ns_s_an, i, &record) < 0 || ns_rr_type(record) != ns_t_mx) continue;
+                const unsigned char* data = ns_rr_rdata(record);
+                char name[NS_MAXDNAME];
+                if (ns_rr_rdlen(record) < 3 || dn_expand(ns_msg_base(message), ns_msg_end(message), data + 2, name, sizeof(name)) < 0) continue;
+                records.emplace_back(ns_get16(data), name);
+            }
+            std::stable_sort(records.begin(), records.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+            for (auto& record : records) hosts.push_back(std::move(record.second));
+            return Lookup::Found;
+        }
+    }
+
+
+
+    DeliveryAgent::DeliveryAgent(const DeliveryOptions& options, MailStore& store, const std::string& databasePath, size_t shards)
+        : m_options(options), m_store(store), m_reader(databasePath, shards), m_wheel(TICK_MS, nowMs()) {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_epoll < 0 || m_wakeFd < 0) {
+            std::cerr << "ERROR: Failed to create delivery event loop" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0; // Connections are tagged from 1
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev);
+
+        m_statusTimer.fire = [this] { flushStatus(); };
+
+        // Listen first, then read the backlog: a row committed in between is
+        // seen twice and kept once, none is missed. Neither is acted on until
+        // the I/O thread starts, so no row is delivered before its backlog
+        // entry is known.
+        m_store.setQueuedListener([this](std::vector<QueuedMessage>& queued) {
+            {
+                std::lock_guard<std::mutex> lock(m_submitMutex);
+                for (QueuedMessage& message : queued) m_submitted.push_back(std::move(message));
+            }
+            wake();
+            });
+        ReadResult backlog = m_reader.listQueued([this](int64_t id, std::string_view recipient, int attempts) {
+            std::lock_guard<std::mutex> lock(m_submitMutex);
+            m_submitted.push_back({ id, std::string(recipient), attempts });
+            });
+        if (backlog == ReadResult::Error) {
+            Log::printf(LogLevel::Error, "Delivery could not read the queue; only new mail will be sent");
+        }
+
+        m_resolver = std::thread([this] { resolveLoop(); });
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    DeliveryAgent::~DeliveryAgent() {
+        m_store.setQueuedListener(nullptr);
+
+        m_stop = true;
+        wake();
+        if (m_thread.joinable()) m_thread.join();
+        {
+            std::lock_guard<std::mutex> lock(m_resolveMutex);
+        }
+        m_resolveWake.notify_all();
+        if (m_resolver.joinable()) m_resolver.join();
+
+        close(m_wakeFd);
+        close(m_epoll);
+    }
+
+
+
+    uint64_t DeliveryAgent::nowMs() {
+        return Metrics::now() / 1000000;
+    }
+
+
+
+    void DeliveryAgent::wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void DeliveryAgent::run() {
+        struct epoll_event events[MAX_EVENTS];
+
+        while (!m_stop) {
+            acceptSubmissions();
+            m_wheel.advance(nowMs());
+            while (!m_dirty.empty()) {
+                std::vector<Domain*> dirty;
+                dirty.swap(m_dirty);
+                for (Domain* domain : dirty) {
+                    domain->dirty = false;
+                    deliverReady(*domain);
+                }
+            }
+            m_closed.clear();
+
+            int ready = epoll_wait(m_epoll, events, MAX_EVENTS, m_wheel.timeoutMs(nowMs()));
+            if (ready < 0 && errno != EINTR) {
+                Log::printf(LogLevel::Error, "Delivery epoll_wait failed: %s", strerror(errno));
+                break;
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                if (events[i].data.u64 == 0) {
+                    uint64_t count;
+                    ssize_t ignored = read(m_wakeFd, &count, sizeof(count));
+                    (void)ignored;
+                    continue;
+                }
+                onEvent(events[i].data.u64, events[i].events);
+            }
+        }
+
+        // Rows on the wire keep their status and go out again after a restart
+        flushStatus();
+        for (auto& entry : m_connections) {
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, entry.second->socket, nullptr);
+            close(entry.second->socket);
+        }
+        m_connections.clear();
+        m_closed.clear();
+    }
+
+
+
+    void DeliveryAgent::acceptSubmissions() {
+        std::vector<Resolution> resolved;
+        m_accepting.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_submitMutex);
+            m_accepting.swap(m_submitted);
+            resolved.swap(m_resolved);
+        }
+
+        for (QueuedMessage& message : m_accepting) {
+            addMessage(message.id, message.recipient, message.attempts);
+        }
+        for (Resolution& resolution : resolved) {
+            onResolved(resolution);
+        }
+    }
+
+
+
+    void DeliveryAgent::addMessage(int64_t id, std::string_view recipient, int attempts) {
+        if (m_messages.count(id) != 0) return;
+
+        auto message = std::make_unique<Message>();
+        message->id = id;
+        message->recipient = recipient;
+        message->attempts = attempts;
+        Message& added = *message;
+        m_messages.emplace(id, std::move(message));
+
+        size_t at = recipient.rfind('@');
+        if (at == std::string_view::npos || at + 1 == recipient.size()) {
+            finish(added, Outcome::Permanent, "no domain in recipient");
+            return;
+        }
+
+        std::string name = lowercase(recipient.substr(at + 1));
+        auto it = m_domains.find(name);
+        if (it == m_domains.end()) {
+            auto domain = std::make_unique<Domain>();
+            domain->name = name;
+            it = m_domains.emplace(name, std::move(domain)).first;
+        }
+        added.domain = it->second.get();
+        added.retry.fire = [this, &added] {
+            added.domain->ready.push_back(&added);
+            markDirty(*added.domain);
+        };
+        added.domain->ready.push_back(&added);
+        markDirty(*added.domain);
+    }
+
+
+
+    void DeliveryAgent::markDirty(Domain& domain) {
+        if (domain.dirty) return;
+        domain.dirty = true;
+        m_dirty.push_back(&domain);
+    }
+
+
+
+    void DeliveryAgent::deliverReady(Domain& domain) {
+        if (domain.ready.empty()) return;
+
+        if (domain.addresses.empty()) {
+            if (!domain.resolving) {
+                domain.resolving = true;
+                {
+                    std::lock_guard<std::mutex> lock(m_resolveMutex);
+                    m_toResolve.push_back(domain.name);
+                }
+                m_resolveWake.notify_one();
+            }
+            return;
+        }
+
+        // Fill the connections already open, least loaded first; with
+        // pipelining a connection takes the next message while the server
+        // is still answering the previous one's end of data
+        size_t opening = 0;
+        while (!domain.ready.empty()) {
+            Connection* chosen = nullptr;
+            opening = 0;
+            for (Connection* connection : domain.pool) {
+                if (connection->quitting) continue;
+                if (!connection->ready) {
+                    ++opening;
+                    continue;
+                }
+                if (connection->inFlight >= (connection->pipelining ? 2 : 1)) continue;
+                if (chosen == nullptr || connection->inFlight < chosen->inFlight) chosen = connection;
+            }
+            if (chosen == nullptr) break;
+
+            Message& message = *domain.ready.front();
+            domain.ready.pop_front();
+            if (assign(*chosen, message)) pump(*chosen);
+        }
+
+        // Open more, up to the pool size, while there is more waiting than
+        // the connections being opened will take. After every address has
+        // refused, only an empty pool tries again.
+        bool mayOpen = domain.failedConnects < domain.addresses.size() || domain.pool.empty();
+        while (mayOpen && !domain.ready.empty() && domain.pool.size() < static_cast<size_t>(std::max(m_options.connectionsPerDomain, 1))
+            && opening < domain.ready.size()) {
+            size_t before = domain.pool.size();
+            connect(domain);
+            if (domain.pool.size() == before) break;    // Failed at once; connectFailed has dealt with it
+            ++opening;
+        }
+    }
+
+
+
+    bool DeliveryAgent::assign(Connection& connection, Message& message) {
+        bool queued = false;
+        ReadResult result = m_reader.fetchMessage(message.id, [&](const MailboxMessage& row) {
+            queued = row.status == DeliveryStatus::Queued || row.status == DeliveryStatus::Deferred;
+            message.sender = row.sender;
+            message.body = row.body;
+            });
+        if (result == ReadResult::Error) {
+            finish(message, Outcome::Temporary, "message could not be read");
+            return false;
+        }
+        if (result == ReadResult::NotFound || !queued) {
+            // Deleted, or settled by someone else since it was queued
+            m_messages.erase(message.id);
+            return false;
+        }
+
+        message.failure = 0;
+        message.reason.clear();
+        message.dataAccepted = false;
+        message.started = Metrics::now();
+        connection.steps.push_back({ Expect::Mail, &message });
+        connection.steps.push_back({ Expect::Rcpt, &message });
+        connection.steps.push_back({ Expect::Data, &message });
+        connection.steps.push_back({ Expect::Body, &message });
+        ++connection.inFlight;
+        ++connection.transactions;
+        if (connection.transactions >= m_options.messagesPerConnection) connection.quitting = true;
+        return true;
+    }
+
+
+
+    void DeliveryAgent::connect(Domain& domain) {
+        const Address& address = domain.addresses[domain.nextAddress % domain.addresses.size()];
+
+        int sock = socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            connectFailed(domain, strerror(errno));
+            return;
+        }
+
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        int result = ::connect(sock, reinterpret_cast<const sockaddr*>(&address.address), address.length);
+        if (result < 0 && errno != EINPROGRESS) {
+            int error = errno;
+            close(sock);
+            connectFailed(domain, strerror(error));
+            return;
+        }
+
+        auto connection = std::make_unique<Connection>();
+        connection->key = m_nextKey++;
+        connection->socket = sock;
+        connection->domain = &domain;
+        connection->connected = (result == 0);
+        connection->awaiting.push_back({ Expect::Greeting, nullptr });
+        uint64_t key = connection->key;
+        connection->deadline.fire = [this, key] { onDeadline(key); };
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = key;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            int error = errno;
+            close(sock);
+            connectFailed(domain, strerror(error));
+            return;
+        }
+
+        Metrics::add(Metrics::Counter::DeliveryConnections);
+        domain.pool.push_back(connection.get());
+        Connection& opened = *connection;
+        m_connections.emplace(key, std::move(connection));
+        armDeadline(opened);
+    }
+
+
+
+    void DeliveryAgent::connectFailed(Domain& domain, std::string_view reason) {
+        Log::printf(LogLevel::Warning, "Delivery to %s: connection failed: %.*s",
+            domain.name.c_str(), static_cast<int>(reason.size()), reason.data());
+        ++domain.nextAddress;
+        if (++domain.failedConnects < domain.addresses.size()) {
+            markDirty(domain);
+            return;
+        }
+        if (!domain.pool.empty()) return;   // The open ones carry on; no more are tried
+
+        // Every address refused: wait out the backoff, then resolve afresh
+        domain.addresses.clear();
+        domain.nextAddress = 0;
+        domain.failedConnects = 0;
+        deferDomain(domain, Outcome::Temporary, reason);
+    }
+
+
+
+    void DeliveryAgent::deferDomain(Domain& domain, Outcome outcome, std::string_view reason) {
+        while (!domain.ready.empty()) {
+            Message& message = *domain.ready.front();
+            domain.ready.pop_front();
+            finish(message, outcome, reason);
+        }
+    }
+
+
+
+    void DeliveryAgent::onResolved(Resolution& resolution) {
+        auto it = m_domains.find(resolution.domain);
+        if (it == m_domains.end()) return;
+        Domain& domain = *it->second;
+        domain.resolving = false;
+
+        if (resolution.addresses.empty()) {
+            const char* reason = resolution.permanent ? "domain does not accept mail" : "domain could not be resolved";
+            Log::printf(LogLevel::Warning, "Delivery to %s: %s", domain.name.c_str(), reason);
+            deferDomain(domain, resolution.permanent ? Outcome::Permanent : Outcome::Temporary, reason);
+            return;
+        }
+        domain.addresses = std::move(resolution.addresses);
+        domain.nextAddress = 0;
+        domain.failedConnects = 0;
+        markDirty(domain);
+    }
+
+
+
+    void DeliveryAgent::onEvent(uint64_t key, uint32_t events) {
+        auto it = m_connections.find(key);
+        if (it == m_connections.end()) return;
+        Connection& connection = *it->second;
+
+        if (!connection.connected) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(connection.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+                failConnection(connection, strerror(error != 0 ? error : ECONNRESET));
+                return;
+            }
+            if (!(events & EPOLLOUT)) return;
+            connection.connected = true;
+            armDeadline(connection);
+        }
+
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !readReplies(connection)) {
+            if (!connection.closed) failConnection(connection, "connection lost");
+            return;
+        }
+        if (!connection.closed && connection.outOffset < connection.out.size() && !flush(connection)) {
+            failConnection(connection, "connection lost");
+        }
+    }
+
+
+
+    void DeliveryAgent::onDeadline(uint64_t key) {
+        auto it = m_connections.find(key);
+        if (it == m_connections.end()) return;
+        Connection& connection = *it->second;
+
+        // Idle past idleTimeoutMs: leave politely
+        if (connection.ready && connection.awaiting.empty() && connection.steps.empty() && !connection.quitting) {
+            connection.quitting = true;
+            connection.steps.push_back({ Expect::Quit, nullptr });
+            pump(connection);
+            return;
+        }
+        failConnection(connection, connection.connected ? "timed out waiting for a reply" : "connect timed out");
+    }
+
+
+
+    void DeliveryAgent::armDeadline(Connection& connection) {
+        if (connection.closed) return;
+        int delay = !connection.connected ? m_options.connectTimeoutMs
+            : !connection.awaiting.empty() ? m_options.replyTimeoutMs
+            : m_options.idleTimeoutMs;
+        m_wheel.schedule(connection.deadline, nowMs(), static_cast<uint64_t>(std::max(delay, 0)));
+    }
+
+
+
+    void DeliveryAgent::pump(Connection& connection) {
+        // Take the next message now, so its MAIL, RCPT and DATA share a write
+        // with the end of data before them rather than costing a round trip
+        Domain& domain = *connection.domain;
+        while (connection.ready && !connection.quitting && !domain.ready.empty()
+            && connection.inFlight < (connection.pipelining ? 2 : 1)) {
+            Message& message = *domain.ready.front();
+            domain.ready.pop_front();
+            assign(connection, message);
+        }
+
+        while (!connection.steps.empty() && !connection.barrier) {
+            Step step = connection.steps.front();
+            if (step.expect == Expect::Body) {
+                if (!step.message->dataAccepted) break;
+                appendStuffed(connection.out, step.message->failure == 0 ? std::string_view(step.message->body) : std::string_view());
+                std::string().swap(step.message->body);
+            }
+            else {
+                // Without PIPELINING every command waits for the previous reply
+                if (!connection.pipelining && !connection.awaiting.empty()) break;
+                switch (step.expect) {
+                case Expect::Ehlo: connection.out += "EHLO " + m_options.heloName + "\r\n"; break;
+                case Expect::Helo: connection.out += "HELO " + m_options.heloName + "\r\n"; break;
+                case Expect::Mail: connection.out += "MAIL FROM:<" + step.message->sender + ">\r\n"; break;
+                case Expect::Rcpt: connection.out += "RCPT TO:<" + step.message->recipient + ">\r\n"; break;
+                case Expect::Data: connection.out += "DATA\r\n"; break;
+                case Expect::Rset: connection.out += "RSET\r\n"; break;
+                case Expect::Quit: connection.out += "QUIT\r\n"; break;
+                default: break;
+                }
+                // RFC 2920 3.1: EHLO and DATA end a group; nothing follows until they are answered
+                connection.barrier = step.expect == Expect::Ehlo || step.expect == Expect::Helo
+                    || step.expect == Expect::Data || step.expect == Expect::Quit;
+            }
+            connection.awaiting.push_back(step);
+            connection.steps.pop_front();
+        }
+
+        if (!connection.connected || connection.outOffset == connection.out.size()) {
+            armDeadline(connection);
+            return;
+        }
+        if (!flush(connection)) {
+            failConnection(connection, "connection lost");
+            return;
+        }
+        armDeadline(connection);
+    }
+
+
+
+    bool DeliveryAgent::flush(Connection& connection) {
+        while (connection.outOffset < connection.out.size()) {
+            ssize_t sent = send(connection.socket, connection.out.data() + connection.outOffset,
+                connection.out.size() - connection.outOffset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            connection.outOffset += static_cast<size_t>(sent);
+        }
+        connection.out.clear();
+        connection.outOffset = 0;
+        return true;
+    }
+
+
+
+    bool DeliveryAgent::readReplies(Connection& connection) {
+        char buffer[4096];
+        bool open = true;
+
+        while (true) {
+            ssize_t bytesRead = recv(connection.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead > 0) {
+                connection.in.append(buffer, static_cast<size_t>(bytesRead));
+                continue;
+            }
+            if (bytesRead < 0 && errno == EINTR) continue;
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            open = false; // Closed by the server or hard error; answer what came before
+            break;
+        }
+
+        size_t offset = 0;
+        size_t end;
+        while (!connection.closed && (end = connection.in.find('\n', offset)) != std::string::npos) {
+            std::string_view line(connection.in.data() + offset, end - offset);
+            offset = end + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.size() < 3 || !isdigit(static_cast<unsigned char>(line[0]))
+                || !isdigit(static_cast<unsigned char>(line[1])) || !isdigit(static_cast<unsigned char>(line[2]))) {
+                return false;
+            }
+            int code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+            std::string_view text = line.size() > 4 ? line.substr(4) : std::string_view();
+            if (!connection.replyText.empty()) connection.replyText += '\n';
+            connection.replyText.append(text.data(), text.size());
+            if (line.size() > 3 && line[3] == '-') continue;
+
+            if (connection.awaiting.empty()) return false;  // Unsolicited
+            onReply(connection, code);
+            connection.replyText.clear();
+        }
+        if (connection.closed) return true;
+        connection.in.erase(0, offset);
+        if (connection.in.size() > MAX_REPLY) return false;
+
+        if (!connection.awaiting.empty() || !connection.steps.empty()) pump(connection);
+        return open;
+    }
+
+
+
+    void DeliveryAgent::onReply(Connection& connection, int code) {
+        Step step = connection.awaiting.front();
+        connection.awaiting.pop_front();
+        bool positive = code / 100 == 2;
+
+        switch (step.expect) {
+        case Expect::Greeting:
+            connection.barrier = false;
+            if (!positive) {
+                failConnection(connection, connection.replyText);
+                return;
+            }
+            connection.steps.push_front({ Expect::Ehlo, nullptr });
+            break;
+
+        case Expect::Ehlo:
+        case Expect::Helo:
+            connection.barrier = false;
+            if (!positive) {
+                // RFC 5321 3.2: a server that does not know EHLO gets HELO
+                if (step.expect == Expect::Ehlo && code / 100 == 5) {
+                    connection.steps.push_front({ Expect::Helo, nullptr });
+                    break;
+                }
+                failConnection(connection, connection.replyText);
+                return;
+            }
+            if (step.expect == Expect::Ehlo && m_options.pipelining) {
+                // Keywords follow the greeting line, one per line
+                size_t line = connection.replyText.find('\n');
+                while (line != std::string::npos) {
+                    std::string keyword = lowercase(std::string_view(connection.replyText).substr(line + 1, 10));
+                    if (keyword == "pipelining") connection.pipelining = true;
+                    line = connection.replyText.find('\n', line + 1);
+                }
+            }
+            connection.ready = true;
+            connection.domain->failedConnects = 0;
+            markDirty(*connection.domain);
+            break;
+
+        case Expect::Mail:
+        case Expect::Rcpt:
+            if (!positive && step.message->failure == 0) {
+                step.message->failure = code;
+                step.message->reason = connection.replyText;
+            }
+            break;
+
+        case Expect::Data:
+            connection.barrier = false;
+            if (code == 354) {
+                step.message->dataAccepted = true;
+                break;
+            }
+            if (step.message->failure == 0) {
+                step.message->failure = code;
+                step.message->reason = connection.replyText;
+            }
+            // No end of data follows; the transaction is reset instead
+            if (!connection.steps.empty() && connection.steps.front().message == step.message) connection.steps.pop_front();
+            connection.steps.push_front({ Expect::Rset, nullptr });
+            complete(connection, *step.message);
+            break;
+
+        case Expect::Body:
+            if (!positive && step.message->failure == 0) {
+                step.message->failure = code;
+                step.message->reason = connection.replyText;
+            }
+            complete(connection, *step.message);
+            break;
+
+        case Expect::Rset:
+            break;
+
+        case Expect::Quit:
+            closeConnection(connection);
+            return;
+        }
+
+        // Drained: leave if the connection is used up, else it waits for more
+        if (connection.ready && connection.inFlight == 0 && connection.steps.empty() && connection.awaiting.empty()) {
+            if (connection.quitting) {
+                connection.steps.push_back({ Expect::Quit, nullptr });
+            }
+            else {
+                markDirty(*connection.domain);
+            }
+        }
+    }
+
+
+
+    void DeliveryAgent::complete(Connection& connection, Message& message) {
+        --connection.inFlight;
+        Metrics::observeSince(Metrics::Histogram::DeliveryTransaction, message.started);
+        if (message.failure == 0) {
+            finish(message, Outcome::Delivered, std::string_view());
+        }
+        else {
+            std::string reason = std::to_string(message.failure) + " " + message.reason;
+            finish(message, message.failure / 100 == 5 ? Outcome::Permanent : Outcome::Temporary, reason);
+        }
+        if (!connection.quitting) markDirty(*connection.domain);
+    }
+
+
+
+    void DeliveryAgent::finish(Message& message, Outcome outcome, std::string_view reason) {
+        ++message.attempts;
+        std::string().swap(message.body);
+
+        if (outcome == Outcome::Delivered) {
+            Metrics::add(Metrics::Counter::DeliveryDelivered);
+            recordStatus(message, DeliveryStatus::Delivered);
+            m_messages.erase(message.id);
+            return;
+        }
+
+        if (outcome == Outcome::Temporary && message.attempts < m_options.maxAttempts) {
+            Metrics::add(Metrics::Counter::DeliveryDeferred);
+            Log::printf(LogLevel::Info, "Delivery of %lld to %s deferred (attempt %d): %.*s",
+                static_cast<long long>(message.id), message.recipient.c_str(), message.attempts,
+                static_cast<int>(reason.size()), reason.data());
+            recordStatus(message, DeliveryStatus::Deferred);
+
+            // retryInitialMs, doubling per attempt up to retryMaxMs
+            uint64_t delay = static_cast<uint64_t>(std::max(m_options.retryInitialMs, 1));
+            for (int i = 1; i < message.attempts && delay < static_cast<uint64_t>(m_options.retryMaxMs); ++i) delay *= 2;
+            delay = std::min(delay, static_cast<uint64_t>(std::max(m_options.retryMaxMs, 1)));
+            m_wheel.schedule(message.retry, nowMs(), delay);
+            return;
+        }
+
+        Metrics::add(Metrics::Counter::DeliveryFailed);
+        Log::printf(LogLevel::Warning, "Delivery of %lld to %s failed after %d attempts: %.*s",
+            static_cast<long long>(message.id), message.recipient.c_str(), message.attempts,
+            static_cast<int>(reason.size()), reason.data());
+        recordStatus(message, DeliveryStatus::Failed);
+        m_messages.erase(message.id);
+    }
+
+
+
+    void DeliveryAgent::failConnection(Connection& connection, std::string_view reason) {
+        if (connection.closed) return;
+        Domain& domain = *connection.domain;
+        bool wasReady = connection.ready;
+
+        // Whatever was assigned goes back with a failed attempt; a message
+        // whose end of data was written may have been delivered, and will be
+        // again (at least once)
+        std::vector<Message*> lost;
+        for (const Step& step : connection.awaiting) {
+            if (step.message != nullptr && std::find(lost.begin(), lost.end(), step.message) == lost.end()) lost.push_back(step.message);
+        }
+        for (const Step& step : connection.steps) {
+            if (step.message != nullptr && std::find(lost.begin(), lost.end(), step.message) == lost.end()) lost.push_back(step.message);
+        }
+        std::string why(reason);
+        closeConnection(connection);
+
+        if (!wasReady) {
+            connectFailed(domain, why);
+        }
+        else if (!lost.empty()) {
+            Log::printf(LogLevel::Warning, "Delivery to %s: %s", domain.name.c_str(), why.c_str());
+        }
+        for (Message* message : lost) {
+            finish(*message, Outcome::Temporary, why);
+        }
+    }
+
+
+
+    void DeliveryAgent::closeConnection(Connection& connection) {
+        if (connection.closed) return;
+        connection.closed = true;
+        m_wheel.cancel(connection.deadline);
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, connection.socket, nullptr);
+        close(connection.socket);
+        connection.steps.clear();
+        connection.awaiting.clear();
+
+        Domain& domain = *connection.domain;
+        domain.pool.erase(std::remove(domain.pool.begin(), domain.pool.end(), &connection), domain.pool.end());
+        if (!domain.ready.empty()) markDirty(domain);
+
+        // Freed once the event being handled is done with it
+        auto it = m_connections.find(connection.key);
+        m_closed.push_back(std::move(it->second));
+        m_connections.erase(it);
+    }
+
+
+
+    void DeliveryAgent::recordStatus(const Message& message, const char* status) {
+        m_statusBuffer.push_back({ message.id, message.recipient, status, message.attempts });
+        if (m_statusBuffer.size() >= m_options.statusBatch) {
+            flushStatus();
+        }
+        else if (!m_statusTimer.pending()) {
+            m_wheel.schedule(m_statusTimer, nowMs(), static_cast<uint64_t>(std::max(m_options.statusFlushMs, 0)));
+        }
+    }
+
+
+
+    void DeliveryAgent::flushStatus() {
+        m_wheel.cancel(m_statusTimer);
+        if (m_statusBuffer.empty()) return;
+
+        // A lost write leaves the rows queued; they go out again after a restart
+        m_store.updateStatus(std::move(m_statusBuffer), [](bool durable) {
+            if (!durable) Log::printf(LogLevel::Error, "Delivery status could not be written back");
+            });
+        m_statusBuffer.clear();
+    }
+
+
+
+    void DeliveryAgent::resolveLoop() {
+        for (;;) {
+            std::string domain;
+            {
+                std::unique_lock<std::mutex> lock(m_resolveMutex);
+                m_resolveWake.wait(lock, [this] { return m_stop || !m_toResolve.empty(); });
+                if (m_stop) return;
+                domain = std::move(m_toResolve.front());
+                m_toResolve.pop_front();
+            }
+
+            Resolution resolution = resolve(domain, m_options);
+            {
+                std::lock_guard<std::mutex> lock(m_submitMutex);
+                m_resolved.push_back(std::move(resolution));
+            }
+            wake();
+        }
+    }
+
+
+
+    DeliveryAgent::Resolution DeliveryAgent::resolve(const std::string& domain, const DeliveryOptions& options) {
+        Resolution resolution;
+        resolution.domain = domain;
+        std::string port = std::to_string(options.port);
+
+        // Configured routes, then the smarthost, then DNS
+        auto route = options.routes.find(domain);
+        if (route != options.routes.end()) {
+            std::string host;
+            if (!splitRoute(route->second, host, port)) {
+                Log::printf(LogLevel::Error, "Delivery route for %s is not host:port: %s", domain.c_str(), route->second.c_str());
+                return resolution;
+            }
+            addressesOf(host, port, resolution.addresses);
+            return resolution;
+        }
+        if (!options.relayHost.empty()) {
+            addressesOf(options.relayHost, port, resolution.addresses);
+            return resolution;
+        }
+
+        // An address literal ("[192.0.2.1]") is the destination itself
+        if (domain.size() > 2 && domain.front() == '[' && domain.back() == ']') {
+            std::string literal = domain.substr(1, domain.size() - 2);
+            if (literal.compare(0, 5, "ipv6:") == 0) literal = literal.substr(5);
+            resolution.permanent = addressesOf(literal, port, resolution.addresses) == Lookup::Missing;
+            return resolution;
+        }
+
+        std::vector<std::string> hosts;
+        Lookup lookup = mxHosts(domain, hosts);
+        if (lookup != Lookup::Found) {
+            resolution.permanent = lookup == Lookup::Missing;
+            return resolution;
+        }
+        if (hosts.size() == 1 && hosts[0].empty()) {
+            resolution.permanent = true;
+            return resolution;
+        }
+        if (hosts.empty()) {
+            resolution.permanent = addressesOf(domain, port, resolution.addresses) == Lookup::Missing;
+            return resolution;
+        }
+        for (const std::string& host : hosts) {
+            addressesOf(host, port, resolution.addresses);
+        }
+        return resolution;
+    }
+}
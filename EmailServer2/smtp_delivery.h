@@ -0,0 +1,197 @@
+#ifndef INCLUDED_SMTP_DELIVERY_LINUX
+#define INCLUDED_SMTP_DELIVERY_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <sys/socket.h>
+#include "smtp_storage.h"
+#include "smtp_mailbox.h"
+#include "smtp_timer_wheel.h"
+
+namespace smtp {
+    struct DeliveryOptions {
+        bool enabled = false;                   // Relays every stored message to its recipient's domain
+        std::string heloName = "localhost";     // EHLO argument
+        std::map<std::string, std::string> routes;  // Domain -> "host:port", ahead of relayHost and MX lookup
+        std::string relayHost;                  // Smarthost for every other domain; empty: the domain's MX hosts
+        int port = 25;                          // Of relayHost and MX hosts
+        int connectionsPerDomain = 2;           // Open at once to one destination
+        int messagesPerConnection = 100;        // Then QUIT and reconnect
+        bool pipelining = true;                 // RFC 2920, where the server offers it
+        int connectTimeoutMs = 30000;
+        int replyTimeoutMs = 300000;            // RFC 5321 4.5.3.2: five minutes for most replies
+        int idleTimeoutMs = 5000;               // A pooled connection with nothing to send is closed after this
+        int retryInitialMs = 60000;             // Wait after the first failed attempt; doubles after each
+        int retryMaxMs = 4 * 3600 * 1000;
+        int maxAttempts = 12;                   // Attempts before a temporary failure becomes FAILED
+        size_t statusBatch = 256;               // Status changes per MailStore::updateStatus
+        int statusFlushMs = 100;                // Longest a status change waits for its batch to fill
+    };
+
+    // Outbound delivery of the Emails rows left QUEUED by the receiving side.
+    // One I/O thread owns everything: rows reach it from the MailStore writers
+    // as they commit (and, once at start, from the queue index), wait in a
+    // queue per recipient domain, and go out over a bounded pool of reusable
+    // connections per domain, several messages per connection. Where the
+    // server offers PIPELINING, MAIL, RCPT and DATA leave in one write and the
+    // next transaction follows the end-of-data line without waiting for its
+    // reply, so a message costs one round trip instead of four.
+    //
+    // A temporary failure (4xx, a lost connection, an unreachable domain)
+    // schedules the row again on a timing wheel after an exponentially
+    // growing wait; nothing polls the table. Status changes (DELIVERED,
+    // DEFERRED, FAILED, with the attempt count) are written back through
+    // MailStore in batches. Delivery is at least once: a connection lost
+    // after the end-of-data line is retried.
+    class DeliveryAgent {
+    public:
+        DeliveryAgent(const DeliveryOptions& options, MailStore& store, const std::string& databasePath, size_t shards);
+        ~DeliveryAgent();   // Stops delivering; rows in flight stay queued and status changes made so far are written
+
+    private:
+        struct Domain;
+
+        struct Connection;
+
+        struct Message {
+            int64_t id;
+            std::string recipient;
+            Domain* domain = nullptr;
+            int attempts = 0;
+            Timer retry;
+
+            // While assigned to a connection
+            std::string sender;
+            std::string body;           // Released once written
+            int failure = 0;            // First negative reply of the transaction
+            std::string reason;         // Its text
+            bool dataAccepted = false;  // 354 came back
+            uint64_t started = 0;       // Metrics::now() when MAIL was written
+        };
+
+        // One destination: resolved from routes, relayHost or MX
+        struct Address {
+            sockaddr_storage address;
+            socklen_t length;
+        };
+
+        struct Domain {
+            std::string name;
+            std::deque<Message*> ready;         // Due now, waiting for a connection
+            std::vector<Address> addresses;     // Empty until resolved; dropped when none answers
+            size_t nextAddress = 0;
+            bool resolving = false;
+            std::vector<Connection*> pool;      // Open or opening
+            size_t failedConnects = 0;          // In a row, across its addresses
+            bool dirty = false;                 // In m_dirty
+        };
+
+        enum class Expect { Greeting, Ehlo, Helo, Mail, Rcpt, Data, Body, Rset, Quit };
+
+        struct Step {
+            Expect expect;
+            Message* message;
+        };
+
+        struct Connection {
+            uint64_t key;
+            int socket = -1;
+            Domain* domain;
+            bool connected = false;
+            bool ready = false;             // Greeted and introduced
+            bool pipelining = false;        // Offered by the server and allowed
+            bool barrier = true;            // Waiting for a reply nothing may be pipelined behind
+            bool quitting = false;          // Takes no more messages
+            bool closed = false;
+            std::deque<Step> steps;         // Not yet written
+            std::deque<Step> awaiting;      // Written, reply not yet read
+            std::string out;
+            size_t outOffset = 0;
+            std::string in;
+            std::string replyText;          // Lines of the multi-line reply being read
+            int transactions = 0;           // Started on this connection
+            int inFlight = 0;               // Messages assigned and not finished
+            Timer deadline;
+        };
+
+        // A resolver answer, handed to the I/O thread
+        struct Resolution {
+            std::string domain;
+            std::vector<Address> addresses;
+            bool permanent = false;         // The domain accepts no mail
+        };
+
+        enum class Outcome { Delivered, Temporary, Permanent };
+
+        void run();
+        void wake();
+        void acceptSubmissions();
+        void addMessage(int64_t id, std::string_view recipient, int attempts);
+        void onResolved(Resolution& resolution);
+        void markDirty(Domain& domain);
+        void deliverReady(Domain& domain);
+        bool assign(Connection& connection, Message& message);
+        void connect(Domain& domain);
+        void connectFailed(Domain& domain, std::string_view reason);
+        void onEvent(uint64_t key, uint32_t events);
+        void onDeadline(uint64_t key);
+        void pump(Connection& connection);
+        bool flush(Connection& connection);
+        bool readReplies(Connection& connection);
+        void onReply(Connection& connection, int code);
+        void complete(Connection& connection, Message& message);
+        void finish(Message& message, Outcome outcome, std::string_view reason);
+        void failConnection(Connection& connection, std::string_view reason);
+        void closeConnection(Connection& connection);
+        void armDeadline(Connection& connection);
+        void deferDomain(Domain& domain, Outcome outcome, std::string_view reason);
+        void recordStatus(const Message& message, const char* status);
+        void flushStatus();
+        void resolveLoop();
+        static Resolution resolve(const std::string& domain, const DeliveryOptions& options);
+        static uint64_t nowMs();
+
+        DeliveryOptions m_options;
+        MailStore& m_store;
+        MailboxReader m_reader;
+        int m_epoll = -1;
+        int m_wakeFd = -1;
+        std::atomic<bool> m_stop{ false };
+        std::thread m_thread;
+
+        // Handed over by the writers and the resolver, drained by the I/O thread
+        std::mutex m_submitMutex;
+        std::vector<QueuedMessage> m_submitted;
+        std::vector<QueuedMessage> m_accepting;
+        std::vector<Resolution> m_resolved;
+
+        // Names to resolve, for the resolver thread (lookups block)
+        std::mutex m_resolveMutex;
+        std::condition_variable m_resolveWake;
+        std::deque<std::string> m_toResolve;
+        std::thread m_resolver;
+
+        // Owned by the I/O thread
+        TimerWheel m_wheel;
+        std::unordered_map<int64_t, std::unique_ptr<Message>> m_messages;
+        std::unordered_map<std::string, std::unique_ptr<Domain>> m_domains;
+        std::unordered_map<uint64_t, std::unique_ptr<Connection>> m_connections;
+        std::vector<std::unique_ptr<Connection>> m_closed;     // Freed after the event that closed them
+        std::vector<Domain*> m_dirty;
+        uint64_t m_nextKey = 1;
+        std::vector<StatusUpdate> m_statusBuffer;
+        Timer m_statusTimer;
+    };
+}
+
+#endif
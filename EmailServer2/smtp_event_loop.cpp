@@ -0,0 +1,324 @@
+#include "smtp_event_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+
+namespace smtp {
+
+    namespace {
+        const int MAX_EVENTS = 256;
+    }
+
+
+
+    EventLoop::EventLoop(TcpServer& server, int listenSocket, int core)
+        : m_server(server), m_listenSocket(listenSocket), m_core(core),
+        m_timers(static_cast<uint64_t>(std::max(server.m_config.timeouts.tickMs, 1)), Metrics::now() / 1000000) {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll < 0) {
+            m_server.exitWithError("Failed to create epoll instance");
+        }
+
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_wakeFd < 0) {
+            m_server.exitWithError("Failed to create eventfd");
+        }
+
+        // The listening socket is level-triggered so a loop that stops accepting
+        // early (EMFILE, shutdown) does not lose the wakeup for queued connections
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &m_listenSocket;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_listenSocket, &ev) < 0) {
+            m_server.exitWithError("Failed to register listening socket with epoll");
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &m_wakeFd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev) < 0) {
+            m_server.exitWithError("Failed to register eventfd with epoll");
+        }
+    }
+
+
+
+    EventLoop::~EventLoop() {
+        stop();
+        join();
+        for (auto& session : m_sessions) {
+            if (session) m_server.closeTransport(*session);
+        }
+        m_sessions.clear();
+        close(m_wakeFd);
+        close(m_epoll);
+    }
+
+
+
+    void EventLoop::start() {
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    void EventLoop::stop() {
+        m_stop = true;
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void EventLoop::join() {
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+
+
+    void EventLoop::run() {
+        struct epoll_event events[MAX_EVENTS];
+        m_server.pinToCore(m_core);
+
+        while (!m_stop) {
+            int ready = epoll_wait(m_epoll, events, MAX_EVENTS, m_timers.timeoutMs(Metrics::now() / 1000000));
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                m_server.exitWithError("epoll_wait failed");
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                void* tag = events[i].data.ptr;
+                if (tag == &m_wakeFd) {
+                    runCompletions();
+                    continue;
+                }
+                if (tag == &m_listenSocket) {
+                    acceptClients();
+                    continue;
+                }
+
+                // A store completion earlier in this batch may have closed it
+                SmtpSession& session = *static_cast<SmtpSession*>(tag);
+                if (session.socket < 0) continue;
+                uint32_t flags = events[i].events;
+
+                if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    onReadable(session);
+                }
+                if (!session.closing && (flags & EPOLLOUT)) {
+                    // A handshake waiting to write continues, then drains the input behind it
+                    if (session.tlsPending) onReadable(session);
+                    else flush(session);
+                }
+                finishEvent(session);
+            }
+
+            m_timers.advance(Metrics::now() / 1000000);
+            for (SmtpSession* session : m_expired) finishEvent(*session);
+            m_expired.clear();
+
+            for (auto& session : m_closed) m_sessionPool.release(std::move(session));
+            m_closed.clear();
+        }
+    }
+
+
+
+    void EventLoop::acceptClients() {
+        while (!m_stop) {
+            struct sockaddr_storage clientAddr;
+            socklen_t clientAddrLen = sizeof(clientAddr);
+            int clientSocket = accept4(m_listenSocket, (struct sockaddr*)&clientAddr, &clientAddrLen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    m_server.log("Failed to accept connection: " + std::string(strerror(errno)));
+                }
+                return;
+            }
+
+            uint64_t acceptedAt = Metrics::now();
+            if (!m_server.rateLimitCheck((struct sockaddr*)&clientAddr)) {
+                m_server.refuseClient(clientSocket);
+                continue;
+            }
+            Metrics::add(Metrics::Counter::ConnectionsAccepted);
+
+            std::unique_ptr<SmtpSession> session = m_sessionPool.acquire();
+            session->socket = clientSocket;
+            session->loop = this;
+            session->acceptedAt = acceptedAt;
+
+            // Register for both directions once; with EPOLLET we are only told
+            // about transitions, so the session never has to re-arm
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = session.get();
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, clientSocket, &ev) < 0) {
+                m_server.log("Failed to register client with epoll: " + std::string(strerror(errno)));
+                close(clientSocket);
+                m_sessionPool.release(std::move(session));
+                continue;
+            }
+
+            SmtpSession& ref = *session;
+            if (static_cast<size_t>(clientSocket) >= m_sessions.size()) m_sessions.resize(clientSocket + 1);
+            m_sessions[clientSocket] = std::move(session);
+
+            // Two pointers: stored inline by std::function, no allocation
+            SmtpSession* target = &ref;
+            ref.timeout.fire = [this, target] { expire(*target); };
+
+            m_server.beginSession(ref);
+            flush(ref);
+            armTimeout(ref);
+            Metrics::observeSince(Metrics::Histogram::AcceptToBanner, acceptedAt);
+        }
+    }
+
+
+
+    void EventLoop::onReadable(SmtpSession& session) {
+        // Leave input in the kernel while a message is being checked and committed;
+        // runCompletions drains it afterwards
+        if (session.messagePending) return;
+
+        // Edge-triggered: drain the socket until EAGAIN or we miss the edge
+        // (with TLS, until OpenSSL has no buffered record left either)
+        while (!session.closing) {
+            // After STARTTLS nothing is read as plaintext again
+            if (session.tlsPending && !advanceTls(session)) return;
+
+            ssize_t bytesRead = m_server.receive(session);
+            if (bytesRead > 0) {
+                m_server.processInput(session);
+                continue;
+            }
+            if (bytesRead < 0) break;
+
+            // Orderly shutdown or hard error: nothing more will arrive
+            session.closing = true;
+            session.replies.clear();
+            return;
+        }
+        flush(session);
+    }
+
+
+
+    bool EventLoop::flush(SmtpSession& session) {
+        // Everything queued while draining the socket leaves in one sendmsg()
+        ReplyQueue::Result result = m_server.flushReplies(session);
+        if (result == ReplyQueue::Result::Error) {
+            session.closing = true;
+            session.replies.clear();
+            return false;
+        }
+        return result == ReplyQueue::Result::Done; // WouldBlock resumes on EPOLLOUT
+    }
+
+
+
+    bool EventLoop::advanceTls(SmtpSession& session) {
+        // The 220 goes out in plaintext; the client starts the handshake once it sees it
+        if (!flush(session)) return false;
+
+        // Want* resumes on the next EPOLLIN or EPOLLOUT edge
+        return m_server.continueTls(session) == TlsStream::Result::Done;
+    }
+
+
+
+    void EventLoop::messageCompleted(SmtpSession& session, MessageOutcome outcome) {
+        {
+            std::lock_guard<std::mutex> lock(m_completionMutex);
+            m_completions.push_back({ &session, outcome });
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void EventLoop::runCompletions() {
+        uint64_t count;
+        ssize_t ignored = read(m_wakeFd, &count, sizeof(count));
+        (void)ignored;
+
+        m_draining.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_completionMutex);
+            m_draining.swap(m_completions);
+        }
+
+        for (const Completion& completion : m_draining) {
+            SmtpSession& session = *completion.session;
+            m_server.completeMessage(session, completion.outcome);
+
+            // Pipelined commands may already be buffered, more may wait in the kernel
+            m_server.processInput(session);
+            onReadable(session);
+            flush(session);
+            finishEvent(session);
+        }
+    }
+
+
+
+    void EventLoop::finishEvent(SmtpSession& session) {
+        // A session the spam client or writer still references is closed once its message completes
+        if (session.closing && session.replies.empty() && !session.messagePending) {
+            closeSession(session);
+            return;
+        }
+
+        // The client's clock restarts; while a message is being checked and
+        // committed it is the server that is busy
+        if (session.messagePending) m_timers.cancel(session.timeout);
+        else armTimeout(session);
+    }
+
+
+
+    void EventLoop::armTimeout(SmtpSession& session) {
+        uint64_t now = Metrics::now() / 1000000;
+        uint64_t delay;
+        if (m_server.nextDeadline(session, now, delay)) m_timers.schedule(session.timeout, now, delay);
+        else m_timers.cancel(session.timeout);
+    }
+
+
+
+    void EventLoop::expire(SmtpSession& session) {
+        // 421 if the socket takes it now; a client that stopped reading gets nothing
+        m_server.timeOut(session);
+        flush(session);
+        session.replies.clear();
+        m_expired.push_back(&session);
+    }
+
+
+
+    void EventLoop::closeSession(SmtpSession& session) {
+        int socket = session.socket;
+        m_timers.cancel(session.timeout);
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, socket, nullptr);
+        m_server.closeTransport(session);
+        Metrics::add(Metrics::Counter::SessionsClosed);
+
+        // Parked until the end of the batch; the descriptor number is free for the next accept
+        session.socket = -1;
+        m_closed.push_back(std::move(m_sessions[socket]));
+    }
+}
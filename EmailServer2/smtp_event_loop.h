@@ -0,0 +1,79 @@
+#ifndef INCLUDED_SMTP_EVENT_LOOP_LINUX
+#define INCLUDED_SMTP_EVENT_LOOP_LINUX
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "smtp_server.h"
+#include "smtp_timer_wheel.h"
+
+namespace smtp {
+    // One edge-triggered epoll reactor on its own thread. Every loop waits on
+    // the shared listening socket (EPOLLEXCLUSIVE, so a new connection wakes
+    // a single loop), or on its own SO_REUSEPORT listener when the server is
+    // configured for it, and owns each session it accepts until that session closes.
+    // Session deadlines live on the loop's own timing wheel: re-arming one
+    // after every event is an O(1) list move, and epoll_wait sleeps until the
+    // earliest.
+    class EventLoop {
+    public:
+        EventLoop(TcpServer& server, int listenSocket, int core = -1); // core >= 0 pins the loop thread
+        ~EventLoop();
+
+        void start();
+        void stop();
+        void join();
+
+        // Called from the spam client or storage writer thread; the session resumes on this loop
+        void messageCompleted(SmtpSession& session, MessageOutcome outcome);
+
+    private:
+        void run();
+        void acceptClients();
+        void onReadable(SmtpSession& session);
+        bool flush(SmtpSession& session);
+        bool advanceTls(SmtpSession& session);
+        void closeSession(SmtpSession& session);
+        void runCompletions();
+        void finishEvent(SmtpSession& session);
+        void armTimeout(SmtpSession& session);
+        void expire(SmtpSession& session);
+
+        struct Completion {
+            SmtpSession* session;
+            MessageOutcome outcome;
+        };
+
+        TcpServer& m_server;
+        int m_listenSocket;
+        int m_core;
+        int m_epoll;
+        int m_wakeFd;   // eventfd that interrupts epoll_wait for stop() and store completions
+        std::thread m_thread;
+        std::atomic<bool> m_stop{ false };
+
+        // Handed over by other threads, drained after each wakeup. The two
+        // vectors trade places, so both keep their capacity.
+        std::mutex m_completionMutex;
+        std::vector<Completion> m_completions;
+        std::vector<Completion> m_draining;
+
+        // Before the sessions, whose timers it must outlive
+        TimerWheel m_timers;
+        std::vector<SmtpSession*> m_expired;    // Closed after the wheel has run, not from inside their own timer
+
+        // Sessions owned by this loop, indexed by socket (descriptors are
+        // small and dense), and recycled ones waiting for the next accept
+        std::vector<std::unique_ptr<SmtpSession>> m_sessions;
+        SessionPool m_sessionPool;
+
+        // Closed during the current epoll_wait batch. Later events in the
+        // batch may still point at them, so they reach the pool (to be
+        // reused or destroyed) only once the batch is done.
+        std::vector<std::unique_ptr<SmtpSession>> m_closed;
+    };
+}
+
+#endif
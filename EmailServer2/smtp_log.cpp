@@ -0,0 +1,399 @@
+#include "smtp_log.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+namespace smtp {
+
+    namespace {
+        const size_t RECORD_SIZE = 256;
+
+        const char* const LEVEL_NAMES[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+        uint64_t realtimeNanos() {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+        }
+
+        // Only used for repeat windows: a few milliseconds of slack are fine
+        uint64_t coarseMillis() {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            return static_cast<uint64_t>(now.tv_sec) * 1000ull + static_cast<uint64_t>(now.tv_nsec) / 1000000ull;
+        }
+
+        void writeAll(int fd, const std::string& data) {
+            size_t written = 0;
+            while (written < data.size()) {
+                ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return; // Nowhere left to report it
+                written += static_cast<size_t>(n);
+            }
+        }
+    }
+
+
+
+    struct Log::Record {
+        uint64_t timeNanos;
+        uint32_t thread;
+        uint16_t length;
+        uint8_t level;
+        char text[RECORD_SIZE - 15];
+    };
+
+    // Single producer (the leasing thread), single consumer (whoever holds
+    // the writer's drain lock)
+    struct Log::Ring {
+        std::unique_ptr<Record[]> records;
+        size_t mask = 0;
+        alignas(64) std::atomic<uint64_t> head{ 0 };    // Next slot to fill
+        alignas(64) std::atomic<uint64_t> tail{ 0 };    // Next slot to format
+        std::atomic<uint64_t> dropped{ 0 };
+        uint64_t droppedReported = 0;                   // Consumer only
+
+        // Producer only
+        uint32_t thread = 0;
+        const Record* last = nullptr;                   // Stays intact until the next push
+        size_t lastLength = 0;                          // Before truncation
+        LogLevel lastLevel = LogLevel::Info;
+        uint64_t windowStart = 0;
+        int repeats = 0;
+        uint64_t suppressed = 0;
+    };
+
+
+
+    // Returns the ring to the writer when its thread exits; records still in
+    // it are written out, and the next new thread reuses it
+    struct Log::Lease {
+        Ring* ring = nullptr;
+        ~Lease();
+    };
+
+
+
+    struct Log::Writer {
+        Writer();
+        void run();
+        void drain();
+        Ring* acquireRing();
+        void releaseRing(Ring* ring);
+
+        std::mutex mutex;               // Rings, idle and options
+        std::vector<Ring*> rings;       // Every ring ever handed out
+        std::vector<Ring*> idle;        // Rings whose thread has exited
+        LogOptions options;
+        std::atomic<int> repeatWindowMs;
+        std::atomic<int> maxRepeats;
+
+        std::mutex wakeMutex;
+        std::condition_variable wake;
+
+        // Consumer side, under drainMutex
+        std::mutex drainMutex;
+        std::vector<Ring*> snapshot;
+        std::vector<uint64_t> heads;
+        std::vector<Record*> pending;
+        std::string output, errors;
+    };
+
+
+
+    std::atomic<int> Log::s_minimumLevel{ static_cast<int>(LogLevel::Info) };
+
+
+
+    Log::Writer& Log::writer() {
+        // Never destroyed: threads may log during exit
+        static Writer* instance = [] {
+            Writer* created = new Writer();
+            std::thread([created] { created->run(); }).detach();
+            std::atexit([] { Log::flush(); });
+            return created;
+        }();
+        return *instance;
+    }
+
+
+
+    Log::Writer::Writer()
+        : repeatWindowMs(options.repeatWindowMs), maxRepeats(options.maxRepeats) {
+        static_assert(sizeof(Record) == RECORD_SIZE, "records are fixed-size slots");
+    }
+
+
+
+    void Log::configure(const LogOptions& options) {
+        Writer& w = writer();
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.options = options;
+        }
+        w.repeatWindowMs.store(options.repeatWindowMs, std::memory_order_relaxed);
+        w.maxRepeats.store(options.maxRepeats, std::memory_order_relaxed);
+        s_minimumLevel.store(static_cast<int>(options.minimumLevel), std::memory_order_relaxed);
+    }
+
+
+
+    void Log::write(LogLevel level, std::string_view message) {
+        if (!enabled(level)) return;
+        submit(level, message.data(), message.size());
+    }
+
+
+
+    void Log::printf(LogLevel level, const char* format, ...) {
+        if (!enabled(level)) return;
+        char text[sizeof(Record::text) + 1];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (length < 0) return;
+        // Longer than a record: let submit() mark the truncation
+        submit(level, text, static_cast<size_t>(length) < sizeof(text) ? static_cast<size_t>(length) : sizeof(text));
+    }
+
+
+
+    void Log::flush() {
+        writer().drain();
+    }
+
+
+
+    uint64_t Log::dropped() {
+        Writer& w = writer();
+        uint64_t total = 0;
+        std::lock_guard<std::mutex> lock(w.mutex);
+        for (const Ring* ring : w.rings) total += ring->dropped.load(std::memory_order_relaxed);
+        return total;
+    }
+
+
+
+    Log::Ring& Log::local() {
+        thread_local Lease lease;
+        if (lease.ring == nullptr) lease.ring = writer().acquireRing();
+        return *lease.ring;
+    }
+
+
+
+    Log::Lease::~Lease() {
+        if (ring == nullptr) return;
+        // Nobody will log on this thread again to trigger the summary
+        summarizeRepeats(*ring);
+        writer().releaseRing(ring);
+    }
+
+
+
+    void Log::submit(LogLevel level, const char* text, size_t length) {
+        Ring& ring = local();
+        Writer& w = writer();
+
+        // A thread repeating itself (an accept error storm, a dead dependency)
+        // is written a few times per window, then counted
+        uint64_t now = coarseMillis();
+        uint64_t window = static_cast<uint64_t>(w.repeatWindowMs.load(std::memory_order_relaxed));
+        bool repeated = ring.last != nullptr && ring.lastLevel == level && ring.lastLength == length
+            && memcmp(ring.last->text, text, std::min(length, sizeof(ring.last->text))) == 0;
+        if (repeated && now - ring.windowStart < window) {
+            if (++ring.repeats > w.maxRepeats.load(std::memory_order_relaxed)) {
+                ++ring.suppressed;
+                return;
+            }
+        }
+        else {
+            summarizeRepeats(ring);
+            ring.lastLevel = level;
+            ring.windowStart = now;
+            ring.repeats = 1;
+        }
+
+        push(ring, level, text, length);
+    }
+
+
+
+    void Log::summarizeRepeats(Ring& ring) {
+        if (ring.suppressed == 0) return;
+        char note[64];
+        int n = snprintf(note, sizeof(note), "(previous message repeated %llu more times)",
+            static_cast<unsigned long long>(ring.suppressed));
+        ring.suppressed = 0;
+        push(ring, ring.lastLevel, note, static_cast<size_t>(n));
+    }
+
+
+
+    void Log::push(Ring& ring, LogLevel level, const char* text, size_t length) {
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        uint64_t used = head - ring.tail.load(std::memory_order_acquire);
+        if (used > ring.mask) {
+            ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            ring.last = nullptr;
+            return;
+        }
+
+        Record& record = ring.records[head & ring.mask];
+        ring.last = &record;
+        ring.lastLength = length;
+        record.timeNanos = realtimeNanos();
+        record.thread = ring.thread;
+        record.level = static_cast<uint8_t>(level);
+        if (length > sizeof(record.text)) {
+            memcpy(record.text, text, sizeof(record.text) - 3);
+            memcpy(record.text + sizeof(record.text) - 3, "...", 3);
+            length = sizeof(record.text);
+        }
+        else {
+            memcpy(record.text, text, length);
+        }
+        record.length = static_cast<uint16_t>(length);
+        ring.head.store(head + 1, std::memory_order_release);
+
+        // Otherwise the writer picks it up within flushIntervalMs
+        if (level == LogLevel::Error || used + 1 == (ring.mask + 1) / 2) writer().wake.notify_one();
+    }
+
+
+
+    Log::Ring* Log::Writer::acquireRing() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Ring* ring;
+        if (!idle.empty()) {
+            ring = idle.back();
+            idle.pop_back();
+        }
+        else {
+            size_t capacity = 16;
+            while (capacity < options.ringRecords) capacity *= 2;
+            ring = new Ring();
+            ring->records.reset(new Record[capacity]);
+            ring->mask = capacity - 1;
+            rings.push_back(ring);
+        }
+        ring->thread = static_cast<uint32_t>(syscall(SYS_gettid));
+        ring->last = nullptr;
+        ring->repeats = 0;
+        ring->suppressed = 0;
+        return ring;
+    }
+
+
+
+    void Log::Writer::releaseRing(Ring* ring) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(ring);
+    }
+
+
+
+    void Log::Writer::run() {
+        while (true) {
+            int interval;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                interval = options.flushIntervalMs > 0 ? options.flushIntervalMs : 1;
+            }
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                wake.wait_for(lock, std::chrono::milliseconds(interval));
+            }
+            drain();
+        }
+    }
+
+
+
+    void Log::Writer::drain() {
+        std::lock_guard<std::mutex> drainLock(drainMutex);
+
+        int outputFd, errorFd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshot = rings;
+            outputFd = options.outputFd;
+            errorFd = options.errorFd;
+        }
+
+        // Claim what each ring holds now; producers keep appending behind it
+        pending.clear();
+        heads.resize(snapshot.size());
+        uint64_t newlyDropped = 0;
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            Ring& ring = *snapshot[i];
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            heads[i] = ring.head.load(std::memory_order_acquire);
+            for (uint64_t slot = tail; slot < heads[i]; ++slot) pending.push_back(&ring.records[slot & ring.mask]);
+
+            uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+            newlyDropped += dropped - ring.droppedReported;
+            ring.droppedReported = dropped;
+        }
+        if (pending.empty() && newlyDropped == 0) return;
+
+        // Interleave threads in time order
+        std::stable_sort(pending.begin(), pending.end(), [](const Record* a, const Record* b) {
+            return a->timeNanos < b->timeNanos;
+        });
+
+        output.clear();
+        errors.clear();
+        char prefix[64];
+        time_t prefixSecond = -1;
+        char stamp[32] = "";
+        for (const Record* record : pending) {
+            time_t second = static_cast<time_t>(record->timeNanos / 1000000000ull);
+            if (second != prefixSecond) {
+                struct tm utc;
+                gmtime_r(&second, &utc);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+                prefixSecond = second;
+            }
+            int n = snprintf(prefix, sizeof(prefix), "%s.%06uZ %s [%u] ", stamp,
+                static_cast<unsigned>(record->timeNanos % 1000000000ull / 1000), LEVEL_NAMES[record->level], record->thread);
+
+            std::string& target = record->level >= static_cast<uint8_t>(LogLevel::Warning) ? errors : output;
+            size_t length = record->length;
+            while (length > 0 && (record->text[length - 1] == '\n' || record->text[length - 1] == '\r')) --length;
+            target.append(prefix, static_cast<size_t>(n));
+            target.append(record->text, length);
+            target.push_back('\n');
+        }
+
+        // The slots are free once formatted
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            snapshot[i]->tail.store(heads[i], std::memory_order_release);
+        }
+
+        if (newlyDropped > 0) {
+            int n = snprintf(prefix, sizeof(prefix), "log: %llu records dropped (ring full)\n",
+                static_cast<unsigned long long>(newlyDropped));
+            errors.append(prefix, static_cast<size_t>(n));
+        }
+
+        writeAll(outputFd, output);
+        writeAll(errorFd, errors);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef INCLUDED_SMTP_LOG_LINUX
+#define INCLUDED_SMTP_LOG_LINUX
+
+#include <string_view>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace smtp {
+    enum class LogLevel { Debug, Info, Warning, Error };
+
+    struct LogOptions {
+        LogLevel minimumLevel = LogLevel::Info;
+        size_t ringRecords = 512;       // Per thread, rounded up to a power of two
+        int flushIntervalMs = 50;       // Longest a record waits in a ring
+        int repeatWindowMs = 1000;      // Identical lines from one thread within this window...
+        int maxRepeats = 5;             // ...are written this many times, then only counted
+        int outputFd = 1;               // Debug and Info (Warning and Error go to errorFd)
+        int errorFd = 2;
+    };
+
+    // Process-wide asynchronous logger. Each thread writes fixed-size records
+    // into its own single-producer ring (no lock, no syscall, no allocation);
+    // a background thread drains every ring, formats the records and writes
+    // them in batches. A full ring drops the record and counts it, so logging
+    // never blocks the caller. Lines longer than a record are truncated.
+    class Log {
+    public:
+        // Before the first record; later calls only change the level
+        static void configure(const LogOptions& options);
+
+        static bool enabled(LogLevel level) {
+            return static_cast<int>(level) >= s_minimumLevel.load(std::memory_order_relaxed);
+        }
+
+        static void write(LogLevel level, std::string_view message);
+        static void printf(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+        // Writes out everything recorded so far; for shutdown and fatal errors
+        static void flush();
+
+        // Records lost to full rings since start
+        static uint64_t dropped();
+
+    private:
+        struct Record;
+        struct Ring;
+        struct Lease;
+        struct Writer;
+
+        static void submit(LogLevel level, const char* text, size_t length);
+        static void push(Ring& ring, LogLevel level, const char* text, size_t length);
+        static void summarizeRepeats(Ring& ring);
+        static Ring& local();
+        static Writer& writer();
+
+        static std::atomic<int> s_minimumLevel;
+    };
+}
+
+#endif
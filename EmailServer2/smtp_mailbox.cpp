@@ -0,0 +1,273 @@
+#include "smtp_mailbox.h"
+#include "smtp_log.h"
+#include "smtp_shards.h"
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+
+namespace smtp {
+
+    namespace {
+        const char* LIST_COLUMNS = "SELECT id, sender, subject, timestamp, status, spam_score FROM Emails ";
+
+        std::string_view columnText(sqlite3_stmt* stmt, int column) {
+            const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, column));
+            if (text == nullptr) return std::string_view();
+            return std::string_view(text, static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+        }
+
+        std::optional<double> columnScore(sqlite3_stmt* stmt, int column) {
+            if (sqlite3_column_type(stmt, column) == SQLITE_NULL) return std::nullopt;
+            return sqlite3_column_double(stmt, column);
+        }
+    }
+
+
+
+    std::optional<int64_t> parseMessageId(std::string_view text) {
+        if (text.empty()) return std::nullopt;
+        int64_t id = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') return std::nullopt;
+            int64_t digit = c - '0';
+            if (id > (INT64_MAX - digit) / 10) return std::nullopt;
+            id = id * 10 + digit;
+        }
+        return id;
+    }
+
+
+
+    std::string MailboxCursor::encode() const {
+        std::string text = timestamp;
+        for (char& c : text) {
+            if (c == ' ') c = 'T';
+        }
+        return text + "_" + std::to_string(id);
+    }
+
+
+
+    std::optional<MailboxCursor> MailboxCursor::decode(std::string_view text) {
+        size_t separator = text.rfind('_');
+        if (separator == std::string_view::npos || separator == 0 || separator + 1 == text.size()) return std::nullopt;
+
+        MailboxCursor cursor;
+        cursor.timestamp.assign(text.substr(0, separator));
+        for (char& c : cursor.timestamp) {
+            if (c == 'T') c = ' ';
+        }
+        std::optional<int64_t> id = parseMessageId(text.substr(separator + 1));
+        if (!id) return std::nullopt;
+        cursor.id = *id;
+        return cursor;
+    }
+
+
+
+    MailboxReader::MailboxReader(const std::string& databasePath, size_t shards) {
+        shards = std::max<size_t>(shards, 1);
+        for (size_t i = 0; i < shards; ++i) {
+            m_shards.push_back(std::make_unique<Shard>());
+            m_shards.back()->path = shardPath(databasePath, i, shards);
+        }
+    }
+
+
+
+    MailboxReader::~MailboxReader() {
+        for (auto& shard : m_shards) {
+            for (Connection* connection : shard->idle) {
+                closeConnection(connection);
+            }
+        }
+    }
+
+
+
+    ReadResult MailboxReader::listMessages(std::string_view recipient, const MailboxCursor* after, int limit,
+        const std::function<void(const MailboxEntry&)>& row, std::optional<MailboxCursor>& next) {
+        next.reset();
+        int64_t shards = static_cast<int64_t>(m_shards.size());
+        int64_t index = static_cast<int64_t>(shardOf(recipient, m_shards.size()));
+        Shard& shard = *m_shards[index];
+        Connection* connection = acquire(shard);
+        if (connection == nullptr) return ReadResult::Error;
+
+        sqlite3_stmt* stmt = after == nullptr ? connection->firstPage : connection->nextPage;
+        sqlite3_bind_text(stmt, 1, recipient.data(), static_cast<int>(recipient.size()), SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, limit);
+        if (after != nullptr) {
+            sqlite3_bind_text(stmt, 3, after->timestamp.data(), static_cast<int>(after->timestamp.size()), SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 4, after->id / shards);
+        }
+
+        int rows = 0;
+        MailboxEntry entry;
+        MailboxCursor last;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            entry.id = sqlite3_column_int64(stmt, 0) * shards + index;
+            entry.sender = columnText(stmt, 1);
+            entry.subject = columnText(stmt, 2);
+            entry.timestamp = columnText(stmt, 3);
+            entry.status = columnText(stmt, 4);
+            entry.spamScore = columnScore(stmt, 5);
+            row(entry);
+            if (++rows == limit) {
+                // Column views die with the next step
+                last.timestamp.assign(entry.timestamp);
+                last.id = entry.id;
+            }
+        }
+        if (rc == SQLITE_DONE && rows == limit) {
+            next = std::move(last);
+        }
+
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        release(shard, connection);
+        return rc == SQLITE_DONE ? ReadResult::Found : ReadResult::Error;
+    }
+
+
+
+    ReadResult MailboxReader::fetchMessage(int64_t id, const std::function<void(const MailboxMessage&)>& found) {
+        if (id < 0) return ReadResult::NotFound;
+        int64_t shards = static_cast<int64_t>(m_shards.size());
+        Shard& shard = *m_shards[id % shards];
+        Connection* connection = acquire(shard);
+        if (connection == nullptr) return ReadResult::Error;
+
+        sqlite3_stmt* stmt = connection->message;
+        sqlite3_bind_int64(stmt, 1, id / shards);
+        int rc = sqlite3_step(stmt);
+        std::string logged, body;
+        if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 8) != SQLITE_NULL
+            && !segmentLog(shard).read(static_cast<uint64_t>(sqlite3_column_int64(stmt, 8)), logged)) {
+            Log::printf(LogLevel::Error, "Mailbox: body of message %lld missing from %s-log", static_cast<long long>(id), shard.path.c_str());
+            rc = SQLITE_ERROR;
+        }
+        if (rc == SQLITE_ROW) {
+            std::string_view stored = sqlite3_column_type(stmt, 8) != SQLITE_NULL ? std::string_view(logged) : columnText(stmt, 4);
+            if (!shard.decoder.decode(connection->db, sqlite3_column_int(stmt, 9), sqlite3_column_int64(stmt, 10), stored,
+                static_cast<size_t>(sqlite3_column_int64(stmt, 11)), body)) {
+                Log::printf(LogLevel::Error, "Mailbox: body of message %lld does not decode", static_cast<long long>(id));
+                rc = SQLITE_ERROR;
+            }
+        }
+        if (rc == SQLITE_ROW) {
+            MailboxMessage message;
+            message.id = id;
+            message.sender = columnText(stmt, 1);
+            message.recipient = columnText(stmt, 2);
+            message.subject = columnText(stmt, 3);
+            message.body = body;
+            message.bodyBuffer = &body;
+            message.timestamp = columnText(stmt, 5);
+            message.status = columnText(stmt, 6);
+            message.spamScore = columnScore(stmt, 7);
+            found(message);
+        }
+
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        release(shard, connection);
+        if (rc == SQLITE_ROW) return ReadResult::Found;
+        return rc == SQLITE_DONE ? ReadResult::NotFound : ReadResult::Error;
+    }
+
+
+
+    ReadResult MailboxReader::listQueued(const std::function<void(int64_t id, std::string_view recipient, int attempts)>& row) {
+        int64_t shards = static_cast<int64_t>(m_shards.size());
+        for (int64_t index = 0; index < shards; ++index) {
+            Shard& shard = *m_shards[index];
+            Connection* connection = acquire(shard);
+            if (connection == nullptr) return ReadResult::Error;
+
+            // Read once per start, so not kept prepared
+            sqlite3_stmt* stmt = nullptr;
+            int rc = sqlite3_prepare_v2(connection->db, "SELECT id, recipient, attempts FROM Emails "
+                "WHERE status IN ('QUEUED', 'DEFERRED') ORDER BY id;", -1, &stmt, nullptr);
+            while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                row(sqlite3_column_int64(stmt, 0) * shards + index, columnText(stmt, 1), sqlite3_column_int(stmt, 2));
+                rc = SQLITE_OK;
+            }
+            if (rc != SQLITE_DONE) Log::printf(LogLevel::Error, "Mailbox database error: %s", sqlite3_errmsg(connection->db));
+            sqlite3_finalize(stmt);
+            release(shard, connection);
+            if (rc != SQLITE_DONE) return ReadResult::Error;
+        }
+        return ReadResult::Found;
+    }
+
+
+
+    MailboxReader::Connection* MailboxReader::acquire(Shard& shard) {
+        {
+            std::lock_guard<std::mutex> lock(shard.poolMutex);
+            if (!shard.idle.empty()) {
+                Connection* connection = shard.idle.back();
+                shard.idle.pop_back();
+                return connection;
+            }
+        }
+
+        // Pool grows to the number of threads reading the shard at once
+        Connection* connection = new Connection();
+        if (sqlite3_open_v2(shard.path.c_str(), &connection->db,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+            Log::printf(LogLevel::Error, "Mailbox database error: %s", sqlite3_errmsg(connection->db));
+            closeConnection(connection);
+            return nullptr;
+        }
+        sqlite3_busy_timeout(connection->db, 1000);
+
+        std::string firstPage = std::string(LIST_COLUMNS)
+            + "WHERE recipient = ?1 ORDER BY timestamp DESC, id DESC LIMIT ?2;";
+        std::string nextPage = std::string(LIST_COLUMNS)
+            + "WHERE recipient = ?1 AND (timestamp, id) < (?3, ?4) ORDER BY timestamp DESC, id DESC LIMIT ?2;";
+        const struct { sqlite3_stmt** target; const char* sql; } statements[] = {
+            { &connection->firstPage, firstPage.c_str() },
+            { &connection->nextPage, nextPage.c_str() },
+            { &connection->message, "SELECT e.id, e.sender, e.recipient, e.subject, b.body, e.timestamp, e.status, e.spam_score, b.location, "
+                "b.codec, b.dictionary, b.size "
+                "FROM Emails e JOIN Bodies b ON b.id = e.body_id WHERE e.id = ?1;" },
+        };
+        for (const auto& statement : statements) {
+            if (sqlite3_prepare_v3(connection->db, statement.sql, -1, SQLITE_PREPARE_PERSISTENT, statement.target, nullptr) != SQLITE_OK) {
+                Log::printf(LogLevel::Error, "Mailbox database error: %s", sqlite3_errmsg(connection->db));
+                closeConnection(connection);
+                return nullptr;
+            }
+        }
+        return connection;
+    }
+
+
+
+    SegmentLogReader& MailboxReader::segmentLog(Shard& shard) {
+        std::lock_guard<std::mutex> lock(shard.poolMutex);
+        if (!shard.log) shard.log = std::make_unique<SegmentLogReader>(shard.path + "-log");
+        return *shard.log;
+    }
+
+
+
+    void MailboxReader::release(Shard& shard, Connection* connection) {
+        std::lock_guard<std::mutex> lock(shard.poolMutex);
+        shard.idle.push_back(connection);
+    }
+
+
+
+    void MailboxReader::closeConnection(Connection* connection) {
+        sqlite3_finalize(connection->firstPage);
+        sqlite3_finalize(connection->nextPage);
+        sqlite3_finalize(connection->message);
+        sqlite3_close(connection->db);
+        delete connection;
+    }
+}
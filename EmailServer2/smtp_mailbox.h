@@ -0,0 +1,100 @@
+#ifndef INCLUDED_SMTP_MAILBOX_LINUX
+#define INCLUDED_SMTP_MAILBOX_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <functional>
+#include <cstdint>
+#include <sqlite3.h>
+#include "smtp_segment_log.h"
+#include "smtp_compression.h"
+
+namespace smtp {
+    // A message id as it appears in a URL or cursor: decimal digits only, no
+    // sign, no more than fits in int64_t
+    std::optional<int64_t> parseMessageId(std::string_view text);
+
+    // Position in a mailbox listing: the (timestamp, id) of the last row seen
+    struct MailboxCursor {
+        std::string timestamp;
+        int64_t id = 0;
+
+        // URL-safe text form "2026-01-31T12:00:00_42"
+        std::string encode() const;
+        static std::optional<MailboxCursor> decode(std::string_view text);
+    };
+
+    // One row of a listing; views are valid only during the callback
+    struct MailboxEntry {
+        int64_t id;
+        std::string_view sender, subject, timestamp, status;
+        std::optional<double> spamScore;
+    };
+
+    // A whole message; views are valid only during the callback
+    struct MailboxMessage {
+        int64_t id;
+        std::string_view sender, recipient, subject, body, timestamp, status;
+        std::optional<double> spamScore;
+        std::string* bodyBuffer = nullptr;  // Holds body; a caller may move it out rather than copy it
+    };
+
+    enum class ReadResult { Found, NotFound, Error };
+
+    // Read side of the Emails table. Listings use keyset pagination on
+    // (recipient, timestamp, id), answered entirely from the covering index
+    // idx_emails_mailbox, so a page costs the same at any depth. Rows are
+    // handed to the caller as they are stepped, never collected. Connections
+    // are read-only, pooled, and safe to use from any number of threads.
+    //
+    // Over a sharded store a listing goes to the recipient's shard only, and
+    // the ids it hands out carry the shard (id * shards + shard), so
+    // fetchMessage finds the row without asking every shard. Bodies kept in
+    // a shard's segment log (BodyStorage::SegmentLog) are read from there.
+    class MailboxReader {
+    public:
+        explicit MailboxReader(const std::string& databasePath, size_t shards = 1);
+        ~MailboxReader();
+
+        // Newest first, strictly older than after (if given). next is set to
+        // the cursor of the following page when this one came back full.
+        ReadResult listMessages(std::string_view recipient, const MailboxCursor* after, int limit,
+            const std::function<void(const MailboxEntry&)>& row, std::optional<MailboxCursor>& next);
+
+        ReadResult fetchMessage(int64_t id, const std::function<void(const MailboxMessage&)>& found);
+
+        // Every row waiting for outbound delivery (QUEUED or DEFERRED), in id order per shard
+        ReadResult listQueued(const std::function<void(int64_t id, std::string_view recipient, int attempts)>& row);
+
+    private:
+        struct Connection {
+            sqlite3* db = nullptr;
+            sqlite3_stmt* firstPage = nullptr;
+            sqlite3_stmt* nextPage = nullptr;
+            sqlite3_stmt* message = nullptr;
+        };
+
+        // One database file, its idle connections and its segment log
+        struct Shard {
+            std::string path;
+            std::mutex poolMutex;
+            std::vector<Connection*> idle;
+            std::unique_ptr<SegmentLogReader> log;  // Opened by the first body found there
+            BodyDecoder decoder;
+        };
+
+        SegmentLogReader& segmentLog(Shard& shard);
+
+        Connection* acquire(Shard& shard);
+        void release(Shard& shard, Connection* connection);
+        void closeConnection(Connection* connection);
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
+    };
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include "smtp_mailbox_cache.h"
+#include "smtp_log.h"
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+namespace smtp {
+
+    MailboxGenerations::MailboxGenerations(const std::string& databasePath) {
+        std::string path = databasePath + "-gen";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0 && ftruncate(fd, sizeof(Table)) == 0) {
+            // A fresh file reads as zeros, which is a valid table
+            void* mapping = mmap(nullptr, sizeof(Table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED) {
+                m_table = static_cast<Table*>(mapping);
+                m_mapped = true;
+            }
+        }
+        if (fd >= 0) close(fd);
+
+        if (!m_mapped) {
+            // Still correct within this process; other processes' writes go unseen
+            Log::printf(LogLevel::Warning, "Mailbox generations: cannot map %s, caching is process-local", path.c_str());
+            m_table = new Table();
+        }
+    }
+
+
+
+    MailboxGenerations::~MailboxGenerations() {
+        if (m_mapped) munmap(m_table, sizeof(Table));
+        else delete m_table;
+    }
+
+
+
+    uint64_t MailboxGenerations::current(std::string_view recipient) const {
+        return m_table->slots[slotOf(recipient)].load(std::memory_order_acquire);
+    }
+
+
+
+    void MailboxGenerations::beginCommit() {
+        m_table->begun.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+
+
+    void MailboxGenerations::bump(std::string_view recipient) {
+        m_table->slots[slotOf(recipient)].fetch_add(1, std::memory_order_seq_cst);
+    }
+
+
+
+    void MailboxGenerations::endCommit() {
+        m_table->ended.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+
+
+    bool MailboxGenerations::snapshot(uint64_t& token) const {
+        uint64_t ended = m_table->ended.load(std::memory_order_seq_cst);
+        token = m_table->begun.load(std::memory_order_seq_cst);
+        return token == ended;
+    }
+
+
+
+    bool MailboxGenerations::unchanged(uint64_t token) const {
+        return m_table->begun.load(std::memory_order_seq_cst) == token;
+    }
+
+
+
+    size_t MailboxGenerations::slotOf(std::string_view recipient) {
+        // FNV-1a: the layout is shared between processes, so no std::hash
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : recipient) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return static_cast<size_t>(hash % SLOTS);
+    }
+
+
+
+    MailboxCache::MailboxCache(const CacheOptions& options, const MailboxGenerations& generations)
+        : m_generations(generations) {
+        size_t shards = options.shards > 0 ? options.shards : 1;
+        m_shardBudget = options.byteBudget / shards;
+        for (size_t i = 0; i < shards; ++i) {
+            m_shards.push_back(std::make_unique<Shard>());
+        }
+    }
+
+
+
+    std::shared_ptr<const std::string> MailboxCache::find(const std::string& key) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) {
+            ++shard.misses;
+            return nullptr;
+        }
+
+        auto it = found->second;
+        if (m_generations.current(it->recipient) != it->generation) {
+            ++shard.invalidations;
+            ++shard.misses;
+            erase(shard, it);
+            return nullptr;
+        }
+
+        ++shard.hits;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it);
+        return it->value;
+    }
+
+
+
+    void MailboxCache::insert(const std::string& key, std::string_view recipient, uint64_t generation,
+        std::shared_ptr<const std::string> value) {
+        // Strings and value plus list and index node overhead
+        size_t charge = key.size() + recipient.size() + value->size() + 128;
+        if (charge > maxEntryBytes()) return;
+
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            erase(shard, found->second);
+        }
+
+        while (shard.bytes + charge > m_shardBudget && !shard.lru.empty()) {
+            ++shard.evictions;
+            erase(shard, std::prev(shard.lru.end()));
+        }
+
+        shard.lru.push_front(Entry{ key, std::string(recipient), generation, std::move(value), charge });
+        shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+        shard.bytes += charge;
+    }
+
+
+
+    CacheStats MailboxCache::stats() const {
+        CacheStats total;
+        for (const auto& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total.hits += shard->hits;
+            total.misses += shard->misses;
+            total.evictions += shard->evictions;
+            total.invalidations += shard->invalidations;
+            total.bytes += shard->bytes;
+            total.entries += shard->lru.size();
+        }
+        return total;
+    }
+
+
+
+    MailboxCache::Shard& MailboxCache::shardFor(const std::string& key) {
+        return *m_shards[std::hash<std::string>()(key) % m_shards.size()];
+    }
+
+
+
+    void MailboxCache::erase(Shard& shard, std::list<Entry>::iterator it) {
+        shard.bytes -= it->charge;
+        shard.index.erase(it->key);
+        shard.lru.erase(it);
+    }
+}
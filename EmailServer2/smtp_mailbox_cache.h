@@ -0,0 +1,114 @@
+#ifndef INCLUDED_SMTP_MAILBOX_CACHE_LINUX
+#define INCLUDED_SMTP_MAILBOX_CACHE_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+
+namespace smtp {
+    // Per-recipient change counters shared by every process that uses one
+    // database, kept in a small file mapped next to it ("<db>-gen"). MailStore
+    // bumps a recipient's slot after each commit that gave it mail; readers
+    // remember the value they saw when they cached something and drop the
+    // entry once it moves. Recipients hash onto slots, so a collision only
+    // costs a spurious miss.
+    class MailboxGenerations {
+    public:
+        explicit MailboxGenerations(const std::string& databasePath);
+        ~MailboxGenerations();
+
+        uint64_t current(std::string_view recipient) const;
+
+        // Writer side: bracket each commit, bump its recipients in between
+        void beginCommit();
+        void bump(std::string_view recipient);
+        void endCommit();
+
+        // Reader side, for data whose recipient is only known after the read:
+        // snapshot() fails while a commit is in flight, unchanged() fails if
+        // one started since. Between the two, generations are trustworthy.
+        bool snapshot(uint64_t& token) const;
+        bool unchanged(uint64_t token) const;
+
+    private:
+        static const size_t SLOTS = 16384;
+
+        struct Table {
+            std::atomic<uint64_t> begun;
+            std::atomic<uint64_t> ended;
+            std::atomic<uint64_t> slots[SLOTS];
+        };
+
+        static size_t slotOf(std::string_view recipient);
+
+        Table* m_table = nullptr;
+        bool m_mapped = false;  // false: process-local table (mapping failed)
+    };
+
+    struct CacheOptions {
+        size_t byteBudget = 64 * 1024 * 1024;   // 0 disables the cache
+        size_t shards = 16;
+    };
+
+    struct CacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;       // Pushed out by the byte budget
+        uint64_t invalidations = 0;   // Dropped because their recipient got mail
+        size_t bytes = 0;
+        size_t entries = 0;
+    };
+
+    // Sharded, byte-bounded LRU of rendered mailbox pages and messages. Each
+    // entry carries the recipient generation it was built under and is only
+    // served while that generation is still current, so new mail is visible
+    // on the next read without the writer knowing the cache exists.
+    class MailboxCache {
+    public:
+        MailboxCache(const CacheOptions& options, const MailboxGenerations& generations);
+
+        std::shared_ptr<const std::string> find(const std::string& key);
+        void insert(const std::string& key, std::string_view recipient, uint64_t generation,
+            std::shared_ptr<const std::string> value);
+
+        // Largest value worth offering to insert()
+        size_t maxEntryBytes() const { return m_shardBudget / 4; }
+
+        CacheStats stats() const;
+
+    private:
+        struct Entry {
+            std::string key;
+            std::string recipient;
+            uint64_t generation;
+            std::shared_ptr<const std::string> value;
+            size_t charge;
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            std::list<Entry> lru;   // Most recently used first
+            std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+            size_t bytes = 0;
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+            uint64_t invalidations = 0;
+        };
+
+        Shard& shardFor(const std::string& key);
+        static void erase(Shard& shard, std::list<Entry>::iterator it);
+
+        const MailboxGenerations& m_generations;
+        size_t m_shardBudget;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+    };
+}
+
+#endif
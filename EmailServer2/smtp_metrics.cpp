@@ -0,0 +1,279 @@
+#include "smtp_metrics.h"
+#include "smtp_log.h"
+#include <sstream>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+
+namespace smtp {
+
+    namespace {
+        struct CounterInfo {
+            const char* name;
+            const char* help;
+        };
+
+        const CounterInfo COUNTERS[] = {
+            { "smtp_connections_accepted_total", "Connections accepted" },
+            { "smtp_connections_refused_total", "Connections refused by the rate limiter" },
+            { "smtp_sessions_closed_total", "Sessions closed" },
+            { "smtp_sessions_timed_out_total", "Sessions answered 421 and closed after missing a deadline" },
+            { "smtp_received_bytes_total", "Bytes read from clients" },
+            { "smtp_messages_accepted_total", "Messages stored and answered 250" },
+            { "smtp_messages_rejected_total", "Messages classified as spam and answered 554" },
+            { "smtp_messages_deferred_total", "Messages answered 451 because a dependency failed" },
+            { "smtp_store_batches_total", "Group-commit transactions" },
+            { "smtp_store_rows_total", "Recipient rows written by committed transactions" },
+            { "smtp_store_failures_total", "Rows that could not be stored" },
+            { "smtp_store_bodies_written_total", "Message bodies stored for the first time" },
+            { "smtp_store_bodies_shared_total", "Messages whose body was already stored" },
+            { "smtp_tls_handshakes_total", "Completed STARTTLS handshakes" },
+            { "smtp_tls_resumptions_total", "Handshakes resumed from the session cache or a ticket" },
+            { "smtp_tls_kernel_send_total", "Handshakes after which the kernel encrypts outgoing records" },
+            { "smtp_tls_failures_total", "STARTTLS handshakes that failed" },
+            { "smtp_delivery_connections_total", "Outbound connections opened for delivery" },
+            { "smtp_delivery_delivered_total", "Messages accepted by the destination server" },
+            { "smtp_delivery_deferred_total", "Delivery attempts that failed temporarily and will be retried" },
+            { "smtp_delivery_failed_total", "Messages given up on: permanent failure or retries exhausted" },
+        };
+
+        struct HistogramInfo {
+            const char* name;
+            const char* label;  // Extra label (name="value"), or nullptr
+            const char* help;
+        };
+
+        const HistogramInfo HISTOGRAMS[] = {
+            { "smtp_accept_to_banner_seconds", nullptr, "Time from accept to the 220 banner being written" },
+            { "smtp_command_seconds", "verb=\"HELO\"", "Time to handle one SMTP command" },
+            { "smtp_command_seconds", "verb=\"EHLO\"", nullptr },
+            { "smtp_command_seconds", "verb=\"MAIL\"", nullptr },
+            { "smtp_command_seconds", "verb=\"RCPT\"", nullptr },
+            { "smtp_command_seconds", "verb=\"DATA\"", nullptr },
+            { "smtp_command_seconds", "verb=\"RSET\"", nullptr },
+            { "smtp_command_seconds", "verb=\"NOOP\"", nullptr },
+            { "smtp_command_seconds", "verb=\"QUIT\"", nullptr },
+            { "smtp_command_seconds", "verb=\"STARTTLS\"", nullptr },
+            { "smtp_command_seconds", "verb=\"unknown\"", nullptr },
+            { "smtp_data_transfer_seconds", nullptr, "Time from 354 to the end-of-data line" },
+            { "smtp_bayes_score_seconds", nullptr, "In-process spam model scoring time" },
+            { "smtp_spam_check_seconds", nullptr, "External spam classifier round trip" },
+            { "smtp_store_commit_seconds", nullptr, "Duration of one group-commit transaction" },
+            { "smtp_tls_handshake_seconds", nullptr, "Time from the STARTTLS 220 to a completed handshake" },
+            { "smtp_delivery_transaction_seconds", nullptr, "Outbound transaction time, MAIL to the reply after the end of data" },
+        };
+
+        static_assert(sizeof(COUNTERS) / sizeof(COUNTERS[0]) == static_cast<size_t>(Metrics::Counter::Count),
+            "every counter needs a name");
+        static_assert(sizeof(HISTOGRAMS) / sizeof(HISTOGRAMS[0]) == static_cast<size_t>(Metrics::Histogram::Count),
+            "every histogram needs a name");
+
+        // Exposed bucket bounds are powers of two of nanoseconds (128ns to
+        // 34s), where the internal buckets split exactly
+        const int FIRST_BOUND_EXPONENT = 7;
+    }
+
+
+
+    struct Metrics::Registry {
+        std::mutex mutex;
+        std::vector<Block*> blocks;     // Every block ever handed out
+        std::vector<Block*> idle;       // Blocks whose thread has exited
+    };
+
+
+
+    Metrics::Registry& Metrics::registry() {
+        static Registry* instance = new Registry(); // Never destroyed: threads may record during exit
+        return *instance;
+    }
+
+
+
+    Metrics::Lease::~Lease() {
+        if (block != nullptr) releaseBlock(block);
+    }
+
+
+
+    Metrics::Block* Metrics::acquireBlock() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        if (!reg.idle.empty()) {
+            Block* block = reg.idle.back();
+            reg.idle.pop_back();
+            return block;
+        }
+        Block* block = new Block();
+        reg.blocks.push_back(block);
+        return block;
+    }
+
+
+
+    void Metrics::releaseBlock(Block* block) {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.idle.push_back(block);
+    }
+
+
+
+    std::string Metrics::scrape() {
+        const size_t counterCount = static_cast<size_t>(Counter::Count);
+        const size_t histogramCount = static_cast<size_t>(Histogram::Count);
+        std::vector<uint64_t> counters(counterCount, 0);
+        std::vector<uint64_t> buckets(histogramCount * BUCKETS, 0);
+        std::vector<uint64_t> sums(histogramCount, 0);
+        {
+            Registry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            for (const Block* entry : reg.blocks) {
+                const Block& block = *entry;
+                for (size_t i = 0; i < counterCount; ++i) {
+                    counters[i] += block.counters[i].load(std::memory_order_relaxed);
+                }
+                for (size_t h = 0; h < histogramCount; ++h) {
+                    const HistogramData& data = block.histograms[h];
+                    for (size_t b = 0; b < BUCKETS; ++b) {
+                        buckets[h * BUCKETS + b] += data.buckets[b].load(std::memory_order_relaxed);
+                    }
+                    sums[h] += data.sumNanos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::ostringstream out;
+        for (size_t i = 0; i < counterCount; ++i) {
+            out << "# HELP " << COUNTERS[i].name << ' ' << COUNTERS[i].help << '\n'
+                << "# TYPE " << COUNTERS[i].name << " counter\n"
+                << COUNTERS[i].name << ' ' << counters[i] << '\n';
+        }
+
+        char number[32];
+        for (size_t h = 0; h < histogramCount; ++h) {
+            const HistogramInfo& info = HISTOGRAMS[h];
+            if (info.help != nullptr) {
+                out << "# HELP " << info.name << ' ' << info.help << '\n'
+                    << "# TYPE " << info.name << " histogram\n";
+            }
+            std::string labels = info.label != nullptr ? std::string(info.label) + "," : std::string();
+
+            const uint64_t* data = &buckets[h * BUCKETS];
+            uint64_t cumulative = 0;
+            size_t next = 0;
+            for (int exponent = FIRST_BOUND_EXPONENT; exponent <= MAX_EXPONENT; ++exponent) {
+                // Internal buckets below index (e - 2) * 8 hold values under 2^e ns
+                size_t end = static_cast<size_t>((exponent - 2) * 8);
+                for (; next < end; ++next) cumulative += data[next];
+                snprintf(number, sizeof(number), "%.9g", static_cast<double>(1ull << exponent) / 1e9);
+                out << info.name << "_bucket{" << labels << "le=\"" << number << "\"} " << cumulative << '\n';
+            }
+            for (; next < BUCKETS; ++next) cumulative += data[next];
+            out << info.name << "_bucket{" << labels << "le=\"+Inf\"} " << cumulative << '\n';
+
+            std::string suffix;
+            if (info.label != nullptr) suffix.append("{").append(info.label).append("}");
+            snprintf(number, sizeof(number), "%.9g", static_cast<double>(sums[h]) / 1e9);
+            out << info.name << "_sum" << suffix << ' ' << number << '\n'
+                << info.name << "_count" << suffix << ' ' << cumulative << '\n';
+        }
+        return out.str();
+    }
+
+
+
+    MetricsEndpoint::MetricsEndpoint(const MetricsOptions& options) {
+        m_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_socket < 0) {
+            Log::write(LogLevel::Warning, "Metrics endpoint: cannot create socket");
+            return;
+        }
+        int opt = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(options.port));
+        if (inet_pton(AF_INET, options.address.c_str(), &address.sin_addr) != 1
+            || bind(m_socket, (struct sockaddr*)&address, sizeof(address)) < 0
+            || listen(m_socket, 16) < 0) {
+            // Metrics are optional: the server keeps running without them
+            Log::printf(LogLevel::Warning, "Metrics endpoint: cannot listen on %s:%d: %s",
+                options.address.c_str(), options.port, strerror(errno));
+            close(m_socket);
+            m_socket = -1;
+            return;
+        }
+
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    MetricsEndpoint::~MetricsEndpoint() {
+        m_stop = true;
+        if (m_socket >= 0) shutdown(m_socket, SHUT_RDWR); // Wakes accept()
+        if (m_thread.joinable()) m_thread.join();
+        if (m_socket >= 0) close(m_socket);
+    }
+
+
+
+    void MetricsEndpoint::run() {
+        while (!m_stop) {
+            int clientSocket = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+            if (clientSocket < 0) {
+                if (m_stop) break;
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                Log::printf(LogLevel::Error, "Metrics endpoint: accept failed: %s", strerror(errno));
+                break;
+            }
+            serve(clientSocket);
+            close(clientSocket);
+        }
+    }
+
+
+
+    void MetricsEndpoint::serve(int clientSocket) {
+        // A stalled scraper must not hold the thread
+        struct timeval timeout = { 2, 0 };
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t received = recv(clientSocket, buffer, sizeof(buffer), 0);
+            if (received <= 0) return;
+            request.append(buffer, static_cast<size_t>(received));
+        }
+
+        std::string response;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+            std::string body = Metrics::scrape();
+            response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        }
+        else {
+            response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(clientSocket, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            sent += static_cast<size_t>(n);
+        }
+    }
+}
@@ -0,0 +1,166 @@
+#ifndef INCLUDED_SMTP_METRICS_LINUX
+#define INCLUDED_SMTP_METRICS_LINUX
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include "smtp_parser.h"
+
+namespace smtp {
+    // Process-wide counters and latency histograms. Every thread records into
+    // its own block (plain relaxed load + store, no lock, no shared cache
+    // line), so an event costs a few nanoseconds; a scrape walks all blocks
+    // and sums them. Histograms are HDR-style: 8 linear sub-buckets per power
+    // of two of nanoseconds, i.e. 12.5% resolution from 8 ns to 34 s.
+    class Metrics {
+    public:
+        enum class Counter {
+            ConnectionsAccepted,
+            ConnectionsRefused,     // Rate limited, answered 421
+            SessionsClosed,
+            SessionsTimedOut,       // Missed a deadline, answered 421
+            BytesReceived,
+            MessagesAccepted,
+            MessagesRejected,       // Spam, answered 554
+            MessagesDeferred,       // Classifier or storage unavailable, answered 451
+            StoreBatches,
+            StoreRows,
+            StoreFailures,
+            StoreBodiesWritten,     // Bodies not seen before
+            StoreBodiesShared,      // Messages whose body was already stored
+            TlsHandshakes,
+            TlsResumptions,         // Handshakes that reused a cached session or ticket
+            TlsKernelSend,          // Handshakes that handed record encryption to the kernel
+            TlsFailures,
+            DeliveryConnections,    // Outbound connections opened
+            DeliveryDelivered,
+            DeliveryDeferred,       // Temporary failures that will be retried
+            DeliveryFailed,         // Permanent failures and exhausted retries
+            Count
+        };
+
+        // The Command* entries follow the order of smtp::Verb
+        enum class Histogram {
+            AcceptToBanner,
+            CommandHelo, CommandEhlo, CommandMail, CommandRcpt, CommandData,
+            CommandRset, CommandNoop, CommandQuit, CommandStarttls, CommandUnknown,
+            DataTransfer,           // 354 to the end-of-data line
+            BayesScore,
+            SpamCheck,              // External classifier round trip
+            StoreCommit,            // One group-commit transaction
+            TlsHandshake,           // STARTTLS 220 to a completed handshake
+            DeliveryTransaction,    // Outbound MAIL written to the reply after the end of data
+            Count
+        };
+
+        static Histogram command(Verb verb) {
+            return static_cast<Histogram>(static_cast<int>(Histogram::CommandHelo) + static_cast<int>(verb));
+        }
+
+        // Monotonic nanoseconds, the unit every histogram records
+        static uint64_t now() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        static void add(Counter counter, uint64_t amount = 1) {
+            bump(local().counters[static_cast<size_t>(counter)], amount);
+        }
+
+        static void observe(Histogram histogram, uint64_t nanos) {
+            HistogramData& data = local().histograms[static_cast<size_t>(histogram)];
+            bump(data.buckets[bucketOf(nanos)], 1);
+            bump(data.sumNanos, nanos);
+        }
+
+        static void observeSince(Histogram histogram, uint64_t start) {
+            observe(histogram, now() - start);
+        }
+
+        // Everything recorded so far, in Prometheus text exposition format
+        static std::string scrape();
+
+        // Records the time from construction to the end of the scope
+        class Timer {
+        public:
+            explicit Timer(Histogram histogram) : m_histogram(histogram), m_start(now()) {}
+            ~Timer() { observeSince(m_histogram, m_start); }
+            void retarget(Histogram histogram) { m_histogram = histogram; }
+
+        private:
+            Histogram m_histogram;
+            uint64_t m_start;
+        };
+
+    private:
+        static const int MAX_EXPONENT = 35;                      // Last power of two with its own buckets
+        static const size_t BUCKETS = (MAX_EXPONENT - 1) * 8 + 1; // Plus one overflow bucket
+
+        struct HistogramData {
+            std::atomic<uint64_t> buckets[BUCKETS];
+            std::atomic<uint64_t> sumNanos;
+        };
+
+        // Written by one thread at a time; read by scrapes
+        struct Block {
+            std::atomic<uint64_t> counters[static_cast<size_t>(Counter::Count)];
+            HistogramData histograms[static_cast<size_t>(Histogram::Count)];
+        };
+
+        // Returns the block to the registry when its thread exits; the next
+        // new thread continues from its totals
+        struct Lease {
+            Block* block = nullptr;
+            ~Lease();
+        };
+
+        static void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        static Block& local() {
+            thread_local Lease lease;
+            if (lease.block == nullptr) lease.block = acquireBlock();
+            return *lease.block;
+        }
+
+        static size_t bucketOf(uint64_t nanos) {
+            if (nanos < 8) return static_cast<size_t>(nanos);
+            int exponent = 63 - __builtin_clzll(nanos);
+            if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+            return static_cast<size_t>((exponent - 2) * 8) + ((nanos >> (exponent - 3)) & 7);
+        }
+
+        struct Registry;
+        static Registry& registry();
+        static Block* acquireBlock();
+        static void releaseBlock(Block* block);
+    };
+
+    struct MetricsOptions {
+        bool enabled = true;
+        std::string address = "127.0.0.1"; // Scrapers only; not meant for the public interface
+        int port = 9025;
+    };
+
+    // Minimal HTTP listener answering GET /metrics with Metrics::scrape().
+    // One thread, one request per connection: scrapes are rare and small.
+    class MetricsEndpoint {
+    public:
+        explicit MetricsEndpoint(const MetricsOptions& options);
+        ~MetricsEndpoint();
+
+    private:
+        void run();
+        void serve(int clientSocket);
+
+        int m_socket = -1;
+        std::atomic<bool> m_stop{ false };
+        std::thread m_thread;
+    };
+}
+
+#endif
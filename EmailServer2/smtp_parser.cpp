@@ -0,0 +1,255 @@
+#include "smtp_parser.h"
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+
+namespace smtp {
+
+    namespace {
+        // Smallest read we offer to recv(); below this we compact or grow first
+        const size_t MIN_READ_SPACE = 1024;
+    }
+
+
+
+    LineBuffer::LineBuffer(size_t initialCapacity)
+        : m_data(initialCapacity < MIN_READ_SPACE ? MIN_READ_SPACE : initialCapacity) {
+    }
+
+
+
+    char* LineBuffer::writable(size_t& available) {
+        if (m_data.size() - m_end < MIN_READ_SPACE) {
+            // Slide unconsumed bytes to the front before considering growth
+            if (m_begin > 0) {
+                size_t used = m_end - m_begin;
+                if (used > 0) memmove(m_data.data(), m_data.data() + m_begin, used);
+                m_begin = 0;
+                m_end = used;
+            }
+            if (m_data.size() - m_end < MIN_READ_SPACE) {
+                m_data.resize(m_data.size() * 2);
+            }
+        }
+        available = m_data.size() - m_end;
+        return m_data.data() + m_end;
+    }
+
+
+
+    void LineBuffer::commit(size_t bytes) {
+        m_end += bytes;
+    }
+
+
+
+    LineBuffer::Line LineBuffer::nextLine(std::string_view& line, size_t maxLength) {
+        while (true) {
+            const char* start = m_data.data() + m_begin;
+            size_t used = m_end - m_begin;
+
+            // Only search bytes we have not looked at yet
+            const void* lf = memchr(start + m_scanned, '\n', used - m_scanned);
+            if (lf == nullptr) {
+                if (m_discarding) {
+                    clear();
+                    return Line::Partial;
+                }
+                if (used > maxLength) {
+                    // Drop what we have and keep dropping until the next LF
+                    clear();
+                    m_discarding = true;
+                    return Line::TooLong;
+                }
+                m_scanned = used;
+                return Line::Partial;
+            }
+
+            size_t length = static_cast<const char*>(lf) - start;
+            m_begin += length + 1;
+            m_scanned = 0;
+            if (m_begin == m_end) m_begin = m_end = 0; // View still points at valid bytes
+
+            if (m_discarding) {
+                m_discarding = false;
+                continue;
+            }
+            if (length > 0 && start[length - 1] == '\r') --length;
+            if (length > maxLength) return Line::TooLong;
+
+            line = std::string_view(start, length);
+            return Line::Ready;
+        }
+    }
+
+
+
+    void LineBuffer::consume(size_t bytes) {
+        m_begin += bytes;
+        m_scanned = 0;
+        if (m_begin == m_end) m_begin = m_end = 0;
+    }
+
+
+
+    void LineBuffer::clear() {
+        m_begin = m_end = 0;
+        m_scanned = 0;
+    }
+
+
+
+    void LineBuffer::reset() {
+        clear();
+        m_discarding = false;
+    }
+
+
+
+    std::string_view trim(std::string_view text) {
+        size_t first = text.find_first_not_of(" \t");
+        if (first == std::string_view::npos) return std::string_view();
+        size_t last = text.find_last_not_of(" \t");
+        return text.substr(first, last - first + 1);
+    }
+
+
+
+    Verb parseCommand(std::string_view line, std::string_view& argument) {
+        argument = std::string_view();
+        if (line.size() < 4) return Verb::Unknown;
+
+        // The first letter picks the only candidates worth comparing
+        switch (asciiUpper(line[0])) {
+        case 'H':
+        case 'E':
+            if (startsWithNoCase(line, "HELO ") || startsWithNoCase(line, "EHLO ")) {
+                argument = line.substr(5);
+                return asciiUpper(line[0]) == 'E' ? Verb::Ehlo : Verb::Helo;
+            }
+            break;
+        case 'M':
+            if (startsWithNoCase(line, "MAIL FROM:")) {
+                argument = line.substr(10);
+                return Verb::Mail;
+            }
+            break;
+        case 'R':
+            if (startsWithNoCase(line, "RCPT TO:")) {
+                argument = line.substr(8);
+                return Verb::Rcpt;
+            }
+            if (equalsNoCase(line, "RSET")) return Verb::Rset;
+            break;
+        case 'D':
+            if (equalsNoCase(line, "DATA")) return Verb::Data;
+            break;
+        case 'N':
+            if (equalsNoCase(line, "NOOP")) return Verb::Noop;
+            break;
+        case 'Q':
+            if (equalsNoCase(line, "QUIT")) return Verb::Quit;
+            break;
+        case 'S':
+            if (equalsNoCase(line, "STARTTLS")) return Verb::Starttls;
+            break;
+        }
+        return Verb::Unknown;
+    }
+
+
+
+    std::string_view extractEmailAddress(std::string_view input) {
+        size_t start = input.find('<');
+        size_t end = input.find('>');
+        if (start != std::string_view::npos && end != std::string_view::npos && end > start) {
+            return input.substr(start + 1, end - start - 1);
+        }
+        return trim(input);
+    }
+
+
+
+    void sanitizeInput(std::string& data) {
+        data.erase(std::remove_if(data.begin(), data.end(),
+            [](char c) { return !isprint(static_cast<unsigned char>(c)) || c == '\r' || c == '\n'; }), data.end());
+    }
+
+
+
+    bool isPrintable(std::string_view text) {
+        for (char c : text) {
+            if (c < 0x20 || c > 0x7e) return false;
+        }
+        return true;
+    }
+
+
+
+    namespace {
+        // Byte classes of the address language
+        enum AddressClass : unsigned char { OTHER, LETTER, WORD, DOT, PLUS, AT, CLASS_COUNT };
+
+        // States: the domain is D+ '.' A{2,} with D a superset of A and '.',
+        // so only the bytes since its last dot matter
+        enum AddressState : unsigned char {
+            REJECT,
+            START,
+            LOCAL,          // Inside the local part
+            DOMAIN_START,   // Just after '@'
+            DOMAIN,         // Domain, last byte neither a dot nor a letter following one
+            DOT_SEEN,       // Domain, just after a dot
+            ONE_LETTER,     // Domain, one letter after the last dot
+            TLD,            // Domain, two or more letters after the last dot (accepting)
+            STATE_COUNT
+        };
+
+        struct AddressTables {
+            unsigned char classOf[256] = {};
+            unsigned char next[STATE_COUNT][CLASS_COUNT] = {};
+        };
+
+        constexpr AddressTables makeAddressTables() {
+            AddressTables t;
+            for (int c = 'a'; c <= 'z'; ++c) t.classOf[c] = LETTER;
+            for (int c = 'A'; c <= 'Z'; ++c) t.classOf[c] = LETTER;
+            for (int c = '0'; c <= '9'; ++c) t.classOf[c] = WORD;
+            t.classOf[static_cast<unsigned char>('_')] = WORD;
+            t.classOf[static_cast<unsigned char>('-')] = WORD;
+            t.classOf[static_cast<unsigned char>('.')] = DOT;
+            t.classOf[static_cast<unsigned char>('+')] = PLUS;
+            t.classOf[static_cast<unsigned char>('@')] = AT;
+
+            // Everything not listed goes to REJECT (0)
+            t.next[START][LETTER] = t.next[START][WORD] = t.next[START][DOT] = t.next[START][PLUS] = LOCAL;
+            t.next[LOCAL][LETTER] = t.next[LOCAL][WORD] = t.next[LOCAL][DOT] = t.next[LOCAL][PLUS] = LOCAL;
+            t.next[LOCAL][AT] = DOMAIN_START;
+            // The first domain byte is always part of D+, even a dot
+            t.next[DOMAIN_START][LETTER] = t.next[DOMAIN_START][WORD] = t.next[DOMAIN_START][DOT] = DOMAIN;
+            const unsigned char domainStates[] = { DOMAIN, DOT_SEEN, ONE_LETTER, TLD };
+            for (unsigned char state : domainStates) {
+                t.next[state][WORD] = DOMAIN;
+                t.next[state][DOT] = DOT_SEEN;
+                t.next[state][LETTER] = DOMAIN;
+            }
+            t.next[DOT_SEEN][LETTER] = ONE_LETTER;
+            t.next[ONE_LETTER][LETTER] = TLD;
+            t.next[TLD][LETTER] = TLD;
+            return t;
+        }
+
+        constexpr AddressTables ADDRESS_TABLES = makeAddressTables();
+    }
+
+
+
+    bool isValidEmailAddress(std::string_view address) {
+        unsigned char state = START;
+        for (char c : address) {
+            state = ADDRESS_TABLES.next[state][ADDRESS_TABLES.classOf[static_cast<unsigned char>(c)]];
+            if (state == REJECT) return false;
+        }
+        return state == TLD;
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef INCLUDED_SMTP_PARSER_LINUX
+#define INCLUDED_SMTP_PARSER_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+
+namespace smtp {
+    // Per-session input buffer. recv() writes straight into the free tail and
+    // complete lines are handed out as views into the buffer, so a command split
+    // across two reads is simply completed by the next one. Storage is only
+    // reallocated when a session needs more room than it has ever used before.
+    class LineBuffer {
+    public:
+        enum class Line {
+            Ready,      // line holds a complete line without its terminator
+            Partial,    // Need more bytes
+            TooLong     // Line exceeded maxLength and is being discarded
+        };
+
+        explicit LineBuffer(size_t initialCapacity = 4096);
+
+        // Free space for the next read (compacts/grows first). Invalidates views.
+        char* writable(size_t& available);
+        void commit(size_t bytes);
+
+        // Next LF-terminated line (a preceding CR is stripped). The view stays
+        // valid until the next writable() call.
+        Line nextLine(std::string_view& line, size_t maxLength);
+
+        // Raw access for consumers that do not work line by line
+        std::string_view pending() const { return std::string_view(m_data.data() + m_begin, m_end - m_begin); }
+        void consume(size_t bytes);
+
+        size_t size() const { return m_end - m_begin; }
+        bool empty() const { return m_begin == m_end; }
+        size_t capacity() const { return m_data.size(); }
+        void clear();
+        void reset();   // clear(), and stop discarding an over-long line
+
+    private:
+        std::vector<char> m_data;
+        size_t m_begin = 0;         // First unconsumed byte
+        size_t m_end = 0;           // One past the last received byte
+        size_t m_scanned = 0;       // Bytes after m_begin already searched for LF
+        bool m_discarding = false;  // Dropping the rest of an over-long line
+    };
+
+    // ASCII case-insensitive comparisons for SMTP verbs (no copies, no locale)
+    inline char asciiUpper(char c) {
+        return (c >= 'a' && c <= 'z') ? static_cast<char>(c - ('a' - 'A')) : c;
+    }
+
+    inline bool startsWithNoCase(std::string_view text, std::string_view prefix) {
+        if (text.size() < prefix.size()) return false;
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            if (asciiUpper(text[i]) != asciiUpper(prefix[i])) return false;
+        }
+        return true;
+    }
+
+    inline bool equalsNoCase(std::string_view text, std::string_view other) {
+        return text.size() == other.size() && startsWithNoCase(text, other);
+    }
+
+    enum class Verb { Helo, Ehlo, Mail, Rcpt, Data, Rset, Noop, Quit, Starttls, Unknown };
+
+    // Classifies one command line. argument is what follows the verb: the
+    // domain for HELO/EHLO, the path after "FROM:"/"TO:" for MAIL/RCPT.
+    // Verbs without arguments only match exactly.
+    Verb parseCommand(std::string_view line, std::string_view& argument);
+
+    // The address inside <...>, or the trimmed argument when there are no brackets
+    std::string_view extractEmailAddress(std::string_view input);
+
+    // Removes CR, LF and other non-printable bytes (CRLF injection guard)
+    void sanitizeInput(std::string& data);
+
+    // Strips leading/trailing spaces and tabs
+    std::string_view trim(std::string_view text);
+
+    // True if every byte is printable ASCII (guards replies that echo client input)
+    bool isPrintable(std::string_view text);
+
+    // True if address is in the language of the original validation regex
+    //   ^([a-zA-Z0-9_\-\.\+]+)@([a-zA-Z0-9_\-\.]+)\.([a-zA-Z]{2,})$
+    // One table lookup per byte, no allocation
+    bool isValidEmailAddress(std::string_view address);
+}
+
+#endif
@@ -0,0 +1,237 @@
+#include "smtp_rate_limiter.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <netinet/in.h>
+
+
+namespace smtp {
+
+    namespace {
+        const uint64_t TICKS_PER_SEC = 1024;
+        const uint64_t TOKEN_ONE = 256;             // One token in fixed point
+        const uint64_t TOKEN_MASK = (1u << 24) - 1;
+        const int PROBE_BUCKETS = 2;
+
+        uint64_t mix(uint64_t x) {
+            // splitmix64 finalizer
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ULL;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebULL;
+            x ^= x >> 31;
+            return x;
+        }
+
+        uint64_t loadWord(const unsigned char* bytes) {
+            uint64_t word;
+            memcpy(&word, bytes, sizeof(word));
+            return word;
+        }
+    }
+
+
+
+    RateLimiter::RateLimiter(const RateLimitOptions& options)
+        : m_options(options) {
+        if (m_options.ratePerSec == 0) m_options.ratePerSec = 1;
+        if (m_options.burst == 0) m_options.burst = 1;
+        if (m_options.burst > 65535) m_options.burst = 65535;
+        if (m_options.bucketsPerShard == 0 || (m_options.bucketsPerShard & (m_options.bucketsPerShard - 1)) != 0) {
+            m_options.bucketsPerShard = 1024;
+        }
+
+        // Per-process seed: clients cannot aim many addresses at one bucket
+        m_seed = (static_cast<uint64_t>(std::random_device{}()) << 32) | std::random_device{}();
+        m_capacity = m_options.burst * TOKEN_ONE;
+        m_idleTicks = (m_options.burst * TICKS_PER_SEC + m_options.ratePerSec - 1) / m_options.ratePerSec + 1;
+
+        size_t shards = size_t(1) << m_options.shardBits;
+        m_shards = std::make_unique<Shard[]>(shards);
+        for (size_t i = 0; i < shards; ++i) {
+            m_shards[i].buckets = std::make_unique<Bucket[]>(m_options.bucketsPerShard);
+        }
+
+        if (m_options.enabled) {
+            m_evictor = std::thread([this] { run(); });
+        }
+    }
+
+
+
+    RateLimiter::~RateLimiter() {
+        {
+            std::lock_guard<std::mutex> lock(m_evictMutex);
+            m_stop = true;
+        }
+        m_evictWake.notify_one();
+        if (m_evictor.joinable()) m_evictor.join();
+    }
+
+
+
+    bool RateLimiter::allow(const sockaddr* address) {
+        if (!m_options.enabled) return true;
+
+        uint64_t key = hashAddress(address);
+        if (key == 0) return true; // Not an IP address
+
+        Shard& shard = m_shards[m_options.shardBits == 0 ? 0 : key >> (64 - m_options.shardBits)];
+        uint64_t mask = m_options.bucketsPerShard - 1;
+        uint64_t time = now();
+
+        Slot* empty = nullptr;
+        for (int probe = 0; probe < PROBE_BUCKETS; ++probe) {
+            Bucket& bucket = shard.buckets[(key + probe) & mask];
+            for (Slot& slot : bucket.slots) {
+                uint64_t current = slot.key.load(std::memory_order_acquire);
+                if (current == key) return take(slot, time);
+                if (current == 0 && empty == nullptr) empty = &slot;
+            }
+        }
+
+        // Claim a free slot; whoever wins the CAS owns it. Two racing first
+        // connections from one address may claim two slots, in which case the
+        // later one just idles until it is evicted.
+        while (empty != nullptr) {
+            uint64_t expected = 0;
+            if (empty->key.compare_exchange_strong(expected, key, std::memory_order_acq_rel)) {
+                return take(*empty, time);
+            }
+            if (expected == key) return take(*empty, time);
+            empty = nullptr;
+            for (int probe = 0; probe < PROBE_BUCKETS && empty == nullptr; ++probe) {
+                Bucket& bucket = shard.buckets[(key + probe) & mask];
+                for (Slot& slot : bucket.slots) {
+                    if (slot.key.load(std::memory_order_acquire) == 0) {
+                        empty = &slot;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Table full around this hash: fail open rather than refuse real clients
+        shard.overflows.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+
+
+    uint64_t RateLimiter::overflows() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < (size_t(1) << m_options.shardBits); ++i) {
+            total += m_shards[i].overflows.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+
+
+    uint64_t RateLimiter::hashAddress(const sockaddr* address) const {
+        uint64_t high = 0, low = 0;
+        if (address->sa_family == AF_INET) {
+            const sockaddr_in* v4 = reinterpret_cast<const sockaddr_in*>(address);
+            low = v4->sin_addr.s_addr;
+            high = 4;
+        }
+        else if (address->sa_family == AF_INET6) {
+            const unsigned char* bytes = reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr.s6_addr;
+            static const unsigned char V4_MAPPED[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+            if (memcmp(bytes, V4_MAPPED, sizeof(V4_MAPPED)) == 0) {
+                // Same bucket as the plain IPv4 address
+                uint32_t v4;
+                memcpy(&v4, bytes + 12, sizeof(v4));
+                low = v4;
+                high = 4;
+            }
+            else {
+                unsigned char prefix[16];
+                memcpy(prefix, bytes, sizeof(prefix));
+                int bits = m_options.ipv6PrefixBits < 0 ? 0 : (m_options.ipv6PrefixBits > 128 ? 128 : m_options.ipv6PrefixBits);
+                for (int i = bits / 8; i < 16; ++i) {
+                    prefix[i] = i == bits / 8 ? static_cast<unsigned char>(prefix[i] & (0xff00 >> (bits % 8))) : 0;
+                }
+                high = loadWord(prefix) ^ 6;
+                low = loadWord(prefix + 8);
+            }
+        }
+        else {
+            return 0;
+        }
+
+        uint64_t key = mix(high ^ mix(low ^ m_seed));
+        return key == 0 ? 1 : key;
+    }
+
+
+
+    bool RateLimiter::take(Slot& slot, uint64_t time) {
+        uint64_t state = slot.state.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t tokens = m_capacity;
+            if (state != 0) {
+                uint64_t last = state >> 24;
+                uint64_t elapsed = time > last ? time - last : 0;
+                if (elapsed > m_idleTicks) elapsed = m_idleTicks;
+                tokens = (state & TOKEN_MASK) + ((elapsed * m_options.ratePerSec * TOKEN_ONE) / TICKS_PER_SEC);
+                if (tokens > m_capacity) tokens = m_capacity;
+            }
+
+            bool allowed = tokens >= TOKEN_ONE;
+            if (allowed) tokens -= TOKEN_ONE;
+
+            // Ticks start at 1, so a written state is never 0
+            uint64_t next = (time << 24) | tokens;
+            if (slot.state.compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+                return allowed;
+            }
+        }
+    }
+
+
+
+    uint64_t RateLimiter::now() const {
+        auto elapsed = std::chrono::steady_clock::now().time_since_epoch();
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        return ns / (1000000000 / TICKS_PER_SEC) + 1;
+    }
+
+
+
+    void RateLimiter::evictIdle() {
+        uint64_t time = now();
+        for (size_t s = 0; s < (size_t(1) << m_options.shardBits); ++s) {
+            Shard& shard = m_shards[s];
+            for (size_t b = 0; b < m_options.bucketsPerShard; ++b) {
+                for (Slot& slot : shard.buckets[b].slots) {
+                    if (slot.key.load(std::memory_order_relaxed) == 0) continue;
+
+                    uint64_t state = slot.state.load(std::memory_order_relaxed);
+                    if (state == 0 || time - (state >> 24) < m_idleTicks) continue; // 0: just claimed
+
+                    // Reset the bucket only if no connection touched it meanwhile,
+                    // then free the slot
+                    if (slot.state.compare_exchange_strong(state, 0, std::memory_order_relaxed)) {
+                        slot.key.store(0, std::memory_order_release);
+                        m_evicted.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+    }
+
+
+
+    void RateLimiter::run() {
+        std::unique_lock<std::mutex> lock(m_evictMutex);
+        while (!m_stop) {
+            m_evictWake.wait_for(lock, std::chrono::seconds(m_options.evictIntervalSec > 0 ? m_options.evictIntervalSec : 1));
+            if (m_stop) break;
+
+            lock.unlock();
+            evictIdle();
+            lock.lock();
+        }
+    }
+}
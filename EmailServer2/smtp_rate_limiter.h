@@ -0,0 +1,76 @@
+#ifndef INCLUDED_SMTP_RATE_LIMITER_LINUX
+#define INCLUDED_SMTP_RATE_LIMITER_LINUX
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <sys/socket.h>
+
+namespace smtp {
+    struct RateLimitOptions {
+        bool enabled = true;
+        unsigned ratePerSec = 10;       // Sustained connections per second per address
+        unsigned burst = 20;            // Bucket size (at most 65535)
+        unsigned shardBits = 6;         // 64 shards
+        unsigned bucketsPerShard = 1024; // Power of two; 4 addresses per bucket
+        int ipv6PrefixBits = 64;        // IPv6 clients are limited per prefix, not per address
+        int evictIntervalSec = 30;      // How often idle addresses are dropped
+    };
+
+    // Token bucket per client address in a fixed open-addressed table. Each
+    // 64-byte bucket holds four {address hash, packed tokens + timestamp} slots,
+    // so a lookup touches one or two cache lines and an update is a single CAS:
+    // the accept path never takes a lock. Shards are allocated separately and
+    // carry their own overflow counter so no two cores write the same line for
+    // bookkeeping. A background thread clears addresses whose bucket has
+    // refilled, which is exactly the state a new entry would start from.
+    class RateLimiter {
+    public:
+        explicit RateLimiter(const RateLimitOptions& options);
+        ~RateLimiter();
+
+        // True if a connection from address may proceed (consumes one token)
+        bool allow(const sockaddr* address);
+
+        uint64_t overflows() const; // Lookups allowed because the table was full
+        size_t evicted() const { return m_evicted.load(std::memory_order_relaxed); }
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> key{ 0 };     // Address hash, 0 = empty
+            std::atomic<uint64_t> state{ 0 };   // [40-bit tick][24-bit tokens, 8 fractional bits], 0 = full bucket
+        };
+
+        struct alignas(64) Bucket {
+            Slot slots[4];
+        };
+
+        struct alignas(64) Shard {
+            std::unique_ptr<Bucket[]> buckets;
+            std::atomic<uint64_t> overflows{ 0 };
+        };
+
+        uint64_t hashAddress(const sockaddr* address) const;
+        bool take(Slot& slot, uint64_t now);
+        uint64_t now() const;
+        void evictIdle();
+        void run();
+
+        RateLimitOptions m_options;
+        uint64_t m_seed;
+        uint64_t m_capacity;        // burst in fixed point
+        uint64_t m_idleTicks;       // Time after which any bucket is full again
+        std::unique_ptr<Shard[]> m_shards;
+        std::atomic<size_t> m_evicted{ 0 };
+
+        std::thread m_evictor;
+        std::mutex m_evictMutex;
+        std::condition_variable m_evictWake;
+        bool m_stop = false;
+    };
+}
+
+#endif
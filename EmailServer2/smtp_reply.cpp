@@ -0,0 +1,147 @@
+#include "smtp_reply.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "smtp_tls.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+namespace smtp {
+
+    namespace {
+        // Pieces handed to one sendmsg(); replies for a read rarely need more
+        const size_t MAX_IOV = 64;
+
+        // Plaintext per SSL_write(): one full TLS record
+        const size_t MAX_RECORD = 16384;
+    }
+
+
+
+    void ReplyQueue::addStatic(std::string_view text) {
+        if (text.empty()) return;
+        m_pieces.push_back({ text.data(), 0, text.size() });
+    }
+
+
+
+    void ReplyQueue::addCopy(std::string_view text) {
+        if (text.empty()) return;
+
+        // Extend the previous copied piece when they are adjacent in m_scratch
+        if (m_pieces.size() > m_head && m_pieces.back().data == nullptr
+            && m_pieces.back().offset + m_pieces.back().length == m_scratch.size()) {
+            m_pieces.back().length += text.size();
+        }
+        else {
+            m_pieces.push_back({ nullptr, m_scratch.size(), text.size() });
+        }
+        m_scratch.append(text.data(), text.size());
+    }
+
+
+
+    ReplyQueue::Result ReplyQueue::flush(int socket, TlsStream* tls) {
+        if (tls != nullptr && !tls->kernelSend()) return flushTls(*tls);
+
+        struct iovec iov[MAX_IOV];
+
+        while (!empty()) {
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = gather(iov, MAX_IOV);
+
+            ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return Result::WouldBlock;
+                return Result::Error;
+            }
+
+            advance(static_cast<size_t>(sent));
+        }
+
+        clear();
+        return Result::Done;
+    }
+
+
+
+    size_t ReplyQueue::gather(struct iovec* iov, size_t max) const {
+        // From the partially sent head onwards
+        size_t count = 0;
+        for (size_t i = m_head; i < m_pieces.size() && count < max; ++i, ++count) {
+            const Piece& piece = m_pieces[i];
+            const char* base = piece.data ? piece.data : m_scratch.data() + piece.offset;
+            size_t skip = (i == m_head) ? m_headSent : 0;
+            iov[count].iov_base = const_cast<char*>(base + skip);
+            iov[count].iov_len = piece.length - skip;
+        }
+        return count;
+    }
+
+
+
+    void ReplyQueue::sent(size_t bytes) {
+        advance(bytes);
+        if (empty()) clear();
+    }
+
+
+
+    ReplyQueue::Result ReplyQueue::flushTls(TlsStream& tls) {
+        // Every SSL_write() seals at least one record, so gather the pieces
+        // first instead of writing them one by one
+        char record[MAX_RECORD];
+
+        while (!empty()) {
+            size_t length = 0;
+            for (size_t i = m_head; i < m_pieces.size() && length < MAX_RECORD; ++i) {
+                const Piece& piece = m_pieces[i];
+                const char* base = piece.data ? piece.data : m_scratch.data() + piece.offset;
+                size_t skip = (i == m_head) ? m_headSent : 0;
+                size_t take = std::min(piece.length - skip, MAX_RECORD - length);
+                memcpy(record + length, base + skip, take);
+                length += take;
+            }
+
+            // A retry after WantWrite passes the same leading bytes again, as OpenSSL requires
+            size_t sent;
+            TlsStream::Result result = tls.write(record, length, sent);
+            if (result == TlsStream::Result::WantRead || result == TlsStream::Result::WantWrite) {
+                return Result::WouldBlock;
+            }
+            if (result != TlsStream::Result::Done) return Result::Error;
+            advance(sent);
+        }
+
+        clear();
+        return Result::Done;
+    }
+
+
+
+    void ReplyQueue::advance(size_t sent) {
+        // Move past whatever the transport took
+        while (sent > 0) {
+            size_t left = m_pieces[m_head].length - m_headSent;
+            if (sent < left) {
+                m_headSent += sent;
+                return;
+            }
+            sent -= left;
+            ++m_head;
+            m_headSent = 0;
+        }
+    }
+
+
+
+    void ReplyQueue::clear() {
+        m_pieces.clear();
+        m_scratch.clear();
+        m_head = 0;
+        m_headSent = 0;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef INCLUDED_SMTP_REPLY_LINUX
+#define INCLUDED_SMTP_REPLY_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+
+struct iovec;
+
+namespace smtp {
+    class TlsStream;
+
+    // Replies produced while working through one read's worth of (possibly
+    // pipelined) commands. They are written together with a single sendmsg()
+    // whose iovecs point at the reply literals themselves; only text built at
+    // runtime is copied, into a per-session scratch buffer.
+    class ReplyQueue {
+    public:
+        enum class Result { Done, WouldBlock, Error };
+
+        // text must outlive the queue entry (a string literal, for example)
+        void addStatic(std::string_view text);
+        // text is copied
+        void addCopy(std::string_view text);
+
+        // Writes as much as the socket takes. Blocking sockets return Done or Error.
+        // With a TLS stream the pieces are coalesced into records and go
+        // through SSL_write, unless the kernel encrypts (then sendmsg as usual).
+        Result flush(int socket, TlsStream* tls = nullptr);
+
+        // For a transport that writes asynchronously (io_uring): up to max
+        // iovecs over the unsent bytes, valid until the next add or sent()
+        size_t gather(struct iovec* iov, size_t max) const;
+        // Marks bytes as written; the queue is cleared once all of them are
+        void sent(size_t bytes);
+
+        bool empty() const { return m_head == m_pieces.size(); }
+        void clear();
+
+    private:
+        Result flushTls(TlsStream& tls);
+        void advance(size_t sent);
+
+        struct Piece {
+            const char* data;   // nullptr: bytes live in m_scratch at offset
+            size_t offset;
+            size_t length;
+        };
+
+        std::vector<Piece> m_pieces;
+        std::string m_scratch;
+        size_t m_head = 0;      // First piece not completely sent
+        size_t m_headSent = 0;  // Bytes of that piece already sent
+    };
+}
+
+#endif
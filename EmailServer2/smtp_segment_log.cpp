@@ -0,0 +1,647 @@
+#include "smtp_segment_log.h"
+#include "smtp_log.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+namespace smtp {
+
+    namespace {
+        const uint32_t RECORD_MAGIC = 0x3147534d;               // "MSG1"
+        const uint64_t INDEX_MAGIC = 0x3158444947455321ull;     // "!SEGIDX1"
+        const uint64_t INDEX_CHUNK = uint64_t(1) << 20;         // Index growth step: 64K entries
+        const size_t INDEX_RESERVE = size_t(1) << 34;           // Address space for 1G entries
+        const int OFFSET_BITS = 40;
+        const uint64_t DROP_CHUNK = 65536;                      // Index entries judged per lock hold
+
+        // Followed by length bytes of data, padded to 8
+        struct RecordHeader {
+            uint32_t magic;
+            uint32_t length;
+            uint64_t id;
+            uint64_t check;     // Of the fields above: a torn header at the tail fails it
+        };
+
+        // Entry id of the index file; entry 0 is the IndexHeader. position is
+        // segment << 40 | offset, or 0 when the id has no record. ENTRY_DROPPED
+        // marks a record compaction judged dead, so recovery does not bring
+        // it back from the active segment.
+        struct IndexEntry {
+            uint64_t position;
+            uint32_t length;
+            uint32_t flags;
+        };
+
+        const uint32_t ENTRY_DROPPED = 1;
+
+        struct IndexHeader {
+            uint64_t magic;
+            uint64_t nextId;
+        };
+
+        static_assert(sizeof(IndexEntry) == 16 && sizeof(IndexHeader) == sizeof(IndexEntry), "index layout");
+
+        uint64_t headerCheck(const RecordHeader& header) {
+            uint64_t x = ((static_cast<uint64_t>(header.length) << 32) | header.magic) ^ (header.id * 0x9e3779b97f4a7c15ull);
+            x ^= x >> 31;
+            x *= 0xbf58476d1ce4e5b9ull;
+            return x ^ (x >> 27);
+        }
+
+        uint64_t recordBytes(uint64_t length) {
+            return (sizeof(RecordHeader) + length + 7) & ~uint64_t(7);
+        }
+
+        uint64_t makePosition(uint32_t segment, uint64_t offset) {
+            return (static_cast<uint64_t>(segment) << OFFSET_BITS) | offset;
+        }
+
+        uint32_t segmentOf(uint64_t position) {
+            return static_cast<uint32_t>(position >> OFFSET_BITS);
+        }
+
+        uint64_t offsetOf(uint64_t position) {
+            return position & ((uint64_t(1) << OFFSET_BITS) - 1);
+        }
+
+        IndexEntry* entryAt(char* index, uint64_t id) {
+            return reinterpret_cast<IndexEntry*>(index) + id;
+        }
+
+        // Readers in other processes see an entry change as one 8-byte store
+        uint64_t loadPosition(const IndexEntry* entry) {
+            return __atomic_load_n(&entry->position, __ATOMIC_ACQUIRE);
+        }
+
+        void storePosition(IndexEntry* entry, uint64_t position) {
+            __atomic_store_n(&entry->position, position, __ATOMIC_RELEASE);
+        }
+
+        std::string segmentPath(const std::string& directory, uint32_t segment) {
+            char name[16];
+            snprintf(name, sizeof(name), "%08u.seg", segment);
+            return directory + "/" + name;
+        }
+
+        bool parseSegmentName(const char* name, uint32_t& segment) {
+            if (strlen(name) != 12 || strcmp(name + 8, ".seg") != 0) return false;
+            segment = 0;
+            for (int i = 0; i < 8; ++i) {
+                if (name[i] < '0' || name[i] > '9') return false;
+                segment = segment * 10 + static_cast<uint32_t>(name[i] - '0');
+            }
+            return segment != 0;
+        }
+
+        // The index is mapped into one reserved range and grows by mapping
+        // more of the file after what is already there, so entries never
+        // move under a thread that is reading them
+        char* reserveIndex() {
+            void* base = mmap(nullptr, INDEX_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            return base == MAP_FAILED ? nullptr : static_cast<char*>(base);
+        }
+
+        bool mapIndex(char* base, int fd, uint64_t from, uint64_t to, int protection) {
+            if (to <= from) return true;
+            return mmap(base + from, to - from, protection, MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(from)) != MAP_FAILED;
+        }
+
+        bool readAll(int fd, char* data, size_t size, uint64_t offset) {
+            while (size > 0) {
+                ssize_t n = pread(fd, data, size, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                data += n;
+                size -= static_cast<size_t>(n);
+                offset += static_cast<uint64_t>(n);
+            }
+            return true;
+        }
+
+        bool writeAll(int fd, iovec* parts, int count, uint64_t offset) {
+            while (count > 0) {
+                ssize_t n = pwritev(fd, parts, count, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return false;
+                offset += static_cast<uint64_t>(n);
+                size_t written = static_cast<size_t>(n);
+                while (count > 0 && written >= parts->iov_len) {
+                    written -= parts->iov_len;
+                    ++parts;
+                    --count;
+                }
+                if (count > 0) {
+                    parts->iov_base = static_cast<char*>(parts->iov_base) + written;
+                    parts->iov_len -= written;
+                }
+            }
+            return true;
+        }
+
+        bool readHeader(int fd, uint64_t offset, RecordHeader& header) {
+            return readAll(fd, reinterpret_cast<char*>(&header), sizeof(header), offset)
+                && header.magic == RECORD_MAGIC && header.check == headerCheck(header);
+        }
+
+        // The record at offset, if it is still the one the index described
+        bool readRecord(int fd, uint64_t offset, uint64_t id, uint32_t length, std::string& data) {
+            RecordHeader header;
+            if (!readHeader(fd, offset, header) || header.id != id || header.length != length) return false;
+            data.resize(length);
+            return readAll(fd, &data[0], length, offset + sizeof(header));
+        }
+    }
+
+
+
+    SegmentLogReader::SegmentLogReader(const std::string& directory)
+        : m_directory(directory) {
+    }
+
+
+
+    SegmentLogReader::~SegmentLogReader() {
+        if (m_index != nullptr) munmap(m_index, INDEX_RESERVE);
+        if (m_indexFd >= 0) close(m_indexFd);
+    }
+
+
+
+    bool SegmentLogReader::read(uint64_t id, std::string& data) {
+        if (id == 0) return false;
+        uint64_t needed = (id + 1) * sizeof(IndexEntry);
+        if (needed > m_mappedBytes.load(std::memory_order_acquire)) {
+            // The writer has grown the index since it was last mapped here (or it never was)
+            std::lock_guard<std::mutex> lock(m_mapMutex);
+            size_t mapped = m_mappedBytes.load(std::memory_order_relaxed);
+            if (needed > mapped) {
+                if (m_indexFd < 0) {
+                    m_indexFd = ::open((m_directory + "/index").c_str(), O_RDONLY | O_CLOEXEC);
+                    if (m_indexFd < 0) return false;
+                }
+                if (m_index == nullptr && (m_index = reserveIndex()) == nullptr) return false;
+                struct stat info;
+                if (fstat(m_indexFd, &info) != 0) return false;
+                uint64_t size = std::min<uint64_t>(static_cast<uint64_t>(info.st_size), INDEX_RESERVE) / INDEX_CHUNK * INDEX_CHUNK;
+                if (needed > size || !mapIndex(m_index, m_indexFd, mapped, size, PROT_READ)) return false;
+                m_mappedBytes.store(size, std::memory_order_release);
+            }
+        }
+
+        const IndexEntry* entry = entryAt(m_index, id);
+        // Compaction can move the record between loading its position and
+        // reading it (the old file is then gone or holds another id): look again once
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            uint64_t position = loadPosition(entry);
+            if (position == 0) return false;
+            uint32_t length = __atomic_load_n(&entry->length, __ATOMIC_RELAXED);
+            int fd = ::open(segmentPath(m_directory, segmentOf(position)).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+            bool found = readRecord(fd, offsetOf(position), id, length, data);
+            close(fd);
+            if (found) return true;
+        }
+        return false;
+    }
+
+
+
+    SegmentLog::SegmentLog(const std::string& directory, const SegmentLogOptions& options, LiveIds live)
+        : m_directory(directory), m_options(options), m_live(std::move(live)) {
+    }
+
+
+
+    SegmentLog::~SegmentLog() {
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        if (m_compactor.joinable()) m_compactor.join();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        syncLocked();
+        for (auto& entry : m_segments) close(entry.second.fd);
+        if (m_index != nullptr) munmap(m_index, INDEX_RESERVE);
+        if (m_indexFd >= 0) close(m_indexFd);
+    }
+
+
+
+    bool SegmentLog::open() {
+        if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!openIndex() || !recover()) return false;
+        }
+        if (m_options.compactIntervalMs > 0) {
+            m_compactor = std::thread([this] { runCompaction(); });
+        }
+        return true;
+    }
+
+
+
+    bool SegmentLog::openIndex() {
+        m_indexFd = ::open((m_directory + "/index").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_indexFd < 0) return false;
+        struct stat info;
+        if (fstat(m_indexFd, &info) != 0) return false;
+        uint64_t size = static_cast<uint64_t>(info.st_size) / INDEX_CHUNK * INDEX_CHUNK;
+        if (size == 0) {
+            size = INDEX_CHUNK;
+            if (ftruncate(m_indexFd, static_cast<off_t>(size)) != 0) return false;
+        }
+        if ((m_index = reserveIndex()) == nullptr) return false;
+        if (!mapIndex(m_index, m_indexFd, 0, size, PROT_READ | PROT_WRITE)) return false;
+        m_indexBytes = size;
+
+        IndexHeader* header = reinterpret_cast<IndexHeader*>(m_index);
+        if (header->magic == 0) {
+            header->magic = INDEX_MAGIC;
+            header->nextId = 1;
+        }
+        else if (header->magic != INDEX_MAGIC) {
+            errno = EINVAL;
+            return false;
+        }
+        return true;
+    }
+
+
+
+    // Opens every segment, finds the end of the active one, repairs index
+    // entries a crash left pointing past it or at removed files, and totals
+    // the live bytes of each segment
+    bool SegmentLog::recover() {
+        DIR* directory = opendir(m_directory.c_str());
+        if (directory == nullptr) return false;
+        while (dirent* item = readdir(directory)) {
+            uint32_t number;
+            if (!parseSegmentName(item->d_name, number)) continue;
+            Segment segment;
+            segment.fd = ::open(segmentPath(m_directory, number).c_str(), O_RDWR | O_CLOEXEC);
+            struct stat info;
+            if (segment.fd < 0 || fstat(segment.fd, &info) != 0) {
+                if (segment.fd >= 0) close(segment.fd);
+                closedir(directory);
+                return false;
+            }
+            segment.capacity = static_cast<uint64_t>(info.st_size);
+            m_segments[number] = segment;
+        }
+        closedir(directory);
+
+        IndexHeader* header = reinterpret_cast<IndexHeader*>(m_index);
+        m_nextId = std::max<uint64_t>(header->nextId, 1);
+        if (m_segments.empty()) {
+            if (!createSegment(0)) return false;
+        }
+        else {
+            // Records after the last synced one may be missing from the index, or torn
+            m_active = m_segments.rbegin()->first;
+            Segment& active = m_segments.rbegin()->second;
+            uint64_t offset = 0;
+            RecordHeader record;
+            while (offset + sizeof(record) <= active.capacity && readHeader(active.fd, offset, record)
+                && offset + recordBytes(record.length) <= active.capacity) {
+                if (!growIndex(record.id)) return false;
+                IndexEntry* entry = entryAt(m_index, record.id);
+                if (loadPosition(entry) == 0 && !(entry->flags & ENTRY_DROPPED)) {
+                    entry->length = record.length;
+                    storePosition(entry, makePosition(m_active, offset));
+                }
+                m_nextId = std::max(m_nextId, record.id + 1);
+                offset += recordBytes(record.length);
+            }
+            m_end = offset;
+        }
+
+        uint64_t entries = m_indexBytes / sizeof(IndexEntry);
+        for (uint64_t id = 1; id < entries; ++id) {
+            IndexEntry* entry = entryAt(m_index, id);
+            uint64_t position = loadPosition(entry);
+            if (position == 0 && !(entry->flags & ENTRY_DROPPED)) continue;
+            m_nextId = std::max(m_nextId, id + 1);
+            if (position == 0) continue;
+            auto segment = m_segments.find(segmentOf(position));
+            if (segment == m_segments.end() || (segment->first == m_active && offsetOf(position) >= m_end)) {
+                storePosition(entry, 0);
+                continue;
+            }
+            segment->second.live += recordBytes(entry->length);
+        }
+
+        header->nextId = m_nextId;
+        m_dirtyFrom = 0;
+        m_dirtyTo = m_indexBytes;
+        m_settled.store(m_nextId, std::memory_order_release);
+        return syncLocked();
+    }
+
+
+
+    bool SegmentLog::createSegment(uint64_t minimumBytes) {
+        uint32_t number = m_segments.empty() ? 1 : m_segments.rbegin()->first + 1;
+        uint64_t capacity = std::max<uint64_t>(m_options.segmentBytes, minimumBytes);
+        std::string path = segmentPath(m_directory, number);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        // Allocated up front, so appends never extend the file and fdatasync
+        // has no size change to write
+        int rc = posix_fallocate(fd, 0, static_cast<off_t>(capacity));
+        if (rc != 0) {
+            close(fd);
+            unlink(path.c_str());
+            errno = rc;
+            return false;
+        }
+        // The name has to outlive a crash before anything in the file is referenced
+        int directory = ::open(m_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directory >= 0) {
+            fsync(directory);
+            close(directory);
+        }
+
+        Segment segment;
+        segment.fd = fd;
+        segment.capacity = capacity;
+        m_segments[number] = segment;
+        m_active = number;
+        m_end = 0;
+        return true;
+    }
+
+
+
+    bool SegmentLog::growIndex(uint64_t id) {
+        uint64_t needed = (id + 1) * sizeof(IndexEntry);
+        if (needed <= m_indexBytes) return true;
+        uint64_t size = (needed + INDEX_CHUNK - 1) / INDEX_CHUNK * INDEX_CHUNK;
+        if (size > INDEX_RESERVE) {
+            errno = EFBIG;
+            return false;
+        }
+        if (ftruncate(m_indexFd, static_cast<off_t>(size)) != 0) return false;
+        if (!mapIndex(m_index, m_indexFd, m_indexBytes, size, PROT_READ | PROT_WRITE)) return false;
+        m_indexBytes = size;
+        return true;
+    }
+
+
+
+    uint64_t SegmentLog::append(std::string_view data) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t id = m_nextId;
+        if (!write(id, data)) {
+            Log::printf(LogLevel::Error, "Segment log %s: append failed: %s", m_directory.c_str(), strerror(errno));
+            return 0;
+        }
+        m_nextId = id + 1;
+        reinterpret_cast<IndexHeader*>(m_index)->nextId = m_nextId;
+        m_dirtyFrom = 0;
+        return id;
+    }
+
+
+
+    // Appends a record for id at the head and points the index at it; a
+    // record id had elsewhere (a compaction move) stops counting as live there
+    bool SegmentLog::write(uint64_t id, std::string_view data) {
+        if (data.size() > UINT32_MAX) {
+            errno = EFBIG;
+            return false;
+        }
+        uint64_t bytes = recordBytes(data.size());
+        if (m_end + bytes > m_segments[m_active].capacity) {
+            if (!createSegment(bytes)) return false;
+        }
+        if (!growIndex(id)) return false;
+
+        Segment& segment = m_segments[m_active];
+        RecordHeader header = { RECORD_MAGIC, static_cast<uint32_t>(data.size()), id, 0 };
+        header.check = headerCheck(header);
+        static const char PADDING[8] = {};
+        iovec parts[3] = {
+            { &header, sizeof(header) },
+            { const_cast<char*>(data.data()), data.size() },
+            { const_cast<char*>(PADDING), bytes - sizeof(header) - data.size() },
+        };
+        if (!writeAll(segment.fd, parts, 3, m_end)) return false;
+
+        IndexEntry* entry = entryAt(m_index, id);
+        uint64_t previous = loadPosition(entry);
+        if (previous != 0) {
+            auto old = m_segments.find(segmentOf(previous));
+            if (old != m_segments.end()) old->second.live -= std::min(old->second.live, recordBytes(entry->length));
+        }
+        __atomic_store_n(&entry->length, static_cast<uint32_t>(data.size()), __ATOMIC_RELAXED);
+        entry->flags = 0;
+        storePosition(entry, makePosition(m_active, m_end));
+
+        segment.live += bytes;
+        m_end += bytes;
+        if (m_unsynced.empty() || m_unsynced.back() != m_active) m_unsynced.push_back(m_active);
+        m_dirtyFrom = std::min(m_dirtyFrom, id * sizeof(IndexEntry));
+        m_dirtyTo = std::max(m_dirtyTo, (id + 1) * sizeof(IndexEntry));
+        return true;
+    }
+
+
+
+    bool SegmentLog::sync() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (syncLocked()) return true;
+        Log::printf(LogLevel::Error, "Segment log %s: sync failed: %s", m_directory.c_str(), strerror(errno));
+        return false;
+    }
+
+
+
+    // Data before index: an entry never becomes durable ahead of its record
+    bool SegmentLog::syncLocked() {
+        bool synced = true;
+        for (uint32_t number : m_unsynced) {
+            auto segment = m_segments.find(number);
+            if (segment != m_segments.end() && fdatasync(segment->second.fd) != 0) synced = false;
+        }
+        m_unsynced.clear();
+
+        if (m_dirtyTo > m_dirtyFrom) {
+            uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            uint64_t from = m_dirtyFrom / page * page;
+            if (msync(m_index + from, m_dirtyTo - from, MS_SYNC) != 0) synced = false;
+        }
+        m_dirtyFrom = UINT64_MAX;
+        m_dirtyTo = 0;
+        return synced;
+    }
+
+
+
+    void SegmentLog::settled() {
+        m_settled.store(m_nextId, std::memory_order_release);
+    }
+
+
+
+    bool SegmentLog::read(uint64_t id, std::string& data) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (id == 0 || (id + 1) * sizeof(IndexEntry) > m_indexBytes) return false;
+        const IndexEntry* entry = entryAt(m_index, id);
+        uint64_t position = loadPosition(entry);
+        if (position == 0) return false;
+        auto segment = m_segments.find(segmentOf(position));
+        if (segment == m_segments.end()) return false;
+        return readRecord(segment->second.fd, offsetOf(position), id, entry->length, data);
+    }
+
+
+
+    uint64_t SegmentLog::diskBytes() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t bytes = 0;
+        for (const auto& segment : m_segments) bytes += segment.second.capacity;
+        return bytes;
+    }
+
+
+
+    size_t SegmentLog::compact() {
+        // Ids appended after this may not be referenced yet; they wait for the next pass
+        uint64_t below = m_settled.load(std::memory_order_acquire);
+        std::vector<uint64_t> live;
+        if (!m_live(live)) return 0;
+        std::sort(live.begin(), live.end());
+        size_t dropped = dropDead(live, below);
+
+        std::vector<uint32_t> victims;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto& segment : m_segments) {
+                if (segment.first == m_active) continue;
+                if (segment.second.live < m_options.compactBelow * static_cast<double>(segment.second.capacity)) {
+                    victims.push_back(segment.first);
+                }
+            }
+        }
+
+        size_t removed = 0;
+        for (uint32_t number : victims) {
+            if (rewrite(number)) ++removed;
+        }
+        if (dropped > 0 || removed > 0) {
+            Log::printf(LogLevel::Info, "Segment log %s: %zu records dropped, %zu segments compacted",
+                m_directory.c_str(), dropped, removed);
+        }
+        return removed;
+    }
+
+
+
+    // Clears the index entry of every id below `below` that is not in live
+    // (sorted), a chunk of the index at a time, and marks it dropped
+    size_t SegmentLog::dropDead(const std::vector<uint64_t>& live, uint64_t below) {
+        size_t dropped = 0;
+        size_t next = 0;
+        for (uint64_t first = 1; first < below; first += DROP_CHUNK) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            uint64_t last = std::min({ below, first + DROP_CHUNK, m_indexBytes / sizeof(IndexEntry) });
+            for (uint64_t id = first; id < last; ++id) {
+                while (next < live.size() && live[next] < id) ++next;
+                if (next < live.size() && live[next] == id) continue;
+
+                IndexEntry* entry = entryAt(m_index, id);
+                uint64_t position = loadPosition(entry);
+                if (position == 0) continue;
+                auto segment = m_segments.find(segmentOf(position));
+                if (segment != m_segments.end()) {
+                    segment->second.live -= std::min(segment->second.live, recordBytes(entry->length));
+                }
+                storePosition(entry, 0);
+                entry->flags |= ENTRY_DROPPED;
+                m_dirtyFrom = std::min(m_dirtyFrom, id * sizeof(IndexEntry));
+                m_dirtyTo = std::max(m_dirtyTo, (id + 1) * sizeof(IndexEntry));
+                ++dropped;
+            }
+        }
+        return dropped;
+    }
+
+
+
+    // Copies the records of a sealed segment that the index still points at
+    // to the head, makes the copies durable, then removes the file
+    bool SegmentLog::rewrite(uint32_t number) {
+        int fd;
+        uint64_t capacity;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto segment = m_segments.find(number);
+            if (segment == m_segments.end() || number == m_active) return false;
+            fd = segment->second.fd;
+            capacity = segment->second.capacity;
+        }
+
+        // Only this thread closes a sealed segment, so fd stays valid unlocked
+        std::string data;
+        RecordHeader record;
+        for (uint64_t offset = 0; offset + sizeof(record) <= capacity && readHeader(fd, offset, record);
+            offset += recordBytes(record.length)) {
+            uint64_t position = makePosition(number, offset);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if ((record.id + 1) * sizeof(IndexEntry) > m_indexBytes
+                    || loadPosition(entryAt(m_index, record.id)) != position) continue;
+            }
+            if (!readRecord(fd, offset, record.id, record.length, data)) {
+                Log::printf(LogLevel::Error, "Segment log %s: unreadable record in segment %u", m_directory.c_str(), number);
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (loadPosition(entryAt(m_index, record.id)) != position) continue;
+            if (!write(record.id, data)) {
+                Log::printf(LogLevel::Error, "Segment log %s: compaction failed: %s", m_directory.c_str(), strerror(errno));
+                return false;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Segment& segment = m_segments[number];
+        if (segment.live != 0) {
+            // Something the scan could not reach is still referenced
+            Log::printf(LogLevel::Warning, "Segment log %s: segment %u keeps %llu live bytes",
+                m_directory.c_str(), number, static_cast<unsigned long long>(segment.live));
+            return false;
+        }
+        if (!syncLocked()) return false;
+        close(segment.fd);
+        m_segments.erase(number);
+        unlink(segmentPath(m_directory, number).c_str());
+        return true;
+    }
+
+
+
+    void SegmentLog::runCompaction() {
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        while (!m_stop) {
+            m_wake.wait_for(lock, std::chrono::milliseconds(m_options.compactIntervalMs), [this] { return m_stop; });
+            if (m_stop) break;
+            lock.unlock();
+            compact();
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef INCLUDED_SMTP_SEGMENT_LOG_LINUX
+#define INCLUDED_SMTP_SEGMENT_LOG_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+namespace smtp {
+    struct SegmentLogOptions {
+        size_t segmentBytes = size_t(64) << 20;  // Preallocated size of each segment file
+        double compactBelow = 0.5;                // Sealed segments holding less live data than this fraction are rewritten
+        int compactIntervalMs = 60000;            // Between compaction passes; 0 turns compaction off
+    };
+
+    // Read side of a segment log directory. The index is mapped read-only and
+    // grows in place; a record is read with its own open/pread/close, so a
+    // reader never holds a compacted segment alive. Safe from any number of
+    // threads, and from other processes while the writer appends.
+    class SegmentLogReader {
+    public:
+        explicit SegmentLogReader(const std::string& directory);
+        ~SegmentLogReader();
+
+        // False if id has no record: never stored, or reclaimed by compaction
+        bool read(uint64_t id, std::string& data);
+
+    private:
+        std::string m_directory;
+        int m_indexFd = -1;
+        char* m_index = nullptr;                    // Reserved address range, mapped up to m_mappedBytes
+        std::atomic<size_t> m_mappedBytes{ 0 };
+        std::mutex m_mapMutex;
+    };
+
+    // Append-only store of records addressed by increasing 64-bit ids, kept in
+    // a directory of preallocated segment files ("00000001.seg", ...) and an
+    // index file of fixed 16-byte entries (id -> segment, offset, length)
+    // that readers map. Only the newest segment is appended to; the others
+    // are sealed. A record becomes durable at the next sync(), which
+    // fdatasyncs every segment written since the last one and then the index,
+    // so one sync covers a whole batch.
+    //
+    // Compaction runs on a background thread: it asks the owner which ids
+    // are still live, drops the rest from the index, and rewrites sealed
+    // segments that fell below compactBelow by copying their live records to
+    // the head of the log, after which the old file is removed. Moving a
+    // record only changes its index entry, so whatever refers to it by id is
+    // never touched.
+    class SegmentLog {
+    public:
+        // Fills ids with every live id, in any order; false skips the pass.
+        // Runs on the compaction thread.
+        using LiveIds = std::function<bool(std::vector<uint64_t>& ids)>;
+
+        SegmentLog(const std::string& directory, const SegmentLogOptions& options, LiveIds live);
+        ~SegmentLog();
+
+        // Creates or recovers the log and starts compaction; false (with errno) on failure
+        bool open();
+
+        // One writer thread. append() returns the id data is stored under, or 0;
+        // settled() tells compaction that every id appended so far is either
+        // referenced by its owner or never will be, so it may be judged.
+        uint64_t append(std::string_view data);
+        bool sync();
+        void settled();
+        bool read(uint64_t id, std::string& data);
+
+        // One pass now, as the background thread does; returns the segments removed
+        size_t compact();
+
+        // Bytes of every segment file, live or not
+        uint64_t diskBytes();
+
+    private:
+        struct Segment {
+            int fd = -1;
+            uint64_t capacity = 0;  // File size
+            uint64_t live = 0;      // Bytes of records the index points at
+        };
+
+        bool openIndex();
+        bool recover();
+        bool createSegment(uint64_t minimumBytes);
+        bool growIndex(uint64_t id);
+        bool write(uint64_t id, std::string_view data);   // m_mutex held
+        bool syncLocked();
+        size_t dropDead(const std::vector<uint64_t>& live, uint64_t below);
+        bool rewrite(uint32_t segment);
+        void runCompaction();
+
+        std::string m_directory;
+        SegmentLogOptions m_options;
+        LiveIds m_live;
+
+        int m_indexFd = -1;
+        char* m_index = nullptr;        // Reserved address range, mapped up to m_indexBytes
+        uint64_t m_indexBytes = 0;
+
+        // Segments, the append position, the index and its dirty range
+        std::mutex m_mutex;
+        std::map<uint32_t, Segment> m_segments;
+        uint32_t m_active = 0;
+        uint64_t m_end = 0;             // Append offset in the active segment
+        std::vector<uint32_t> m_unsynced;
+        uint64_t m_dirtyFrom = UINT64_MAX, m_dirtyTo = 0;
+        uint64_t m_nextId = 1;
+        std::atomic<uint64_t> m_settled{ 1 };
+
+        std::mutex m_wakeMutex;
+        std::condition_variable m_wake;
+        bool m_stop = false;
+        std::thread m_compactor;
+    };
+}
+
+#endif
@@ -2,98 +2,139 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <regex>
-#include <sqlite3.h>
+#include <netinet/tcp.h>
+#include "smtp_event_loop.h"
+#include "smtp_uring_loop.h"
 
 
 namespace smtp {
 
+    namespace {
+        // RFC 5321 4.5.3.1: 512 octets per command line
+        const size_t MAX_COMMAND_LINE = 512;
+
+        // Continuation of the EHLO reply (RFC 2920 command pipelining, RFC 3207
+        // STARTTLS while the session is still in plaintext)
+        const char EHLO_EXTENSIONS[] = "250 PIPELINING\r\n";
+        const char EHLO_EXTENSIONS_STARTTLS[] = "250-PIPELINING\r\n250 STARTTLS\r\n";
+
+        // Threaded mode: how long a timed-out session may take to write its 421
+        const uint64_t TIMEOUT_GRACE_MS = 5000;
+    }
 
 
 // Constructor
     TcpServer::TcpServer(const std::string& ipAddress, int port, int maxThreads)
-        : m_ip_address(ipAddress), m_port(port) {
-        
+        : TcpServer([&] {
+            ServerConfig config;
+            config.ipAddress = ipAddress;
+            config.port = port;
+            config.maxThreads = maxThreads;
+            return config;
+        }()) {
+    }
+
+
+
+    TcpServer::TcpServer(const ServerConfig& config)
+        : m_config(config), m_ip_address(config.ipAddress), m_port(config.port) {
         
+        Log::configure(m_config.log);
 
 
-// Initialize thread pool
-        for (int i = 0; i < maxThreads; ++i) {
-            workerThreads.emplace_back([this] {
-                while (true) {
-                    int clientSocket = -1;
-                    {
-                        std::unique_lock<std::mutex> lock(queueMutex);
-                        condition.wait(lock, [this] {
-                            return !clientQueue.empty() || shutdownFlag;
-                            });
-                        if (shutdownFlag) return;
-                        clientSocket = clientQueue.front();
-                        clientQueue.pop();
-                    }
-                    handleClient(clientSocket);
-                }
-                });
+// Session deadlines (threaded workers share one timer thread; each epoll loop keeps its own wheel)
+        if (m_config.ioModel == IoModel::Threaded) {
+            m_sessionTimers = std::make_unique<TimerThread>(static_cast<uint64_t>(std::max(m_config.timeouts.tickMs, 1)));
         }
 
 
+// Initialize thread pool (the epoll loops and reusePort acceptor groups are started by startListen instead)
+        if (m_config.ioModel == IoModel::Threaded && !m_config.reusePort) {
+            for (int i = 0; i < m_config.maxThreads; ++i) {
+                workerThreads.emplace_back([this] { serveQueue(clientQueue, queueMutex, condition); });
+            }
+        }
 
 
-// Database Initialization
-        sqlite3* db;
 
 
-        // In constructor:
-        if (sqlite3_open("smtp_server.db", &m_db) != SQLITE_OK) {
-            exitWithError("Failed to open database");
+// Metrics (per-thread counters and histograms, scraped at /metrics)
+        if (m_config.metrics.enabled) {
+            m_metricsEndpoint = std::make_unique<MetricsEndpoint>(m_config.metrics);
         }
 
-        // Create tables if they don't exist
-        const char* createTablesSQL = R"(
-    CREATE TABLE IF NOT EXISTS Emails (
-        id INTEGER PRIMARY KEY AUTOINCREMENT,
-        sender TEXT NOT NULL,
-        recipient TEXT NOT NULL,
-        subject TEXT,
-        body TEXT NOT NULL,
-        timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
-        status TEXT DEFAULT 'QUEUED',
-        spam_score REAL
-    );
-    CREATE TABLE IF NOT EXISTS SpamLogs (
-        id INTEGER PRIMARY KEY AUTOINCREMENT,
-        sender TEXT NOT NULL,
-        recipient TEXT NOT NULL,
-        body TEXT NOT NULL,
-        timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
-        spam_score REAL NOT NULL
-    );
-)";
-        if (sqlite3_exec(db, createTablesSQL, nullptr, nullptr, nullptr) != SQLITE_OK) {
-            std::cerr << "Failed to create tables: " << sqlite3_errmsg(db) << std::endl;
-            exit(1);
+
+// STARTTLS (loads the certificate; a bad one stops the server here rather than at the first client)
+        if (m_config.tls.enabled) {
+            m_tls = std::make_unique<TlsContext>(m_config.tls);
+            // OpenSSL writes with write(), not send(MSG_NOSIGNAL): a peer that
+            // hangs up mid-reply must not kill the process
+            signal(SIGPIPE, SIG_IGN);
         }
-        sqlite3_close(db);
 
 
+// Rate Limiting (per-address token buckets, idle addresses evicted in the background)
+        m_rateLimiter = std::make_unique<RateLimiter>(m_config.rateLimit);
+
+
+// Database Initialization (opens the file, creates tables, starts the writer thread)
+        m_store = std::make_unique<MailStore>(m_config.storage);
+
+        // Picks up the queue left by the last run, then every row as it is committed
+        if (m_config.delivery.enabled) {
+            m_delivery = std::make_unique<DeliveryAgent>(m_config.delivery, *m_store, m_config.storage.path, m_config.storage.shards);
+        }
+
+        // Persistent connections to the spam classifier are opened on first use
+        m_spamClient = std::make_unique<SpamClient>(m_config.spamCheck);
 
+        // Trains from SpamLogs/Emails in the background; until then every message goes to the client
+        m_classifier = std::make_unique<BayesClassifier>(m_config.bayes, m_config.storage.path, m_config.storage.shards);
 
 
+
+
+
+// Create, bind and listen (with reusePort, acceptors open more sockets on the same port)
+        m_socket = openListener();
+
+        // Log server start
+        std::ostringstream ss;
+        ss << "SMTP server started on " << m_ip_address << ":" << m_port;
+        log(ss.str());
+    }
+
+
+
+
+    int TcpServer::openListener() {
 // Create the socket
-        m_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (m_socket < 0) {
+        int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSocket < 0) {
             exitWithError("Failed to create socket");
         }
 
         // Allow socket reuse to avoid "address already in use" errors
         int opt = 1;
-        if (setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
             exitWithError("Failed to set SO_REUSEADDR");
         }
 
+        // Every socket in a SO_REUSEPORT group gets its own accept queue; the
+        // kernel spreads incoming connections across them
+        if (m_config.reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            exitWithError("Failed to set SO_REUSEPORT");
+        }
+
 
 // Configure the server address structure
         struct sockaddr_in serverAddress;
@@ -104,27 +145,23 @@ namespace smtp {
 
 
 // Bind the socket to the IP/port
-        if (bind(m_socket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        if (bind(listenSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
             std::ostringstream ss;
             ss << "Failed to bind to " << m_ip_address << ":" << m_port;
             exitWithError(ss.str());
         }
 
 
-// Start listening (backlog of 100 pending connections)
-        if (listen(m_socket, 100) < 0) {
+// Start listening (completed connections waiting for accept, capped by net.core.somaxconn)
+        if (listen(listenSocket, m_config.backlog) < 0) {
             exitWithError("Failed to listen on socket");
         }
 
-        // Log server start
-        std::ostringstream ss;
-        ss << "SMTP server started on " << m_ip_address << ":" << m_port;
-        log(ss.str());
+        return listenSocket;
     }
 
 
 
-
 // Destructor
     TcpServer::~TcpServer() {
         shutdownFlag = true;
@@ -132,236 +169,813 @@ namespace smtp {
         for (auto& thread : workerThreads) {
             if (thread.joinable()) thread.join();
         }
+        for (auto& group : acceptorGroups) {
+            // Wakes an acceptor blocked in accept()
+            shutdown(group->listenSocket, SHUT_RDWR);
+            {
+                std::lock_guard<std::mutex> lock(group->mutex);
+            }
+            group->ready.notify_all();
+            if (group->acceptor.joinable()) group->acceptor.join();
+            for (auto& thread : group->workers) {
+                if (thread.joinable()) thread.join();
+            }
+        }
+        for (auto& loop : eventLoops) {
+            loop->stop();
+            loop->join();
+        }
+        for (auto& loop : uringLoops) {
+            loop->stop();
+            loop->join();
+        }
+        m_sessionTimers.reset();
+
+        // Fail outstanding spam checks, stop delivering (its last status
+        // changes are queued on the store), then commit what is still queued;
+        // completions for epoll sessions land in loops that are stopped but
+        // not yet destroyed
+        m_spamClient.reset();
+        m_classifier.reset();
+        m_delivery.reset();
+        m_store.reset();
+        eventLoops.clear();
+        uringLoops.clear();
+        for (int listenSocket : m_listeners) {
+            close(listenSocket);
+        }
         close(m_socket);
-        sqlite3_close(m_db);
+        Log::flush();
     }
 
 
 
 // Start listening for connections 
     void TcpServer::startListen() {
+        if (m_config.ioModel == IoModel::Epoll) {
+            runEventLoops();
+        }
+        else if (m_config.ioModel == IoModel::IoUring) {
+            runUringLoops();
+        }
+        else {
+            runThreaded();
+        }
+    }
+
+
+
+    void TcpServer::runThreaded() {
+        if (m_config.reusePort) {
+            runAcceptorGroups();
+        }
+        else {
+            acceptInto(m_socket, clientQueue, queueMutex, condition);
+        }
+    }
+
+
+
+    void TcpServer::acceptInto(int listenSocket, std::queue<AcceptedClient>& queue, std::mutex& mutex, std::condition_variable& ready) {
         while (!shutdownFlag) {
-            struct sockaddr_in clientAddr;
+            struct sockaddr_storage clientAddr;
             socklen_t clientAddrLen = sizeof(clientAddr);
-            int clientSocket = accept(m_socket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+            int clientSocket = accept(listenSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
             if (clientSocket < 0) {
                 if (shutdownFlag) break; // Graceful shutdown
+                if (errno == EINTR || errno == ECONNABORTED) continue;
                 exitWithError("Failed to accept connection");
             }
 
+            uint64_t acceptedAt = Metrics::now();
+            if (!rateLimitCheck((struct sockaddr*)&clientAddr)) {
+                refuseClient(clientSocket);
+                continue;
+            }
+            Metrics::add(Metrics::Counter::ConnectionsAccepted);
+
             {
-                std::lock_guard<std::mutex> lock(queueMutex);
-                clientQueue.push(clientSocket);
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push(AcceptedClient{ clientSocket, acceptedAt });
             }
-            condition.notify_one();
-        }
-    }
-
-
-
-
-// Email Processing
-    void TcpServer::handleClient(int clientSocket) {
-        // SMTP State Machine
-        enum class SmtpState { INIT, HELO, MAIL, RCPT, DATA, QUIT };
-        SmtpState state = SmtpState::INIT;
-        std::string sender, recipient, emailBody;
-        bool connectionActive = true;
-
-        sendResponse(clientSocket, "220 smtp.example.com ESMTP Ready\r\n");
-
-        char buffer[1024];
-        while (connectionActive) {
-            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            if (bytesRead <= 0) break;
-
-            std::string clientData(buffer, bytesRead);
-            sanitizeInput(clientData);
-
-            // Process complete SMTP commands (CRLF separated)
-            size_t crlfPos;
-            while ((crlfPos = clientData.find("\r\n")) != std::string::npos) {
-                std::string command = clientData.substr(0, crlfPos);
-                clientData.erase(0, crlfPos + 2);
-                std::transform(command.begin(), command.end(), command.begin(), ::toupper);
-
-                try {
-                    switch (state) {
-                    case SmtpState::INIT:
-                        if (command.substr(0, 4) == "HELO") {
-                            sendResponse(clientSocket, "250 Hello " + command.substr(5) + "\r\n");
-                            state = SmtpState::HELO;
-                        }
-                        break;
-
-                    case SmtpState::HELO:
-                        if (command.substr(0, 4) == "MAIL") {
-                            sender = extractEmailAddress(command.substr(10));
-                            if (validateEmail(sender)) {
-                                sendResponse(clientSocket, "250 Sender OK\r\n");
-                                state = SmtpState::MAIL;
-                            }
-                            else {
-                                sendResponse(clientSocket, "550 Invalid sender address\r\n");
-                            }
-                        }
-                        break;
-
-                    case SmtpState::MAIL:
-                        if (command.substr(0, 4) == "RCPT") {
-                            recipient = extractEmailAddress(command.substr(8));
-                            if (validateEmail(recipient)) {
-                                sendResponse(clientSocket, "250 Recipient OK\r\n");
-                                state = SmtpState::RCPT;
-                            }
-                            else {
-                                sendResponse(clientSocket, "550 Invalid recipient address\r\n");
-                            }
-                        }
-                        break;
-
-                    case SmtpState::RCPT:
-                        if (command == "DATA") {
-                            sendResponse(clientSocket, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
-                            state = SmtpState::DATA;
-                        }
-                        break;
-
-                    case SmtpState::DATA: {
-                        // Handle dot-stuffing (RFC 5321 Section 4.5.2)
-                        size_t dotPos = emailBody.find("\r\n.");
-                        while (dotPos != std::string::npos) {
-                            emailBody.replace(dotPos, 3, "\r\n");
-                            dotPos = emailBody.find("\r\n.", dotPos + 2);
-                        }
-
-                        // Check for termination sequence
-                        if (emailBody.find("\r\n.\r\n") != std::string::npos) {
-                            // Process complete email
-                            bool isSpam = checkSpam(emailBody);
-
-                            if (isSpam) {
-                                logSpam(sender, recipient, emailBody);
-                                sendResponse(clientSocket, "554 Message rejected as spam\r\n");
-                            }
-                            else {
-                                storeEmail(sender, recipient, emailBody);
-                                sendResponse(clientSocket, "250 Message accepted for delivery\r\n");
-                            }
-
-                            // Reset for next email
-                            state = SmtpState::HELO;
-                            emailBody.clear();
-                        }
-                        break;
-                    }
-
-                    case SmtpState::QUIT:
-                        sendResponse(clientSocket, "221 Bye\r\n");
-                        close(clientSocket);
-                        connectionActive = false;
-                        break;
-                    }
-                }
-                catch (const std::out_of_range&) {
-                    sendResponse(clientSocket, "500 Syntax error, command unrecognized\r\n");
+            ready.notify_one();
+        }
+    }
+
+
+
+    void TcpServer::serveQueue(std::queue<AcceptedClient>& queue, std::mutex& mutex, std::condition_variable& ready) {
+        // A worker drives one session at a time: a single recycled session suffices
+        SessionPool sessions(1);
+        while (true) {
+            AcceptedClient client{ -1, 0 };
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] {
+                    return !queue.empty() || shutdownFlag;
+                    });
+                if (shutdownFlag) return;
+                client = queue.front();
+                queue.pop();
+            }
+            handleClient(client, sessions);
+        }
+    }
+
+
+
+    void TcpServer::runAcceptorGroups() {
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        if (cores <= 0) cores = 1;
+        int groups = m_config.acceptors > 0 ? m_config.acceptors : cores;
+        int workersPerGroup = std::max(1, m_config.maxThreads / groups);
+
+        // Each group is an acceptor with its own listener and queue plus the
+        // workers that drain it, all on one core: a connection never crosses
+        // cores and no lock is shared between groups
+        for (int i = 0; i < groups; ++i) {
+            auto group = std::make_unique<AcceptorGroup>();
+            group->core = i % cores;
+            if (i == 0) {
+                group->listenSocket = m_socket;
+            }
+            else {
+                group->listenSocket = openListener();
+                m_listeners.push_back(group->listenSocket);
+            }
+            acceptorGroups.push_back(std::move(group));
+        }
+
+        for (auto& entry : acceptorGroups) {
+            AcceptorGroup* group = entry.get();
+            for (int i = 0; i < workersPerGroup; ++i) {
+                group->workers.emplace_back([this, group] {
+                    pinToCore(group->core);
+                    serveQueue(group->clients, group->mutex, group->ready);
+                    });
+            }
+            if (group->listenSocket == m_socket) continue; // Accepted on the calling thread below
+            group->acceptor = std::thread([this, group] {
+                pinToCore(group->core);
+                acceptInto(group->listenSocket, group->clients, group->mutex, group->ready);
+                });
+        }
+
+        std::ostringstream ss;
+        ss << "Running " << groups << " SO_REUSEPORT acceptor(s) with " << workersPerGroup << " worker(s) each";
+        log(ss.str());
+
+        // As in the single-queue mode, startListen's thread is an acceptor and returns on shutdown
+        AcceptorGroup& first = *acceptorGroups.front();
+        pinToCore(first.core);
+        acceptInto(first.listenSocket, first.clients, first.mutex, first.ready);
+    }
+
+
+
+    void TcpServer::runEventLoops() {
+        // Every loop accepts for itself, so the listener must never block
+        setNonBlocking(m_socket);
+
+        int loops = m_config.eventLoops;
+        if (loops <= 0) {
+            loops = static_cast<int>(std::thread::hardware_concurrency());
+            if (loops <= 0) loops = 1;
+        }
+
+        // Without reusePort every loop shares m_socket (EPOLLEXCLUSIVE); with it
+        // each loop gets its own listener and stays on one core
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        if (cores <= 0) cores = 1;
+        for (int i = 0; i < loops; ++i) {
+            int listenSocket = m_socket;
+            int core = -1;
+            if (m_config.reusePort) {
+                core = i % cores;
+                if (i > 0) {
+                    listenSocket = openListener();
+                    m_listeners.push_back(listenSocket);
                 }
+            }
+            if (listenSocket != m_socket) setNonBlocking(listenSocket);
+            eventLoops.push_back(std::make_unique<EventLoop>(*this, listenSocket, core));
+        }
+        for (auto& loop : eventLoops) {
+            loop->start();
+        }
 
-                // Handle QUIT command in any state
-                if (command == "QUIT") {
-                    state = SmtpState::QUIT;
+        std::ostringstream ss;
+        ss << "Running " << loops << " epoll event loop(s)" << (m_config.reusePort ? " with SO_REUSEPORT listeners" : "");
+        log(ss.str());
+
+        for (auto& loop : eventLoops) {
+            loop->join();
+        }
+    }
+
+
+
+    void TcpServer::runUringLoops() {
+        // As runEventLoops, except that the listener stays blocking: accepts
+        // are completions, never attempts that would block
+        int loops = m_config.eventLoops;
+        if (loops <= 0) {
+            loops = static_cast<int>(std::thread::hardware_concurrency());
+            if (loops <= 0) loops = 1;
+        }
+
+        int cores = static_cast<int>(std::thread::hardware_concurrency());
+        if (cores <= 0) cores = 1;
+        for (int i = 0; i < loops; ++i) {
+            int listenSocket = m_socket;
+            int core = -1;
+            if (m_config.reusePort) {
+                core = i % cores;
+                if (i > 0) {
+                    listenSocket = openListener();
+                    m_listeners.push_back(listenSocket);
                 }
             }
+            uringLoops.push_back(std::make_unique<UringLoop>(*this, listenSocket, core));
+        }
+        for (auto& loop : uringLoops) {
+            loop->start();
         }
 
-        close(clientSocket);
-        emailsProcessed++;
+        std::ostringstream ss;
+        ss << "Running " << loops << " io_uring loop(s)" << (m_config.reusePort ? " with SO_REUSEPORT listeners" : "");
+        log(ss.str());
+
+        for (auto& loop : uringLoops) {
+            loop->join();
+        }
     }
 
 
 
 
-    bool TcpServer::validateEmail(const std::string& email) {
-        // Basic RFC 5322 regex check
-        // More RFC 5322-compliant regex (still simplified):
-        const std::regex pattern(R"(^([a-zA-Z0-9_\-\.\+]+)@([a-zA-Z0-9_\-\.]+)\.([a-zA-Z]{2,})$)");
-        return std::regex_match(email, pattern);
+// Email Processing (threaded mode: this worker owns the socket for the whole session)
+    void TcpServer::handleClient(const AcceptedClient& client, SessionPool& sessions) {
+        int clientSocket = client.socket;
+        std::unique_ptr<SmtpSession> owned = sessions.acquire();
+        SmtpSession& session = *owned;
+        session.socket = clientSocket;
+        session.acceptedAt = client.acceptedAt;
+
+        // The worker is blocked in recv() or send() when a deadline passes, so
+        // the timer thread shuts the socket under it: reads first, which ends
+        // the wait for input and still lets the 421 out; everything after a
+        // grace period, in case the client is not reading either
+        SmtpSession* target = &session;
+        session.timeout.fire = [this, target] {
+            if (target->timedOut.exchange(true)) {
+                shutdown(target->socket, SHUT_RDWR);
+                return;
+            }
+            shutdown(target->socket, SHUT_RD);
+            m_sessionTimers->schedule(target->timeout, TIMEOUT_GRACE_MS);
+        };
+
+        // Includes the wait for a free worker
+        beginSession(session);
+        armTimeout(session);
+        session.replies.flush(clientSocket);
+        Metrics::observeSince(Metrics::Histogram::AcceptToBanner, session.acceptedAt);
+
+        while (!session.closing) {
+            if (receive(session) <= 0) break;
+
+            // Processing is the server's time, not the client's (it may wait
+            // on the classifier and a commit)
+            m_sessionTimers->cancel(session.timeout);
+            processInput(session);
+            armTimeout(session);
+
+            // One write for every reply to the commands this read contained
+            if (flushReplies(session) != ReplyQueue::Result::Done) break;
+
+            // Blocking socket: the handshake either completes or fails here
+            if (session.tlsPending && continueTls(session) != TlsStream::Result::Done) break;
+        }
+
+        // Once cancelled, the timer thread is done with the session
+        m_sessionTimers->cancel(session.timeout);
+        if (session.timedOut) {
+            timeOut(session);
+            flushReplies(session);
+        }
+
+        closeTransport(session);
+        Metrics::add(Metrics::Counter::SessionsClosed);
+        sessions.release(std::move(owned));
     }
 
 
 
+    void TcpServer::armTimeout(SmtpSession& session) {
+        uint64_t delay;
+        if (nextDeadline(session, Metrics::now() / 1000000, delay)) m_sessionTimers->schedule(session.timeout, delay);
+        else m_sessionTimers->cancel(session.timeout);
+    }
 
-    void TcpServer::sanitizeInput(std::string& data) {
-        // Prevent CRLF injection and strip non-printable chars
-        data.erase(std::remove_if(data.begin(), data.end(),
-            [](char c) { return !isprint(c) || c == '\r' || c == '\n'; }), data.end());
+
+
+    ssize_t TcpServer::receive(SmtpSession& session) {
+        size_t available;
+        char* tail = session.inBuffer.writable(available);
+        size_t received = 0;
+
+        if (session.tls) {
+            TlsStream::Result result = session.tls->read(tail, available, received);
+            if (result == TlsStream::Result::WantRead || result == TlsStream::Result::WantWrite) return -1;
+            if (result != TlsStream::Result::Done) return 0;
+        }
+        else {
+            ssize_t bytesRead;
+            do {
+                bytesRead = recv(session.socket, tail, available, 0);
+            } while (bytesRead < 0 && errno == EINTR);
+            if (bytesRead < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? -1 : 0;
+            if (bytesRead == 0) return 0;
+            received = static_cast<size_t>(bytesRead);
+        }
+
+        commitInput(session, received);
+        return static_cast<ssize_t>(received);
     }
 
 
 
+    void TcpServer::commitInput(SmtpSession& session, size_t bytes) {
+        Metrics::add(Metrics::Counter::BytesReceived, bytes);
+        session.inBuffer.commit(bytes);
+        session.heard = true;
+    }
+
 
-    bool checkSpam(const std::string& emailBody) {
-        // Connect to Python spam service
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        sockaddr_in serv_addr;
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(65432);
-        inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
 
-        if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            std::cerr << "Failed to connect to spam filter" << std::endl;
-            return false;
+    ReplyQueue::Result TcpServer::flushReplies(SmtpSession& session) {
+        return session.replies.flush(session.socket, session.tls.get());
+    }
+
+
+
+    TlsStream::Result TcpServer::continueTls(SmtpSession& session) {
+        if (!session.tls) {
+            SSL* ssl = m_tls->newConnection(session.socket);
+            if (ssl == nullptr) {
+                Metrics::add(Metrics::Counter::TlsFailures);
+                session.closing = true;
+                return TlsStream::Result::Error;
+            }
+            session.tls = std::make_unique<TlsStream>(ssl);
+
+            // Handshake flights and session tickets are separate small writes;
+            // Nagle would hold each behind the peer's delayed ACK
+            int opt = 1;
+            setsockopt(session.socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
         }
 
-        // Send email body to Python
-        send(sock, emailBody.c_str(), emailBody.size(), 0);
+        TlsStream::Result result = session.tls->handshake();
+        if (result == TlsStream::Result::Done) {
+            session.tlsPending = false;
+            Metrics::observeSince(Metrics::Histogram::TlsHandshake, session.tlsStartedAt);
+            Metrics::add(Metrics::Counter::TlsHandshakes);
+            if (session.tls->resumed()) Metrics::add(Metrics::Counter::TlsResumptions);
+            if (session.tls->kernelSend()) Metrics::add(Metrics::Counter::TlsKernelSend);
+        }
+        else if (result != TlsStream::Result::WantRead && result != TlsStream::Result::WantWrite) {
+            Metrics::add(Metrics::Counter::TlsFailures);
+            session.closing = true;
+            session.replies.clear();
+        }
+        return result;
+    }
+
 
-        // Receive result (SPAM/HAM)
-        char buffer[4] = { 0 };
-        recv(sock, buffer, 4, 0);
-        close(sock);
-        return std::string(buffer) == "SPAM";
+
+    void TcpServer::closeTransport(SmtpSession& session) {
+        if (session.tls) session.tls->close();
+        close(session.socket);
     }
 
-    // In handleClient():
-    if (checkSpam(emailBody)) {
-        sendResponse(clientSocket, "554 Message rejected as spam\r\n");
+
+
+    void TcpServer::beginSession(SmtpSession& session) {
+        const TimeoutOptions& timeouts = m_config.timeouts;
+        if (timeouts.sessionMs > 0) session.sessionEndsAt = session.acceptedAt / 1000000 + static_cast<uint64_t>(timeouts.sessionMs);
+        reply(session, "220 smtp.example.com ESMTP Ready\r\n");
     }
-    else {
-        
+
+
+
+    bool TcpServer::nextDeadline(const SmtpSession& session, uint64_t nowMs, uint64_t& delayMs) const {
+        const TimeoutOptions& timeouts = m_config.timeouts;
+        int idle = !session.heard ? timeouts.bannerMs
+            : session.state == SmtpState::DATA ? timeouts.dataBlockMs
+            : timeouts.commandMs;
+
+        bool limited = idle > 0;
+        delayMs = limited ? static_cast<uint64_t>(idle) : 0;
+        if (session.sessionEndsAt != 0) {
+            uint64_t left = session.sessionEndsAt > nowMs ? session.sessionEndsAt - nowMs : 0;
+            delayMs = limited ? std::min(delayMs, left) : left;
+            limited = true;
+        }
+        return limited;
     }
 
 
 
+    void TcpServer::timeOut(SmtpSession& session) {
+        // Whatever was still queued is not coming out now
+        Metrics::add(Metrics::Counter::SessionsTimedOut);
+        session.replies.clear();
+        reply(session, "421 smtp.example.com Timeout exceeded, closing transmission channel\r\n");
+        session.closing = true;
+    }
+
+
+
+    void TcpServer::processInput(SmtpSession& session) {
+        std::string_view line;
+        while (!session.closing && !session.messagePending && !session.tlsPending) {
+            if (session.state == SmtpState::DATA) {
+                // Message bytes bypass the tokenizer and stream into the spool
+                bool complete;
+                size_t used = session.dataDecoder.feed(session.inBuffer.pending(), session.message, complete);
+                session.inBuffer.consume(used);
+                if (!complete) break;
+                Metrics::observeSince(Metrics::Histogram::DataTransfer, session.dataStartedAt);
+                finishMessage(session);
+                continue;
+            }
 
-    std::string TcpServer::extractEmailAddress(const std::string& input) {
-        size_t start = input.find('<');
-        size_t end = input.find('>');
-        if (start != std::string::npos && end != std::string::npos) {
-            return input.substr(start + 1, end - start - 1);
+            LineBuffer::Line result = session.inBuffer.nextLine(line, MAX_COMMAND_LINE);
+            if (result == LineBuffer::Line::Partial) break;
+
+            if (result == LineBuffer::Line::TooLong) {
+                reply(session, "500 Line too long\r\n");
+                continue;
+            }
+
+            handleCommand(session, line);
         }
-        return input;
     }
 
 
 
+    void TcpServer::handleCommand(SmtpSession& session, std::string_view command) {
+        // Replies may echo arguments, so refuse anything that could inject CR/LF
+        if (!isPrintable(command)) {
+            reply(session, "500 Syntax error, command unrecognized\r\n");
+            return;
+        }
 
-    void TcpServer::storeEmail(const std::string& sender,
-        const std::string& recipient,
-        const std::string& body) {
-        sqlite3_stmt* stmt;
-        const char* sql = "INSERT INTO Emails (sender, recipient, body) VALUES (?, ?, ?);";
+        SmtpState& state = session.state;
+        std::string_view argument;
+        Verb verb = parseCommand(command, argument);
+        Metrics::Timer timer(Metrics::command(verb));
+
+        switch (verb) {
+        // Commands valid in any state
+        case Verb::Quit:
+            reply(session, "221 Bye\r\n");
+            session.closing = true;
+            return;
+
+        case Verb::Noop:
+            reply(session, "250 OK\r\n");
+            return;
+
+        case Verb::Rset:
+            session.resetEnvelope();
+            if (state != SmtpState::INIT) state = SmtpState::HELO;
+            reply(session, "250 OK\r\n");
+            return;
+
+        // A (re)greeting also resets the envelope
+        case Verb::Helo:
+        case Verb::Ehlo: {
+            bool extended = verb == Verb::Ehlo;
+            session.resetEnvelope();
+            reply(session, extended ? "250-Hello " : "250 Hello ");
+            replyCopy(session, trim(argument));
+            reply(session, "\r\n");
+            if (extended) reply(session, m_tls && !session.tls ? EHLO_EXTENSIONS_STARTTLS : EHLO_EXTENSIONS);
+            state = SmtpState::HELO;
+            return;
+        }
 
-        if (sqlite3_prepare_v2(m_db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, sender.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 2, recipient.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 3, body.c_str(), -1, SQLITE_TRANSIENT);
+        case Verb::Starttls:
+            if (!m_tls) {
+                reply(session, "502 Command not implemented\r\n");
+                return;
+            }
+            if (session.tls || state != SmtpState::HELO) {
+                reply(session, "503 Bad sequence of commands\r\n");
+                return;
+            }
+            reply(session, "220 Ready to start TLS\r\n");
+            // RFC 3207 4.2: forget everything learned in plaintext, including
+            // any commands pipelined behind STARTTLS (they could be injected)
+            session.inBuffer.clear();
+            session.resetEnvelope();
+            state = SmtpState::INIT;
+            session.tlsPending = true;
+            session.tlsStartedAt = Metrics::now();
+            return;
+
+        case Verb::Mail: {
+            if (state != SmtpState::HELO) {
+                reply(session, "503 Bad sequence of commands\r\n");
+                return;
+            }
+            std::string_view address = extractEmailAddress(argument);
+            if (validateEmail(address)) {
+                session.resetEnvelope();
+                session.sender = session.envelope.copy(address);
+                reply(session, "250 Sender OK\r\n");
+                state = SmtpState::MAIL;
+            }
+            else {
+                reply(session, "550 Invalid sender address\r\n");
+            }
+            return;
+        }
 
-            if (sqlite3_step(stmt) != SQLITE_DONE) {
-                log("Database error: " + std::string(sqlite3_errmsg(m_db)));
+        case Verb::Rcpt: {
+            if (state != SmtpState::MAIL && state != SmtpState::RCPT) {
+                reply(session, "503 Bad sequence of commands\r\n");
+                return;
             }
-            sqlite3_finalize(stmt);
+            std::string_view address = extractEmailAddress(argument);
+            if (!validateEmail(address)) {
+                reply(session, "550 Invalid recipient address\r\n");
+                return;
+            }
+            // A repeated address is accepted but stored once
+            if (std::find(session.recipients.begin(), session.recipients.end(), address) == session.recipients.end()) {
+                // Also bounds how far one envelope can grow the session arena
+                if (session.recipients.size() >= m_config.maxRecipients) {
+                    reply(session, "452 Too many recipients\r\n");
+                    return;
+                }
+                session.recipients.push_back(session.envelope.copy(address));
+            }
+            reply(session, "250 Recipient OK\r\n");
+            state = SmtpState::RCPT;
+            return;
+        }
+
+        case Verb::Data:
+            // With PIPELINING a client sends DATA before seeing the RCPT replies
+            if (state == SmtpState::MAIL) {
+                reply(session, "554 No valid recipients\r\n");
+                return;
+            }
+            if (state != SmtpState::RCPT) {
+                reply(session, "503 Bad sequence of commands\r\n");
+                return;
+            }
+            reply(session, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
+            session.message.begin(m_config.spool);
+            session.dataDecoder.reset();
+            session.dataStartedAt = Metrics::now();
+            state = SmtpState::DATA;
+            return;
+
+        case Verb::Unknown:
+            break;
         }
+
+        reply(session, "500 Syntax error, command unrecognized\r\n");
+    }
+
+
+
+    void TcpServer::finishMessage(SmtpSession& session) {
+        MessageSpool& message = session.message;
+
+        if (!message.finish()) {
+            if (message.status() == MessageSpool::Status::TooLarge) {
+                reply(session, "552 Message size exceeds fixed maximum message size\r\n");
+            }
+            else {
+                reply(session, "451 Requested action aborted: local error in processing\r\n");
+            }
+            session.state = SmtpState::HELO;
+            message.reset();
+            return;
+        }
+
+        // The spam client and the writer read the envelope and body in place
+        // (spooled bodies straight from the mapping), so parsing stops until
+        // the message has been checked and committed
+        session.messagePending = true;
+
+        // Confident in-process scores decide on the spot; the external
+        // classifier only sees what the model is unsure about
+        uint64_t scoreStart = Metrics::now();
+        session.spamScore = m_classifier->score(message.contents());
+        Metrics::observeSince(Metrics::Histogram::BayesScore, scoreStart);
+
+        const std::optional<double>& score = session.spamScore;
+        if (score && *score >= m_config.bayes.spamThreshold) spamDecided(session, SpamVerdict::Spam);
+        else if (score && *score <= m_config.bayes.hamThreshold) spamDecided(session, SpamVerdict::Ham);
+        else {
+            // Captures two pointers: stored inline by std::function, no allocation
+            SmtpSession* target = &session;
+            session.spamCheckStartedAt = Metrics::now();
+            checkSpam(message.contents(), [this, target](SpamVerdict verdict) {
+                Metrics::observeSince(Metrics::Histogram::SpamCheck, target->spamCheckStartedAt);
+                spamDecided(*target, verdict);
+            });
+        }
+
+        // Threaded mode: this worker simply waits for the outcome
+        if (session.loop == nullptr && session.ring == nullptr) {
+            completeMessage(session, session.waitForOutcome());
+        }
+    }
+
+
+
+    void TcpServer::spamDecided(SmtpSession& session, SpamVerdict verdict) {
+        if (verdict == SpamVerdict::Unavailable) {
+            messageFinished(session, MessageOutcome::Deferred);
+            return;
+        }
+
+        session.isSpam = verdict == SpamVerdict::Spam;
+        SmtpSession* target = &session;
+        StoreCallback stored = [this, target](bool durable) {
+            if (!durable) messageFinished(*target, MessageOutcome::Deferred);
+            else messageFinished(*target, target->isSpam ? MessageOutcome::Rejected : MessageOutcome::Accepted);
+        };
+
+        std::string_view emailBody = session.message.contents();
+        if (session.isSpam) logSpam(session.sender, session.recipients, emailBody, session.spamScore, std::move(stored));
+        else storeEmail(session.sender, session.recipients, emailBody, session.spamScore, std::move(stored));
+    }
+
+
+
+    void TcpServer::messageFinished(SmtpSession& session, MessageOutcome outcome) {
+        if (session.loop != nullptr) session.loop->messageCompleted(session, outcome);
+        else if (session.ring != nullptr) session.ring->messageCompleted(session, outcome);
+        else session.postOutcome(outcome);
+    }
+
+
+
+    void TcpServer::completeMessage(SmtpSession& session, MessageOutcome outcome) {
+        session.messagePending = false;
+
+        switch (outcome) {
+        case MessageOutcome::Accepted:
+            Metrics::add(Metrics::Counter::MessagesAccepted);
+            reply(session, "250 Message accepted for delivery\r\n");
+            break;
+        case MessageOutcome::Rejected:
+            Metrics::add(Metrics::Counter::MessagesRejected);
+            reply(session, "554 Message rejected as spam\r\n");
+            break;
+        case MessageOutcome::Deferred:
+            Metrics::add(Metrics::Counter::MessagesDeferred);
+            reply(session, "451 Requested action aborted: local error in processing\r\n");
+            break;
+        }
+
+        // Reset for next email
+        session.state = SmtpState::HELO;
+        session.message.reset();
+    }
+
+
+
+    void TcpServer::reply(SmtpSession& session, std::string_view response) {
+        session.replies.addStatic(response);
+    }
+
+
+
+    void TcpServer::replyCopy(SmtpSession& session, std::string_view response) {
+        session.replies.addCopy(response);
+    }
+
+
+
+
+    bool TcpServer::validateEmail(std::string_view email) {
+        // Same language as the former per-call std::regex, as a state machine
+        return isValidEmailAddress(email);
+    }
+
+
+
+
+    void TcpServer::sanitizeInput(std::string& data) {
+        // Prevent CRLF injection and strip non-printable chars
+        smtp::sanitizeInput(data);
+    }
+
+
+
+
+    bool TcpServer::rateLimitCheck(const sockaddr* clientAddr) {
+        if (m_rateLimiter->allow(clientAddr)) return true;
+        Metrics::add(Metrics::Counter::ConnectionsRefused);
+        return false;
+    }
+
+
+
+    void TcpServer::refuseClient(int clientSocket) {
+        // Best effort: the socket may not be writable and nobody waits for it
+        static const char REFUSED[] = "421 Too many connections from your address, try again later\r\n";
+        send(clientSocket, REFUSED, sizeof(REFUSED) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(clientSocket);
+    }
+
+
+
+    void TcpServer::checkSpam(std::string_view emailBody, SpamCallback done) {
+        m_spamClient->check(emailBody, std::move(done));
+    }
+
+
+
+
+    void TcpServer::reloadSpamModel() {
+        m_classifier->reload();
+    }
+
+
+
+
+    std::string_view TcpServer::extractEmailAddress(std::string_view input) {
+        return smtp::extractEmailAddress(input);
+    }
+
+
+
+
+    void TcpServer::storeEmail(std::string_view sender,
+        const std::vector<std::string_view>& recipients,
+        std::string_view body,
+        std::optional<double> spamScore,
+        StoreCallback done) {
+        m_store->storeEmail(sender, recipients, body, spamScore, std::move(done));
+    }
+
+
+
+
+    void TcpServer::logSpam(std::string_view sender,
+        const std::vector<std::string_view>& recipients,
+        std::string_view body,
+        std::optional<double> spamScore,
+        StoreCallback done) {
+        m_store->logSpam(sender, recipients, body, spamScore, std::move(done));
+    }
+
+
+
+
+    void TcpServer::log(const std::string& message) {
+        Log::write(LogLevel::Info, message);
+    }
+
+
+
+
+    void TcpServer::setNonBlocking(int listenSocket) {
+        int flags = fcntl(listenSocket, F_GETFL, 0);
+        if (flags < 0 || fcntl(listenSocket, F_SETFL, flags | O_NONBLOCK) < 0) {
+            exitWithError("Failed to make listening socket non-blocking");
+        }
+    }
+
+
+
+    void TcpServer::pinToCore(int core) {
+        if (core < 0) return;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0) {
+            log("Failed to pin thread to core " + std::to_string(core) + ": " + strerror(error));
+        }
+    }
+
+
+
+    void TcpServer::exitWithError(const std::string& errorMessage) {
+        Log::flush(); // Whatever led up to this goes out first
+        std::cerr << "ERROR: " << errorMessage << std::endl;
+        std::exit(EXIT_FAILURE);
     }
 
 
@@ -2,51 +2,190 @@
 #define INCLUDED_SMTP_TCPSERVER_LINUX
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <atomic>
 #include <condition_variable>
 #include <arpa/inet.h>
-#include <openssl/ssl.h> // For future TLS integration
+#include <sys/types.h>
+#include <sqlite3.h>
+#include "smtp_parser.h"
+#include "smtp_spool.h"
+#include "smtp_reply.h"
+#include "smtp_storage.h"
+#include "smtp_delivery.h"
+#include "smtp_spam_client.h"
+#include "smtp_bayes.h"
+#include "smtp_rate_limiter.h"
+#include "smtp_metrics.h"
+#include "smtp_tls.h"
+#include "smtp_session.h"
+#include "smtp_uring.h"
+#include "smtp_log.h"
 
 namespace smtp {
+    // How accepted connections are driven
+    enum class IoModel {
+        Threaded,   // One blocked worker thread per connection (maxThreads workers)
+        Epoll,      // Edge-triggered epoll reactor, sessions driven by readiness events
+        IoUring     // io_uring completion loop, each session a coroutine (Linux 6.1)
+    };
+
+    struct ServerConfig {
+        std::string ipAddress = "0.0.0.0";
+        int port = 25;
+        IoModel ioModel = IoModel::Threaded;
+        int maxThreads = 50;    // Threaded: size of the worker pool
+        int eventLoops = 0;     // Epoll, IoUring: number of loops, 0 = one per core
+        int backlog = 1024;     // listen() backlog per listening socket
+        bool reusePort = false; // One SO_REUSEPORT listener per acceptor (threaded) or loop (epoll, io_uring), pinned to a core
+        int acceptors = 0;      // Threaded + reusePort: acceptor groups, 0 = one per core; maxThreads is split across them
+        size_t maxRecipients = 100; // RCPTs accepted per message (RFC 5321 minimum); later ones get 452
+        TimeoutOptions timeouts;    // Banner, command, DATA block and session deadlines
+        UringOptions uring;         // IoUring: queue depth and provided receive buffers per loop
+        SpoolOptions spool;     // DATA buffering and size limits
+        StorageOptions storage; // Database file and group-commit tuning
+        DeliveryOptions delivery;   // Outbound relay of stored mail: routes, connection pools, retry schedule
+        SpamCheckOptions spamCheck; // Classifier connection pool, deadlines, circuit breaker
+        BayesOptions bayes;     // In-process scorer; only borderline messages reach spamCheck
+        RateLimitOptions rateLimit; // Per-address connection rate, checked on accept
+        MetricsOptions metrics;     // Prometheus scrape endpoint
+        TlsOptions tls;             // STARTTLS certificate, resumption and kernel offload
+        LogOptions log;             // Level, per-thread ring size, flush interval, repeat limits
+    };
+
+    // A connection waiting for a worker in threaded mode
+    struct AcceptedClient {
+        int socket;
+        uint64_t acceptedAt;    // Metrics::now() at accept
+    };
+
     class TcpServer {
     public:
         TcpServer(const std::string& ipAddress = "0.0.0.0", int port = 25, int maxThreads = 50);
+        explicit TcpServer(const ServerConfig& config);
         ~TcpServer();
         void startListen();
 
+        // Retrains the in-process spam model from the database without a restart
+        void reloadSpamModel();
+
     private:
-        // SMTP Protocol Handlers
-        void handleClient(int clientSocket);
-        void sendResponse(int socket, const std::string& response);
-        bool validateEmail(const std::string& email); // Basic RFC 5322 validation
+        friend class EventLoop;
+        friend class UringLoop;
+
+        // Connection Drivers
+        int openListener();
+        void runThreaded();
+        void acceptInto(int listenSocket, std::queue<AcceptedClient>& queue, std::mutex& mutex, std::condition_variable& ready);
+        void serveQueue(std::queue<AcceptedClient>& queue, std::mutex& mutex, std::condition_variable& ready);
+        void runAcceptorGroups();
+        void runEventLoops();
+        void runUringLoops();
+        void handleClient(const AcceptedClient& client, SessionPool& sessions);
+
+        // SMTP Protocol Handlers (shared by every driver, replies go to session.replies)
+        void beginSession(SmtpSession& session);
+        void processInput(SmtpSession& session); // Consumes every complete line in session.inBuffer
+        void handleCommand(SmtpSession& session, std::string_view command);
+        void finishMessage(SmtpSession& session);
+        void spamDecided(SmtpSession& session, SpamVerdict verdict);        // Any thread
+        void messageFinished(SmtpSession& session, MessageOutcome outcome); // Any thread; hands the outcome to the session's driver
+        void completeMessage(SmtpSession& session, MessageOutcome outcome);
+        void reply(SmtpSession& session, std::string_view response);     // response must be a literal
+        void replyCopy(SmtpSession& session, std::string_view response);
+
+        // Session deadlines: the delay until the next one for the session's
+        // state, false when none applies; a missed one queues 421 and closes
+        bool nextDeadline(const SmtpSession& session, uint64_t nowMs, uint64_t& delayMs) const;
+        void timeOut(SmtpSession& session);
+        void armTimeout(SmtpSession& session);  // Threaded mode
+        bool validateEmail(std::string_view email); // Basic RFC 5322 validation
+
+        // Transport (the plain socket, or the TLS stream after STARTTLS)
+        ssize_t receive(SmtpSession& session);                  // Into inBuffer: bytes, 0 at EOF/error, -1 would block
+        void commitInput(SmtpSession& session, size_t bytes);   // Bytes already copied into inBuffer's writable space
+        ReplyQueue::Result flushReplies(SmtpSession& session);
+        TlsStream::Result continueTls(SmtpSession& session);    // Starts or advances the STARTTLS handshake
+        void closeTransport(SmtpSession& session);              // close_notify, then close the socket
+        std::string_view extractEmailAddress(std::string_view input);
+
+        // Spam Filtering and Storage (callbacks run on the client/writer threads)
+        void checkSpam(std::string_view emailBody, SpamCallback done);
+        void storeEmail(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done);
+        void logSpam(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done);
 
         // Security
         void sanitizeInput(std::string& data);
-        bool rateLimitCheck(const sockaddr_in& clientAddr); // Limits 10 requests/sec per IP
+        bool rateLimitCheck(const sockaddr* clientAddr); // Limits 10 connections/sec per IP by default
+        void refuseClient(int clientSocket);              // 421 and close, without a session
+
+        // Helpers
+        void log(const std::string& message);
+        void setNonBlocking(int listenSocket);
+        void pinToCore(int core); // Current thread; core < 0 leaves it unpinned
+        void exitWithError(const std::string& errorMessage);
+
+        ServerConfig m_config;
 
         // Thread Pool
         std::vector<std::thread> workerThreads;
-        std::queue<int> clientQueue;
+        std::queue<AcceptedClient> clientQueue;
         std::mutex queueMutex;
         std::condition_variable condition;
-        bool shutdownFlag = false;
+        std::atomic<bool> shutdownFlag{ false };
+
+        // Deadlines of threaded sessions (epoll loops keep their own wheels)
+        std::unique_ptr<TimerThread> m_sessionTimers;
+
+        // Core-local acceptor groups (IoModel::Threaded with reusePort)
+        struct AcceptorGroup {
+            int listenSocket = -1;
+            int core = 0;
+            std::thread acceptor;
+            std::vector<std::thread> workers;
+            std::queue<AcceptedClient> clients;
+            std::mutex mutex;
+            std::condition_variable ready;
+        };
+        std::vector<std::unique_ptr<AcceptorGroup>> acceptorGroups;
+
+        // Event Loops (IoModel::Epoll)
+        std::vector<std::unique_ptr<EventLoop>> eventLoops;
+
+        // Completion Loops (IoModel::IoUring)
+        std::vector<std::unique_ptr<UringLoop>> uringLoops;
 
         // Server State
         int m_socket;
+        std::vector<int> m_listeners;   // SO_REUSEPORT siblings of m_socket
         struct sockaddr_in m_socketAddress;
         std::string m_ip_address;
         int m_port;
 
-        // Security Metrics
-        std::atomic<int> blockedRequests{ 0 };
-        std::atomic<int> emailsProcessed{ 0 };
+        // STARTTLS (one context: the session cache and ticket keys are shared by every connection)
+        std::unique_ptr<TlsContext> m_tls;
+
+        // Metrics (recorded per thread through Metrics, served here)
+        std::unique_ptr<MetricsEndpoint> m_metricsEndpoint;
+
+        // Database (single writer thread, group commit)
+        std::unique_ptr<MailStore> m_store;
+
+        // Outbound delivery of stored mail (one I/O thread, pooled connections per domain)
+        std::unique_ptr<DeliveryAgent> m_delivery;
+
+        // Connection admission (lock-free, shared by every accepting thread)
+        std::unique_ptr<RateLimiter> m_rateLimiter;
 
-        // Database 
-        sqlite3* m_db;
+        // Spam classifiers: in-process first, external for borderline scores
+        std::unique_ptr<BayesClassifier> m_classifier;
+        std::unique_ptr<SpamClient> m_spamClient;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,123 @@
+#include "smtp_session.h"
+#include <cstring>
+#include <algorithm>
+
+
+namespace smtp {
+
+    namespace {
+        // Buffers that grew past these are dropped on recycle rather than
+        // kept for the next connection
+        const size_t RETAINED_INPUT = 64 * 1024;
+        const size_t RETAINED_ENVELOPE = 64 * 1024;
+    }
+
+
+
+    std::string_view SessionArena::copy(std::string_view text) {
+        if (text.empty()) return std::string_view();
+
+        // Earlier blocks are full, later ones are free again after a rewind
+        while (m_current < m_blocks.size() && m_blocks[m_current].size - m_used < text.size()) {
+            ++m_current;
+            m_used = 0;
+        }
+        if (m_current == m_blocks.size()) {
+            size_t size = std::max(m_blockSize, text.size());
+            m_blocks.push_back({ std::unique_ptr<char[]>(new char[size]), size });
+            m_used = 0;
+        }
+
+        char* target = m_blocks[m_current].data.get() + m_used;
+        memcpy(target, text.data(), text.size());
+        m_used += text.size();
+        return std::string_view(target, text.size());
+    }
+
+
+
+    void SessionArena::rewind() {
+        m_current = 0;
+        m_used = 0;
+    }
+
+
+
+    size_t SessionArena::capacity() const {
+        size_t total = 0;
+        for (const Block& block : m_blocks) total += block.size;
+        return total;
+    }
+
+
+
+    void SmtpSession::resetEnvelope() {
+        sender = std::string_view();
+        recipients.clear();
+        envelope.rewind();
+    }
+
+
+
+    void SmtpSession::postOutcome(MessageOutcome result) {
+        std::lock_guard<std::mutex> lock(m_outcomeMutex);
+        m_outcome = result;
+        m_outcomeReady.notify_one();
+    }
+
+
+
+    MessageOutcome SmtpSession::waitForOutcome() {
+        std::unique_lock<std::mutex> lock(m_outcomeMutex);
+        m_outcomeReady.wait(lock, [this] { return m_outcome.has_value(); });
+        MessageOutcome result = *m_outcome;
+        m_outcome.reset();
+        return result;
+    }
+
+
+
+    void SmtpSession::recycle() {
+        socket = -1;
+        state = SmtpState::INIT;
+        resetEnvelope();
+        if (envelope.capacity() > RETAINED_ENVELOPE) envelope = SessionArena();
+        message.reset();
+        dataDecoder.reset();
+        if (inBuffer.capacity() > RETAINED_INPUT) inBuffer = LineBuffer();
+        else inBuffer.reset();
+        replies.clear();
+        loop = nullptr;
+        ring = nullptr;
+        messagePending = false;
+        closing = false;
+        tlsPending = false;
+        tls.reset();
+        acceptedAt = 0;
+        dataStartedAt = 0;
+        tlsStartedAt = 0;
+        heard = false;
+        sessionEndsAt = 0;
+        timedOut = false;
+        spamScore.reset();
+        isSpam = false;
+        spamCheckStartedAt = 0;
+    }
+
+
+
+    std::unique_ptr<SmtpSession> SessionPool::acquire() {
+        if (m_idle.empty()) return std::make_unique<SmtpSession>();
+        std::unique_ptr<SmtpSession> session = std::move(m_idle.back());
+        m_idle.pop_back();
+        return session;
+    }
+
+
+
+    void SessionPool::release(std::unique_ptr<SmtpSession> session) {
+        if (m_idle.size() >= m_maxIdle) return; // Destroyed
+        session->recycle();
+        m_idle.push_back(std::move(session));
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef INCLUDED_SMTP_SESSION_LINUX
+#define INCLUDED_SMTP_SESSION_LINUX
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include "smtp_parser.h"
+#include "smtp_spool.h"
+#include "smtp_reply.h"
+#include "smtp_tls.h"
+#include "smtp_timer_wheel.h"
+
+namespace smtp {
+    // SMTP State Machine
+    enum class SmtpState { INIT, HELO, MAIL, RCPT, DATA, QUIT };
+
+    // What finally happened to a message after DATA
+    enum class MessageOutcome {
+        Accepted,   // Stored, 250
+        Rejected,   // Spam, logged and refused with 554
+        Deferred    // Classifier or database unavailable, 451
+    };
+
+    // Server-side deadlines after RFC 5321 4.5.3.2; a session that misses one
+    // is answered 421 and closed. 0 disables a deadline.
+    struct TimeoutOptions {
+        int bannerMs = 60000;       // From the 220 banner to the client's first bytes
+        int commandMs = 300000;     // Waiting for the next command (at least 5 minutes, per the RFC)
+        int dataBlockMs = 180000;   // Between two reads inside DATA
+        int sessionMs = 1800000;    // Whole connection, however busy
+        int tickMs = 100;           // Resolution of every deadline
+    };
+
+    class EventLoop;
+    class UringLoop;
+
+    // Bump allocator for the envelope strings of one transaction. Blocks are
+    // kept across rewind(), so once a session has seen its largest envelope
+    // it copies addresses without touching the heap.
+    class SessionArena {
+    public:
+        explicit SessionArena(size_t blockSize = 1024) : m_blockSize(blockSize) {}
+
+        // The copy stays valid until rewind()
+        std::string_view copy(std::string_view text);
+        // Forgets every copy, keeps the memory
+        void rewind();
+
+        size_t capacity() const;
+
+    private:
+        struct Block {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        size_t m_blockSize;
+        std::vector<Block> m_blocks;
+        size_t m_current = 0;   // Block being filled
+        size_t m_used = 0;      // Bytes used in it
+    };
+
+    // Everything a connection needs between two reads. Sessions come from a
+    // SessionPool owned by the thread that drives them (a worker or an event
+    // loop) and go back to it on close, so buffers keep the capacity they grew
+    // to and a steady-state session does not allocate.
+    struct SmtpSession {
+        int socket = -1;
+        SmtpState state = SmtpState::INIT;
+        std::string_view sender;        // In envelope
+        std::vector<std::string_view> recipients; // In envelope, distinct, at most ServerConfig::maxRecipients
+        SessionArena envelope;          // Rewound by MAIL, RSET, HELO/EHLO and STARTTLS
+        MessageSpool message;           // Body of the message in DATA
+        DataDecoder dataDecoder;
+        LineBuffer inBuffer;            // Bytes received but not yet parsed
+        ReplyQueue replies;             // Replies not yet written to the socket
+        EventLoop* loop = nullptr;      // Owning loop in epoll mode
+        UringLoop* ring = nullptr;      // Owning loop in io_uring mode (neither: threaded mode)
+        bool messagePending = false;    // In spam check/storage, input paused until it completes
+        bool closing = false;           // Close once replies are flushed
+        bool tlsPending = false;        // STARTTLS answered, input paused until the handshake completes
+        std::unique_ptr<TlsStream> tls; // Set by STARTTLS; all later I/O goes through it
+        uint64_t acceptedAt = 0;        // Metrics::now() at accept
+        uint64_t dataStartedAt = 0;     // Metrics::now() when 354 was queued
+        uint64_t tlsStartedAt = 0;      // Metrics::now() when the STARTTLS 220 was queued
+
+        // Deadlines: one timer, always set to whichever comes first
+        Timer timeout;
+        bool heard = false;             // Any byte received (the banner deadline is over)
+        uint64_t sessionEndsAt = 0;     // Milliseconds on the Metrics::now() clock, 0 = unlimited
+        std::atomic<bool> timedOut{ false };    // Threaded mode: set by the timer thread before it shuts the socket
+
+        // The message after DATA. Callbacks capture only the session, so they
+        // fit std::function's inline storage; what they need is kept here.
+        std::optional<double> spamScore;
+        bool isSpam = false;
+        uint64_t spamCheckStartedAt = 0;
+
+        void resetEnvelope();
+
+        // Threaded mode: the worker blocks in waitForOutcome() until another
+        // thread posts the outcome
+        void postOutcome(MessageOutcome result);
+        MessageOutcome waitForOutcome();
+
+        // Back to the state of a new session, keeping buffer capacity
+        void recycle();
+
+    private:
+        std::mutex m_outcomeMutex;
+        std::condition_variable m_outcomeReady;
+        std::optional<MessageOutcome> m_outcome;
+    };
+
+    // Idle sessions of one thread. Not thread-safe: every acquire and release
+    // happens on the owning worker or loop thread.
+    class SessionPool {
+    public:
+        explicit SessionPool(size_t maxIdle = 256) : m_maxIdle(maxIdle) {}
+
+        std::unique_ptr<SmtpSession> acquire();
+        void release(std::unique_ptr<SmtpSession> session);
+
+    private:
+        size_t m_maxIdle;
+        std::vector<std::unique_ptr<SmtpSession>> m_idle;
+    };
+}
+
+#endif
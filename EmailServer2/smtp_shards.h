@@ -0,0 +1,38 @@
+#ifndef INCLUDED_SMTP_SHARDS_LINUX
+#define INCLUDED_SMTP_SHARDS_LINUX
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+namespace smtp {
+    // Placement of mail when the store is split over several SQLite files.
+    // Writers (MailStore), readers (MailboxReader, the Bayes trainer) and the
+    // rebalance tool must agree on both, across processes and versions, so
+    // neither uses std::hash.
+
+    // The shard holding every row addressed to recipient
+    inline size_t shardOf(std::string_view recipient, size_t shards) {
+        if (shards <= 1) return 0;
+        // FNV-1a, seeded apart from MailboxGenerations' slots
+        uint64_t hash = 14695981039346656037ull ^ 0x5348415244ull;
+        for (char c : recipient) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return static_cast<size_t>((hash >> 16) % shards);
+    }
+
+    // "mail.db" with 4 shards: mail.0.db ... mail.3.db; one shard keeps the plain path
+    inline std::string shardPath(const std::string& path, size_t shard, size_t shards) {
+        if (shards <= 1) return path;
+        size_t dot = path.rfind('.');
+        size_t slash = path.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return path + "." + std::to_string(shard);
+        }
+        return path.substr(0, dot) + "." + std::to_string(shard) + path.substr(dot);
+    }
+}
+
+#endif
@@ -0,0 +1,466 @@
+#include "smtp_spam_client.h"
+#include "smtp_log.h"
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+namespace smtp {
+
+    namespace {
+        const int MAX_EVENTS = 64;
+        const size_t FRAME_HEADER = 8;
+        const uint32_t MAX_REPLY = 64; // "SPAM" / "HAM", anything larger is a protocol error
+
+        void putU32(char* out, uint32_t value) {
+            value = htonl(value);
+            memcpy(out, &value, sizeof(value));
+        }
+
+        uint32_t getU32(const char* in) {
+            uint32_t value;
+            memcpy(&value, in, sizeof(value));
+            return ntohl(value);
+        }
+    }
+
+
+
+    SpamClient::SpamClient(const SpamCheckOptions& options)
+        : m_options(options), m_connections(std::max(options.connections, 1)) {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_epoll < 0 || m_wakeFd < 0) {
+            std::cerr << "ERROR: Failed to create spam client event loop" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0; // Connection i is tagged i + 1
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &ev);
+
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    SpamClient::~SpamClient() {
+        m_stop = true;
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+        if (m_thread.joinable()) m_thread.join();
+
+        for (Connection& connection : m_connections) {
+            if (connection.socket >= 0) close(connection.socket);
+        }
+        close(m_wakeFd);
+        close(m_epoll);
+    }
+
+
+
+    void SpamClient::check(std::string_view body, SpamCallback done) {
+        auto request = std::make_unique<Request>();
+        request->body = body;
+        request->done = std::move(done);
+        request->deadline = Clock::now() + std::chrono::milliseconds(m_options.timeoutMs);
+        {
+            std::lock_guard<std::mutex> lock(m_submitMutex);
+            m_submitted.push_back(std::move(request));
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void SpamClient::run() {
+        struct epoll_event events[MAX_EVENTS];
+
+        while (!m_stop) {
+            int ready = epoll_wait(m_epoll, events, MAX_EVENTS, nextTimeout(Clock::now()));
+            if (ready < 0 && errno != EINTR) {
+                Log::printf(LogLevel::Error, "Spam client epoll_wait failed: %s", strerror(errno));
+                break;
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                if (events[i].data.u64 == 0) {
+                    uint64_t count;
+                    ssize_t ignored = read(m_wakeFd, &count, sizeof(count));
+                    (void)ignored;
+                    continue;
+                }
+                onEvent(static_cast<int>(events[i].data.u64 - 1), events[i].events);
+            }
+
+            acceptSubmissions();
+            dispatch();
+            expire(Clock::now());
+        }
+
+        // Nobody may be left waiting on a verdict
+        acceptSubmissions();
+        for (size_t i = 0; i < m_connections.size(); ++i) {
+            if (m_connections[i].socket >= 0) dropConnection(static_cast<int>(i));
+        }
+        while (!m_pending.empty()) {
+            uint32_t id = m_pending.front();
+            m_pending.pop_front();
+            finish(id, SpamVerdict::Unavailable, true);
+        }
+    }
+
+
+
+    void SpamClient::acceptSubmissions() {
+        m_accepting.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_submitMutex);
+            m_accepting.swap(m_submitted);
+        }
+
+        for (auto& request : m_accepting) {
+            uint32_t id = m_nextId++;
+            if (id == 0) id = m_nextId++;
+            request->id = id;
+            putU32(request->header, id);
+            putU32(request->header + 4, static_cast<uint32_t>(request->body.size()));
+            m_requests.emplace(id, std::move(request));
+            m_pending.push_back(id);
+        }
+    }
+
+
+
+    void SpamClient::dispatch() {
+        if (m_pending.empty()) return;
+
+        // Open circuit: fail fast instead of queueing behind a dead classifier.
+        // Once the cooldown is over, one request probes it and the others fail
+        // fast until the probe has an answer.
+        if (m_consecutiveFailures >= m_options.breakerThreshold) {
+            if (m_probe != 0 || Clock::now() < m_openUntil) {
+                failPending();
+                return;
+            }
+            m_probe = m_pending.front();
+            m_pending.pop_front();
+            failPending();
+            m_pending.push_back(m_probe);
+        }
+
+        size_t count = m_connections.size();
+        while (!m_pending.empty()) {
+            int chosen = -1;
+            for (size_t n = 0; n < count; ++n) {
+                int index = static_cast<int>((m_nextConnection + n) % count);
+                Connection& connection = m_connections[index];
+                if (connection.socket < 0 && !connect(index)) continue;
+                if (connection.inFlight < static_cast<size_t>(m_options.maxInFlight)) {
+                    chosen = index;
+                    break;
+                }
+            }
+
+            if (chosen < 0) {
+                bool anyOpen = std::any_of(m_connections.begin(), m_connections.end(),
+                    [](const Connection& connection) { return connection.socket >= 0; });
+                if (anyOpen) break; // Every connection is busy, wait for replies
+
+                // Classifier unreachable
+                while (!m_pending.empty()) {
+                    uint32_t id = m_pending.front();
+                    m_pending.pop_front();
+                    finish(id, SpamVerdict::Unavailable, true);
+                }
+                return;
+            }
+
+            m_nextConnection = static_cast<size_t>(chosen) + 1;
+            uint32_t id = m_pending.front();
+            m_pending.pop_front();
+
+            Connection& connection = m_connections[chosen];
+            m_requests[id]->connection = chosen;
+            connection.sendQueue.push_back(id);
+            ++connection.inFlight;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            Connection& connection = m_connections[i];
+            if (connection.connected && !connection.sendQueue.empty() && !writeQueued(static_cast<int>(i))) {
+                dropConnection(static_cast<int>(i));
+            }
+        }
+    }
+
+
+
+    bool SpamClient::connect(int index) {
+        Connection& connection = m_connections[index];
+
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0) return false;
+
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        sockaddr_in serv_addr;
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_port = htons(m_options.port);
+        inet_pton(AF_INET, m_options.host.c_str(), &serv_addr.sin_addr);
+
+        int result = ::connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        if (result < 0 && errno != EINPROGRESS) {
+            close(sock);
+            return false;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = static_cast<uint64_t>(index) + 1;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            close(sock);
+            return false;
+        }
+
+        connection.socket = sock;
+        connection.connected = (result == 0);
+        connection.headWritten = 0;
+        connection.readBuffer.clear();
+        return true;
+    }
+
+
+
+    void SpamClient::onEvent(int index, uint32_t events) {
+        Connection& connection = m_connections[index];
+        if (connection.socket < 0) return;
+
+        if (!connection.connected) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(connection.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+                dropConnection(index);
+                return;
+            }
+            if (!(events & EPOLLOUT)) return;
+            connection.connected = true;
+        }
+
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !readReplies(index)) {
+            dropConnection(index);
+            return;
+        }
+        if (!connection.sendQueue.empty() && !writeQueued(index)) {
+            dropConnection(index);
+        }
+    }
+
+
+
+    bool SpamClient::writeQueued(int index) {
+        Connection& connection = m_connections[index];
+
+        while (!connection.sendQueue.empty()) {
+            Request& request = *m_requests[connection.sendQueue.front()];
+            size_t frameSize = FRAME_HEADER + request.body.size();
+            size_t written = connection.headWritten;
+
+            // Header and body leave together; the body is never copied
+            struct iovec iov[2];
+            int count = 0;
+            if (written < FRAME_HEADER) {
+                iov[count].iov_base = request.header + written;
+                iov[count].iov_len = FRAME_HEADER - written;
+                ++count;
+            }
+            size_t bodyOffset = written > FRAME_HEADER ? written - FRAME_HEADER : 0;
+            if (bodyOffset < request.body.size()) {
+                iov[count].iov_base = const_cast<char*>(request.body.data() + bodyOffset);
+                iov[count].iov_len = request.body.size() - bodyOffset;
+                ++count;
+            }
+
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t sent = sendmsg(connection.socket, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            request.state = RequestState::Sending;
+            connection.headWritten += static_cast<size_t>(sent);
+            if (connection.headWritten == frameSize) {
+                request.state = RequestState::Sent;
+                connection.sendQueue.pop_front();
+                connection.headWritten = 0;
+            }
+        }
+        return true;
+    }
+
+
+
+    bool SpamClient::readReplies(int index) {
+        Connection& connection = m_connections[index];
+        char buffer[4096];
+
+        while (true) {
+            ssize_t bytesRead = recv(connection.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead > 0) {
+                connection.readBuffer.append(buffer, static_cast<size_t>(bytesRead));
+                continue;
+            }
+            if (bytesRead < 0 && errno == EINTR) continue;
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false; // Closed by the classifier or hard error
+        }
+
+        size_t offset = 0;
+        while (connection.readBuffer.size() - offset >= FRAME_HEADER) {
+            const char* frame = connection.readBuffer.data() + offset;
+            uint32_t id = getU32(frame);
+            uint32_t length = getU32(frame + 4);
+            if (length > MAX_REPLY) return false;
+            if (connection.readBuffer.size() - offset < FRAME_HEADER + length) break;
+
+            std::string_view payload(frame + FRAME_HEADER, length);
+            offset += FRAME_HEADER + length;
+
+            // Replies to requests that already timed out are simply dropped
+            auto it = m_requests.find(id);
+            if (it == m_requests.end() || it->second->connection != index || it->second->state != RequestState::Sent) continue;
+            finish(id, payload == "SPAM" ? SpamVerdict::Spam : SpamVerdict::Ham, false);
+        }
+        connection.readBuffer.erase(0, offset);
+        return true;
+    }
+
+
+
+    void SpamClient::dropConnection(int index) {
+        Connection& connection = m_connections[index];
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, connection.socket, nullptr);
+        close(connection.socket);
+        connection.socket = -1;
+        connection.connected = false;
+        connection.sendQueue.clear();
+        connection.headWritten = 0;
+        connection.readBuffer.clear();
+
+        std::vector<uint32_t> lost;
+        for (const auto& entry : m_requests) {
+            if (entry.second->connection == index) lost.push_back(entry.first);
+        }
+        for (uint32_t id : lost) {
+            finish(id, SpamVerdict::Unavailable, true);
+        }
+        connection.inFlight = 0;
+    }
+
+
+
+    void SpamClient::expire(Clock::time_point now) {
+        std::vector<uint32_t> expired;
+        for (const auto& entry : m_requests) {
+            if (entry.second->deadline <= now) expired.push_back(entry.first);
+        }
+
+        for (uint32_t id : expired) {
+            auto it = m_requests.find(id);
+            if (it == m_requests.end()) continue; // Went down with an earlier connection
+
+            Request& request = *it->second;
+            if (request.state == RequestState::Sending) {
+                // Half a frame is on the wire; the stream cannot be resynchronised
+                dropConnection(request.connection);
+                continue;
+            }
+            if (request.connection >= 0) {
+                std::deque<uint32_t>& queue = m_connections[request.connection].sendQueue;
+                queue.erase(std::remove(queue.begin(), queue.end(), id), queue.end());
+            }
+            else {
+                m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), id), m_pending.end());
+            }
+            finish(id, SpamVerdict::Unavailable, true);
+        }
+    }
+
+
+
+    int SpamClient::nextTimeout(Clock::time_point now) const {
+        if (m_requests.empty()) return -1;
+
+        Clock::time_point earliest = Clock::time_point::max();
+        for (const auto& entry : m_requests) {
+            earliest = std::min(earliest, entry.second->deadline);
+        }
+        if (earliest <= now) return 0;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(earliest - now).count();
+        return static_cast<int>(wait) + 1;
+    }
+
+
+
+    void SpamClient::finish(uint32_t id, SpamVerdict verdict, bool failed) {
+        auto it = m_requests.find(id);
+        if (it == m_requests.end()) return;
+
+        std::unique_ptr<Request> request = std::move(it->second);
+        m_requests.erase(it);
+        if (request->connection >= 0 && m_connections[request->connection].inFlight > 0) {
+            --m_connections[request->connection].inFlight;
+        }
+
+        // A probe that fails reopens the circuit for another cooldown; one
+        // that succeeds closes it
+        if (id == m_probe) m_probe = 0;
+        if (failed) {
+            // Every failure past the threshold (re)opens the circuit
+            if (++m_consecutiveFailures >= m_options.breakerThreshold) {
+                m_openUntil = Clock::now() + std::chrono::milliseconds(m_options.breakerCooldownMs);
+            }
+        }
+        else if (verdict != SpamVerdict::Unavailable) {
+            m_consecutiveFailures = 0;
+        }
+
+        if (verdict == SpamVerdict::Unavailable && m_options.failOpen) {
+            verdict = SpamVerdict::Ham;
+        }
+        request->done(verdict);
+    }
+
+
+
+    void SpamClient::failPending() {
+        while (!m_pending.empty()) {
+            uint32_t id = m_pending.front();
+            m_pending.pop_front();
+            finish(id, SpamVerdict::Unavailable, false);
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef INCLUDED_SMTP_SPAM_CLIENT_LINUX
+#define INCLUDED_SMTP_SPAM_CLIENT_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+namespace smtp {
+    struct SpamCheckOptions {
+        std::string host = "127.0.0.1";
+        int port = 65432;
+        int connections = 4;            // Persistent connections to the classifier
+        int maxInFlight = 32;           // Outstanding requests per connection
+        int timeoutMs = 2000;           // Deadline per request, from submission
+        bool failOpen = true;           // Accept mail (true) or defer it with 451 (false) when unavailable
+        int breakerThreshold = 5;       // Consecutive failures that open the circuit
+        int breakerCooldownMs = 5000;   // Time the circuit stays open before one request probes the classifier
+    };
+
+    enum class SpamVerdict { Ham, Spam, Unavailable };
+
+    // Runs on the client's I/O thread
+    using SpamCallback = std::function<void(SpamVerdict)>;
+
+    // Client for the external classifier. One I/O thread multiplexes a small pool
+    // of persistent connections; requests are framed as
+    //   [u32 id][u32 length][body]      (big-endian)
+    // and answered with [u32 id][u32 length]["SPAM" | "HAM"], so many requests
+    // can be in flight on one connection and replies may come back in any order.
+    // Failures (timeouts, refused or dropped connections) feed a circuit breaker;
+    // while it is open, checks fail immediately instead of waiting out a deadline.
+    // After the cooldown it is half-open: one check goes through as a probe and
+    // the rest keep failing fast until the probe succeeds, which closes it.
+    class SpamClient {
+    public:
+        explicit SpamClient(const SpamCheckOptions& options);
+        ~SpamClient(); // Fails whatever is still outstanding
+
+        // body must stay valid until done runs
+        void check(std::string_view body, SpamCallback done);
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        enum class RequestState { Queued, Sending, Sent };
+
+        struct Request {
+            uint32_t id;
+            std::string_view body;
+            SpamCallback done;
+            Clock::time_point deadline;
+            RequestState state = RequestState::Queued;
+            int connection = -1;
+            char header[8];
+        };
+
+        struct Connection {
+            int socket = -1;
+            bool connected = false;
+            std::deque<uint32_t> sendQueue;   // Head may be partly written
+            size_t headWritten = 0;
+            size_t inFlight = 0;              // Requests assigned to this connection
+            std::string readBuffer;
+        };
+
+        void run();
+        void acceptSubmissions();
+        void dispatch();
+        bool connect(int index);
+        void onEvent(int index, uint32_t events);
+        bool writeQueued(int index);
+        bool readReplies(int index);
+        void dropConnection(int index);
+        void expire(Clock::time_point now);
+        int nextTimeout(Clock::time_point now) const;
+        void finish(uint32_t id, SpamVerdict verdict, bool failed);
+        void failPending();
+
+        SpamCheckOptions m_options;
+        int m_epoll;
+        int m_wakeFd;
+        std::thread m_thread;
+        std::atomic<bool> m_stop{ false };
+
+        // Handed over by check(), drained by the I/O thread (through
+        // m_accepting, which trades places with m_submitted to keep both capacities)
+        std::mutex m_submitMutex;
+        std::vector<std::unique_ptr<Request>> m_submitted;
+        std::vector<std::unique_ptr<Request>> m_accepting;
+
+        // Owned by the I/O thread
+        uint32_t m_nextId = 1;
+        std::unordered_map<uint32_t, std::unique_ptr<Request>> m_requests;
+        std::deque<uint32_t> m_pending;       // Not yet assigned to a connection
+        std::vector<Connection> m_connections;
+        size_t m_nextConnection = 0;
+        int m_consecutiveFailures = 0;
+        Clock::time_point m_openUntil;
+        uint32_t m_probe = 0;                 // Request sent while half-open, 0 if none
+    };
+}
+
+#endif
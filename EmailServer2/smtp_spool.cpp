@@ -0,0 +1,199 @@
+#include "smtp_spool.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+namespace smtp {
+
+    namespace {
+        // Once on disk, bytes are written out in chunks of this size
+        const size_t WRITE_BEHIND_SIZE = 256 * 1024;
+
+        // Sessions keep at most this much buffer capacity between messages
+        const size_t RETAINED_CAPACITY = 64 * 1024;
+    }
+
+
+
+    MessageSpool::~MessageSpool() {
+        reset();
+    }
+
+
+
+    void MessageSpool::begin(const SpoolOptions& options) {
+        reset();
+        m_options = &options;
+    }
+
+
+
+    void MessageSpool::append(const char* data, size_t length) {
+        if (m_status != Status::Ok) return; // Keep draining DATA, but store nothing
+
+        if (m_size + length > m_options->maxMessageSize) {
+            m_status = Status::TooLarge;
+            m_buffer.clear();
+            return;
+        }
+
+        m_buffer.append(data, length);
+        m_size += length;
+
+        if (m_fd < 0) {
+            if (m_size > m_options->memoryThreshold && !spill()) m_status = Status::IoError;
+        }
+        else if (m_buffer.size() >= WRITE_BEHIND_SIZE) {
+            if (!writeBuffer()) m_status = Status::IoError;
+        }
+    }
+
+
+
+    bool MessageSpool::finish() {
+        if (m_status != Status::Ok) return false;
+        if (m_fd < 0 || m_size == 0) return true; // Served straight from m_buffer
+
+        if (!writeBuffer()) {
+            m_status = Status::IoError;
+            return false;
+        }
+
+        m_map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (m_map == MAP_FAILED) {
+            m_map = nullptr;
+            m_status = Status::IoError;
+            return false;
+        }
+        madvise(m_map, m_size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+
+
+    std::string_view MessageSpool::contents() const {
+        if (m_map != nullptr) return std::string_view(static_cast<const char*>(m_map), m_size);
+        return std::string_view(m_buffer);
+    }
+
+
+
+    void MessageSpool::reset() {
+        if (m_map != nullptr) {
+            munmap(m_map, m_size);
+            m_map = nullptr;
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        if (m_buffer.capacity() > RETAINED_CAPACITY) {
+            std::string().swap(m_buffer);
+        }
+        m_buffer.clear();
+        m_size = 0;
+        m_status = Status::Ok;
+    }
+
+
+
+    bool MessageSpool::spill() {
+        // Anonymous file: nothing to clean up if we crash mid-message
+        m_fd = open(m_options->directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (m_fd < 0) {
+            std::string path = m_options->directory + "/smtp-spool-XXXXXX";
+            m_fd = mkostemp(&path[0], O_CLOEXEC);
+            if (m_fd < 0) return false;
+            unlink(path.c_str());
+        }
+        return writeBuffer();
+    }
+
+
+
+    bool MessageSpool::writeBuffer() {
+        size_t written = 0;
+        while (written < m_buffer.size()) {
+            ssize_t n = write(m_fd, m_buffer.data() + written, m_buffer.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            written += static_cast<size_t>(n);
+        }
+        m_buffer.clear();
+        return true;
+    }
+
+
+
+    size_t DataDecoder::feed(std::string_view input, MessageSpool& spool, bool& complete) {
+        const char* data = input.data();
+        size_t length = input.size();
+        size_t i = 0;
+        complete = false;
+
+        while (i < length) {
+            switch (m_state) {
+            case State::LineStart:
+                if (data[i] == '.') {
+                    m_state = State::Dot;
+                    ++i;
+                }
+                else {
+                    m_state = State::Body;
+                }
+                break;
+
+            case State::Dot:
+                // Either the terminator or a stuffed dot, which is dropped
+                if (data[i] == '\r') {
+                    m_state = State::DotCR;
+                    ++i;
+                }
+                else {
+                    m_state = State::Body;
+                }
+                break;
+
+            case State::DotCR:
+                if (data[i] == '\n') {
+                    m_state = State::LineStart;
+                    complete = true;
+                    return i + 1;
+                }
+                spool.append("\r", 1);
+                m_state = State::Body;
+                break;
+
+            case State::Body: {
+                // Copy the run up to the next CR in one go
+                const void* cr = memchr(data + i, '\r', length - i);
+                size_t end = cr ? static_cast<size_t>(static_cast<const char*>(cr) - data) : length;
+                spool.append(data + i, end - i);
+                i = end;
+                if (cr) {
+                    m_state = State::CR;
+                    ++i;
+                }
+                break;
+            }
+
+            case State::CR:
+                if (data[i] == '\n') {
+                    spool.append("\r\n", 2);
+                    m_state = State::LineStart;
+                    ++i;
+                }
+                else {
+                    spool.append("\r", 1);
+                    m_state = State::Body;
+                }
+                break;
+            }
+        }
+        return length;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef INCLUDED_SMTP_SPOOL_LINUX
+#define INCLUDED_SMTP_SPOOL_LINUX
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+namespace smtp {
+    struct SpoolOptions {
+        size_t memoryThreshold = 1024 * 1024;       // Bytes kept in RAM before spilling to disk
+        size_t maxMessageSize = 64 * 1024 * 1024;   // Larger messages are answered with 552
+        std::string directory = "/tmp";             // Where spilled messages are written
+    };
+
+    // Holds one message body while DATA is in progress. Small messages stay in
+    // memory; once a message passes memoryThreshold it moves to an unlinked temp
+    // file, and finish() maps that file so readers get a view of the whole body
+    // without another copy.
+    class MessageSpool {
+    public:
+        enum class Status { Ok, TooLarge, IoError };
+
+        MessageSpool() = default;
+        ~MessageSpool();
+        MessageSpool(const MessageSpool&) = delete;
+        MessageSpool& operator=(const MessageSpool&) = delete;
+
+        void begin(const SpoolOptions& options);
+        void append(const char* data, size_t length);
+        bool finish();                          // Makes contents() valid
+        std::string_view contents() const;      // Whole body, valid until reset()
+        void reset();
+
+        size_t size() const { return m_size; }
+        Status status() const { return m_status; }
+        bool onDisk() const { return m_fd >= 0; }
+
+    private:
+        bool spill();
+        bool writeBuffer();
+
+        const SpoolOptions* m_options = nullptr;
+        std::string m_buffer;       // Whole body in memory, or write-behind buffer once on disk
+        size_t m_size = 0;
+        Status m_status = Status::Ok;
+        int m_fd = -1;
+        void* m_map = nullptr;
+    };
+
+    // Streaming decoder for the DATA phase (RFC 5321 4.5.2). Removes one leading
+    // dot from each line in a single pass and recognises the CRLF.CRLF terminator
+    // even when it is split across reads. The DATA command's own CRLF counts as
+    // the first line start.
+    class DataDecoder {
+    public:
+        void reset() { m_state = State::LineStart; }
+
+        // Feeds input to the spool. Returns the number of bytes consumed; when
+        // complete is set, the terminator was the last of them and anything left
+        // over belongs to the next command.
+        size_t feed(std::string_view input, MessageSpool& spool, bool& complete);
+
+    private:
+        enum class State { LineStart, Dot, DotCR, Body, CR };
+        State m_state = State::LineStart;
+    };
+}
+
+#endif
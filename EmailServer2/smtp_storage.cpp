@@ -0,0 +1,871 @@
+#include "smtp_storage.h"
+#include "smtp_metrics.h"
+#include "smtp_log.h"
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <sqlite3.h>
+
+
+namespace smtp {
+
+    namespace {
+        const char* CREATE_TABLES_SQL = R"(
+    -- One row per distinct body; hash and size are of the original bytes, hash is
+    -- not unique. location is the segment log id of a body kept there (body is
+    -- then empty); codec and dictionary say how the stored bytes decode.
+    CREATE TABLE IF NOT EXISTS Bodies (
+        id INTEGER PRIMARY KEY,
+        hash INTEGER NOT NULL,
+        size INTEGER NOT NULL,
+        body TEXT NOT NULL,
+        location INTEGER,
+        codec INTEGER NOT NULL DEFAULT 0,
+        dictionary INTEGER REFERENCES Dictionaries (id)
+    );
+    -- Compression dictionaries, never changed once written
+    CREATE TABLE IF NOT EXISTS Dictionaries (
+        id INTEGER PRIMARY KEY,
+        data BLOB NOT NULL,
+        created DATETIME DEFAULT CURRENT_TIMESTAMP
+    );
+    CREATE INDEX IF NOT EXISTS idx_bodies_hash ON Bodies (hash);
+    -- One delivery row per recipient
+    CREATE TABLE IF NOT EXISTS Emails (
+        id INTEGER PRIMARY KEY AUTOINCREMENT,
+        sender TEXT NOT NULL,
+        recipient TEXT NOT NULL,
+        subject TEXT,
+        body_id INTEGER NOT NULL REFERENCES Bodies (id),
+        timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
+        status TEXT DEFAULT 'QUEUED',
+        spam_score REAL,
+        attempts INTEGER NOT NULL DEFAULT 0
+    );
+    CREATE TABLE IF NOT EXISTS SpamLogs (
+        id INTEGER PRIMARY KEY AUTOINCREMENT,
+        sender TEXT NOT NULL,
+        recipient TEXT NOT NULL,
+        body_id INTEGER NOT NULL REFERENCES Bodies (id),
+        timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
+        spam_score REAL NOT NULL
+    );
+    -- Mailbox listings: keyset pages on (recipient, timestamp, id) read only this index
+    CREATE INDEX IF NOT EXISTS idx_emails_mailbox
+        ON Emails (recipient, timestamp, id, sender, subject, status, spam_score);
+    -- The outbound queue, read once when delivery starts
+    CREATE INDEX IF NOT EXISTS idx_emails_outbound
+        ON Emails (id) WHERE status IN ('QUEUED', 'DEFERRED');
+)";
+
+        // Databases from before single-instance bodies kept a body column in
+        // each row: move the bodies out, keeping ids, in one transaction
+        const char* MIGRATE_INLINE_BODIES_SQL = R"(
+    DROP INDEX IF EXISTS idx_emails_mailbox;
+    ALTER TABLE Emails RENAME TO Emails_inline;
+    ALTER TABLE SpamLogs RENAME TO SpamLogs_inline;
+)";
+        const char* COPY_INLINE_BODIES_SQL = R"(
+    INSERT INTO Bodies (hash, size, body)
+        SELECT content_hash(body), length(CAST(body AS BLOB)), body
+        FROM (SELECT body FROM Emails_inline UNION SELECT body FROM SpamLogs_inline);
+    INSERT INTO Emails (id, sender, recipient, subject, body_id, timestamp, status, spam_score)
+        SELECT e.id, e.sender, e.recipient, e.subject, b.id, e.timestamp, e.status, e.spam_score
+        FROM Emails_inline e JOIN Bodies b ON b.hash = content_hash(e.body) AND b.body = e.body;
+    INSERT INTO SpamLogs (id, sender, recipient, body_id, timestamp, spam_score)
+        SELECT s.id, s.sender, s.recipient, b.id, s.timestamp, s.spam_score
+        FROM SpamLogs_inline s JOIN Bodies b ON b.hash = content_hash(s.body) AND b.body = s.body;
+    DROP TABLE Emails_inline;
+    DROP TABLE SpamLogs_inline;
+)";
+
+        // Columns added after their table; older files get them on open
+        const struct { const char* table; const char* name; const char* definition; } ADDED_COLUMNS[] = {
+            { "Bodies", "location", "location INTEGER" },
+            { "Bodies", "codec", "codec INTEGER NOT NULL DEFAULT 0" },
+            { "Bodies", "dictionary", "dictionary INTEGER REFERENCES Dictionaries (id)" },
+            { "Emails", "attempts", "attempts INTEGER NOT NULL DEFAULT 0" },
+        };
+
+        uint64_t rotateLeft(uint64_t value, int bits) {
+            return (value << bits) | (value >> (64 - bits));
+        }
+
+        uint64_t readWord(const unsigned char* p) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            return word;
+        }
+
+        uint32_t readHalfWord(const unsigned char* p) {
+            uint32_t word;
+            memcpy(&word, p, sizeof(word));
+            return word;
+        }
+
+        const uint64_t PRIME1 = 11400714785074694791ull;
+        const uint64_t PRIME2 = 14029467366897019727ull;
+        const uint64_t PRIME3 = 1609587929392839161ull;
+        const uint64_t PRIME4 = 9650029242287828579ull;
+        const uint64_t PRIME5 = 2870177450012600261ull;
+
+        uint64_t hashRound(uint64_t accumulator, uint64_t input) {
+            accumulator += input * PRIME2;
+            return rotateLeft(accumulator, 31) * PRIME1;
+        }
+
+        uint64_t hashMerge(uint64_t accumulator, uint64_t value) {
+            accumulator ^= hashRound(0, value);
+            return accumulator * PRIME1 + PRIME4;
+        }
+
+        void contentHashFunction(sqlite3_context* context, int, sqlite3_value** arguments) {
+            const char* data = static_cast<const char*>(sqlite3_value_blob(arguments[0]));
+            size_t size = static_cast<size_t>(sqlite3_value_bytes(arguments[0]));
+            uint64_t hash = MailStore::contentHash(std::string_view(data ? data : "", size));
+            sqlite3_result_int64(context, static_cast<sqlite3_int64>(hash));
+        }
+
+        std::string_view columnBytes(sqlite3_stmt* stmt, int column) {
+            const char* data = static_cast<const char*>(sqlite3_column_blob(stmt, column));
+            return std::string_view(data ? data : "", static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+        }
+
+        // Whether a stored candidate decodes to body
+        bool sameBody(BodyCompressor& compressor, sqlite3* db, int codec, int64_t dictionary,
+            std::string_view stored, std::string_view body, std::string& scratch) {
+            if (codec == static_cast<int>(BodyCodec::None)) return stored == body;
+            return compressor.decoder().decode(db, codec, dictionary, stored, body.size(), scratch) && scratch == body;
+        }
+
+        void bindEncoding(sqlite3_stmt* stmt, int column, bool compressed, int64_t dictionary) {
+            sqlite3_bind_int(stmt, column, static_cast<int>(compressed ? BodyCodec::Deflate : BodyCodec::None));
+            if (compressed && dictionary != 0) sqlite3_bind_int64(stmt, column + 1, dictionary);
+            else sqlite3_bind_null(stmt, column + 1);
+        }
+
+        // Bodies in the Bodies row itself
+        class SqliteBodies : public BodyStore {
+        public:
+            SqliteBodies(sqlite3* db, BodyCompressor& compressor) : m_db(db), m_compressor(compressor) {}
+
+            ~SqliteBodies() override {
+                sqlite3_finalize(m_find);
+                sqlite3_finalize(m_insert);
+            }
+
+            bool open() override {
+                return sqlite3_prepare_v3(m_db, "SELECT id, codec, dictionary, body FROM Bodies WHERE hash = ?1 AND size = ?2 AND location IS NULL;",
+                    -1, SQLITE_PREPARE_PERSISTENT, &m_find, nullptr) == SQLITE_OK
+                    && sqlite3_prepare_v3(m_db, "INSERT INTO Bodies (hash, size, body, codec, dictionary) VALUES (?1, ?2, ?3, ?4, ?5);",
+                    -1, SQLITE_PREPARE_PERSISTENT, &m_insert, nullptr) == SQLITE_OK;
+            }
+
+            bool store(std::string_view body, uint64_t hash, int64_t& id) override {
+                // Candidates are compared by their original bytes, so a hash collision only costs a miss
+                sqlite3_bind_int64(m_find, 1, static_cast<sqlite3_int64>(hash));
+                sqlite3_bind_int64(m_find, 2, static_cast<sqlite3_int64>(body.size()));
+                bool found = false;
+                while (!found && sqlite3_step(m_find) == SQLITE_ROW) {
+                    found = sameBody(m_compressor, m_db, sqlite3_column_int(m_find, 1), sqlite3_column_int64(m_find, 2),
+                        columnBytes(m_find, 3), body, m_scratch);
+                    if (found) id = sqlite3_column_int64(m_find, 0);
+                }
+                sqlite3_reset(m_find);
+                sqlite3_clear_bindings(m_find);
+                if (found) {
+                    Metrics::add(Metrics::Counter::StoreBodiesShared);
+                    return true;
+                }
+
+                int64_t dictionary = 0;
+                bool compressed = m_compressor.compress(body, m_encoded, dictionary);
+                sqlite3_bind_int64(m_insert, 1, static_cast<sqlite3_int64>(hash));
+                sqlite3_bind_int64(m_insert, 2, static_cast<sqlite3_int64>(body.size()));
+                if (compressed) sqlite3_bind_blob(m_insert, 3, m_encoded.data(), static_cast<int>(m_encoded.size()), SQLITE_STATIC);
+                else sqlite3_bind_text(m_insert, 3, body.data(), static_cast<int>(body.size()), SQLITE_STATIC);
+                bindEncoding(m_insert, 4, compressed, dictionary);
+                bool inserted = sqlite3_step(m_insert) == SQLITE_DONE;
+                sqlite3_reset(m_insert);
+                sqlite3_clear_bindings(m_insert);
+                if (!inserted) return false;
+                id = sqlite3_last_insert_rowid(m_db);
+                m_compressor.observe(body);
+                Metrics::add(Metrics::Counter::StoreBodiesWritten);
+                return true;
+            }
+
+        private:
+            sqlite3* m_db;
+            BodyCompressor& m_compressor;
+            std::string m_encoded;
+            std::string m_scratch;
+            sqlite3_stmt* m_find = nullptr;
+            sqlite3_stmt* m_insert = nullptr;
+        };
+
+        // Bodies appended to a segment log next to the database; the Bodies
+        // row keeps the hash and the log id. The log is synced once per batch
+        // before the transaction commits, so a committed row never refers to
+        // a record a crash could lose. A record whose row was rolled back or
+        // later deleted is dead, and compaction reclaims it.
+        class LogBodies : public BodyStore {
+        public:
+            LogBodies(sqlite3* db, BodyCompressor& compressor, const StorageOptions& options)
+                : m_db(db), m_compressor(compressor), m_path(options.path),
+                m_log(std::make_unique<SegmentLog>(options.path + "-log", options.segmentLog,
+                    [this](std::vector<uint64_t>& ids) { return liveIds(ids); })) {
+            }
+
+            ~LogBodies() override {
+                // Stops compaction before its connection goes
+                m_log.reset();
+                sqlite3_finalize(m_find);
+                sqlite3_finalize(m_insert);
+                sqlite3_finalize(m_live);
+                sqlite3_close(m_compactorDb);
+            }
+
+            bool open() override {
+                return sqlite3_prepare_v3(m_db, "SELECT id, codec, dictionary, location FROM Bodies WHERE hash = ?1 AND size = ?2 AND location IS NOT NULL;",
+                    -1, SQLITE_PREPARE_PERSISTENT, &m_find, nullptr) == SQLITE_OK
+                    && sqlite3_prepare_v3(m_db, "INSERT INTO Bodies (hash, size, body, location, codec, dictionary) VALUES (?1, ?2, '', ?3, ?4, ?5);",
+                    -1, SQLITE_PREPARE_PERSISTENT, &m_insert, nullptr) == SQLITE_OK
+                    && m_log->open();
+            }
+
+            bool store(std::string_view body, uint64_t hash, int64_t& id) override {
+                // Candidates are compared with the stored bytes, so a hash collision only costs a miss
+                sqlite3_bind_int64(m_find, 1, static_cast<sqlite3_int64>(hash));
+                sqlite3_bind_int64(m_find, 2, static_cast<sqlite3_int64>(body.size()));
+                bool found = false;
+                while (!found && sqlite3_step(m_find) == SQLITE_ROW) {
+                    found = m_log->read(static_cast<uint64_t>(sqlite3_column_int64(m_find, 3)), m_scratch)
+                        && sameBody(m_compressor, m_db, sqlite3_column_int(m_find, 1), sqlite3_column_int64(m_find, 2), m_scratch, body, m_decoded);
+                    if (found) id = sqlite3_column_int64(m_find, 0);
+                }
+                sqlite3_reset(m_find);
+                sqlite3_clear_bindings(m_find);
+                if (found) {
+                    Metrics::add(Metrics::Counter::StoreBodiesShared);
+                    return true;
+                }
+
+                int64_t dictionary = 0;
+                bool compressed = m_compressor.compress(body, m_encoded, dictionary);
+                uint64_t location = m_log->append(compressed ? std::string_view(m_encoded) : body);
+                if (location == 0) return false;
+                sqlite3_bind_int64(m_insert, 1, static_cast<sqlite3_int64>(hash));
+                sqlite3_bind_int64(m_insert, 2, static_cast<sqlite3_int64>(body.size()));
+                sqlite3_bind_int64(m_insert, 3, static_cast<sqlite3_int64>(location));
+                bindEncoding(m_insert, 4, compressed, dictionary);
+                bool inserted = sqlite3_step(m_insert) == SQLITE_DONE;
+                sqlite3_reset(m_insert);
+                sqlite3_clear_bindings(m_insert);
+                if (!inserted) return false;
+                id = sqlite3_last_insert_rowid(m_db);
+                m_compressor.observe(body);
+                Metrics::add(Metrics::Counter::StoreBodiesWritten);
+                return true;
+            }
+
+            bool sync() override {
+                return m_log->sync();
+            }
+
+            void settled() override {
+                m_log->settled();
+            }
+
+        private:
+            // Compaction thread: every log id a Bodies row still holds, on a
+            // read-only connection of its own (WAL, so it never blocks the writer)
+            bool liveIds(std::vector<uint64_t>& ids) {
+                if (m_compactorDb == nullptr) {
+                    if (sqlite3_open_v2(m_path.c_str(), &m_compactorDb, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK
+                        || sqlite3_prepare_v3(m_compactorDb, "SELECT location FROM Bodies WHERE location IS NOT NULL;",
+                            -1, SQLITE_PREPARE_PERSISTENT, &m_live, nullptr) != SQLITE_OK) {
+                        Log::printf(LogLevel::Error, "Segment log compaction: %s", sqlite3_errmsg(m_compactorDb));
+                        sqlite3_close(m_compactorDb);
+                        m_compactorDb = nullptr;
+                        return false;
+                    }
+                    sqlite3_busy_timeout(m_compactorDb, 5000);
+                }
+                int rc;
+                while ((rc = sqlite3_step(m_live)) == SQLITE_ROW) {
+                    ids.push_back(static_cast<uint64_t>(sqlite3_column_int64(m_live, 0)));
+                }
+                sqlite3_reset(m_live);
+                if (rc == SQLITE_DONE) return true;
+                Log::printf(LogLevel::Error, "Segment log compaction: %s", sqlite3_errmsg(m_compactorDb));
+                return false;
+            }
+
+            sqlite3* m_db;
+            BodyCompressor& m_compressor;
+            std::string m_path;
+            std::string m_encoded;
+            std::string m_scratch;
+            std::string m_decoded;
+            sqlite3_stmt* m_find = nullptr;
+            sqlite3_stmt* m_insert = nullptr;
+            sqlite3* m_compactorDb = nullptr;
+            sqlite3_stmt* m_live = nullptr;
+            std::unique_ptr<SegmentLog> m_log;
+        };
+    }
+
+
+
+    // XXH64 with seed 0 (little-endian): several GB/s, so hashing on the
+    // session thread costs less than receiving the body did
+    uint64_t MailStore::contentHash(std::string_view body) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(body.data());
+        const unsigned char* end = p + body.size();
+        uint64_t hash;
+
+        if (body.size() >= 32) {
+            uint64_t v1 = PRIME1 + PRIME2, v2 = PRIME2, v3 = 0, v4 = 0 - PRIME1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = hashRound(v1, readWord(p));
+                v2 = hashRound(v2, readWord(p + 8));
+                v3 = hashRound(v3, readWord(p + 16));
+                v4 = hashRound(v4, readWord(p + 24));
+            }
+            hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+            hash = hashMerge(hash, v1);
+            hash = hashMerge(hash, v2);
+            hash = hashMerge(hash, v3);
+            hash = hashMerge(hash, v4);
+        }
+        else {
+            hash = PRIME5;
+        }
+        hash += body.size();
+
+        for (; p + 8 <= end; p += 8) {
+            hash ^= hashRound(0, readWord(p));
+            hash = rotateLeft(hash, 27) * PRIME1 + PRIME4;
+        }
+        if (p + 4 <= end) {
+            hash ^= readHalfWord(p) * PRIME1;
+            hash = rotateLeft(hash, 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+        for (; p < end; ++p) {
+            hash ^= *p * PRIME5;
+            hash = rotateLeft(hash, 11) * PRIME1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+
+
+    class MailStore::Shard {
+    public:
+        Shard(MailStore& store, const StorageOptions& options, size_t index);
+        ~Shard(); // Commits whatever is still queued
+
+        void push(Request* request);
+
+    private:
+        void run();
+        void commitBatch(std::vector<Request*>& batch);
+        bool insertMessage(Request& request);
+        void migrateInlineBodies();
+        bool applyStatus(Request& request);
+        void addColumns();
+        bool exec(const char* sql);
+        void fail(const std::string& message);
+
+        MailStore& m_store;
+        StorageOptions m_options;   // path is this shard's file
+        MailboxGenerations& m_generations;
+        int64_t m_index;            // Of this shard, in ids handed out (row id * shards + index)
+        int64_t m_shardCount;
+        sqlite3* m_db = nullptr;
+        sqlite3_stmt* m_insertEmail = nullptr;
+        sqlite3_stmt* m_insertSpam = nullptr;
+        sqlite3_stmt* m_updateStatus = nullptr;
+        BodyCompressor m_compressor;
+        std::unique_ptr<BodyStore> m_bodies;
+        sqlite3_stmt* m_savepoint = nullptr;
+        sqlite3_stmt* m_releaseSavepoint = nullptr;
+        sqlite3_stmt* m_rollbackSavepoint = nullptr;
+        sqlite3_stmt* m_begin = nullptr;
+        sqlite3_stmt* m_commit = nullptr;
+        sqlite3_stmt* m_rollback = nullptr;
+
+        // Intrusive LIFO the writer swaps out whole
+        std::atomic<Request*> m_head{ nullptr };
+        std::mutex m_wakeMutex;
+        std::condition_variable m_wake;
+        std::atomic<bool> m_stop{ false };
+        std::thread m_writer;
+    };
+
+
+
+    // Per-shard recipient lists of one message, and the fan-in of their commits
+    struct MailStore::Split {
+        std::vector<std::vector<std::string_view>> recipients;  // Indexed by shard
+        std::atomic<size_t> remaining{ 0 };
+        std::atomic<bool> durable{ true };
+        StoreCallback done;
+
+        void finished(bool shardDurable) {
+            if (!shardDurable) durable.store(false, std::memory_order_relaxed);
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+            if (done) done(durable.load(std::memory_order_relaxed));
+            delete this;
+        }
+    };
+
+
+
+    MailStore::MailStore(const StorageOptions& options)
+        : m_options(options), m_generations(options.path) {
+        size_t shards = std::max<size_t>(m_options.shards, 1);
+        for (size_t i = 0; i < shards; ++i) {
+            StorageOptions shardOptions = m_options;
+            shardOptions.path = shardPath(m_options.path, i, shards);
+            m_shards.push_back(std::make_unique<Shard>(*this, shardOptions, i));
+        }
+    }
+
+
+
+    MailStore::~MailStore() {
+        // Each shard drains its own queue
+        m_shards.clear();
+    }
+
+
+
+    void MailStore::storeEmail(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done) {
+        route(Kind::Email, sender, recipients, body, spamScore, std::move(done));
+    }
+
+
+
+    void MailStore::logSpam(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done) {
+        route(Kind::Spam, sender, recipients, body, spamScore, std::move(done));
+    }
+
+
+
+    void MailStore::route(Kind kind, std::string_view sender, const std::vector<std::string_view>& recipients,
+        std::string_view body, std::optional<double> spamScore, StoreCallback done) {
+        uint64_t bodyHash = contentHash(body);
+        size_t shards = m_shards.size();
+
+        // Common case: one shard holds every recipient, and gets the caller's list
+        size_t first = recipients.empty() ? 0 : shardOf(recipients[0], shards);
+        bool together = true;
+        for (size_t i = 1; together && i < recipients.size(); ++i) {
+            together = shardOf(recipients[i], shards) == first;
+        }
+        if (together) {
+            m_shards[first]->push(new Request{ kind, sender, &recipients, body, bodyHash, spamScore, std::move(done), nullptr });
+            return;
+        }
+
+        Split* split = new Split();
+        split->recipients.resize(shards);
+        for (std::string_view recipient : recipients) {
+            split->recipients[shardOf(recipient, shards)].push_back(recipient);
+        }
+        size_t involved = 0;
+        for (const auto& list : split->recipients) {
+            if (!list.empty()) ++involved;
+        }
+        split->remaining.store(involved, std::memory_order_relaxed);
+        split->done = std::move(done);
+
+        // Nothing touches split after the last push: the first commit may finish it
+        for (size_t shard = 0, pushed = 0; pushed < involved; ++shard) {
+            if (split->recipients[shard].empty()) continue;
+            ++pushed;
+            m_shards[shard]->push(new Request{ kind, sender, &split->recipients[shard], body, bodyHash, spamScore,
+                [split](bool durable) { split->finished(durable); }, nullptr });
+        }
+    }
+
+
+
+    void MailStore::updateStatus(std::vector<StatusUpdate> updates, StoreCallback done) {
+        size_t shards = m_shards.size();
+        std::vector<std::vector<StatusUpdate>> byShard(shards);
+        for (StatusUpdate& update : updates) {
+            byShard[static_cast<size_t>(update.id) % shards].push_back(std::move(update));
+        }
+        size_t involved = 0;
+        for (const auto& list : byShard) {
+            if (!list.empty()) ++involved;
+        }
+        if (involved == 0) {
+            if (done) done(true);
+            return;
+        }
+
+        Split* split = new Split();
+        split->remaining.store(involved, std::memory_order_relaxed);
+        split->done = std::move(done);
+        for (size_t shard = 0; shard < shards; ++shard) {
+            if (byShard[shard].empty()) continue;
+            Request* request = new Request{ Kind::Status, {}, nullptr, {}, 0, std::nullopt,
+                [split](bool durable) { split->finished(durable); }, nullptr };
+            request->updates = std::move(byShard[shard]);
+            m_shards[shard]->push(request);
+        }
+    }
+
+
+
+    void MailStore::setQueuedListener(QueuedCallback listener) {
+        std::lock_guard<std::mutex> lock(m_listenerMutex);
+        m_queuedListener = std::move(listener);
+        m_listening.store(static_cast<bool>(m_queuedListener), std::memory_order_relaxed);
+    }
+
+
+
+    void MailStore::notifyQueued(std::vector<QueuedMessage>& queued) {
+        std::lock_guard<std::mutex> lock(m_listenerMutex);
+        if (m_queuedListener) m_queuedListener(queued);
+    }
+
+
+
+    MailStore::Shard::Shard(MailStore& store, const StorageOptions& options, size_t index)
+        : m_store(store), m_options(options), m_generations(store.m_generations), m_index(static_cast<int64_t>(index)),
+        m_shardCount(static_cast<int64_t>(std::max<size_t>(options.shards, 1))), m_compressor(options.compression) {
+        // Only the writer thread touches this connection
+        if (sqlite3_open_v2(m_options.path.c_str(), &m_db,
+            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+            fail("Failed to open database");
+        }
+        sqlite3_busy_timeout(m_db, 5000);
+
+        if (m_options.wal && !exec("PRAGMA journal_mode=WAL;")) {
+            fail("Failed to enable WAL");
+        }
+        std::string synchronous = "PRAGMA synchronous=" + m_options.synchronous + ";";
+        if (!exec(synchronous.c_str())) {
+            fail("Failed to set synchronous mode");
+        }
+
+        if (sqlite3_create_function(m_db, "content_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            nullptr, contentHashFunction, nullptr, nullptr) != SQLITE_OK) {
+            fail("Failed to register content_hash");
+        }
+
+        migrateInlineBodies();
+
+        // Create tables if they don't exist
+        if (!exec(CREATE_TABLES_SQL)) {
+            fail("Failed to create tables");
+        }
+        addColumns();
+        if (!m_compressor.loadDictionary(m_db)) {
+            fail("Failed to load the body dictionary");
+        }
+
+        // Prepared once, reused for every message
+        const struct { sqlite3_stmt** target; const char* sql; } statements[] = {
+            { &m_insertEmail, "INSERT INTO Emails (sender, recipient, body_id, spam_score) VALUES (?, ?, ?, ?);" },
+            { &m_insertSpam, "INSERT INTO SpamLogs (sender, recipient, body_id, spam_score) VALUES (?, ?, ?, ?);" },
+            { &m_updateStatus, "UPDATE Emails SET status = ?2, attempts = ?3 WHERE id = ?1;" },
+            { &m_savepoint, "SAVEPOINT message;" },
+            { &m_releaseSavepoint, "RELEASE message;" },
+            { &m_rollbackSavepoint, "ROLLBACK TO message;" },
+            { &m_begin, "BEGIN;" },
+            { &m_commit, "COMMIT;" },
+            { &m_rollback, "ROLLBACK;" },
+        };
+        for (const auto& statement : statements) {
+            if (sqlite3_prepare_v3(m_db, statement.sql, -1, SQLITE_PREPARE_PERSISTENT, statement.target, nullptr) != SQLITE_OK) {
+                fail("Failed to prepare statement");
+            }
+        }
+
+        if (m_options.bodies == BodyStorage::SegmentLog) {
+            m_bodies = std::make_unique<LogBodies>(m_db, m_compressor, m_options);
+        }
+        else {
+            m_bodies = std::make_unique<SqliteBodies>(m_db, m_compressor);
+        }
+        if (!m_bodies->open()) {
+            fail("Failed to open body storage");
+        }
+
+        m_writer = std::thread([this] { run(); });
+    }
+
+
+
+    MailStore::Shard::~Shard() {
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        if (m_writer.joinable()) m_writer.join();
+
+        sqlite3_finalize(m_insertEmail);
+        sqlite3_finalize(m_insertSpam);
+        sqlite3_finalize(m_updateStatus);
+        m_bodies.reset();
+        sqlite3_finalize(m_savepoint);
+        sqlite3_finalize(m_releaseSavepoint);
+        sqlite3_finalize(m_rollbackSavepoint);
+        sqlite3_finalize(m_begin);
+        sqlite3_finalize(m_commit);
+        sqlite3_finalize(m_rollback);
+        sqlite3_close(m_db);
+    }
+
+
+
+    void MailStore::Shard::push(Request* request) {
+        Request* head = m_head.load(std::memory_order_relaxed);
+        do {
+            request->next = head;
+        } while (!m_head.compare_exchange_weak(head, request, std::memory_order_release, std::memory_order_relaxed));
+
+        // Only the push that makes the list non-empty can find the writer asleep
+        if (head == nullptr) {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_wake.notify_one();
+        }
+    }
+
+
+
+    void MailStore::Shard::run() {
+        std::vector<Request*> pending;
+        std::vector<Request*> batch;
+
+        while (true) {
+            Request* list = m_head.exchange(nullptr, std::memory_order_acquire);
+            if (list == nullptr) {
+                if (m_stop) return;
+                std::unique_lock<std::mutex> lock(m_wakeMutex);
+                m_wake.wait(lock, [this] {
+                    return m_head.load(std::memory_order_relaxed) != nullptr || m_stop;
+                    });
+                continue;
+            }
+
+            // The list is newest first; commit in arrival order
+            pending.clear();
+            for (Request* request = list; request != nullptr; request = request->next) {
+                pending.push_back(request);
+            }
+
+            std::reverse(pending.begin(), pending.end());
+
+            size_t maxBatch = std::max<size_t>(m_options.maxBatch, 1);
+            for (size_t start = 0; start < pending.size(); start += maxBatch) {
+                size_t end = std::min(pending.size(), start + maxBatch);
+                batch.assign(pending.begin() + start, pending.begin() + end);
+                commitBatch(batch);
+            }
+        }
+    }
+
+
+
+    void MailStore::Shard::commitBatch(std::vector<Request*>& batch) {
+        uint64_t commitStart = Metrics::now();
+        m_generations.beginCommit();
+        bool began = sqlite3_step(m_begin) == SQLITE_DONE;
+        sqlite3_reset(m_begin);
+
+        for (size_t i = 0; began && i < batch.size(); ++i) {
+            batch[i]->inserted = batch[i]->kind == Kind::Status ? applyStatus(*batch[i]) : insertMessage(*batch[i]);
+        }
+
+        bool committed = false;
+        if (began) {
+            // Bodies kept outside the database are durable before any row refers to them
+            bool synced = m_bodies->sync();
+            committed = synced && sqlite3_step(m_commit) == SQLITE_DONE;
+            sqlite3_reset(m_commit);
+            if (!committed) {
+                if (synced) Log::printf(LogLevel::Error, "Database commit failed: %s", sqlite3_errmsg(m_db));
+                sqlite3_step(m_rollback);
+                sqlite3_reset(m_rollback);
+            }
+        }
+        else {
+            Log::printf(LogLevel::Error, "Database error: %s", sqlite3_errmsg(m_db));
+        }
+        m_bodies->settled();
+        if (m_compressor.due()) m_compressor.retrain(m_db);
+
+        // A status change shows in the recipient's listing as much as new mail does
+        for (size_t i = 0; committed && i < batch.size(); ++i) {
+            if (!batch[i]->inserted) continue;
+            if (batch[i]->kind == Kind::Email) {
+                for (std::string_view recipient : *batch[i]->recipients) m_generations.bump(recipient);
+            }
+            else if (batch[i]->kind == Kind::Status) {
+                for (const StatusUpdate& update : batch[i]->updates) m_generations.bump(update.recipient);
+            }
+        }
+        m_generations.endCommit();
+        Metrics::observeSince(Metrics::Histogram::StoreCommit, commitStart);
+
+        size_t stored = 0, failed = 0;
+        std::vector<QueuedMessage> queued;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            Request& request = *batch[i];
+            if (request.kind == Kind::Status) continue;
+            (committed && request.inserted ? stored : failed) += request.recipients->size();
+            for (size_t row = 0; committed && request.inserted && row < request.rows.size(); ++row) {
+                queued.push_back({ request.rows[row] * m_shardCount + m_index, std::string((*request.recipients)[row]) });
+            }
+        }
+        Metrics::add(Metrics::Counter::StoreBatches);
+        Metrics::add(Metrics::Counter::StoreRows, stored);
+        Metrics::add(Metrics::Counter::StoreFailures, failed);
+        if (!queued.empty()) m_store.notifyQueued(queued);
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (batch[i]->done) batch[i]->done(committed && batch[i]->inserted);
+            delete batch[i];
+        }
+    }
+
+
+
+    // One message inside the open transaction: its body (unless already
+    // stored) and a row per recipient. A savepoint keeps a failure from
+    // leaving some recipients stored, or sinking the rest of the batch.
+    bool MailStore::Shard::insertMessage(Request& request) {
+        sqlite3_step(m_savepoint);
+        sqlite3_reset(m_savepoint);
+
+        int64_t body = 0;
+        bool inserted = m_bodies->store(request.body, request.bodyHash, body);
+
+        bool email = request.kind == Kind::Email;
+        sqlite3_stmt* stmt = email ? m_insertEmail : m_insertSpam;
+        bool listening = email && m_store.m_listening.load(std::memory_order_relaxed);
+        if (inserted) {
+            sqlite3_bind_text(stmt, 1, request.sender.data(), static_cast<int>(request.sender.size()), SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 3, body);
+            if (request.spamScore) sqlite3_bind_double(stmt, 4, *request.spamScore);
+            else if (request.kind == Kind::Spam) sqlite3_bind_double(stmt, 4, 1.0);  // Verdict without a score
+            else sqlite3_bind_null(stmt, 4);
+        }
+        for (size_t i = 0; inserted && i < request.recipients->size(); ++i) {
+            std::string_view recipient = (*request.recipients)[i];
+            sqlite3_bind_text(stmt, 2, recipient.data(), static_cast<int>(recipient.size()), SQLITE_STATIC);
+            inserted = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+            if (inserted && listening) request.rows.push_back(sqlite3_last_insert_rowid(m_db));
+        }
+        sqlite3_clear_bindings(stmt);
+
+        if (!inserted) {
+            Log::printf(LogLevel::Error, "Database error: %s", sqlite3_errmsg(m_db));
+            sqlite3_step(m_rollbackSavepoint);
+            sqlite3_reset(m_rollbackSavepoint);
+        }
+        sqlite3_step(m_releaseSavepoint);
+        sqlite3_reset(m_releaseSavepoint);
+        return inserted;
+    }
+
+
+
+    // The status changes of one request inside the open transaction, all or none
+    bool MailStore::Shard::applyStatus(Request& request) {
+        sqlite3_step(m_savepoint);
+        sqlite3_reset(m_savepoint);
+
+        bool applied = true;
+        for (size_t i = 0; applied && i < request.updates.size(); ++i) {
+            const StatusUpdate& update = request.updates[i];
+            sqlite3_bind_int64(m_updateStatus, 1, update.id / m_shardCount);
+            sqlite3_bind_text(m_updateStatus, 2, update.status, -1, SQLITE_STATIC);
+            sqlite3_bind_int(m_updateStatus, 3, update.attempts);
+            applied = sqlite3_step(m_updateStatus) == SQLITE_DONE;
+            sqlite3_reset(m_updateStatus);
+        }
+        sqlite3_clear_bindings(m_updateStatus);
+
+        if (!applied) {
+            Log::printf(LogLevel::Error, "Database error: %s", sqlite3_errmsg(m_db));
+            sqlite3_step(m_rollbackSavepoint);
+            sqlite3_reset(m_rollbackSavepoint);
+        }
+        sqlite3_step(m_releaseSavepoint);
+        sqlite3_reset(m_releaseSavepoint);
+        return applied;
+    }
+
+
+
+    void MailStore::Shard::migrateInlineBodies() {
+        sqlite3_stmt* stmt = nullptr;
+        bool inlineBodies = false;
+        if (sqlite3_prepare_v2(m_db, "SELECT 1 FROM pragma_table_info('Emails') WHERE name = 'body';", -1, &stmt, nullptr) == SQLITE_OK) {
+            inlineBodies = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        sqlite3_finalize(stmt);
+        if (!inlineBodies) return;
+
+        Log::write(LogLevel::Info, "Moving message bodies into the Bodies table");
+        if (!exec("BEGIN;") || !exec(MIGRATE_INLINE_BODIES_SQL) || !exec(CREATE_TABLES_SQL)
+            || !exec(COPY_INLINE_BODIES_SQL) || !exec("COMMIT;")) {
+            fail("Failed to migrate message bodies");
+        }
+    }
+
+
+
+    void MailStore::Shard::addColumns() {
+        for (const auto& column : ADDED_COLUMNS) {
+            sqlite3_stmt* stmt = nullptr;
+            bool present = false;
+            if (sqlite3_prepare_v2(m_db, "SELECT 1 FROM pragma_table_info(?1) WHERE name = ?2;", -1, &stmt, nullptr) == SQLITE_OK) {
+                sqlite3_bind_text(stmt, 1, column.table, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, column.name, -1, SQLITE_STATIC);
+                present = sqlite3_step(stmt) == SQLITE_ROW;
+            }
+            sqlite3_finalize(stmt);
+            std::string sql = std::string("ALTER TABLE ") + column.table + " ADD COLUMN " + column.definition + ";";
+            if (!present && !exec(sql.c_str())) {
+                fail(std::string("Failed to add ") + column.table + "." + column.name);
+            }
+        }
+    }
+
+
+
+    bool MailStore::Shard::exec(const char* sql) {
+        return sqlite3_exec(m_db, sql, nullptr, nullptr, nullptr) == SQLITE_OK;
+    }
+
+
+
+    void MailStore::Shard::fail(const std::string& message) {
+        std::cerr << "ERROR: " << message << ": " << (m_db ? sqlite3_errmsg(m_db) : "") << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
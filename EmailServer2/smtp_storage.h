@@ -0,0 +1,163 @@
+#ifndef INCLUDED_SMTP_STORAGE_LINUX
+#define INCLUDED_SMTP_STORAGE_LINUX
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <optional>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "smtp_mailbox_cache.h"
+#include "smtp_compression.h"
+#include "smtp_segment_log.h"
+#include "smtp_shards.h"
+
+namespace smtp {
+    // Where a shard keeps the bytes of message bodies (see BodyStore)
+    enum class BodyStorage { Sqlite, SegmentLog };
+
+    struct StorageOptions {
+        std::string path = "smtp_server.db";
+        bool wal = true;                        // journal_mode=WAL
+        std::string synchronous = "FULL";       // OFF | NORMAL | FULL | EXTRA (FULL makes every commit durable)
+        size_t maxBatch = 256;                  // Messages per transaction
+        size_t shards = 1;                      // Database files, each with its own writer (see smtp_shards.h)
+        BodyStorage bodies = BodyStorage::Sqlite;
+        SegmentLogOptions segmentLog;           // BodyStorage::SegmentLog: a "<database file>-log" directory per shard
+        CompressionOptions compression;         // Of new bodies, on the writer thread (see BodyCompressor)
+    };
+
+    // A shard's body backend, driven by its writer thread. The Bodies table
+    // keeps (hash, size) of every body whatever the backend, and rows point
+    // at it by id, so readers and deduplication see one schema; a backend
+    // decides where the bytes go. Bodies.location is null for a body held in
+    // the row itself and the segment log id otherwise; Bodies.codec and
+    // Bodies.dictionary say how those bytes decode (see BodyCompressor).
+    class BodyStore {
+    public:
+        virtual ~BodyStore() = default;
+
+        // Prepares statements and opens files; false is fatal
+        virtual bool open() = 0;
+
+        // Inside the batch transaction: the Bodies id of body, already stored or added now
+        virtual bool store(std::string_view body, uint64_t hash, int64_t& id) = 0;
+
+        // Before COMMIT: every body added since the last call is durable once this returns true
+        virtual bool sync() { return true; }
+
+        // After the batch committed or rolled back
+        virtual void settled() {}
+    };
+
+    // Called on a writer thread once the transactions holding the message have
+    // committed (durable == true) or one of them failed
+    using StoreCallback = std::function<void(bool durable)>;
+
+    // Emails.status over a row's outbound life: QUEUED when stored, DEFERRED
+    // after a failed attempt that will be retried, then DELIVERED or FAILED
+    namespace DeliveryStatus {
+        const char* const Queued = "QUEUED";
+        const char* const Deferred = "DEFERRED";
+        const char* const Delivered = "DELIVERED";
+        const char* const Failed = "FAILED";
+    }
+
+    // Ids are those MailboxReader hands out: row id * shards + shard
+    struct QueuedMessage {
+        int64_t id;
+        std::string recipient;
+        int attempts = 0;           // Emails.attempts
+    };
+
+    struct StatusUpdate {
+        int64_t id;
+        std::string recipient;      // Whose mailbox listing changes
+        const char* status;         // A DeliveryStatus value
+        int attempts;               // Delivery attempts made so far (Emails.attempts)
+    };
+
+    // Runs on a writer thread after a commit that added Emails rows
+    using QueuedCallback = std::function<void(std::vector<QueuedMessage>& queued)>;
+
+    // Storage stage. Mail is partitioned by recipient over options.shards
+    // database files, each with a single writer: sessions enqueue finished
+    // messages on the shard's lock-free MPSC list, and its thread takes
+    // everything queued so far and commits it as one transaction with
+    // statements prepared once, so N concurrent messages share a single fsync
+    // and shards commit in parallel. Each commit bumps its recipients'
+    // mailbox generations (one table for all shards) so cached listings of
+    // them go stale. A message to recipients in several shards is written to
+    // each of them and completes when all have committed.
+    //
+    // Bodies are single-instance: a message is one row per recipient in
+    // Emails (or SpamLogs) pointing at a row in Bodies, and a body already
+    // stored under the same content hash is shared rather than written again.
+    // With BodyStorage::SegmentLog the body bytes are appended to the shard's
+    // segment log instead of the Bodies row, and SQLite only holds metadata.
+    // New bodies are compressed by the writer, never by the session thread;
+    // deduplication compares the original bytes.
+    class MailStore {
+    public:
+        explicit MailStore(const StorageOptions& options);
+        ~MailStore(); // Commits whatever is still queued
+
+        // Strings, recipients and body are referenced, not copied: they must stay valid until done runs.
+        // spamScore is the classifier probability stored with the rows, when there is one.
+        // Within a shard a message is stored for all of its recipients or for none; if one
+        // shard fails, done reports failure even where others committed (a retry duplicates).
+        void storeEmail(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done);
+        void logSpam(std::string_view sender, const std::vector<std::string_view>& recipients, std::string_view body, std::optional<double> spamScore, StoreCallback done);
+
+        // Outbound delivery write-back: every update of one shard is applied in
+        // its writer's next transaction, alongside whatever mail it commits
+        void updateStatus(std::vector<StatusUpdate> updates, StoreCallback done);
+
+        // Told about every Emails row once it is committed, for delivery;
+        // nullptr stops the calls, returning once none is still running
+        void setQueuedListener(QueuedCallback listener);
+
+        // The key of the Bodies table (XXH64); also registered as the SQL function content_hash()
+        static uint64_t contentHash(std::string_view body);
+
+    private:
+        enum class Kind { Email, Spam, Status };
+
+        struct Request {
+            Kind kind;
+            std::string_view sender;
+            const std::vector<std::string_view>* recipients;    // All in the receiving shard
+            std::string_view body;
+            uint64_t bodyHash;      // Computed by the sender, off the writer thread
+            std::optional<double> spamScore;
+            StoreCallback done;
+            Request* next;
+            bool inserted = false;  // Set by the writer: an insert can fail without sinking its batch
+            std::vector<StatusUpdate> updates{};    // Kind::Status, all in the receiving shard
+            std::vector<int64_t> rows{};            // Set by the writer: Emails ids, one per recipient
+        };
+
+        class Shard;    // One database file and its writer thread
+        struct Split;   // A message whose recipients live in several shards
+
+        void route(Kind kind, std::string_view sender, const std::vector<std::string_view>& recipients,
+            std::string_view body, std::optional<double> spamScore, StoreCallback done);
+        void notifyQueued(std::vector<QueuedMessage>& queued);
+
+        StorageOptions m_options;
+
+        // Tells mailbox caches (in any process) which recipients got new mail
+        MailboxGenerations m_generations;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+
+        // Called by writer threads under m_listenerMutex, so clearing it waits them out
+        std::mutex m_listenerMutex;
+        QueuedCallback m_queuedListener;
+        std::atomic<bool> m_listening{ false };     // Writers only collect row ids while someone listens
+    };
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include "smtp_timer_wheel.h"
+#include <algorithm>
+#include <chrono>
+
+
+namespace smtp {
+
+    TimerWheel::TimerWheel(uint64_t tickMs, uint64_t nowMs)
+        : m_tickMs(tickMs > 0 ? tickMs : 1), m_now(nowMs / m_tickMs) {
+        for (auto& level : m_slots) {
+            for (TimerLink& slot : level) slot.prev = slot.next = &slot;
+        }
+    }
+
+
+
+    TimerWheel::~TimerWheel() {
+        for (auto& level : m_slots) {
+            for (TimerLink& slot : level) {
+                while (slot.next != &slot) static_cast<Timer*>(slot.next)->unlink();
+            }
+        }
+    }
+
+
+
+    void TimerWheel::schedule(Timer& timer, uint64_t nowMs, uint64_t delayMs) {
+        cancel(timer);
+
+        // An empty wheel skips the ticks nobody waited for
+        if (m_pending == 0) m_now = std::max(m_now, nowMs / m_tickMs);
+        timer.m_expires = (nowMs + delayMs + m_tickMs - 1) / m_tickMs;
+        place(timer);
+        ++m_pending;
+    }
+
+
+
+    void TimerWheel::cancel(Timer& timer) {
+        if (!timer.pending()) return;
+        timer.unlink();
+        --m_pending;
+    }
+
+
+
+    size_t TimerWheel::advance(uint64_t nowMs) {
+        uint64_t target = nowMs / m_tickMs;
+        size_t fired = 0;
+        TimerLink due;
+        due.prev = due.next = &due;
+
+        while (m_now <= target) {
+            if (m_pending == 0) {
+                m_now = target + 1;
+                break;
+            }
+            uint64_t tick = m_now;
+
+            // Entering a new lap of a level brings its next slot's timers down
+            if ((tick & (SLOTS - 1)) == 0) {
+                for (int level = 1; level < LEVELS; ++level) {
+                    size_t index = (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+                    take(m_slots[level][index], due);
+                    while (due.next != &due) {
+                        Timer* timer = static_cast<Timer*>(due.next);
+                        timer->unlink();
+                        place(*timer);
+                    }
+                    if (index != 0) break;
+                }
+            }
+
+            take(m_slots[0][tick & (SLOTS - 1)], due);
+            m_now = tick + 1;
+            while (due.next != &due) {
+                Timer* timer = static_cast<Timer*>(due.next);
+                timer->unlink();
+                if (timer->m_expires > tick) {
+                    place(*timer);      // Parked beyond the top level
+                    continue;
+                }
+                --m_pending;
+                ++fired;
+                timer->fire();
+            }
+        }
+        return fired;
+    }
+
+
+
+    int TimerWheel::timeoutMs(uint64_t nowMs) const {
+        if (m_pending == 0) return -1;
+
+        // The finest level up to its next lap; past that, wake for the cascade
+        uint64_t lapEnd = m_now | (SLOTS - 1);
+        uint64_t tick = m_now;
+        while (tick <= lapEnd && m_slots[0][tick & (SLOTS - 1)].next == &m_slots[0][tick & (SLOTS - 1)]) ++tick;
+
+        uint64_t at = tick * m_tickMs;
+        if (at <= nowMs) return 0;
+        uint64_t wait = at - nowMs;
+        return wait > INT32_MAX ? INT32_MAX : static_cast<int>(wait);
+    }
+
+
+
+    void TimerWheel::place(Timer& timer) {
+        uint64_t expires = timer.m_expires < m_now ? m_now : timer.m_expires;
+        uint64_t delta = expires - m_now;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) ++level;
+        uint64_t range = uint64_t(1) << (SLOT_BITS * LEVELS);
+        if (delta >= range) expires = m_now + range - 1;
+
+        TimerLink& slot = m_slots[level][(expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        TimerLink& node = timer;
+        node.prev = slot.prev;
+        node.next = &slot;
+        slot.prev->next = &node;
+        slot.prev = &node;
+    }
+
+
+
+    void TimerWheel::take(TimerLink& slot, TimerLink& list) {
+        if (slot.next == &slot) return;
+        // list is empty whenever this runs
+        list.next = slot.next;
+        list.prev = slot.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        slot.prev = slot.next = &slot;
+    }
+
+
+
+    TimerThread::TimerThread(uint64_t tickMs)
+        : m_wheel(tickMs, nowMs()) {
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    TimerThread::~TimerThread() {
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+
+
+    uint64_t TimerThread::nowMs() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+
+
+    void TimerThread::schedule(Timer& timer, uint64_t delayMs) {
+        uint64_t now = nowMs();
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        m_wheel.schedule(timer, now, delayMs);
+        if (now + delayMs < m_wakeAt) {
+            m_wakeAt = now + delayMs;
+            m_wake.notify_one();
+        }
+    }
+
+
+
+    void TimerThread::cancel(Timer& timer) {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        m_wheel.cancel(timer);
+    }
+
+
+
+    void TimerThread::run() {
+        std::unique_lock<std::recursive_mutex> lock(m_mutex);
+        while (!m_stop) {
+            uint64_t now = nowMs();
+            m_wheel.advance(now);
+            int timeout = m_wheel.timeoutMs(now);
+            if (timeout < 0) {
+                m_wakeAt = UINT64_MAX;
+                m_wake.wait(lock);
+            }
+            else {
+                m_wakeAt = now + static_cast<uint64_t>(timeout);
+                m_wake.wait_for(lock, std::chrono::milliseconds(timeout));
+            }
+        }
+    }
+}
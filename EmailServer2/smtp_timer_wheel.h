@@ -0,0 +1,120 @@
+#ifndef INCLUDED_SMTP_TIMER_WHEEL_LINUX
+#define INCLUDED_SMTP_TIMER_WHEEL_LINUX
+
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+namespace smtp {
+    // Intrusive list node; a wheel slot is a circular list around one
+    struct TimerLink {
+        TimerLink* prev = nullptr;
+        TimerLink* next = nullptr;
+    };
+
+    // A timer embedded in its owner. fire is set once by the owner; the wheel
+    // only links and unlinks the node, so scheduling never allocates.
+    struct Timer : private TimerLink {
+        std::function<void()> fire;
+
+        Timer() = default;
+        explicit Timer(std::function<void()> callback) : fire(std::move(callback)) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() { unlink(); }  // The owner cancels first; this only keeps the wheel's lists intact
+
+        bool pending() const { return next != nullptr; }
+
+    private:
+        friend class TimerWheel;
+
+        void unlink() {
+            if (next == nullptr) return;
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+
+        uint64_t m_expires = 0;     // Tick
+    };
+
+    // Hierarchical timing wheel (Varghese & Lauck): LEVELS wheels of SLOTS
+    // lists each, every level a factor SLOTS coarser than the one below.
+    // schedule() and cancel() are O(1) list operations; a timer far out sits
+    // in a coarse slot and is moved down a level each time its slot comes up,
+    // at most LEVELS - 1 times in its life, so advancing costs O(timers due)
+    // plus one slot per tick. Deadlines beyond the top level's range are
+    // parked in its last slot and re-placed until they are in reach.
+    //
+    // Times are caller-supplied milliseconds on any monotonic clock. Not
+    // thread-safe: one owner thread schedules, cancels and advances, and
+    // callbacks run on it from inside advance(), where they may schedule or
+    // cancel any timer, their own included.
+    class TimerWheel {
+    public:
+        static const int LEVELS = 4;
+        static const int SLOT_BITS = 6;
+        static const size_t SLOTS = size_t(1) << SLOT_BITS;
+
+        TimerWheel(uint64_t tickMs, uint64_t nowMs);
+        ~TimerWheel();  // Timers still pending are unlinked, not fired
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        // Fires timer at nowMs + delayMs, rounded up to a tick; moves it if already pending
+        void schedule(Timer& timer, uint64_t nowMs, uint64_t delayMs);
+        void cancel(Timer& timer);
+
+        // Fires everything due at nowMs; returns how many fired
+        size_t advance(uint64_t nowMs);
+
+        // Milliseconds an event loop may sleep before calling advance() again
+        // (-1: nothing pending). Never late; may be early when the next
+        // timer is beyond the finest level.
+        int timeoutMs(uint64_t nowMs) const;
+
+        size_t pending() const { return m_pending; }
+
+    private:
+        void place(Timer& timer);
+        static void take(TimerLink& slot, TimerLink& list);    // Moves every timer of slot onto list
+
+        uint64_t m_tickMs;
+        uint64_t m_now;             // Next tick to process
+        size_t m_pending = 0;
+        TimerLink m_slots[LEVELS][SLOTS];   // List heads
+    };
+
+    // A TimerWheel on its own thread, for timers armed from many threads
+    // (the threaded server's workers). One lock guards the wheel and is held
+    // while callbacks run, so once cancel() returns the timer's callback is
+    // neither running nor due; callbacks may schedule and cancel timers
+    // themselves. The thread sleeps until the earliest deadline and is only
+    // woken early when a timer is armed ahead of it.
+    class TimerThread {
+    public:
+        explicit TimerThread(uint64_t tickMs);
+        ~TimerThread(); // Pending timers do not fire
+        TimerThread(const TimerThread&) = delete;
+        TimerThread& operator=(const TimerThread&) = delete;
+
+        void schedule(Timer& timer, uint64_t delayMs);
+        void cancel(Timer& timer);
+
+    private:
+        static uint64_t nowMs();
+        void run();
+
+        std::recursive_mutex m_mutex;
+        std::condition_variable_any m_wake;
+        TimerWheel m_wheel;
+        uint64_t m_wakeAt = UINT64_MAX;     // Where the thread's current sleep ends
+        bool m_stop = false;
+        std::thread m_thread;
+    };
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include "smtp_tls.h"
+#include <iostream>
+#include <cstdlib>
+#include <openssl/err.h>
+
+
+namespace smtp {
+
+    namespace {
+        // Identifies sessions cached by this server (required for resumption
+        // when peers are verified; harmless otherwise)
+        const unsigned char SESSION_ID_CONTEXT[] = "smtp";
+
+        std::string lastError() {
+            unsigned long code = ERR_get_error();
+            if (code == 0) return "unknown error";
+            char text[256];
+            ERR_error_string_n(code, text, sizeof(text));
+            ERR_clear_error();
+            return text;
+        }
+    }
+
+
+
+    TlsContext::TlsContext(const TlsOptions& options) {
+        m_ctx = SSL_CTX_new(TLS_server_method());
+        if (m_ctx == nullptr) fail("Cannot create TLS context");
+
+        SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(m_ctx, options.certificateFile.c_str()) != 1) {
+            fail("Cannot load TLS certificate " + options.certificateFile);
+        }
+        if (SSL_CTX_use_PrivateKey_file(m_ctx, options.privateKeyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+            fail("Cannot load TLS private key " + options.privateKeyFile);
+        }
+        if (SSL_CTX_check_private_key(m_ctx) != 1) fail("TLS private key does not match the certificate");
+
+        // Resumption skips the key exchange and certificate signature, which
+        // dominate handshake cost. The cache lives in the SSL_CTX, so every
+        // thread and loop shares it; tickets need no server state at all.
+        SSL_CTX_set_session_id_context(m_ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+        SSL_CTX_set_timeout(m_ctx, options.sessionTimeoutSec);
+        if (options.sessionCache) {
+            SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(m_ctx, options.sessionCacheSize);
+        }
+        else {
+            SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_OFF);
+        }
+        if (options.sessionTickets) {
+            SSL_CTX_set_num_tickets(m_ctx, 1); // One reusable ticket per connection is enough for SMTP
+        }
+        else {
+            SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+            if (!options.sessionCache) SSL_CTX_set_num_tickets(m_ctx, 0);
+        }
+
+#ifdef SSL_OP_ENABLE_KTLS
+        // OpenSSL falls back to user-space records when the kernel lacks the
+        // tls module or the negotiated cipher
+        if (options.kernelTls) SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+        // Replies are retried from a rebuilt buffer after WantWrite
+        SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+
+
+    TlsContext::~TlsContext() {
+        if (m_ctx != nullptr) SSL_CTX_free(m_ctx);
+    }
+
+
+
+    SSL* TlsContext::newConnection(int socket) const {
+        SSL* ssl = SSL_new(m_ctx);
+        if (ssl == nullptr) return nullptr;
+        if (SSL_set_fd(ssl, socket) != 1) {
+            SSL_free(ssl);
+            return nullptr;
+        }
+        SSL_set_accept_state(ssl);
+        return ssl;
+    }
+
+
+
+    void TlsContext::fail(const std::string& message) {
+        std::cerr << message << ": " << lastError() << std::endl;
+        exit(1);
+    }
+
+
+
+    TlsStream::TlsStream(SSL* ssl) : m_ssl(ssl) {}
+
+
+
+    TlsStream::~TlsStream() {
+        SSL_free(m_ssl);
+    }
+
+
+
+    TlsStream::Result TlsStream::handshake() {
+        if (m_established) return Result::Done;
+        int rc = SSL_do_handshake(m_ssl);
+        if (rc != 1) return classify(rc);
+
+        m_established = true;
+#ifdef SSL_OP_ENABLE_KTLS
+        m_kernelSend = BIO_get_ktls_send(SSL_get_wbio(m_ssl)) != 0;
+#endif
+        return Result::Done;
+    }
+
+
+
+    bool TlsStream::resumed() const {
+        return SSL_session_reused(m_ssl) == 1;
+    }
+
+
+
+    TlsStream::Result TlsStream::read(char* data, size_t size, size_t& received) {
+        received = 0;
+        size_t bytes = 0;
+        int rc = SSL_read_ex(m_ssl, data, size, &bytes);
+        if (rc != 1) return classify(rc);
+        received = bytes;
+        return Result::Done;
+    }
+
+
+
+    TlsStream::Result TlsStream::write(const char* data, size_t size, size_t& sent) {
+        sent = 0;
+        size_t bytes = 0;
+        int rc = SSL_write_ex(m_ssl, data, size, &bytes);
+        if (rc != 1) return classify(rc);
+        sent = bytes;
+        return Result::Done;
+    }
+
+
+
+    void TlsStream::close() {
+        if (m_established) SSL_shutdown(m_ssl);
+    }
+
+
+
+    TlsStream::Result TlsStream::classify(int rc) {
+        int error = SSL_get_error(m_ssl, rc);
+        switch (error) {
+        case SSL_ERROR_WANT_READ:
+            return Result::WantRead;
+        case SSL_ERROR_WANT_WRITE:
+            return Result::WantWrite;
+        case SSL_ERROR_ZERO_RETURN:
+            return Result::Closed;
+        case SSL_ERROR_SYSCALL:
+            ERR_clear_error();
+            // EOF without close_notify: SMTP clients routinely just hang up
+            return Result::Closed;
+        default:
+            ERR_clear_error();
+            return Result::Error;
+        }
+    }
+}
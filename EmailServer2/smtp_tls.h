@@ -0,0 +1,66 @@
+#ifndef INCLUDED_SMTP_TLS_LINUX
+#define INCLUDED_SMTP_TLS_LINUX
+
+#include <string>
+#include <cstddef>
+#include <openssl/ssl.h>
+
+namespace smtp {
+    struct TlsOptions {
+        bool enabled = false;               // Advertise and accept STARTTLS
+        std::string certificateFile;        // PEM, leaf first
+        std::string privateKeyFile;         // PEM
+        bool sessionCache = true;           // Server-side cache shared by every connection
+        bool sessionTickets = true;         // Stateless resumption; no server state per peer
+        bool kernelTls = true;              // Record encryption in the kernel (sendmsg) where supported
+        long sessionCacheSize = 20480;      // Cached sessions
+        long sessionTimeoutSec = 300;       // Lifetime of cached sessions and tickets
+    };
+
+    // One SSL_CTX for the whole server, so every connection shares the session
+    // cache and the ticket keys
+    class TlsContext {
+    public:
+        explicit TlsContext(const TlsOptions& options);
+        ~TlsContext();
+
+        SSL* newConnection(int socket) const; // nullptr on failure
+
+    private:
+        void fail(const std::string& message);
+
+        SSL_CTX* m_ctx = nullptr;
+    };
+
+    // Server side of one TLS connection over a socket that may be blocking
+    // (threaded mode) or non-blocking (epoll mode, where Want* means: call
+    // again when the socket is ready).
+    class TlsStream {
+    public:
+        enum class Result { Done, WantRead, WantWrite, Closed, Error };
+
+        explicit TlsStream(SSL* ssl);
+        ~TlsStream();
+
+        Result handshake();
+        bool established() const { return m_established; }
+        bool resumed() const;
+
+        Result read(char* data, size_t size, size_t& received);
+        Result write(const char* data, size_t size, size_t& sent);
+
+        // The kernel encrypts records: replies can go out with plain sendmsg()
+        bool kernelSend() const { return m_kernelSend; }
+
+        void close(); // Best-effort close_notify
+
+    private:
+        Result classify(int rc);
+
+        SSL* m_ssl;
+        bool m_established = false;
+        bool m_kernelSend = false;
+    };
+}
+
+#endif
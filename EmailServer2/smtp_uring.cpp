@@ -0,0 +1,263 @@
+#include "smtp_uring.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+namespace smtp {
+
+    namespace {
+        int setup(unsigned entries, io_uring_params& params) {
+            return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        }
+
+        int enter(int fd, unsigned submit, unsigned wait, unsigned flags, const void* arg, size_t argSize) {
+            return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argSize));
+        }
+
+        int registerRing(int fd, unsigned opcode, const void* arg, unsigned count) {
+            return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+        }
+    }
+
+
+
+    IoRing::IoRing(const UringOptions& options) {
+        // Single issuer with deferred task work (Linux 6.1) where the kernel
+        // has it; the plain ring still works without
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        params.cq_entries = options.entries * 4;
+        m_fd = setup(options.entries, params);
+        if (m_fd < 0 && errno == EINVAL) {
+            memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+            params.cq_entries = options.entries * 4;
+            m_fd = setup(options.entries, params);
+        }
+        if (m_fd < 0) {
+            m_error = errno;
+            return;
+        }
+
+        // Waiting with a timeout needs the extended enter argument (Linux 5.11)
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !mapQueues(params)
+            || !provideBuffers(options.buffers, options.bufferSize)) {
+            if (m_error == 0) m_error = errno != 0 ? errno : EOPNOTSUPP;
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+
+
+    IoRing::~IoRing() {
+        // Closing the ring cancels whatever is still in flight
+        if (m_fd >= 0) close(m_fd);
+        if (m_bufferRing != nullptr) munmap(m_bufferRing, m_bufferRingSize);
+        if (m_entries != nullptr) munmap(m_entries, m_entriesSize);
+        if (m_queues != nullptr) munmap(m_queues, m_queuesSize);
+    }
+
+
+
+    bool IoRing::mapQueues(const io_uring_params& params) {
+        // Both rings share one mapping (Linux 5.4)
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            m_error = EOPNOTSUPP;
+            return false;
+        }
+
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_queuesSize = sqSize > cqSize ? sqSize : cqSize;
+        m_queues = mmap(nullptr, m_queuesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_queues == MAP_FAILED) {
+            m_queues = nullptr;
+            m_error = errno;
+            return false;
+        }
+
+        m_entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* entries = mmap(nullptr, m_entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (entries == MAP_FAILED) {
+            m_error = errno;
+            return false;
+        }
+        m_entries = static_cast<io_uring_sqe*>(entries);
+
+        char* base = static_cast<char*>(m_queues);
+        m_sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        m_sqEntries = params.sq_entries;
+        m_cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        m_completions = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // Slot i of the indirection array always names entry i
+        unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for (unsigned i = 0; i < m_sqEntries; ++i) array[i] = i;
+        m_sqLocalTail = m_sqSubmitted = *m_sqTail;
+        return true;
+    }
+
+
+
+    bool IoRing::provideBuffers(unsigned count, unsigned size) {
+        if (count == 0 || count > 32768 || (count & (count - 1)) != 0 || size == 0) {
+            m_error = EINVAL;
+            return false;
+        }
+
+        // The kernel reads the ring from this page-aligned mapping; the tail
+        // overlays the first entry's reserved field
+        m_bufferRingSize = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (ring == MAP_FAILED) {
+            m_error = errno;
+            return false;
+        }
+        m_bufferRing = static_cast<io_uring_buf_ring*>(ring);
+        m_bufferMask = count - 1;
+        m_bufferSize = size;
+        m_bufferMemory = std::make_unique<char[]>(static_cast<size_t>(count) * size);
+
+        // Multishot receive with buffer selection needs Linux 6.0
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = count;
+        reg.bgid = 0;
+        if (registerRing(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            m_error = errno;
+            return false;
+        }
+
+        for (unsigned id = 0; id < count; ++id) recycle(static_cast<uint16_t>(id));
+        return true;
+    }
+
+
+
+    bool IoRing::enable() {
+        if (registerRing(m_fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) < 0) {
+            m_error = errno;
+            return false;
+        }
+        return true;
+    }
+
+
+
+    bool IoRing::reserve(unsigned count) {
+        if (count > m_sqEntries) {
+            m_error = EINVAL;
+            return false;
+        }
+
+        // Hand the batch over without waiting; the kernel consumes what it
+        // can during the call, and the head says how far it got
+        while (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries) {
+            __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+            int submitted = enter(m_fd, m_sqLocalTail - m_sqSubmitted, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted > 0) {
+                m_sqSubmitted += static_cast<unsigned>(submitted);
+            }
+            else if (submitted < 0 && errno == EBUSY) {
+                // The completion queue is full: its entries must go before more can be taken
+                setAside();
+            }
+            else if (submitted < 0 && errno != EINTR && errno != EAGAIN) {
+                m_error = errno;
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+
+    void IoRing::setAside() {
+        if (m_setAsideNext == m_setAside.size()) {
+            m_setAside.clear();
+            m_setAsideNext = 0;
+        }
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) m_setAside.push_back(m_completions[head & m_cqMask]);
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+
+
+    io_uring_sqe* IoRing::prepare() {
+        if (!reserve(1)) return nullptr;
+        io_uring_sqe* entry = &m_entries[m_sqLocalTail & m_sqMask];
+        memset(entry, 0, sizeof(*entry));
+        ++m_sqLocalTail;
+        return entry;
+    }
+
+
+
+    void IoRing::submit(int timeoutMs) {
+        __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+        // Always asks for completions: with deferred task work, that is when
+        // they are posted. With some set aside it does not wait for more.
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        if (m_setAsideNext < m_setAside.size()) timeoutMs = 0;
+        unsigned wait = timeoutMs == 0 ? 0 : 1;
+        struct __kernel_timespec timeout;
+        io_uring_getevents_arg arg;
+        const void* extra = nullptr;
+        size_t extraSize = 0;
+        if (timeoutMs > 0) {
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            flags |= IORING_ENTER_EXT_ARG;
+            extra = &arg;
+            extraSize = sizeof(arg);
+        }
+
+        // EINTR, ETIME and EBUSY (completions to reap first) all just return to the caller
+        int submitted = enter(m_fd, m_sqLocalTail - m_sqSubmitted, wait, flags, extra, extraSize);
+        if (submitted > 0) m_sqSubmitted += static_cast<unsigned>(submitted);
+    }
+
+
+
+    bool IoRing::next(io_uring_cqe& completion) {
+        // Set aside before anything still in the ring, so they come out first
+        if (m_setAsideNext < m_setAside.size()) {
+            completion = m_setAside[m_setAsideNext++];
+            return true;
+        }
+
+        unsigned head = *m_cqHead;
+        if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) return false;
+        completion = m_completions[head & m_cqMask];
+        __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+
+
+    void IoRing::recycle(uint16_t id) {
+        io_uring_buf* entries = reinterpret_cast<io_uring_buf*>(m_bufferRing);
+        io_uring_buf& entry = entries[m_bufferTail & m_bufferMask];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = static_cast<uint32_t>(m_bufferSize);
+        entry.bid = id;
+        ++m_bufferTail;
+        __atomic_store_n(&m_bufferRing->tail, m_bufferTail, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef INCLUDED_SMTP_URING_LINUX
+#define INCLUDED_SMTP_URING_LINUX
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+namespace smtp {
+    struct UringOptions {
+        unsigned entries = 1024;        // Submission queue slots per loop (the completion queue gets 4x)
+        unsigned buffers = 256;         // Provided receive buffers per loop, a power of two
+        unsigned bufferSize = 16384;    // Bytes in each
+    };
+
+    // One io_uring instance driven through the raw system calls (no
+    // liburing): the mapped submission and completion queues, plus a ring of
+    // provided buffers that multishot receives pick from. Created disabled on
+    // any thread; the thread that calls enable() becomes the only one that
+    // may submit, which lets the kernel skip the locking and defer completion
+    // work until that thread asks for completions.
+    class IoRing {
+    public:
+        explicit IoRing(const UringOptions& options);
+        ~IoRing();
+        IoRing(const IoRing&) = delete;
+        IoRing& operator=(const IoRing&) = delete;
+
+        bool valid() const { return m_fd >= 0; }
+        int error() const { return m_error; }  // errno of the step that failed
+        bool enable();  // On the submitting thread, before anything is prepared
+
+        // A zeroed submission entry. When the queue is full what is in it
+        // is submitted first; otherwise nothing reaches the kernel before
+        // submit(). nullptr if the kernel refuses the queued entries.
+        io_uring_sqe* prepare();
+        // Room for count entries in a row, so a linked chain is not split.
+        // Submits until the kernel has taken enough of the queue, setting
+        // completions aside when it wants them reaped first; false with
+        // error() set if it fails otherwise.
+        bool reserve(unsigned count);
+
+        // Submits everything prepared and waits up to timeoutMs (-1: no
+        // limit, 0: not at all) for a completion; one system call either way
+        void submit(int timeoutMs);
+
+        // Takes the oldest completion, set-aside ones first; false when there is none
+        bool next(io_uring_cqe& completion);
+
+        // Provided buffers, group 0 (IOSQE_BUFFER_SELECT)
+        const char* buffer(uint16_t id) const { return m_bufferMemory.get() + static_cast<size_t>(id) * m_bufferSize; }
+        void recycle(uint16_t id);  // Back to the kernel once its bytes have been copied out
+
+    private:
+        bool mapQueues(const io_uring_params& params);
+        bool provideBuffers(unsigned count, unsigned size);
+        void setAside();
+
+        int m_fd = -1;
+        int m_error = 0;
+
+        void* m_queues = nullptr;       // Submission and completion rings, one mapping
+        size_t m_queuesSize = 0;
+        io_uring_sqe* m_entries = nullptr;
+        size_t m_entriesSize = 0;
+        unsigned* m_sqHead = nullptr;
+        unsigned* m_sqTail = nullptr;
+        unsigned m_sqMask = 0;
+        unsigned m_sqEntries = 0;
+        unsigned m_sqLocalTail = 0;     // Prepared, published to the kernel on submit()
+        unsigned m_sqSubmitted = 0;     // Consumed by the kernel
+        unsigned* m_cqHead = nullptr;
+        unsigned* m_cqTail = nullptr;
+        unsigned m_cqMask = 0;
+        io_uring_cqe* m_completions = nullptr;
+        std::vector<io_uring_cqe> m_setAside;   // Reaped by reserve() while the queue was full
+        size_t m_setAsideNext = 0;
+
+        io_uring_buf_ring* m_bufferRing = nullptr;
+        size_t m_bufferRingSize = 0;
+        unsigned m_bufferMask = 0;
+        uint16_t m_bufferTail = 0;
+        size_t m_bufferSize = 0;
+        std::unique_ptr<char[]> m_bufferMemory;
+    };
+}
+
+#endif
@@ -0,0 +1,601 @@
+#include "smtp_uring_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+
+namespace smtp {
+
+    namespace {
+        const uint64_t OP_MASK = 15;
+
+        // Pieces per sendmsg, as in ReplyQueue::flush
+        const size_t MAX_IOV = 64;
+
+        // Input held in a session's buffer while its message is checked and
+        // committed; past this the recv stops and the rest waits in the kernel
+        const size_t RECEIVE_BACKLOG = 64 * 1024;
+
+        // Finished connections kept for reuse, as in SessionPool
+        const size_t MAX_IDLE = 256;
+    }
+
+
+
+    UringLoop::UringLoop(TcpServer& server, int listenSocket, int core)
+        : m_server(server), m_listenSocket(listenSocket), m_core(core), m_ring(server.m_config.uring),
+        m_timers(static_cast<uint64_t>(std::max(server.m_config.timeouts.tickMs, 1)), Metrics::now() / 1000000) {
+        if (!m_ring.valid()) {
+            m_server.exitWithError("Failed to set up io_uring (needs Linux 6.1): " + std::string(strerror(m_ring.error())));
+        }
+
+        m_wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (m_wakeFd < 0) {
+            m_server.exitWithError("Failed to create eventfd");
+        }
+    }
+
+
+
+    UringLoop::~UringLoop() {
+        stop();
+        join();
+        for (auto& connection : m_live) {
+            if (connection->task) connection->task.destroy();
+            if (!connection->closed) m_server.closeTransport(*connection);
+        }
+        m_live.clear();
+        m_idle.clear();
+        close(m_wakeFd);
+    }
+
+
+
+    void UringLoop::start() {
+        m_thread = std::thread([this] { run(); });
+    }
+
+
+
+    void UringLoop::stop() {
+        m_stop = true;
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void UringLoop::join() {
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+
+
+    void UringLoop::run() {
+        m_server.pinToCore(m_core);
+        if (!m_ring.enable()) {
+            m_server.exitWithError("Failed to enable io_uring: " + std::string(strerror(m_ring.error())));
+        }
+        armWake();
+
+        while (!m_stop) {
+            if (!m_accepting) armAccept();
+
+            // Everything prepared since the last wait is submitted by the call that waits
+            m_ring.submit(m_timers.timeoutMs(Metrics::now() / 1000000));
+
+            io_uring_cqe completion;
+            while (m_ring.next(completion)) {
+                complete(completion);
+            }
+
+            m_timers.advance(Metrics::now() / 1000000);
+            for (Connection* connection : m_expired) expire(*connection);
+            m_expired.clear();
+        }
+    }
+
+
+
+    UringLoop::SessionTask UringLoop::serve(Connection& connection) {
+        SmtpSession& session = connection;
+
+        m_server.beginSession(session);
+        armTimeout(connection);
+        bool open = co_await wait(connection, Wait::Send) != 0;
+        Metrics::observeSince(Metrics::Histogram::AcceptToBanner, session.acceptedAt);
+
+        while (open && !session.closing) {
+            int64_t bytes = co_await wait(connection, Wait::Receive);
+            m_timers.cancel(session.timeout);
+            if (bytes <= 0) break;
+
+            // Everything that arrived is parsed in one go. A message stops
+            // parsing until it has been checked and committed; the commands
+            // pipelined behind it go on from there.
+            m_server.processInput(session);
+            while (session.messagePending) {
+                int64_t outcome = co_await wait(connection, Wait::Outcome);
+                m_server.completeMessage(session, static_cast<MessageOutcome>(outcome));
+                m_server.processInput(session);
+            }
+            armTimeout(connection);
+
+            // The client starts the handshake as soon as it sees the 220, so
+            // the recv has to be gone by then or it would take the ClientHello
+            if (session.tlsPending) co_await wait(connection, Wait::StopReceiving);
+
+            // One sendmsg for every reply to the commands this read contained
+            open = co_await wait(connection, Wait::Send) != 0;
+
+            if (open && session.tlsPending) {
+                // From here OpenSSL reads and writes the socket itself, on readiness
+                session.inBuffer.clear();
+                fcntl(session.socket, F_SETFL, fcntl(session.socket, F_GETFL) | O_NONBLOCK);
+                open = co_await wait(connection, Wait::Handshake) != 0;
+            }
+        }
+
+        m_timers.cancel(session.timeout);
+        if (connection.expired) m_server.timeOut(session);
+        co_await wait(connection, Wait::Close);
+        Metrics::add(Metrics::Counter::SessionsClosed);
+    }
+
+
+
+    void* UringLoop::SessionTask::promise_type::operator new(size_t size, UringLoop&, Connection& connection) {
+        if (connection.frameSize < size) {
+            connection.frame = std::make_unique<char[]>(size);
+            connection.frameSize = size;
+        }
+        return connection.frame.get();
+    }
+
+
+
+    bool UringLoop::attempt(Connection& connection) {
+        if (connection.busy) return false;
+
+        switch (connection.waiting) {
+        case Wait::Receive:
+            if (connection.expired) return finish(connection, 0);
+            if (connection.tls) {
+                ssize_t bytes = m_server.receive(connection);
+                if (bytes >= 0) return finish(connection, bytes);
+                poll(connection, POLLIN);
+                return false;
+            }
+            if (connection.received > 0) {
+                size_t bytes = connection.received;
+                connection.received = 0;
+                return finish(connection, static_cast<int64_t>(bytes));
+            }
+            if (connection.ended) return finish(connection, 0);
+            if (!connection.receiving) receive(connection);
+            return false;
+
+        case Wait::Send:
+            if (connection.expired || connection.failed) return finish(connection, 0);
+            if (connection.tls) {
+                ReplyQueue::Result result = m_server.flushReplies(connection);
+                if (result != ReplyQueue::Result::WouldBlock) return finish(connection, result == ReplyQueue::Result::Done);
+                poll(connection, POLLOUT);
+                return false;
+            }
+            if (connection.replies.empty()) return finish(connection, 1);
+            send(connection);
+            return false;
+
+        case Wait::Handshake:
+            if (connection.expired || connection.failed) return finish(connection, 0);
+            switch (m_server.continueTls(connection)) {
+            case TlsStream::Result::Done:
+                return finish(connection, 1);
+            case TlsStream::Result::WantRead:
+                poll(connection, POLLIN);
+                return false;
+            case TlsStream::Result::WantWrite:
+                poll(connection, POLLOUT);
+                return false;
+            default:
+                return finish(connection, 0);
+            }
+
+        case Wait::Outcome:
+            if (!connection.outcome) return false;
+            {
+                MessageOutcome outcome = *connection.outcome;
+                connection.outcome.reset();
+                return finish(connection, static_cast<int64_t>(outcome));
+            }
+
+        case Wait::StopReceiving:
+            if (!connection.receiving) return finish(connection, 0);
+            if (!connection.cancelling) cancel(connection, Receive);
+            return false;
+
+        case Wait::Close:
+            if (connection.closed) return finish(connection, 0);
+            // Whatever a timeout cancelled completes first, so nothing is
+            // still in flight for the descriptor once it is closed
+            if (connection.inFlight > (connection.receiving ? 1u : 0u)) return false;
+            if (connection.tls) {
+                // Best effort on the non-blocking socket, then close_notify
+                m_server.flushReplies(connection);
+                m_server.closeTransport(connection);
+                connection.closed = true;
+                return finish(connection, 0);
+            }
+            closeLinked(connection);
+            return false;
+
+        case Wait::None:
+            break;
+        }
+        return false;
+    }
+
+
+
+    bool UringLoop::finish(Connection& connection, int64_t result) {
+        connection.result = result;
+        return true;
+    }
+
+
+
+    void UringLoop::resume(Connection& connection) {
+        connection.task.resume();
+    }
+
+
+
+    void UringLoop::settle(Connection& connection) {
+        if (connection.task && connection.task.done() && connection.inFlight == 0) release(connection);
+    }
+
+
+
+    void UringLoop::complete(const io_uring_cqe& completion) {
+        Op op = static_cast<Op>(completion.user_data & OP_MASK);
+        Connection* target = reinterpret_cast<Connection*>(completion.user_data & ~OP_MASK);
+        bool last = !(completion.flags & IORING_CQE_F_MORE);
+
+        if (target == nullptr) {
+            if (op == Accept) {
+                if (last) m_accepting = false;   // Re-armed before the next wait
+                if (completion.res >= 0) acceptClient(completion.res);
+                else if (completion.res != -ECANCELED) m_server.log("Failed to accept connection: " + std::string(strerror(-completion.res)));
+            }
+            else if (op == Wake) {
+                runCompletions();
+                if (!m_stop) armWake();
+            }
+            return;
+        }
+
+        Connection& connection = *target;
+        if (last) --connection.inFlight;
+
+        switch (op) {
+        case Receive:
+            received(connection, completion);
+            break;
+        case Send:
+            connection.busy = false;
+            if (completion.res > 0) connection.replies.sent(static_cast<size_t>(completion.res));
+            else connection.failed = true;
+            break;
+        case Poll:
+            connection.busy = false;
+            if (completion.res < 0) connection.failed = true;
+            break;
+        case Close:
+            connection.busy = false;
+            connection.closed = true;
+            break;
+        default:
+            break;  // Cancel, FinalSend: nothing waits on them
+        }
+
+        // Whatever the coroutine waits for may be possible now
+        if (connection.waiting != Wait::None && attempt(connection)) resume(connection);
+        settle(connection);
+    }
+
+
+
+    void UringLoop::acceptClient(int clientSocket) {
+        uint64_t acceptedAt = Metrics::now();
+
+        // A multishot accept shares one address buffer between completions, so ask instead
+        struct sockaddr_storage clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        if (getpeername(clientSocket, (struct sockaddr*)&clientAddr, &clientAddrLen) < 0) {
+            close(clientSocket);
+            return;
+        }
+        if (!m_server.rateLimitCheck((struct sockaddr*)&clientAddr)) {
+            m_server.refuseClient(clientSocket);
+            return;
+        }
+        Metrics::add(Metrics::Counter::ConnectionsAccepted);
+
+        Connection& connection = acquire();
+        connection.socket = clientSocket;
+        connection.ring = this;
+        connection.acceptedAt = acceptedAt;
+        connection.task = serve(connection).handle;
+        resume(connection);
+        settle(connection);
+    }
+
+
+
+    void UringLoop::received(Connection& connection, const io_uring_cqe& completion) {
+        bool last = !(completion.flags & IORING_CQE_F_MORE);
+        if (completion.res > 0) {
+            // Copied out at once, so the buffer goes straight back to the kernel
+            uint16_t id = static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+            const char* data = m_ring.buffer(id);
+            size_t left = static_cast<size_t>(completion.res);
+            while (left > 0) {
+                size_t available;
+                char* tail = connection.inBuffer.writable(available);
+                size_t take = std::min(left, available);
+                memcpy(tail, data, take);
+                m_server.commitInput(connection, take);
+                data += take;
+                left -= take;
+            }
+            m_ring.recycle(id);
+            connection.received += static_cast<size_t>(completion.res);
+
+            if (connection.messagePending && connection.inBuffer.size() > RECEIVE_BACKLOG && !last && !connection.cancelling) {
+                cancel(connection, Receive);
+            }
+        }
+        else if (completion.res != -ENOBUFS && completion.res != -ECANCELED) {
+            // 0: the peer closed. Out of buffers or stopped, the next wait re-arms it.
+            connection.ended = true;
+        }
+
+        if (last) {
+            connection.receiving = false;
+            connection.cancelling = false;
+        }
+    }
+
+
+
+    void UringLoop::messageCompleted(SmtpSession& session, MessageOutcome outcome) {
+        {
+            std::lock_guard<std::mutex> lock(m_completionMutex);
+            m_completions.push_back({ &session, outcome });
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+
+
+    void UringLoop::runCompletions() {
+        m_draining.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_completionMutex);
+            m_draining.swap(m_completions);
+        }
+
+        for (const Completion& completion : m_draining) {
+            // Every session this loop hands out is a Connection
+            Connection& connection = static_cast<Connection&>(*completion.session);
+            connection.outcome = completion.outcome;
+            if (connection.waiting == Wait::Outcome && attempt(connection)) resume(connection);
+            settle(connection);
+        }
+    }
+
+
+
+    void UringLoop::expire(Connection& connection) {
+        // A wait on the client ends now; an operation in flight for it is
+        // cancelled and ends the wait when its completion arrives
+        switch (connection.waiting) {
+        case Wait::Receive:
+            if (connection.busy) cancel(connection, Poll);
+            else if (attempt(connection)) resume(connection);
+            break;
+        case Wait::Send:
+            if (connection.busy) cancel(connection, connection.tls ? Poll : Send);
+            break;
+        case Wait::Handshake:
+            if (connection.busy) cancel(connection, Poll);
+            break;
+        default:
+            break;
+        }
+        settle(connection);
+    }
+
+
+
+    void UringLoop::armTimeout(Connection& connection) {
+        uint64_t now = Metrics::now() / 1000000;
+        uint64_t delay;
+        if (m_server.nextDeadline(connection, now, delay)) m_timers.schedule(connection.timeout, now, delay);
+        else m_timers.cancel(connection.timeout);
+    }
+
+
+
+    io_uring_sqe* UringLoop::prepare(Connection* connection, Op op) {
+        io_uring_sqe* entry = m_ring.prepare();
+        if (entry == nullptr) m_server.exitWithError("io_uring submission failed: " + std::string(strerror(m_ring.error())));
+        entry->user_data = reinterpret_cast<uint64_t>(connection) | op;
+        if (connection != nullptr) ++connection->inFlight;
+        return entry;
+    }
+
+
+
+    void UringLoop::armAccept() {
+        io_uring_sqe* entry = prepare(nullptr, Accept);
+        entry->opcode = IORING_OP_ACCEPT;
+        entry->fd = m_listenSocket;
+        entry->ioprio = IORING_ACCEPT_MULTISHOT;
+        entry->accept_flags = SOCK_CLOEXEC;
+        m_accepting = true;
+    }
+
+
+
+    void UringLoop::armWake() {
+        io_uring_sqe* entry = prepare(nullptr, Wake);
+        entry->opcode = IORING_OP_READ;
+        entry->fd = m_wakeFd;
+        entry->addr = reinterpret_cast<uint64_t>(&m_wakeCount);
+        entry->len = sizeof(m_wakeCount);
+    }
+
+
+
+    void UringLoop::receive(Connection& connection) {
+        // Armed once, it completes every time data arrives until the peer
+        // closes or the buffers run out
+        io_uring_sqe* entry = prepare(&connection, Receive);
+        entry->opcode = IORING_OP_RECV;
+        entry->fd = connection.socket;
+        entry->ioprio = IORING_RECV_MULTISHOT;
+        entry->flags = IOSQE_BUFFER_SELECT;
+        entry->buf_group = 0;
+        connection.receiving = true;
+    }
+
+
+
+    void UringLoop::send(Connection& connection) {
+        // The iovecs point at the queued replies, which stay put until sent() moves past them
+        connection.msg.msg_iov = connection.iov;
+        connection.msg.msg_iovlen = connection.replies.gather(connection.iov, MAX_IOV);
+
+        io_uring_sqe* entry = prepare(&connection, Send);
+        entry->opcode = IORING_OP_SENDMSG;
+        entry->fd = connection.socket;
+        entry->addr = reinterpret_cast<uint64_t>(&connection.msg);
+        entry->len = 1;
+        entry->msg_flags = MSG_NOSIGNAL;
+        connection.busy = true;
+    }
+
+
+
+    void UringLoop::poll(Connection& connection, short events) {
+        io_uring_sqe* entry = prepare(&connection, Poll);
+        entry->opcode = IORING_OP_POLL_ADD;
+        entry->fd = connection.socket;
+        entry->poll32_events = static_cast<uint16_t>(events);
+        connection.busy = true;
+    }
+
+
+
+    void UringLoop::cancel(Connection& connection, Op target) {
+        io_uring_sqe* entry = prepare(&connection, Cancel);
+        entry->opcode = IORING_OP_ASYNC_CANCEL;
+        entry->fd = -1;
+        entry->addr = reinterpret_cast<uint64_t>(&connection) | target;
+        if (target == Receive) connection.cancelling = true;
+    }
+
+
+
+    void UringLoop::closeLinked(Connection& connection) {
+        // One chain: stop the recv, write the last replies (221, 421) if the
+        // socket takes them right away, close. Hard links, so a cancel that
+        // finds nothing or a short write does not keep the socket open.
+        if (!m_ring.reserve(3)) m_server.exitWithError("io_uring submission failed: " + std::string(strerror(m_ring.error())));
+        if (connection.receiving) {
+            io_uring_sqe* entry = prepare(&connection, Cancel);
+            entry->opcode = IORING_OP_ASYNC_CANCEL;
+            entry->fd = -1;
+            entry->addr = reinterpret_cast<uint64_t>(&connection) | Receive;
+            entry->flags = IOSQE_IO_HARDLINK;
+            connection.cancelling = true;
+        }
+        if (!connection.replies.empty()) {
+            connection.msg.msg_iov = connection.iov;
+            connection.msg.msg_iovlen = connection.replies.gather(connection.iov, MAX_IOV);
+            io_uring_sqe* entry = prepare(&connection, FinalSend);
+            entry->opcode = IORING_OP_SENDMSG;
+            entry->fd = connection.socket;
+            entry->addr = reinterpret_cast<uint64_t>(&connection.msg);
+            entry->len = 1;
+            entry->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            entry->flags = IOSQE_IO_HARDLINK;
+        }
+        io_uring_sqe* entry = prepare(&connection, Close);
+        entry->opcode = IORING_OP_CLOSE;
+        entry->fd = connection.socket;
+        connection.busy = true;
+    }
+
+
+
+    UringLoop::Connection& UringLoop::acquire() {
+        std::unique_ptr<Connection> connection;
+        if (!m_idle.empty()) {
+            connection = std::move(m_idle.back());
+            m_idle.pop_back();
+        }
+        else {
+            connection = std::make_unique<Connection>();
+            // Two pointers: stored inline by std::function, no allocation
+            Connection* target = connection.get();
+            connection->timeout.fire = [this, target] {
+                target->expired = true;
+                m_expired.push_back(target);
+            };
+        }
+        connection->index = m_live.size();
+        m_live.push_back(std::move(connection));
+        return *m_live.back();
+    }
+
+
+
+    void UringLoop::release(Connection& connection) {
+        connection.task.destroy();
+        connection.task = nullptr;
+
+        connection.recycle();
+        connection.waiting = Wait::None;
+        connection.result = 0;
+        connection.busy = false;
+        connection.receiving = false;
+        connection.cancelling = false;
+        connection.ended = false;
+        connection.failed = false;
+        connection.expired = false;
+        connection.closed = false;
+        connection.received = 0;
+        connection.outcome.reset();
+
+        // Swap-remove from the live list
+        size_t index = connection.index;
+        std::unique_ptr<Connection> owned = std::move(m_live[index]);
+        if (index + 1 != m_live.size()) {
+            m_live[index] = std::move(m_live.back());
+            m_live[index]->index = index;
+        }
+        m_live.pop_back();
+
+        if (m_idle.size() < MAX_IDLE) m_idle.push_back(std::move(owned));
+    }
+}
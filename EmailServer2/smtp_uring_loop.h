@@ -0,0 +1,172 @@
+#ifndef INCLUDED_SMTP_URING_LOOP_LINUX
+#define INCLUDED_SMTP_URING_LOOP_LINUX
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "smtp_server.h"
+#include "smtp_timer_wheel.h"
+#include "smtp_uring.h"
+
+namespace smtp {
+    // One io_uring completion loop on its own thread: a multishot accept on
+    // the listening socket (shared, or its own SO_REUSEPORT listener), and
+    // each session a coroutine that reads as straight-line SMTP and
+    // co_awaits its receives, sends and message outcomes. A session's
+    // receive is a single multishot recv into the loop's provided buffers;
+    // replies leave in one sendmsg, and the last ones are linked to the
+    // close. Everything the loop prepares while working through a batch of
+    // completions goes to the kernel in the io_uring_enter that waits for
+    // the next one. After STARTTLS a session waits for readiness instead
+    // and reads and writes through OpenSSL. Deadlines live on the loop's
+    // timing wheel, as in the epoll loops.
+    class UringLoop {
+    public:
+        UringLoop(TcpServer& server, int listenSocket, int core = -1); // core >= 0 pins the loop thread
+        ~UringLoop();
+
+        void start();
+        void stop();
+        void join();
+
+        // Called from the spam client or storage writer thread; the session resumes on this loop
+        void messageCompleted(SmtpSession& session, MessageOutcome outcome);
+
+    private:
+        // What a session's coroutine is suspended on
+        enum class Wait { None, Receive, Send, Handshake, Outcome, StopReceiving, Close };
+
+        // Operations in flight, tagged into the low bits of user_data
+        enum Op : uint64_t { Accept = 1, Wake, Receive, Send, Poll, Cancel, FinalSend, Close };
+
+        struct Connection;
+
+        // The coroutine of one session. It starts suspended and stays
+        // suspended at the end, so the loop resumes it and frees it.
+        struct SessionTask {
+            struct promise_type {
+                // The frame lives in its connection and is reused by the next session there
+                static void* operator new(size_t size, UringLoop& loop, Connection& connection);
+                static void operator delete(void*, size_t) noexcept {}
+
+                SessionTask get_return_object() { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+                std::suspend_always initial_suspend() noexcept { return {}; }
+                std::suspend_always final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        // A session and its io_uring state. Recycled with the session's
+        // buffers; a session driven here is always one of these. Aligned so
+        // its address leaves the low bits of user_data for the Op.
+        struct alignas(16) Connection : SmtpSession {
+            std::coroutine_handle<SessionTask::promise_type> task;
+            size_t index = 0;               // In m_live
+            Wait waiting = Wait::None;
+            int64_t result = 0;             // Handed to the coroutine by await_resume
+            unsigned inFlight = 0;          // Submissions whose last completion has not arrived
+            bool busy = false;              // A send, poll or close for the current wait is in flight
+            bool receiving = false;         // Multishot recv armed
+            bool cancelling = false;        // ... and asked to stop
+            bool ended = false;             // The peer closed or the recv failed
+            bool failed = false;            // A send or poll failed
+            bool expired = false;           // Missed a deadline
+            bool closed = false;
+            size_t received = 0;            // Bytes appended to inBuffer the coroutine has not seen yet
+            std::optional<MessageOutcome> outcome;
+            struct iovec iov[64];           // The sendmsg in flight
+            struct msghdr msg = {};
+            std::unique_ptr<char[]> frame;  // Coroutine frame storage
+            size_t frameSize = 0;
+        };
+
+        // co_await wait(connection, what): completes at once when attempt() can
+        struct Awaiter {
+            UringLoop& loop;
+            Connection& connection;
+            Wait what;
+
+            bool await_ready() {
+                connection.waiting = what;
+                return loop.attempt(connection);
+            }
+            void await_suspend(std::coroutine_handle<>) const noexcept {}   // Resumed through connection.task
+            int64_t await_resume() const {
+                connection.waiting = Wait::None;
+                return connection.result;
+            }
+        };
+
+        void run();
+        SessionTask serve(Connection& connection);
+        Awaiter wait(Connection& connection, Wait what) { return { *this, connection, what }; }
+
+        // Does what the coroutine waits for as far as it can without
+        // blocking: true with connection.result set when it is done, false
+        // when it is now waiting on a completion
+        bool attempt(Connection& connection);
+        bool finish(Connection& connection, int64_t result);
+        void resume(Connection& connection);
+        void settle(Connection& connection);    // Frees a finished session once nothing is in flight for it
+
+        // Completions
+        void complete(const io_uring_cqe& completion);
+        void acceptClient(int clientSocket);
+        void received(Connection& connection, const io_uring_cqe& completion);
+        void runCompletions();
+        void expire(Connection& connection);
+        void armTimeout(Connection& connection);
+
+        // Submissions
+        io_uring_sqe* prepare(Connection* connection, Op op);
+        void armAccept();
+        void armWake();
+        void receive(Connection& connection);
+        void send(Connection& connection);
+        void poll(Connection& connection, short events);
+        void cancel(Connection& connection, Op target);
+        void closeLinked(Connection& connection);
+
+        Connection& acquire();
+        void release(Connection& connection);
+
+        struct Completion {
+            SmtpSession* session;
+            MessageOutcome outcome;
+        };
+
+        TcpServer& m_server;
+        int m_listenSocket;
+        int m_core;
+        IoRing m_ring;
+        bool m_accepting = false;   // Multishot accept armed
+        int m_wakeFd;               // eventfd read through the ring; interrupts the wait for stop() and store completions
+        uint64_t m_wakeCount = 0;
+        std::thread m_thread;
+        std::atomic<bool> m_stop{ false };
+
+        std::mutex m_completionMutex;
+        std::vector<Completion> m_completions;
+        std::vector<Completion> m_draining;
+
+        // Before the connections, whose timers it must outlive
+        TimerWheel m_timers;
+        std::vector<Connection*> m_expired;     // Handled after the wheel has run
+
+        // Sessions in progress, and finished ones kept for the next accept
+        std::vector<std::unique_ptr<Connection>> m_live;
+        std::vector<std::unique_ptr<Connection>> m_idle;
+    };
+}
+
+#endif
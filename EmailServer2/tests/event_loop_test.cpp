@@ -0,0 +1,171 @@
+// Sessions the epoll loop closes from a store completion while their own
+// readiness event is still pending in the same epoll_wait batch. Each client
+// sends QUIT as its own segment up to a millisecond behind its message, so
+// for some of them the QUIT's readiness event lands in the batch with the
+// wakeup that completes the message and, running the buffered QUIT, closes
+// the session. Before the messages go, more idle connections than the
+// session pool keeps come and hang up, so sessions closed that way are
+// destroyed, and the next round's accepts reuse what the pool kept. Every
+// client must get its 250 and 221 and the server must survive; configured
+// with -DCMAKE_CXX_FLAGS=-fsanitize=address the build also reports any
+// session touched after the pool took it back. Exits 1 on failure.
+//
+// Run:
+//   ./event_loop_test [rounds=10] [clients=100]
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "smtp_server.h"
+
+namespace {
+    const int SMTP_PORT = 2601;
+    const int SPAM_PORT = 2600; // Nothing listens; the server fails open
+    const int PARKED = 300;     // More than SessionPool keeps idle
+
+    // Clients in a round wait at DATA until the pool has been filled
+    struct Round {
+        std::atomic<int> atData{ 0 };
+        std::atomic<bool> go{ false };
+    };
+
+    bool writeFully(int s, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(s, data, length, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            length -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Final reply lines in order, until the server closes
+    class Replies {
+    public:
+        explicit Replies(int socket) : m_socket(socket) {}
+
+        bool expect(const char* code) {
+            for (;;) {
+                size_t crlf = m_input.find("\r\n", m_begin);
+                if (crlf != std::string::npos) {
+                    size_t line = m_begin;
+                    m_begin = crlf + 2;
+                    if (crlf - line >= 4 && m_input[line + 3] == ' ') return m_input.compare(line, 3, code) == 0;
+                    continue;
+                }
+                char buffer[1024];
+                ssize_t n = recv(m_socket, buffer, sizeof(buffer), 0);
+                if (n <= 0) return false;
+                m_input.append(buffer, static_cast<size_t>(n));
+            }
+        }
+
+    private:
+        int m_socket;
+        std::string m_input;
+        size_t m_begin = 0;
+    };
+
+    bool session(const sockaddr_in& address, Round& round, int quitDelayUs) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(s, (const sockaddr*)&address, sizeof(address)) < 0) {
+            round.atData.fetch_add(1);
+            close(s);
+            return false;
+        }
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        const char envelope[] = "EHLO test.example.com\r\nMAIL FROM:<a@example.com>\r\nRCPT TO:<b@example.org>\r\nDATA\r\n";
+        const char body[] = "Subject: closing\r\n\r\nbody\r\n.\r\n";
+        const char quit[] = "QUIT\r\n";
+        Replies replies(s);
+        bool ok = replies.expect("220") && writeFully(s, envelope, sizeof(envelope) - 1)
+            && replies.expect("250") && replies.expect("250") && replies.expect("250") && replies.expect("354");
+        round.atData.fetch_add(1);
+        while (!round.go.load()) usleep(100);
+        ok = ok && writeFully(s, body, sizeof(body) - 1);
+        usleep(static_cast<useconds_t>(quitDelayUs));
+        ok = ok && writeFully(s, quit, sizeof(quit) - 1) && replies.expect("250") && replies.expect("221");
+        close(s);
+        return ok;
+    }
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    int clients = argc > 2 ? atoi(argv[2]) : 100;
+
+    // Both ends of every connection are in this process
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    std::string path = "/tmp/event_loop_test_" + std::to_string(getpid()) + ".db";
+    smtp::ServerConfig config;
+    config.ipAddress = "127.0.0.1";
+    config.port = SMTP_PORT;
+    config.ioModel = smtp::IoModel::Epoll;
+    config.eventLoops = 1;
+    config.storage.path = path;
+    config.storage.synchronous = "OFF";
+    config.spamCheck.port = SPAM_PORT;
+    config.rateLimit.enabled = false;
+    config.bayes.enabled = false;
+    config.metrics.enabled = false;
+    smtp::TcpServer* server = new smtp::TcpServer(config);
+    std::thread([server] { server->startListen(); }).detach();
+    usleep(200 * 1000);
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SMTP_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::atomic<int> failed{ 0 };
+    for (int r = 0; r < rounds; ++r) {
+        Round round;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < clients; ++i) {
+            threads.emplace_back([&, i] {
+                if (!session(address, round, i * 37 % 1000)) failed.fetch_add(1);
+            });
+        }
+        while (round.atData.load() < clients) usleep(1000);
+
+        // Idle connections that hang up before the messages go, leaving the
+        // pool full, so the round's sessions are destroyed when they close
+        std::vector<int> parked;
+        for (int i = 0; i < PARKED; ++i) {
+            int s = socket(AF_INET, SOCK_STREAM, 0);
+            Replies replies(s);
+            if (connect(s, (const sockaddr*)&address, sizeof(address)) < 0 || !replies.expect("220")) failed.fetch_add(1);
+            parked.push_back(s);
+        }
+        for (int s : parked) close(s);
+        usleep(50 * 1000);
+
+        round.go = true;
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    printf("%d sessions closing from a store completion: %d failed\n", rounds * clients, failed.load());
+    fflush(stdout);
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    unlink((path + "-shm").c_str());
+    unlink((path + "-gen").c_str());
+    _exit(failed.load() == 0 ? 0 : 1); // The server has no shutdown path
+}
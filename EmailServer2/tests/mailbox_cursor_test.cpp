@@ -0,0 +1,54 @@
+// Listing cursors and message ids as they arrive from HTTP clients:
+// round trips, the largest id that fits, and malformed or over-long ids,
+// which must be rejected rather than overflow. Exits 1 on failure.
+//
+// Run:
+//   ./mailbox_cursor_test
+
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include "smtp_mailbox.h"
+
+namespace {
+    int g_failures = 0;
+
+    void check(bool condition, const char* what) {
+        if (condition) return;
+        printf("FAILED: %s\n", what);
+        ++g_failures;
+    }
+
+    bool rejected(const char* text) {
+        return !smtp::MailboxCursor::decode(text).has_value();
+    }
+}
+
+int main() {
+    smtp::MailboxCursor cursor;
+    cursor.timestamp = "2026-01-31 12:00:00";
+    cursor.id = 42;
+    std::optional<smtp::MailboxCursor> decoded = smtp::MailboxCursor::decode(cursor.encode());
+    check(decoded && decoded->timestamp == cursor.timestamp && decoded->id == 42, "cursor round trip");
+
+    decoded = smtp::MailboxCursor::decode("2026-01-01T00:00:00_9223372036854775807");
+    check(decoded && decoded->id == INT64_MAX, "cursor with the largest id");
+
+    check(rejected("2026-01-01T00:00:00_9223372036854775808"), "cursor id one past INT64_MAX");
+    check(rejected("2026-01-01T00:00:00_99999999999999999999"), "over-long cursor id");
+    check(rejected("2026-01-01T00:00:00_"), "cursor without an id");
+    check(rejected("2026-01-01T00:00:00_-1"), "cursor with a signed id");
+    check(rejected("2026-01-01T00:00:00_12a"), "cursor with a non-digit id");
+    check(rejected("_42"), "cursor without a timestamp");
+
+    check(smtp::parseMessageId("0") == std::optional<int64_t>(0), "message id 0");
+    check(smtp::parseMessageId("9223372036854775807") == std::optional<int64_t>(INT64_MAX), "message id INT64_MAX");
+    check(!smtp::parseMessageId("9223372036854775808"), "message id one past INT64_MAX");
+    check(!smtp::parseMessageId("18446744073709551626"), "message id past UINT64_MAX");
+    check(!smtp::parseMessageId(""), "empty message id");
+    check(!smtp::parseMessageId("+5"), "signed message id");
+
+    printf("mailbox cursors: %d failed\n", g_failures);
+    return g_failures == 0 ? 0 : 1;
+}
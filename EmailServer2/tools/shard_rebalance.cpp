@@ -0,0 +1,192 @@
+// Moves mail between shard files after StorageOptions::shards changes: every
+// row in Emails and SpamLogs ends up in the file shardOf(recipient, to) names,
+// with its body (shared again where the target already holds the same one).
+// Files that are not part of the new layout are left empty and listed at the
+// end. Stop the SMTP and HTTP servers first and restart them with the new
+// shard count; moved rows get new ids, so old message links and cursors no
+// longer resolve. Copies to a shard and deletes from the source commit
+// separately (WAL), so keep a backup: an interrupted run can leave a moved
+// row in both files. Bodies kept in a segment log (BodyStorage::SegmentLog)
+// are not moved: such stores are refused. Compressed bodies are copied
+// decompressed; the target's writer compresses what it stores from then on.
+//
+// Run:
+//   ./shard_rebalance <database path> <current shards> <new shards>
+
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <string_view>
+#include <sqlite3.h>
+#include "smtp_storage.h"
+
+namespace {
+    // shard_of(recipient): the recipient's shard in the new layout
+    void shardOfFunction(sqlite3_context* context, int, sqlite3_value** arguments) {
+        size_t shards = *static_cast<size_t*>(sqlite3_user_data(context));
+        const char* text = reinterpret_cast<const char*>(sqlite3_value_text(arguments[0]));
+        size_t length = static_cast<size_t>(sqlite3_value_bytes(arguments[0]));
+        sqlite3_result_int64(context, static_cast<sqlite3_int64>(smtp::shardOf(std::string_view(text ? text : "", length), shards)));
+    }
+
+    // decoded_body(body, codec, dictionary, size): the original bytes of a source body
+    struct Decoding {
+        sqlite3* db = nullptr;
+        smtp::BodyDecoder decoder;
+        std::string body;
+    };
+
+    void decodedBodyFunction(sqlite3_context* context, int, sqlite3_value** arguments) {
+        Decoding& decoding = *static_cast<Decoding*>(sqlite3_user_data(context));
+        const char* stored = static_cast<const char*>(sqlite3_value_blob(arguments[0]));
+        size_t length = static_cast<size_t>(sqlite3_value_bytes(arguments[0]));
+        if (!decoding.decoder.decode(decoding.db, sqlite3_value_int(arguments[1]), sqlite3_value_int64(arguments[2]),
+            std::string_view(stored ? stored : "", length), static_cast<size_t>(sqlite3_value_int64(arguments[3])), decoding.body)) {
+            sqlite3_result_error(context, "body does not decode", -1);
+            return;
+        }
+        sqlite3_result_text(context, decoding.body.data(), static_cast<int>(decoding.body.size()), SQLITE_TRANSIENT);
+    }
+
+    // Log ids belong to the file's own segment log; another shard could not resolve them
+    bool keepsBodiesInLog(const std::string& path) {
+        sqlite3* db = nullptr;
+        bool inLog = false;
+        if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK) {
+            sqlite3_stmt* stmt = nullptr;
+            inLog = sqlite3_prepare_v2(db, "SELECT 1 FROM Bodies WHERE location IS NOT NULL LIMIT 1;", -1, &stmt, nullptr) == SQLITE_OK
+                && sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_close(db);
+        return inLog;
+    }
+
+    bool exec(sqlite3* db, const std::string& sql) {
+        char* error = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error) == SQLITE_OK) return true;
+        fprintf(stderr, "%s\n", error ? error : sqlite3_errmsg(db));
+        sqlite3_free(error);
+        return false;
+    }
+
+    // Copies the rows of source that belong to target, with their bodies, then
+    // deletes them from source. Returns the number of rows moved, or -1.
+    long long moveRows(sqlite3* source, const std::string& targetPath, size_t target) {
+        sqlite3_stmt* attach = nullptr;
+        bool attached = sqlite3_prepare_v2(source, "ATTACH DATABASE ?1 AS target;", -1, &attach, nullptr) == SQLITE_OK
+            && sqlite3_bind_text(attach, 1, targetPath.c_str(), -1, SQLITE_TRANSIENT) == SQLITE_OK
+            && sqlite3_step(attach) == SQLITE_DONE;
+        sqlite3_finalize(attach);
+        if (!attached) {
+            fprintf(stderr, "%s: %s\n", targetPath.c_str(), sqlite3_errmsg(source));
+            return -1;
+        }
+
+        std::string shard = std::to_string(target);
+
+        // Bodies match on (hash, size, original bytes), as MailStore matches them;
+        // only uncompressed target rows are compared, so a match may be missed
+        const std::string decoded = "decoded_body(b.body, b.codec, b.dictionary, b.size)";
+        const std::string sameBody = "t.hash = b.hash AND t.size = b.size AND t.codec = 0 AND t.body = " + decoded;
+        const std::string targetBody = "(SELECT t.id FROM target.Bodies t JOIN main.Bodies b ON " + sameBody
+            + " WHERE b.id = r.body_id LIMIT 1)";
+        std::string sql = "BEGIN;"
+            "INSERT INTO target.Bodies (hash, size, body) SELECT b.hash, b.size, " + decoded + " FROM main.Bodies b"
+            " WHERE b.id IN (SELECT body_id FROM main.Emails WHERE shard_of(recipient) = " + shard
+            + " UNION SELECT body_id FROM main.SpamLogs WHERE shard_of(recipient) = " + shard + ")"
+            " AND NOT EXISTS (SELECT 1 FROM target.Bodies t WHERE " + sameBody + ");"
+            "INSERT INTO target.Emails (sender, recipient, subject, body_id, timestamp, status, spam_score, attempts)"
+            " SELECT r.sender, r.recipient, r.subject, " + targetBody + ", r.timestamp, r.status, r.spam_score, r.attempts"
+            " FROM main.Emails r WHERE shard_of(r.recipient) = " + shard + " ORDER BY r.id;"
+            "INSERT INTO target.SpamLogs (sender, recipient, body_id, timestamp, spam_score)"
+            " SELECT r.sender, r.recipient, " + targetBody + ", r.timestamp, r.spam_score"
+            " FROM main.SpamLogs r WHERE shard_of(r.recipient) = " + shard + " ORDER BY r.id;"
+            "DELETE FROM main.Emails WHERE shard_of(recipient) = " + shard + ";";
+        if (!exec(source, sql)) {
+            exec(source, "ROLLBACK;");
+            exec(source, "DETACH DATABASE target;");
+            return -1;
+        }
+        long long moved = sqlite3_changes(source);
+        sql = "DELETE FROM main.SpamLogs WHERE shard_of(recipient) = " + shard + ";COMMIT;";
+        if (!exec(source, sql)) {
+            exec(source, "ROLLBACK;");
+            exec(source, "DETACH DATABASE target;");
+            return -1;
+        }
+        moved += sqlite3_changes(source);
+        exec(source, "DETACH DATABASE target;");
+        return moved;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <database path> <current shards> <new shards>\n", argv[0]);
+        return 2;
+    }
+    std::string path = argv[1];
+    size_t from = strtoul(argv[2], nullptr, 10);
+    size_t to = strtoul(argv[3], nullptr, 10);
+    if (from == 0 || to == 0) {
+        fprintf(stderr, "shard counts must be at least 1\n");
+        return 2;
+    }
+
+    for (size_t i = 0; i < from; ++i) {
+        std::string sourcePath = smtp::shardPath(path, i, from);
+        if (keepsBodiesInLog(sourcePath)) {
+            fprintf(stderr, "%s keeps bodies in %s-log, which cannot be rebalanced\n", sourcePath.c_str(), sourcePath.c_str());
+            return 1;
+        }
+    }
+
+    // Opening a store creates (or upgrades) the schema of each of its files
+    for (size_t shards : { from, to }) {
+        smtp::StorageOptions options;
+        options.path = path;
+        options.shards = shards;
+        smtp::MailStore store(options);
+    }
+
+    std::set<std::string> newPaths;
+    for (size_t j = 0; j < to; ++j) newPaths.insert(smtp::shardPath(path, j, to));
+
+    long long total = 0;
+    for (size_t i = 0; i < from; ++i) {
+        std::string sourcePath = smtp::shardPath(path, i, from);
+        sqlite3* source = nullptr;
+        if (sqlite3_open_v2(sourcePath.c_str(), &source, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK) {
+            fprintf(stderr, "%s: %s\n", sourcePath.c_str(), sqlite3_errmsg(source));
+            return 1;
+        }
+        sqlite3_busy_timeout(source, 5000);
+        sqlite3_create_function(source, "shard_of", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, &to, shardOfFunction, nullptr, nullptr);
+        Decoding decoding;
+        decoding.db = source;
+        sqlite3_create_function(source, "decoded_body", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC, &decoding, decodedBodyFunction, nullptr, nullptr);
+
+        for (size_t j = 0; j < to; ++j) {
+            std::string targetPath = smtp::shardPath(path, j, to);
+            if (targetPath == sourcePath) continue;
+            long long moved = moveRows(source, targetPath, j);
+            if (moved < 0) {
+                fprintf(stderr, "moving %s -> %s failed\n", sourcePath.c_str(), targetPath.c_str());
+                sqlite3_close(source);
+                return 1;
+            }
+            if (moved > 0) printf("%s -> %s: %lld rows\n", sourcePath.c_str(), targetPath.c_str(), moved);
+            total += moved;
+        }
+
+        // Bodies nothing points at any more
+        exec(source, "DELETE FROM Bodies WHERE id NOT IN (SELECT body_id FROM Emails UNION SELECT body_id FROM SpamLogs);");
+        sqlite3_close(source);
+        if (newPaths.count(sourcePath) == 0) printf("%s is no longer used and can be removed\n", sourcePath.c_str());
+    }
+
+    printf("%lld rows moved from %zu to %zu shards\n", total, from, to);
+    return 0;
+}